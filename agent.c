@@ -0,0 +1,630 @@
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "helper.h"
+#include "options.h"
+#include "pack.h"
+#include "protocol.h"
+#include "comm.h"
+#include "agent.h"
+
+
+/*
+ * Number of elements of the command line of a process of the tree (see
+ * _parse_argv_on_other() in main.c).
+ */
+#define AGENT_ARGC	6
+/*
+ * Seconds the root waits for the response. Includes the time the new
+ * process needs to daemonize.
+ */
+#define AGENT_TIMEOUT	60
+/*
+ * Seconds the root waits for the connection to the agent.
+ */
+#define AGENT_CONNECT_TIMEOUT	10
+/*
+ * Seconds a client may take to send its request. Clients which connect
+ * and stay silent only occupy a handler for this long.
+ */
+#define AGENT_REQUEST_TIMEOUT	5
+/*
+ * Maximum number of requests served concurrently.
+ */
+#define AGENT_MAX_HANDLERS	64
+
+static int _listen(int port, int *fd);
+static int _reap_handlers(int *nhandlers, int block);
+static int _serve(struct alloc *alloc, int fd, const char *key,
+                  int (*entry)(int, char **));
+static int _key_equal(const char *x, const char *y);
+static int _start(struct message_request_attach *msg, int fd,
+                  int (*entry)(int, char **));
+static int _connect(const char *host, int port, int *fd);
+static int _set_timeout(int fd, int secs);
+static int _send_message(struct alloc *alloc, int fd,
+                         struct message_header *header, void *msg);
+static int _recv_message(struct alloc *alloc, int fd, int type,
+                         struct message_header *header, void *msg);
+static int _read_fully(struct buffer *buf, int fd);
+
+
+int agent_main(struct alloc *alloc, struct optpool *opts,
+               int (*entry)(int, char **))
+{
+	int err, tmp;
+	int port, listenfd, fd;
+	int pid, nhandlers;
+	const char *path;
+	char key[AGENT_MAX_KEY_LEN + 1];
+
+	err = optpool_find_by_key_as_int(opts, "AgentPort", &port);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();	/* Should not happen since we have default values
+			 * in place. */
+	}
+
+	/* Without a key anyone who can reach the port could start
+	 * processes as our user.
+	 */
+	path = optpool_find_by_key(opts, "AgentKeyFile");
+	if (unlikely(!path || !strlen(path))) {
+		error("Refusing to start the agent without 'AgentKeyFile'.");
+		return -EINVAL;
+	}
+
+	err = agent_read_key(path, key, sizeof(key));
+	if (unlikely(err)) {
+		fcallerror("agent_read_key", err);
+		return err;
+	}
+
+	err = _listen(port, &listenfd);
+	if (unlikely(err)) {
+		fcallerror("_listen", err);
+		return err;
+	}
+
+	log("Agent listening on port %d.", port);
+
+	nhandlers = 0;
+
+	while (1) {
+		err = _reap_handlers(&nhandlers, nhandlers >= AGENT_MAX_HANDLERS);
+		if (unlikely(err)) {
+			fcallerror("_reap_handlers", err);
+			break;
+		}
+
+		if (nhandlers >= AGENT_MAX_HANDLERS)
+			continue;
+
+		fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if (unlikely(-1 == fd)) {
+			if ((EINTR == errno) || (ECONNABORTED == errno))
+				continue;
+
+			error("accept4() failed. errno = %d says '%s'.", errno, strerror(errno));
+			err = -errno;
+			break;
+		}
+
+		/* Every request is served by a forked handler so that slow
+		 * or silent clients do not hold up the others. The agent
+		 * is single threaded so forking is safe.
+		 */
+		pid = fork();
+		if (unlikely(-1 == pid)) {
+			error("fork() failed. errno = %d says '%s'.", errno, strerror(errno));
+		} else if (0 == pid) {
+			(void )close(listenfd);
+
+			err = _serve(alloc, fd, key, entry);
+			if (unlikely(err))
+				fcallerror("_serve", err);
+
+			exit((err) ? 1 : 0);
+		} else {
+			++nhandlers;
+		}
+
+		tmp = do_close(fd);
+		if (unlikely(tmp))
+			fcallerror("do_close", tmp);
+	}
+
+	tmp = do_close(listenfd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+
+	return err;
+}
+
+int agent_attach(struct alloc *alloc, const char *host, int port,
+                 const char *key, char *const *argv)
+{
+	int err, tmp;
+	int fd;
+	struct message_header          header;
+	struct message_request_attach  msg;
+	struct message_response_attach reply;
+
+	err = _connect(host, port, &fd);
+	if (unlikely(err)) {
+		error("Failed to connect to the agent on host '%s'.", host);
+		return err;
+	}
+
+	err = _set_timeout(fd, AGENT_TIMEOUT);
+	if (unlikely(err))
+		goto fail;
+
+	memset(&header, 0, sizeof(header));
+	memset(&msg   , 0, sizeof(msg));
+
+	header.flags = MESSAGE_FLAG_UCAST;
+	header.type  = MESSAGE_TYPE_REQUEST_ATTACH;
+
+	msg.version = MESSAGE_PROTOCOL_VERSION;
+	msg.key     = key;
+	msg.argv    = (char **)argv;
+
+	for (msg.argc = 0; argv[msg.argc]; ++msg.argc)
+		;
+
+	err = _send_message(alloc, fd, &header, &msg);
+	if (unlikely(err)) {
+		fcallerror("_send_message", err);
+		goto fail;
+	}
+
+	err = _recv_message(alloc, fd, MESSAGE_TYPE_RESPONSE_ATTACH,
+	                    &header, &reply);
+	if (unlikely(err)) {
+		fcallerror("_recv_message", err);
+		goto fail;
+	}
+
+	err = (int )reply.ret;
+
+	tmp = free_message_payload(&header, alloc, &reply);
+	if (unlikely(tmp))
+		fcallerror("free_message_payload", tmp);
+
+fail:
+	tmp = do_close(fd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+
+	return err;
+}
+
+int agent_read_key(const char *path, char *buf, int size)
+{
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "r");
+	if (unlikely(!fp)) {
+		error("Failed to open key file '%s'. errno = %d says '%s'.",
+		      path, errno, strerror(errno));
+		return -errno;
+	}
+
+	n = fread(buf, 1, size - 1, fp);
+	fclose(fp);
+
+	while ((n > 0) && ('\n' == buf[n - 1]))
+		--n;
+	buf[n] = 0;
+
+	if (unlikely(0 == n)) {
+		error("Key file '%s' is empty.", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int _listen(int port, int *fd)
+{
+	int err;
+	int one;
+	struct sockaddr_in sa;
+
+	*fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (unlikely(-1 == *fd)) {
+		error("socket() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	/* Allow restarting the agent while connections of the previous
+	 * instance are in TIME_WAIT.
+	 */
+	one = 1;
+	if (unlikely(-1 == setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR,
+	                              &one, sizeof(one)))) {
+		error("setsockopt() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family      = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	sa.sin_port        = htons(port);
+
+	if (unlikely(-1 == bind(*fd, (struct sockaddr *)&sa, sizeof(sa)))) {
+		error("bind() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	if (unlikely(-1 == listen(*fd, 128))) {
+		error("listen() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	(void )do_close(*fd);
+
+	return err;
+}
+
+/*
+ * Collect the exit status of terminated handlers. If block is set wait
+ * for at least one.
+ */
+static int _reap_handlers(int *nhandlers, int block)
+{
+	int pid, status;
+
+	while (*nhandlers > 0) {
+		pid = waitpid(-1, &status, (block) ? 0 : WNOHANG);
+		if (0 == pid)
+			break;
+		if (unlikely(-1 == pid)) {
+			if (EINTR == errno)
+				continue;
+
+			error("waitpid() failed. errno = %d says '%s'.", errno, strerror(errno));
+			return -errno;
+		}
+
+		--(*nhandlers);
+		block = 0;
+	}
+
+	return 0;
+}
+
+static int _serve(struct alloc *alloc, int fd, const char *key,
+                  int (*entry)(int, char **))
+{
+	int err, tmp;
+	int ret;
+	struct message_header          header;
+	struct message_request_attach  msg;
+	struct message_response_attach reply;
+
+	err = _set_timeout(fd, AGENT_REQUEST_TIMEOUT);
+	if (unlikely(err))
+		return err;
+
+	err = _recv_message(alloc, fd, MESSAGE_TYPE_REQUEST_ATTACH,
+	                    &header, &msg);
+	if (unlikely(err)) {
+		fcallerror("_recv_message", err);
+		return err;
+	}
+
+	if (unlikely(MESSAGE_PROTOCOL_VERSION != msg.version)) {
+		error("Root speaks protocol version %d but we need version %d.",
+		      (int )msg.version, MESSAGE_PROTOCOL_VERSION);
+		ret = -ESOMEFAULT;
+	} else if (unlikely(!msg.key || !_key_equal(key, msg.key))) {
+		error("Rejecting request with a wrong key.");
+		ret = -EACCES;
+	} else if (unlikely(AGENT_ARGC != msg.argc)) {
+		error("Rejecting request with %d arguments.", (int )msg.argc);
+		ret = -EINVAL;
+	} else {
+		ret = _start(&msg, fd, entry);
+	}
+
+	tmp = free_message_payload(&header, alloc, &msg);
+	if (unlikely(tmp))
+		fcallerror("free_message_payload", tmp);
+
+	memset(&header, 0, sizeof(header));
+	memset(&reply , 0, sizeof(reply));
+
+	header.flags = MESSAGE_FLAG_UCAST;
+	header.type  = MESSAGE_TYPE_RESPONSE_ATTACH;
+
+	reply.ret = ret;
+
+	err = _send_message(alloc, fd, &header, &reply);
+	if (unlikely(err)) {
+		fcallerror("_send_message", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Compare the keys in constant time so that the response time does not
+ * reveal how many leading characters of a guess are correct. x is at
+ * most AGENT_MAX_KEY_LEN characters long (see agent_read_key()).
+ */
+static int _key_equal(const char *x, const char *y)
+{
+	char a[AGENT_MAX_KEY_LEN + 1], b[AGENT_MAX_KEY_LEN + 1];
+	ui8 diff;
+	int i;
+
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+
+	strncpy(a, x, AGENT_MAX_KEY_LEN);
+	strncpy(b, y, AGENT_MAX_KEY_LEN);
+
+	/* Longer keys never match. a always ends in a zero.
+	 */
+	diff = (strnlen(y, AGENT_MAX_KEY_LEN + 1) > AGENT_MAX_KEY_LEN);
+
+	for (i = 0; i < (int )sizeof(a); ++i)
+		diff |= a[i] ^ b[i];
+
+	return (0 == diff);
+}
+
+/*
+ * Fork and call the entry function in the child. The handler is single
+ * threaded so this is safe. Returns once the child daemonized (or
+ * failed).
+ */
+static int _start(struct message_request_attach *msg, int fd,
+                  int (*entry)(int, char **))
+{
+	int pid, status;
+
+	pid = fork();
+	if (unlikely(-1 == pid)) {
+		error("fork() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	if (0 == pid) {
+		(void )close(fd);
+
+		/* main() recognizes the processes of the tree by the
+		 * name of the executable. Use our own installation
+		 * regardless of the one of the root.
+		 */
+		msg->argv[0] = SPAWN_EXE_OTHER;
+
+		exit(entry(msg->argc, msg->argv));
+	}
+
+	while (-1 == waitpid(pid, &status, 0)) {
+		if (EINTR == errno)
+			continue;
+
+		error("waitpid() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	return exit_status_to_error(status);
+}
+
+static int _connect(const char *host, int port, int *fd)
+{
+	int err;
+	struct addrinfo hints, *res, *p;
+	char service[16];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	err = getaddrinfo(host, service, &hints, &res);
+	if (unlikely(err)) {
+		error("getaddrinfo() failed for host '%s'. gai_strerror() says '%s'.",
+		      host, gai_strerror(err));
+		return -ESOMEFAULT;
+	}
+
+	err = -ESOMEFAULT;
+
+	for (p = res; p; p = p->ai_next) {
+		*fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+		if (unlikely(-1 == *fd)) {
+			error("socket() failed. errno = %d says '%s'.", errno, strerror(errno));
+			err = -errno;
+			continue;
+		}
+
+		/* Linux applies the send timeout to connect() as well.
+		 */
+		err = _set_timeout(*fd, AGENT_CONNECT_TIMEOUT);
+		if (likely(!err))
+			err = do_connect(*fd, p->ai_addr, p->ai_addrlen);
+		if (likely(!err))
+			break;
+
+		(void )do_close(*fd);
+	}
+
+	freeaddrinfo(res);
+
+	return err;
+}
+
+static int _set_timeout(int fd, int secs)
+{
+	struct timeval tv;
+
+	tv.tv_sec  = secs;
+	tv.tv_usec = 0;
+
+	if (unlikely(-1 == setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	             -1 == setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))) {
+		error("setsockopt() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int _send_message(struct alloc *alloc, int fd,
+                         struct message_header *header, void *msg)
+{
+	int err, tmp;
+	struct buffer buf;
+
+	err = buffer_ctor(&buf, alloc, 4096);
+	if (unlikely(err)) {
+		fcallerror("buffer_ctor", err);
+		return err;
+	}
+
+	err = pack_message(&buf, header, msg);
+	if (unlikely(err)) {
+		fcallerror("pack_message", err);
+		goto fail;
+	}
+
+	err = do_write_loop(fd, buf.buf, buf.size);
+
+fail:
+	tmp = buffer_dtor(&buf);
+	if (unlikely(tmp))
+		fcallerror("buffer_dtor", tmp);
+
+	return err;
+}
+
+/*
+ * Receive a single message of the given type. Same as
+ * _recv_join_response() in main.c.
+ */
+static int _recv_message(struct alloc *alloc, int fd, int type,
+                         struct message_header *header, void *msg)
+{
+	int err, tmp;
+	struct buffer buf;
+	ll size;
+
+	err = buffer_ctor(&buf, alloc, MESSAGE_HEADER_MAX_SIZE);
+	if (unlikely(err)) {
+		fcallerror("buffer_ctor", err);
+		return err;
+	}
+
+	err = buffer_resize(&buf, MESSAGE_HEADER_MIN_SIZE);
+	if (unlikely(err)) {
+		fcallerror("buffer_resize", err);
+		goto fail;
+	}
+
+	err = _read_fully(&buf, fd);
+	if (unlikely(err))
+		goto fail;
+
+	err = peek_message_size(&buf, &size);
+	if (unlikely(err)) {
+		fcallerror("peek_message_size", err);
+		goto fail;
+	}
+
+	err = buffer_resize(&buf, size);
+	if (unlikely(err)) {
+		fcallerror("buffer_resize", err);
+		goto fail;
+	}
+
+	err = _read_fully(&buf, fd);
+	if (unlikely(err))
+		goto fail;
+
+	err = secretly_copy_header(&buf, header);
+	if (unlikely(err)) {
+		fcallerror("secretly_copy_header", err);
+		goto fail;
+	}
+
+	if (unlikely(type != header->type)) {
+		error("Expected a message of type %d but got %d.", type, header->type);
+		err = -ESOMEFAULT;
+		goto fail;
+	}
+
+	err = buffer_seek(&buf, header->size);
+	if (unlikely(err)) {
+		fcallerror("buffer_seek", err);
+		goto fail;
+	}
+
+	err = unpack_message_payload(&buf, header, alloc, msg);
+	if (unlikely(err))
+		fcallerror("unpack_message_payload", err);
+
+fail:
+	tmp = buffer_dtor(&buf);
+	if (unlikely(tmp))
+		fcallerror("buffer_dtor", tmp);
+
+	return err;
+}
+
+/*
+ * Read until the buffer is full. Fails if the peer closes the connection
+ * or the timeout expires.
+ */
+static int _read_fully(struct buffer *buf, int fd)
+{
+	int err;
+	ll pos;
+
+	while (!buffer_pos_equal_size(buf)) {
+		pos = buf->pos;
+
+		err = buffer_read(buf, fd);
+		if (unlikely(err)) {
+			fcallerror("buffer_read", err);
+			return err;
+		}
+
+		if (unlikely(pos == buf->pos)) {
+			error("Connection closed by peer.");
+			return -ESOMEFAULT;
+		}
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,53 @@
+
+#ifndef SPAWN_AGENT_H_INCLUDED
+#define SPAWN_AGENT_H_INCLUDED 1
+
+struct alloc;
+struct optpool;
+
+
+/*
+ * Resident node agents.
+ *
+ * An agent is started once per node with "spawn --agent" and keeps
+ * running in the foreground. It listens on the TCP port given by the
+ * 'AgentPort' option. Instead of running the command line of a new
+ * process of the tree via ssh or srun the agent.so exec plugin sends it
+ * to the agent of the host (REQUEST_ATTACH). The agent forks and the
+ * child calls the entry function (main()) with the command line
+ * without exec()ing anything. The new process then joins the tree like
+ * any other process with REQUEST_JOIN/RESPONSE_JOIN. The agent replies
+ * (RESPONSE_ATTACH) once the process daemonized so that the semantics
+ * match exec_plugin_ops.exec().
+ *
+ * Anyone who can connect to the port could start processes as the user
+ * running the agent. Hence the agent refuses to start unless the
+ * 'AgentKeyFile' option is set and the content of the file must be sent
+ * along with every request. The file is expected to live in a shared
+ * home directory and to be readable by the owner only. Every request is
+ * served by a forked handler and clients must send it within a few
+ * seconds.
+ */
+#define AGENT_MAX_KEY_LEN	256
+
+/*
+ * Run the agent. Only returns on failure.
+ */
+int agent_main(struct alloc *alloc, struct optpool *opts,
+               int (*entry)(int, char **));
+
+/*
+ * Ask the agent on host listening on port to start the process given
+ * by argv. key may be NULL. Returns the exit code of the process (as
+ * converted by exit_status_to_error()) if it did not daemonize.
+ */
+int agent_attach(struct alloc *alloc, const char *host, int port,
+                 const char *key, char *const *argv);
+
+/*
+ * Read the key from path into buf. A trailing newline is stripped.
+ */
+int agent_read_key(const char *path, char *buf, int size);
+
+#endif
+
@@ -1,11 +1,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "compiler.h"
 #include "alloc.h"
 #include "error.h"
+#include "helper.h"
 
 
 static int _libc_malloc(struct alloc *self, void **p, ll num, ll sz,
@@ -20,6 +23,30 @@ static int _libc_free(struct alloc *self, void **p, ll num, ll sz,
                       const char* file, const char* func, long line, const char* fmt, ...);
 static int _libc_zfree(struct alloc *self, void **p, ll num, ll sz,
                        const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_malloc(struct alloc *self, void **p, ll num, ll sz,
+                         const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_zalloc(struct alloc *self, void **p, ll num, ll sz,
+                         const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_realloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum, ll nsz,
+                          const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_zrealloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum, ll nsz,
+                           const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_free(struct alloc *self, void **p, ll num, ll sz,
+                       const char* file, const char* func, long line, const char* fmt, ...);
+static int _arena_zfree(struct alloc *self, void **p, ll num, ll sz,
+                        const char* file, const char* func, long line, const char* fmt, ...);
+static void _profile_record_alloc(void *p, ll size,
+                                  const char *file, const char *func, long line);
+static void _profile_record_free(void *p);
+static int _profile_find_site(const char *file, const char *func, long line);
+static ll _profile_ptr_home(void *p);
+static void _profile_remove_ptr(ll i);
+static int _profile_find_merged_site(struct alloc_profile *self, const char *file, ll line);
+static int _profile_compare_hwm(const void *a, const void *b);
+static int _arena_bump(struct arena_alloc *self, ll n, void **p);
+static int _arena_resize(struct arena_alloc *self, void **p, ll o, ll n);
+static int _arena_is_last(struct arena_alloc *self, void *p);
+static int _arena_free_chunk(struct arena_alloc *self, struct arena_chunk **chunk);
 
 struct libc_alloc
 {
@@ -36,6 +63,76 @@ static struct alloc_ops _libc_alloc_ops = {
 	.zfree = _libc_zfree
 };
 
+/*
+ * Header of a chunk in struct arena_alloc. The usable memory directly
+ * follows the header.
+ */
+struct arena_chunk
+{
+	struct arena_chunk	*next;
+	ll			size;	/* Usable bytes */
+	ll			used;
+	ll			last;	/* Offset of the most recent allocation */
+};
+
+/* All allocations from an arena are aligned to this many bytes.
+ */
+#define ARENA_ALIGN		16
+#define ARENA_ROUNDUP(N)	(((N) + ARENA_ALIGN - 1) & ~((ll )ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(C)	((char *)(C) + ARENA_ROUNDUP(sizeof(struct arena_chunk)))
+
+/*
+ * The profiler keeps its state in fixed size tables so that no allocation
+ * happens while recording samples. Samples that do not fit are dropped.
+ */
+#define PROFILE_MAX_SITES	1024
+#define PROFILE_MAX_PTRS	16384
+#define PROFILE_FILTER_SIZE	4096
+
+/*
+ * A sampled allocation which is still alive.
+ */
+struct _profile_ptr
+{
+	void	*p;
+	ll	bytes;	/* Extrapolated size */
+	int	site;
+};
+
+static struct
+{
+	pthread_mutex_t			lock;
+	ll				interval;
+
+	struct alloc_profile_site	sites[PROFILE_MAX_SITES];
+	ll				nptrs;
+	struct _profile_ptr		ptrs[PROFILE_MAX_PTRS];
+
+	/* Counting filter over the addresses in ptrs. Allows free
+	 * to skip the lock for the vast majority of the pointers
+	 * which have not been sampled. */
+	volatile ui16			filter[PROFILE_FILTER_SIZE];
+} _profile = {
+	.lock     = PTHREAD_MUTEX_INITIALIZER,
+	.interval = ALLOC_PROFILE_DEFAULT_INTERVAL
+};
+
+/* Number of allocations until the next sample is taken.
+ */
+static __thread ll _profile_countdown = 0;
+
+#define PROFILE_HASH(P)		((((uintptr_t )(P)) >> 4)*0x9E3779B97F4A7C15ULL)
+#define PROFILE_FILTER_SLOT(P)	(PROFILE_HASH(P) >> 52)
+
+static struct alloc_ops _arena_alloc_ops = {
+	.malloc = _arena_malloc,
+	.zalloc = _arena_zalloc,
+	.realloc = _arena_realloc,
+	.zrealloc = _arena_zrealloc,
+	.free = _arena_free,
+	.zfree = _arena_zfree
+};
+
 static struct libc_alloc _libc_alloc_no_debug = {
 	.base  = {
 		.ops = &_libc_alloc_ops
@@ -61,6 +158,233 @@ struct alloc *libc_allocator_with_debugging()
 	return (struct alloc *)&_libc_alloc_wi_debug;
 }
 
+void alloc_profile_set_interval(ll interval)
+{
+	pthread_mutex_lock(&_profile.lock);
+	_profile.interval = MAX(interval, 0);
+	pthread_mutex_unlock(&_profile.lock);
+}
+
+ll alloc_profile_get_interval()
+{
+	return _profile.interval;
+}
+
+int alloc_profile_ctor(struct alloc_profile *self, struct alloc *alloc)
+{
+	self->alloc  = alloc;
+	self->nsites = 0;
+	self->sites  = NULL;
+
+	return 0;
+}
+
+int alloc_profile_dtor(struct alloc_profile *self)
+{
+	int err;
+	ll i;
+
+	for (i = 0; i < self->nsites; ++i) {
+		strfree(self->alloc, (char **)&self->sites[i].file);
+		strfree(self->alloc, (char **)&self->sites[i].func);
+	}
+
+	err = ZFREE(self->alloc, (void **)&self->sites, self->nsites,
+	            sizeof(struct alloc_profile_site), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	self->nsites = 0;
+
+	return 0;
+}
+
+int alloc_profile_snapshot(struct alloc_profile *self)
+{
+	int err, tmp;
+	ll i, n;
+	struct alloc_profile_site *copy;
+
+	/* Copy the table first. Merging allocates memory which may end
+	 * up in the profiler.
+	 */
+	err = MALLOC(self->alloc, (void **)&copy, PROFILE_MAX_SITES,
+	             sizeof(struct alloc_profile_site), "copy");
+	if (unlikely(err)) {
+		fcallerror("MALLOC", err);
+		return err;
+	}
+
+	pthread_mutex_lock(&_profile.lock);
+
+	n = 0;
+	for (i = 0; i < PROFILE_MAX_SITES; ++i) {
+		if (_profile.sites[i].file)
+			copy[n++] = _profile.sites[i];
+	}
+
+	pthread_mutex_unlock(&_profile.lock);
+
+	err = alloc_profile_merge(self, copy, n);
+	if (unlikely(err))
+		fcallerror("alloc_profile_merge", err);
+
+	tmp = FREE(self->alloc, (void **)&copy, PROFILE_MAX_SITES,
+	           sizeof(struct alloc_profile_site), "");
+	if (unlikely(tmp))
+		fcallerror("FREE", tmp);
+
+	return err;
+}
+
+int alloc_profile_merge(struct alloc_profile *self, const struct alloc_profile_site *sites, ll nsites)
+{
+	int err, tmp;
+	ll i, k;
+	struct alloc_profile_site *x;
+	char *file, *func;
+
+	for (i = 0; i < nsites; ++i) {
+		k = _profile_find_merged_site(self, sites[i].file, sites[i].line);
+
+		if (k < 0) {
+			/* The site is only added once it is complete since
+			 * _profile_find_merged_site() compares the file names.
+			 */
+			file = NULL;
+			func = NULL;
+
+			err = xstrdup(self->alloc, sites[i].file, &file);
+			if (unlikely(err)) {
+				fcallerror("xstrdup", err);
+				goto fail;
+			}
+
+			err = xstrdup(self->alloc, sites[i].func, &func);
+			if (unlikely(err)) {
+				fcallerror("xstrdup", err);
+				goto fail;
+			}
+
+			err = ZREALLOC(self->alloc, (void **)&self->sites,
+			               self->nsites, sizeof(struct alloc_profile_site),
+			               self->nsites + 1, sizeof(struct alloc_profile_site), "sites");
+			if (unlikely(err)) {
+				fcallerror("ZREALLOC", err);
+				goto fail;
+			}
+
+			k = self->nsites++;
+			x = &self->sites[k];
+
+			x->file = file;
+			x->func = func;
+			x->line = sites[i].line;
+		}
+
+		x = &self->sites[k];
+
+		x->count += sites[i].count;
+		x->bytes += sites[i].bytes;
+		x->live  += sites[i].live;
+		x->hwm   += sites[i].hwm;
+	}
+
+	return 0;
+
+fail:
+	tmp = strfree(self->alloc, &func);
+	if (unlikely(tmp))
+		fcallerror("strfree", tmp);
+
+	tmp = strfree(self->alloc, &file);
+	if (unlikely(tmp))
+		fcallerror("strfree", tmp);
+
+	return err;
+}
+
+int alloc_profile_log(struct alloc_profile *self, int nlines)
+{
+	ll i;
+	struct alloc_profile_site *x;
+
+	qsort(self->sites, self->nsites, sizeof(struct alloc_profile_site),
+	      _profile_compare_hwm);
+
+	log("Allocation profile (sampling interval %lld, %lld sites):",
+	    _profile.interval, self->nsites);
+	log("%-12s %-32s %5s %12s %14s %12s %12s",
+	    "file", "function", "line", "count", "bytes", "live", "hwm");
+
+	for (i = 0; i < MIN(nlines, self->nsites); ++i) {
+		x = &self->sites[i];
+		log("%-12s %-32s %5lld %12lld %14lld %12lld %12lld",
+		    x->file, x->func, x->line, x->count, x->bytes, x->live, x->hwm);
+	}
+
+	return 0;
+}
+
+int arena_alloc_ctor(struct arena_alloc *self, struct alloc *parent, ll chunksize)
+{
+	if (unlikely(!self || !parent || (chunksize < 0)))
+		return -EINVAL;
+
+	self->base.ops  = &_arena_alloc_ops;
+	self->parent    = parent;
+	self->chunksize = chunksize ? ARENA_ROUNDUP(chunksize) : ARENA_DEFAULT_CHUNKSIZE;
+	self->head      = NULL;
+
+	return 0;
+}
+
+int arena_alloc_dtor(struct arena_alloc *self)
+{
+	int err;
+	struct arena_chunk *chunk;
+
+	while (self->head) {
+		chunk = self->head;
+		self->head = chunk->next;
+
+		err = _arena_free_chunk(self, &chunk);
+		if (unlikely(err)) {
+			fcallerror("_arena_free_chunk", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+int arena_alloc_reset(struct arena_alloc *self)
+{
+	int err;
+	struct arena_chunk *chunk;
+
+	if (!self->head)
+		return 0;
+
+	while (self->head->next) {
+		chunk = self->head;
+		self->head = chunk->next;
+
+		err = _arena_free_chunk(self, &chunk);
+		if (unlikely(err)) {
+			fcallerror("_arena_free_chunk", err);
+			return err;
+		}
+	}
+
+	self->head->used = 0;
+	self->head->last = 0;
+
+	return 0;
+}
+
 
 static int _libc_malloc(struct alloc *self, void **p, ll num, ll sz,
                         const char* file, const char* func, long line, const char* fmt, ...)
@@ -71,7 +395,8 @@ static int _libc_malloc(struct alloc *self, void **p, ll num, ll sz,
 	*p = malloc(num*sz);
 
 	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
+		if (*p)
+			_profile_record_alloc(*p, num*sz, file, func, line);
 	}
 
 	if (unlikely(!(*p)))
@@ -89,7 +414,8 @@ static int _libc_zalloc(struct alloc *self, void **p, ll num, ll sz,
 	*p = calloc(num, sz);
 
 	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
+		if (*p)
+			_profile_record_alloc(*p, num*sz, file, func, line);
 	}
 
 	if (unlikely(!(*p)))
@@ -104,10 +430,14 @@ static int _libc_realloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum,
 	if (unlikely(!self || !p || (onum < 0) || (osz < 0) || (nnum < 0) || (nsz < 0)))
 		return -EINVAL;
 
+	if (unlikely(((struct libc_alloc *)self)->debug))	/* optimize for non-debug path */
+		_profile_record_free(*p);
+
 	*p = realloc(*p, nnum*nsz);
 
 	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
+		if (*p)
+			_profile_record_alloc(*p, nnum*nsz, file, func, line);
 	}
 
 	if (unlikely(!(*p)))
@@ -122,10 +452,14 @@ static int _libc_zrealloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum
 	if (unlikely(!self || !p || (onum < 0) || (osz < 0) || (nnum < 0) || (nsz < 0)))
 		return -EINVAL;
 
+	if (unlikely(((struct libc_alloc *)self)->debug))	/* optimize for non-debug path */
+		_profile_record_free(*p);
+
 	*p = realloc(*p, nnum*nsz);
 
 	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
+		if (*p)
+			_profile_record_alloc(*p, nnum*nsz, file, func, line);
 	}
 
 	if (unlikely(!(*p)))
@@ -143,9 +477,8 @@ static int _libc_free(struct alloc *self, void **p, ll num, ll sz,
 	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
 		return -EINVAL;
 
-	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
-	}
+	if (unlikely(((struct libc_alloc *)self)->debug))	/* optimize for non-debug path */
+		_profile_record_free(*p);
 
 	free(*p);
 	*p = NULL;
@@ -159,9 +492,8 @@ static int _libc_zfree(struct alloc *self, void **p, ll num, ll sz,
 	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
 		return -EINVAL;
 
-	if (unlikely(((struct libc_alloc *)self)->debug)) {	/* optimize for non-debug path */
-		/* TODO */
-	}
+	if (unlikely(((struct libc_alloc *)self)->debug))	/* optimize for non-debug path */
+		_profile_record_free(*p);
 
 	free(memset(*p, 0, num*sz));
 	*p = NULL;
@@ -169,3 +501,317 @@ static int _libc_zfree(struct alloc *self, void **p, ll num, ll sz,
 	return 0;
 }
 
+
+static void _profile_record_alloc(void *p, ll size,
+                                  const char *file, const char *func, long line)
+{
+	ll i, w;
+	int k;
+	struct alloc_profile_site *x;
+
+	if (likely(--_profile_countdown > 0))
+		return;
+
+	/* If the profiler is disabled check again every now and then
+	 * in case it is re-enabled later.
+	 */
+	w = _profile.interval;
+	if (0 == w) {
+		_profile_countdown = 1024;
+		return;
+	}
+
+	_profile_countdown = w;
+
+	pthread_mutex_lock(&_profile.lock);
+
+	k = _profile_find_site(file, func, line);
+	if (unlikely(k < 0))
+		goto done;	/* Table is full. */
+
+	x = &_profile.sites[k];
+
+	x->count += w;
+	x->bytes += w*size;
+	x->live  += w*size;
+	x->hwm    = MAX(x->hwm, x->live);
+
+	/* Keep the load factor below 3/4.
+	 */
+	if (unlikely(4*(_profile.nptrs + 1) > 3*PROFILE_MAX_PTRS))
+		goto done;
+
+	i = _profile_ptr_home(p);
+	while (_profile.ptrs[i].p)
+		i = (i + 1) & (PROFILE_MAX_PTRS - 1);
+
+	_profile.ptrs[i].p     = p;
+	_profile.ptrs[i].bytes = w*size;
+	_profile.ptrs[i].site  = k;
+	_profile.nptrs += 1;
+	_profile.filter[PROFILE_FILTER_SLOT(p)] += 1;
+
+done:
+	pthread_mutex_unlock(&_profile.lock);
+}
+
+static void _profile_record_free(void *p)
+{
+	ll i;
+
+	if (likely(!p || (0 == _profile.filter[PROFILE_FILTER_SLOT(p)])))
+		return;
+
+	pthread_mutex_lock(&_profile.lock);
+
+	i = _profile_ptr_home(p);
+	while (_profile.ptrs[i].p) {
+		if (p == _profile.ptrs[i].p) {
+			_profile.sites[_profile.ptrs[i].site].live -= _profile.ptrs[i].bytes;
+			_profile.filter[PROFILE_FILTER_SLOT(p)] -= 1;
+			_profile_remove_ptr(i);
+			break;
+		}
+
+		i = (i + 1) & (PROFILE_MAX_PTRS - 1);
+	}
+
+	pthread_mutex_unlock(&_profile.lock);
+}
+
+/*
+ * Must be called with the profiler lock held. file is a string literal so
+ * comparing pointers is sufficient.
+ */
+static int _profile_find_site(const char *file, const char *func, long line)
+{
+	ll i, k;
+
+	i = (PROFILE_HASH(file) ^ PROFILE_HASH(line)) & (PROFILE_MAX_SITES - 1);
+
+	for (k = 0; k < PROFILE_MAX_SITES; ++k) {
+		if (!_profile.sites[i].file) {
+			_profile.sites[i].file = file;
+			_profile.sites[i].func = func;
+			_profile.sites[i].line = line;
+			return i;
+		}
+		if ((file == _profile.sites[i].file) && (line == _profile.sites[i].line))
+			return i;
+
+		i = (i + 1) & (PROFILE_MAX_SITES - 1);
+	}
+
+	return -1;
+}
+
+static ll _profile_ptr_home(void *p)
+{
+	return PROFILE_HASH(p) & (PROFILE_MAX_PTRS - 1);
+}
+
+/*
+ * Remove entry i from the linear probing table by shifting back the
+ * entries of the same cluster.
+ */
+static void _profile_remove_ptr(ll i)
+{
+	ll j, k;
+
+	j = i;
+	while (1) {
+		j = (j + 1) & (PROFILE_MAX_PTRS - 1);
+		if (!_profile.ptrs[j].p)
+			break;
+
+		k = _profile_ptr_home(_profile.ptrs[j].p);
+
+		/* Move entry j into the hole at i unless its home
+		 * lies cyclically in (i, j].
+		 */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+
+		_profile.ptrs[i] = _profile.ptrs[j];
+		i = j;
+	}
+
+	_profile.ptrs[i].p = NULL;
+	_profile.nptrs -= 1;
+}
+
+static int _profile_find_merged_site(struct alloc_profile *self, const char *file, ll line)
+{
+	ll i;
+
+	for (i = 0; i < self->nsites; ++i) {
+		if ((line == self->sites[i].line) && !strcmp(file, self->sites[i].file))
+			return i;
+	}
+
+	return -1;
+}
+
+static int _profile_compare_hwm(const void *a, const void *b)
+{
+	ll x = ((const struct alloc_profile_site *)a)->hwm;
+	ll y = ((const struct alloc_profile_site *)b)->hwm;
+
+	return (x < y) - (x > y);
+}
+
+static int _arena_malloc(struct alloc *self, void **p, ll num, ll sz,
+                         const char* file, const char* func, long line, const char* fmt, ...)
+{
+	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
+		return -EINVAL;
+
+	return _arena_bump((struct arena_alloc *)self, num*sz, p);
+}
+
+static int _arena_zalloc(struct alloc *self, void **p, ll num, ll sz,
+                         const char* file, const char* func, long line, const char* fmt, ...)
+{
+	int err;
+
+	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
+		return -EINVAL;
+
+	err = _arena_bump((struct arena_alloc *)self, num*sz, p);
+	if (unlikely(err))
+		return err;
+
+	memset(*p, 0, num*sz);
+
+	return 0;
+}
+
+static int _arena_realloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum, ll nsz,
+                          const char* file, const char* func, long line, const char* fmt, ...)
+{
+	if (unlikely(!self || !p || (onum < 0) || (osz < 0) || (nnum < 0) || (nsz < 0)))
+		return -EINVAL;
+
+	return _arena_resize((struct arena_alloc *)self, p, onum*osz, nnum*nsz);
+}
+
+static int _arena_zrealloc(struct alloc *self, void **p, ll onum, ll osz, ll nnum, ll nsz,
+                           const char* file, const char* func, long line, const char* fmt, ...)
+{
+	int err;
+
+	if (unlikely(!self || !p || (onum < 0) || (osz < 0) || (nnum < 0) || (nsz < 0)))
+		return -EINVAL;
+
+	err = _arena_resize((struct arena_alloc *)self, p, onum*osz, nnum*nsz);
+	if (unlikely(err))
+		return err;
+
+	if ((nnum*nsz) > (onum*osz))
+		memset((*p) + (onum*osz), 0, (nnum*nsz) - (onum*osz));
+
+	return 0;
+}
+
+static int _arena_free(struct alloc *self, void **p, ll num, ll sz,
+                       const char* file, const char* func, long line, const char* fmt, ...)
+{
+	struct arena_alloc *arena = (struct arena_alloc *)self;
+
+	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
+		return -EINVAL;
+
+	/* Only the most recent allocation can be given back. Everything
+	 * else is released by arena_alloc_reset().
+	 */
+	if (_arena_is_last(arena, *p))
+		arena->head->used = arena->head->last;
+
+	*p = NULL;
+
+	return 0;
+}
+
+static int _arena_zfree(struct alloc *self, void **p, ll num, ll sz,
+                        const char* file, const char* func, long line, const char* fmt, ...)
+{
+	if (unlikely(!self || !p || (num < 0) || (sz < 0)))
+		return -EINVAL;
+
+	if (*p)
+		memset(*p, 0, num*sz);
+
+	return _arena_free(self, p, num, sz, file, func, line, fmt);
+}
+
+static int _arena_bump(struct arena_alloc *self, ll n, void **p)
+{
+	int err;
+	ll size;
+	struct arena_chunk *chunk;
+
+	n = ARENA_ROUNDUP(MAX(n, 1));
+
+	chunk = self->head;
+	if (unlikely(!chunk || (chunk->used + n > chunk->size))) {
+		size = MAX(self->chunksize, n);
+
+		err = MALLOC(self->parent, (void **)&chunk, 1,
+		             ARENA_ROUNDUP(sizeof(struct arena_chunk)) + size, "arena chunk");
+		if (unlikely(err)) {
+			fcallerror("MALLOC", err);
+			return err;
+		}
+
+		chunk->next = self->head;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->last = 0;
+
+		self->head = chunk;
+	}
+
+	*p = ARENA_CHUNK_DATA(chunk) + chunk->used;
+
+	chunk->last  = chunk->used;
+	chunk->used += n;
+
+	return 0;
+}
+
+static int _arena_resize(struct arena_alloc *self, void **p, ll o, ll n)
+{
+	int err;
+	void *q;
+
+	if (!(*p))
+		return _arena_bump(self, n, p);
+
+	/* Grow or shrink in place if this is the most recent allocation.
+	 */
+	if (_arena_is_last(self, *p) &&
+	    (self->head->last + ARENA_ROUNDUP(MAX(n, 1)) <= self->head->size)) {
+		self->head->used = self->head->last + ARENA_ROUNDUP(MAX(n, 1));
+		return 0;
+	}
+
+	err = _arena_bump(self, n, &q);
+	if (unlikely(err))
+		return err;
+
+	memcpy(q, *p, MIN(o, n));
+	*p = q;
+
+	return 0;
+}
+
+static int _arena_is_last(struct arena_alloc *self, void *p)
+{
+	return self->head && (p == ARENA_CHUNK_DATA(self->head) + self->head->last);
+}
+
+static int _arena_free_chunk(struct arena_alloc *self, struct arena_chunk **chunk)
+{
+	return FREE(self->parent, (void **)chunk, 1,
+	            ARENA_ROUNDUP(sizeof(struct arena_chunk)) + (*chunk)->size, "");
+}
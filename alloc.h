@@ -88,13 +88,111 @@ struct alloc *libc_allocator();
 
 /*
  * Get a pointer to an allocator that works directly on top of malloc/calloc/free - just like libc_allocator() - but
- * additionally provides debugging information. Each operation will result in an info() message send to stderr and thus
- * may slowdown the execution significantly.
+ * additionally feeds the allocation profiler (see below). Only every n-th allocation is sampled so the overhead
+ * remains small.
  *
  * TODO Provide an option for a ring buffer that can be written to for debugging purpose.
  *
  */
 struct alloc *libc_allocator_with_debugging();
 
+
+/*
+ * Statistics for a single allocation site. All numbers are estimates extrapolated from the sampled allocations.
+ * For profiles aggregated over multiple processes the values are sums and hwm is thus an upper bound for the
+ * combined high-water mark.
+ */
+struct alloc_profile_site
+{
+	const char	*file;
+	const char	*func;
+	ll		line;
+
+	ll		count;	/* Number of allocations */
+	ll		bytes;	/* Number of bytes allocated in total */
+	ll		live;	/* Bytes currently allocated */
+	ll		hwm;	/* High-water mark of live */
+};
+
+/*
+ * A copy of the allocation profile. Used to take snapshots of the samples collected by the debugging allocator
+ * and to aggregate the profiles of multiple processes. The strings in sites are owned by the structure.
+ */
+struct alloc_profile
+{
+	struct alloc			*alloc;
+
+	ll				nsites;
+	struct alloc_profile_site	*sites;
+};
+
+/*
+ * Default sampling interval. One out of ALLOC_PROFILE_DEFAULT_INTERVAL allocations is recorded. The profiler is
+ * disabled by default and enabled with the 'AllocProfileInterval' option.
+ */
+#define ALLOC_PROFILE_DEFAULT_INTERVAL	0
+
+/*
+ * Change the sampling interval of the debugging allocator. An interval of zero disables the profiler.
+ */
+void alloc_profile_set_interval(ll interval);
+ll alloc_profile_get_interval();
+
+int alloc_profile_ctor(struct alloc_profile *self, struct alloc *alloc);
+int alloc_profile_dtor(struct alloc_profile *self);
+
+/*
+ * Add the current samples of this process to the profile.
+ */
+int alloc_profile_snapshot(struct alloc_profile *self);
+
+/*
+ * Add the sites of another profile to self. Sites are matched by file and line number.
+ */
+int alloc_profile_merge(struct alloc_profile *self, const struct alloc_profile_site *sites, ll nsites);
+
+/*
+ * Write the nlines sites with the largest high-water mark to the log.
+ */
+int alloc_profile_log(struct alloc_profile *self, int nlines);
+
+
+struct arena_chunk;
+
+/*
+ * Region (bump) allocator. Memory is carved out of large chunks obtained from the parent allocator and is
+ * released all at once by arena_alloc_reset() or arena_alloc_dtor(). The free operation only reclaims the
+ * memory if it is the most recent allocation, realloc grows the most recent allocation in place if possible.
+ * This makes the arena a good fit for allocations with a common, short lifetime (e.g., the payload of a
+ * received message or the data owned by a job) since the per-object malloc/free calls disappear.
+ *
+ * The arena is not thread-safe. Each instance must only be used by a single thread at a time.
+ */
+struct arena_alloc
+{
+	struct alloc		base;
+	struct alloc		*parent;	/* Allocator for the chunks */
+	ll			chunksize;	/* Default size of a chunk */
+	struct arena_chunk	*head;		/* Current chunk. Older chunks are chained via next */
+};
+
+/*
+ * Default chunk size for arenas if zero is passed to arena_alloc_ctor().
+ */
+#define ARENA_DEFAULT_CHUNKSIZE	4096
+
+/*
+ * Constructor and destructor for struct arena_alloc. No memory is allocated in the constructor, the first
+ * chunk is requested from the parent on demand. The destructor returns all chunks to the parent.
+ */
+int arena_alloc_ctor(struct arena_alloc *self, struct alloc *parent, ll chunksize);
+int arena_alloc_dtor(struct arena_alloc *self);
+
+/*
+ * Release all allocations in one shot. The oldest chunk is kept for reuse, all others are returned to the
+ * parent allocator. Pointers handed out before the reset are invalid afterwards.
+ */
+int arena_alloc_reset(struct arena_alloc *self);
+
 #endif
 
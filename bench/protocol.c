@@ -0,0 +1,182 @@
+
+/*
+ * Microbenchmark for the message pack and unpack routines (protocol.c).
+ *
+ * Reports the time per message in nanoseconds for a few representative
+ * message types. Pack includes the header. Unpack includes the header and
+ * freeing the unpacked payload. Build with "make bench" and run
+ * bench/protocol.exe [iterations]. The regular build uses -O0 so pass
+ * optimization flags for meaningful numbers, e.g.,
+ *
+ *   make clean && make bench CFLAGS="-O2 -Wall -std=gnu11 -fPIC"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "pack.h"
+#include "protocol.h"
+
+
+#define NHOSTS	1024
+
+union any_message
+{
+	struct message_ping			ping;
+	struct message_request_join		request_join;
+	struct message_request_exec		request_exec;
+	struct message_request_build_tree	request_build_tree;
+	struct message_user			user;
+	struct message_write_stdout		write_stdout;
+};
+
+static double _now();
+static int _run(const char *name, int type, void *msg, ll iters);
+
+
+int main(int argc, char **argv)
+{
+	ll iters;
+	struct message_ping ping;
+	struct message_request_join join;
+	struct message_request_exec exec;
+	struct message_request_build_tree tree;
+	struct message_user user;
+	struct message_write_stdout out;
+	char *args[] = {"/usr/bin/ssh", "-o", "BatchMode=yes", "node0001",
+	                "/opt/spawn/libexec/spawn", "10.0.0.1", NULL};
+	static ui32 addrs[NHOSTS];
+	static ui8 bytes[256];
+	int i;
+
+	iters = (argc > 1) ? atoll(argv[1]) : 200000;
+
+	memset(&ping, 0, sizeof(ping));
+	ping.now = 1234567890;
+
+	memset(&join, 0, sizeof(join));
+	join.version = MESSAGE_PROTOCOL_VERSION;
+	join.pid     = 4242;
+	join.ip      = 0x0A000001;
+	join.portnum = 40000;
+
+	memset(&exec, 0, sizeof(exec));
+	exec.host = "node0001";
+	exec.argc = 6;
+	exec.argv = args;
+	exec.cost = 1000;
+
+	for (i = 0; i < NHOSTS; ++i)
+		addrs[i] = 0x0A000000 + i;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.hosts  = "node[0001-1024]";
+	tree.naddrs = NHOSTS;
+	tree.addrs  = addrs;
+	tree.layout = 0;
+	tree.width  = 16;
+
+	memset(&user, 0, sizeof(user));
+	user.len   = sizeof(bytes);
+	user.bytes = bytes;
+
+	memset(&out, 0, sizeof(out));
+	out.lines = "The quick brown fox jumps over the lazy dog. "
+	            "The quick brown fox jumps over the lazy dog.\n";
+
+	printf("%-20s %12s %12s\n", "message", "pack [ns]", "unpack [ns]");
+
+	_run("ping"              , MESSAGE_TYPE_PING              , &ping, iters);
+	_run("request_join"      , MESSAGE_TYPE_REQUEST_JOIN      , &join, iters);
+	_run("request_exec"      , MESSAGE_TYPE_REQUEST_EXEC      , &exec, iters);
+	_run("request_build_tree", MESSAGE_TYPE_REQUEST_BUILD_TREE, &tree, iters);
+	_run("user"              , MESSAGE_TYPE_USER              , &user, iters);
+	_run("write_stdout"      , MESSAGE_TYPE_WRITE_STDOUT      , &out , iters);
+
+	return 0;
+}
+
+static double _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return 1e9*ts.tv_sec + ts.tv_nsec;
+}
+
+static int _run(const char *name, int type, void *msg, ll iters)
+{
+	int err;
+	struct alloc *alloc;
+	struct buffer buffer;
+	struct message_header header, x;
+	union any_message y;
+	double t0, t1, t2;
+	ll i;
+
+	alloc = libc_allocator();
+
+	err = buffer_ctor(&buffer, alloc, 4096);
+	if (unlikely(err)) {
+		fcallerror("buffer_ctor", err);
+		return err;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.src   = 1;
+	header.dst   = 2;
+	header.flags = MESSAGE_FLAG_UCAST;
+	header.type  = type;
+
+	t0 = _now();
+
+	for (i = 0; i < iters; ++i) {
+		buffer_clear(&buffer);
+
+		err = pack_message(&buffer, &header, msg);
+		if (unlikely(err)) {
+			fcallerror("pack_message", err);
+			goto fail;
+		}
+	}
+
+	t1 = _now();
+
+	for (i = 0; i < iters; ++i) {
+		buffer_seek(&buffer, 0);
+
+		err = unpack_message_header(&buffer, &x);
+		if (unlikely(err)) {
+			fcallerror("unpack_message_header", err);
+			goto fail;
+		}
+
+		err = unpack_message_payload(&buffer, &x, alloc, &y);
+		if (unlikely(err)) {
+			fcallerror("unpack_message_payload", err);
+			goto fail;
+		}
+
+		err = free_message_payload(&x, alloc, &y);
+		if (unlikely(err)) {
+			fcallerror("free_message_payload", err);
+			goto fail;
+		}
+	}
+
+	t2 = _now();
+
+	printf("%-20s %12.1f %12.1f\n", name, (t1 - t0)/iters, (t2 - t1)/iters);
+
+fail:
+	buffer_dtor(&buffer);
+
+	return err;
+}
+
@@ -0,0 +1,252 @@
+
+/*
+ * Benchmark for the routing table (network.c) and the message header
+ * encoding (protocol.c) at 2^20 simulated participants.
+ *
+ * For several tree widths the routes of the root are installed (one
+ * contiguous id interval per child) and random ids are looked up. For
+ * comparison the same is done with a dense linear forwarding table (one
+ * port per participant) as used before the interval table. Build with
+ * "make bench" (see bench/protocol.c for the compiler flags) and run
+ * bench/routing.exe [participants].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "pack.h"
+#include "network.h"
+#include "protocol.h"
+
+
+#define NLOOKUPS	(1 << 20)
+#define NREPEAT		16
+
+static double _now();
+static void _shuffle(si32 *x, si32 n);
+static int _bench_width(si32 size, int width, const si32 *ids);
+static int _bench_header(const si32 *ids);
+
+
+int main(int argc, char **argv)
+{
+	static const int widths[] = {4, 16, 64, 1024};
+	si32 size;
+	si32 *ids;
+	int i;
+
+	size = (argc > 1) ? atoi(argv[1]) : (1 << 20);
+
+	ids = malloc(NLOOKUPS*sizeof(si32));
+	if (unlikely(!ids))
+		return 1;
+
+	srand(42);
+	for (i = 0; i < NLOOKUPS; ++i)
+		ids[i] = 1 + rand() % (size - 1);
+
+	printf("%d participants, %d lookups\n\n", size, NLOOKUPS);
+	printf("%6s | %-36s | %-36s\n", "", "intervals", "dense LFT");
+	printf("%6s | %12s %10s %12s | %12s %10s %12s\n", "width",
+	       "install [us]", "lookup [ns]", "memory [B]",
+	       "install [us]", "lookup [ns]", "memory [B]");
+
+	for (i = 0; i < (int )(sizeof(widths)/sizeof(widths[0])); ++i)
+		_bench_width(size, widths[i], ids);
+
+	printf("\n");
+
+	_bench_header(ids);
+
+	free(ids);
+
+	return 0;
+}
+
+static double _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return 1e9*ts.tv_sec + ts.tv_nsec;
+}
+
+static void _shuffle(si32 *x, si32 n)
+{
+	si32 i, j, t;
+
+	for (i = n - 1; i > 0; --i) {
+		j = rand() % (i + 1);
+		t = x[i]; x[i] = x[j]; x[j] = t;
+	}
+}
+
+/*
+ * Participant zero is the root and child i covers the ids
+ * first[i], ..., first[i+1] - 1 (see _job_build_tree_ctor()).
+ */
+static int _bench_width(si32 size, int width, const si32 *ids)
+{
+	int err;
+	struct network net;
+	int *fds;
+	si32 *first, *order, *lft;
+	double t0, t1, tinstall, tlookup, linstall, llookup;
+	ll sum;
+	si32 i, k;
+	int r;
+
+	fds   = calloc(width + 1, sizeof(int));
+	first = calloc(width + 1, sizeof(si32));
+	order = calloc(width, sizeof(si32));
+	lft   = calloc(size, sizeof(si32));
+	if (unlikely(!fds || !first || !order || !lft))
+		return -ENOMEM;
+
+	for (i = 0; i <= width; ++i)
+		first[i] = 1 + (ll )(size - 1)*i/width;
+	for (i = 0; i < width; ++i)
+		order[i] = i;
+
+	/* Children connect back in random order.
+	 */
+	_shuffle(order, width);
+
+	tinstall = 0;
+	tlookup  = 0;
+	sum      = 0;
+
+	for (r = 0; r < NREPEAT; ++r) {
+		network_ctor(&net, libc_allocator());
+		network_resize(&net, size);
+
+		err = network_add_ports(&net, fds, width + 1);
+		if (unlikely(err)) {
+			fcallerror("network_add_ports", err);
+			return err;
+		}
+
+		t0 = _now();
+
+		for (i = 0; i < width; ++i) {
+			k = order[i];
+
+			err = network_add_route(&net, k + 1, first[k], first[k+1] - 1);
+			if (unlikely(err)) {
+				fcallerror("network_add_route", err);
+				return err;
+			}
+		}
+
+		t1 = _now();
+		tinstall += t1 - t0;
+
+		for (i = 0; i < NLOOKUPS; ++i)
+			sum += network_route(&net, ids[i]);
+
+		tlookup += _now() - t1;
+
+		FREE(net.alloc, (void **)&net.ports, net.nports, sizeof(int), "ports");
+		network_dtor(&net);
+	}
+
+	linstall = 0;
+	llookup  = 0;
+
+	for (r = 0; r < NREPEAT; ++r) {
+		t0 = _now();
+
+		for (i = 0; i < width; ++i) {
+			k = order[i];
+
+			for (si32 j = first[k]; j < first[k+1]; ++j)
+				lft[j] = k + 1;
+		}
+
+		t1 = _now();
+		linstall += t1 - t0;
+
+		for (i = 0; i < NLOOKUPS; ++i)
+			sum -= lft[ids[i]];
+
+		llookup += _now() - t1;
+	}
+
+	if (unlikely(0 != sum))
+		error("Interval table and dense LFT disagree.");
+
+	printf("%6d | %12.1f %10.1f %12ld | %12.1f %10.1f %12ld\n", width,
+	       tinstall/NREPEAT/1e3, tlookup/NREPEAT/NLOOKUPS,
+	       (long )(width*sizeof(struct network_route)),
+	       linstall/NREPEAT/1e3, llookup/NREPEAT/NLOOKUPS,
+	       (long )(size*sizeof(si32)));
+
+	free(lft);
+	free(order);
+	free(first);
+	free(fds);
+
+	return 0;
+}
+
+static int _bench_header(const si32 *ids)
+{
+	int err;
+	struct buffer buffer;
+	struct message_header x, y;
+	double t0;
+	ll sum;
+	int i;
+
+	err = buffer_ctor(&buffer, libc_allocator(), 64);
+	if (unlikely(err)) {
+		fcallerror("buffer_ctor", err);
+		return err;
+	}
+
+	memset(&x, 0, sizeof(x));
+	x.flags   = MESSAGE_FLAG_UCAST;
+	x.type    = MESSAGE_TYPE_USER;
+	x.payload = 256;
+
+	sum = 0;
+	t0  = _now();
+
+	for (i = 0; i < NLOOKUPS; ++i) {
+		x.src = ids[i];
+		x.dst = ids[NLOOKUPS - 1 - i];
+
+		buffer_clear(&buffer);
+
+		err = pack_message_header(&buffer, &x);
+		if (unlikely(err)) {
+			fcallerror("pack_message_header", err);
+			goto fail;
+		}
+
+		buffer_seek(&buffer, 0);
+
+		err = unpack_message_header(&buffer, &y);
+		if (unlikely(err)) {
+			fcallerror("unpack_message_header", err);
+			goto fail;
+		}
+
+		sum += y.size;
+	}
+
+	printf("header pack + unpack: %.1f ns, %.1f bytes on average\n",
+	       (_now() - t0)/NLOOKUPS, (double )sum/NLOOKUPS);
+
+fail:
+	buffer_dtor(&buffer);
+
+	return err;
+}
+
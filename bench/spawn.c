@@ -0,0 +1,183 @@
+
+/*
+ * Benchmark for the process creation (spawn_process() in helper.c).
+ *
+ * Reports the number of processes per second which are created and
+ * reaped with fork() + execve() as done by the plugins before and with
+ * spawn_process() which uses posix_spawn(). The cost of fork() grows
+ * with the size of the parent so the benchmark touches the given amount
+ * of memory and starts idle threads first to resemble the daemon. Build
+ * with "make bench" (see bench/protocol.c for the compiler flags) and run
+ *
+ *   bench/spawn.exe [processes] [resident MiB] [threads] [executable]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "helper.h"
+
+
+extern char **environ;
+
+static double _now();
+static void *_idle(void *arg);
+static int _fork_execve(char *const *argv, int fd, int *pid);
+static int _run(const char *name, int (*spawn)(char *const *, int, int *),
+                char *const *argv, int n);
+static int _spawn_process(char *const *argv, int fd, int *pid);
+
+
+int main(int argc, char **argv)
+{
+	int err;
+	int n, nthreads;
+	ll size;
+	char *mem;
+	pthread_t thread;
+	char *args[2];
+	int i;
+
+	n        = (argc > 1) ? atoi(argv[1]) : 2000;
+	size     = (argc > 2) ? atoll(argv[2]) : 512;
+	nthreads = (argc > 3) ? atoi(argv[3]) : 8;
+	args[0]  = (argc > 4) ? argv[4] : "/bin/true";
+	args[1]  = NULL;
+
+	mem = malloc(size << 20);
+	if (unlikely(size && !mem))
+		return 1;
+
+	memset(mem, 1, size << 20);
+
+	for (i = 0; i < nthreads; ++i) {
+		err = pthread_create(&thread, NULL, _idle, NULL);
+		if (unlikely(err)) {
+			error("pthread_create() failed. errno = %d says '%s'.",
+			      err, strerror(err));
+			return 1;
+		}
+	}
+
+	printf("%d processes of '%s', %lld MiB resident, %d idle threads\n\n",
+	       n, args[0], size, nthreads);
+	printf("%-20s %12s %12s\n", "method", "spawns [1/s]", "each [us]");
+
+	_run("fork + execve" , _fork_execve  , args, n);
+	_run("spawn_process" , _spawn_process, args, n);
+
+	free(mem);
+
+	return 0;
+}
+
+static double _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return 1e9*ts.tv_sec + ts.tv_nsec;
+}
+
+static void *_idle(void *arg)
+{
+	while (1)
+		pause();
+
+	return NULL;
+}
+
+/*
+ * The child redirects its stdout like the exec plugins did before they
+ * switched to spawn_process().
+ */
+static int _fork_execve(char *const *argv, int fd, int *pid)
+{
+	int child;
+
+	child = fork();
+	if (unlikely(child < 0)) {
+		error("fork() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	if (0 == child) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+
+		execve(argv[0], argv, environ);
+		_exit(127);
+	}
+
+	*pid = child;
+
+	return 0;
+}
+
+static int _spawn_process(char *const *argv, int fd, int *pid)
+{
+	const int dups[1][2] = {{fd, STDOUT_FILENO}};
+
+	return spawn_process(argv, environ, dups, 1, NULL, 0, pid);
+}
+
+static int _run(const char *name, int (*spawn)(char *const *, int, int *),
+                char *const *argv, int n)
+{
+	int err;
+	int fd, pid, status;
+	double t0, t;
+	int i;
+
+	fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (unlikely(fd < 0)) {
+		error("open() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	err = 0;
+	t0  = _now();
+
+	for (i = 0; i < n; ++i) {
+		err = spawn(argv, fd, &pid);
+		if (unlikely(err)) {
+			fcallerror("spawn", err);
+			goto fail;
+		}
+
+		err = wait_process(pid, &status, 0);
+		if (unlikely(err != pid)) {
+			error("wait_process() failed.");
+			err = -ESOMEFAULT;
+			goto fail;
+		}
+
+		if (unlikely(!WIFEXITED(status) || WEXITSTATUS(status))) {
+			error("'%s' failed.", argv[0]);
+			err = -ESOMEFAULT;
+			goto fail;
+		}
+
+		err = 0;
+	}
+
+	t = _now() - t0;
+
+	printf("%-20s %12.0f %12.1f\n", name, 1e9*n/t, t/n/1e3);
+
+fail:
+	close(fd);
+
+	return err;
+}
+
@@ -36,13 +36,18 @@ static int _comm_transfer_arrays(int nrwfds1, struct pollfd *pollfds1,
                                  int nrwfds2, struct pollfd *pollfds2,
                                  struct buffer **recvb2,
                                  struct buffer **sendb2);
+static int _comm_flush_localq(struct comm *self);
 static int _comm_fill_sendb(struct comm *self);
 static int _comm_fill_pollfds_events(struct comm *self);
 static int _comm_accept(struct comm *self);
+static int _comm_retry_held(struct comm *self);
 static int _comm_reads(struct comm *self);
+static int _comm_deliver(struct comm *self, int i);
+static int _comm_recvb_held(struct comm *self, int i);
 static int _comm_writes(struct comm *self);
 static int _comm_pull_recvb(struct comm *self, int i);
 static int _comm_resize_recvb(struct comm *self, int i);
+static void _comm_close_port(struct comm *self, int i);
 static int _copy_buffer(struct buffer_pool *bufpool,
                         struct buffer *buffer, struct buffer **copy);
 
@@ -62,6 +67,7 @@ int comm_ctor(struct comm *self, struct alloc *alloc,
 		goto fail1;	/* queue_with_lock_ctor() reported reason. */
 
 	self->stop    = 0;
+	self->waiting = 0;
 	self->alloc   = alloc;
 	self->net     = net;
 	self->bufpool = bufpool;
@@ -78,6 +84,8 @@ int comm_ctor(struct comm *self, struct alloc *alloc,
 	self->bcastb = NULL;
 	self->bcastp = -1;
 
+	list_ctor(&self->localq);
+
 	err = thread_ctor(&self->thread);
 	if (unlikely(err)) {
 		error("struct thread constructor failed with error %d.", err);
@@ -181,7 +189,46 @@ int comm_halt_processing(struct comm *self)
 
 int comm_enqueue(struct comm *self, struct buffer *buffer)
 {
-	return queue_with_lock_enqueue(&self->sendq, (void *)buffer);
+	int err, tmp;
+	struct timespec delay = {.tv_sec = 0, .tv_nsec = 1000L*1000L};
+	struct timespec abstime;
+
+	err = queue_with_lock_enqueue(&self->sendq, (void *)buffer);
+	if (likely(-ENOMEM != err))
+		return err;
+
+	/* The send queue is full. Wait for the communication thread to
+	 * make room instead of dropping the message.
+	 */
+	err = cond_var_lock_acquire(&self->cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_lock_acquire", err);
+		die();
+	}
+
+	atomic_xadd(self->waiting, 1);
+
+	while (-ENOMEM == (err = queue_with_lock_enqueue(&self->sendq, (void *)buffer))) {
+		tmp = abstime_near_future(&delay, &abstime);
+		if (unlikely(tmp))
+			fcallerror("abstime_near_future", tmp);
+
+		tmp = cond_var_timedwait(&self->cond, &abstime);
+		if (unlikely(tmp && (-ETIMEDOUT != tmp))) {
+			fcallerror("cond_var_timedwait", tmp);
+			die();
+		}
+	}
+
+	atomic_xadd(self->waiting, -1);
+
+	tmp = cond_var_lock_release(&self->cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_release", tmp);
+		die();
+	}
+
+	return err;
 }
 
 int comm_dequeue(struct comm *self, struct buffer **buffer)
@@ -232,8 +279,13 @@ int comm_flush(struct comm *self)
 
 int comm_resv_channel(struct comm *self, ui16 *channel)
 {
-	if (self->channel >= 1023)
-		return -ENOMEM;
+	/* Channels are handed out round robin. A persistent tree (see
+	 * struct control) runs an unbounded number of tasks and the task
+	 * that used a channel before has finished long before it is
+	 * handed out again.
+	 */
+	if (self->channel >= COMM_MAX_CHANNELS - 1)
+		self->channel = 1;
 
 	*channel = self->channel;
 	self->channel++;
@@ -276,10 +328,34 @@ static int _comm_thread(void *arg)
 		if (unlikely(err))
 			goto unlock;
 
+		err = _comm_flush_localq(self);
+		if (unlikely(err))
+			goto unlock;
+
+		err = _comm_retry_held(self);
+		if (unlikely(err))
+			goto unlock;
+
 		err = _comm_fill_sendb(self);
 		if (unlikely(err))
 			goto unlock;	/* _comm_fill_sendb() reports reason. */
 
+		/* Wake up threads blocked in comm_enqueue().
+		 */
+		if (unlikely(atomic_read(self->waiting) > 0)) {
+			err = cond_var_lock_acquire(&self->cond);
+			if (unlikely(err))
+				die();
+
+			err = cond_var_broadcast(&self->cond);
+			if (unlikely(err))
+				fcallerror("cond_var_broadcast", err);
+
+			err = cond_var_lock_release(&self->cond);
+			if (unlikely(err))
+				die();
+		}
+
 		err = _comm_fill_pollfds_events(self);
 		if (unlikely(err))
 			goto unlock;
@@ -501,9 +577,35 @@ static int _comm_transfer_arrays(int nrwfds1, struct pollfd *pollfds1,
 	return 0;
 }
 
+/*
+ * Move local messages from the local queue to the receive queue as long
+ * as there is space.
+ */
+static int _comm_flush_localq(struct comm *self)
+{
+	int err;
+	struct buffer *buffer;
+
+	while (!list_is_empty(&self->localq)) {
+		buffer = LIST_ENTRY(self->localq.next, struct buffer, list);
+
+		err = queue_with_lock_enqueue(&self->recvq, buffer);
+		if (-ENOMEM == err)
+			break;
+		if (unlikely(err)) {
+			fcallerror("queue_with_lock_enqueue", err);
+			return err;
+		}
+
+		list_remove(&buffer->list);
+	}
+
+	return 0;
+}
+
 static int _comm_fill_sendb(struct comm *self)
 {
-	int i, n, err;
+	int i, n, err, port;
 	struct buffer *buffer;
 	struct message_header header;
 
@@ -520,15 +622,22 @@ static int _comm_fill_sendb(struct comm *self)
 			if (n < self->npollfds)
 				break;
 
+			/* Closed ports (see _comm_close_port()) are skipped.
+			 */
 			for (i = 0; i < self->nrwfds; ++i) {
-				if (self->bcastp == i)
+				if ((self->bcastp == i) || (self->pollfds[i].fd < 0))
 					continue;
 
 				self->sendb[i] = buffer;
 				break;
 			}
+			if (self->nrwfds == i) {
+				err = buffer_pool_push(self->bufpool, buffer);
+				if (unlikely(err))
+					fcallerror("buffer_pool_push", err);
+			}
 			for (; i < self->nrwfds; ++i) {
-				if (self->bcastp == i)
+				if ((self->bcastp == i) || (self->pollfds[i].fd < 0))
 					continue;
 
 				err = _copy_buffer(self->bufpool, buffer, &self->sendb[i]);
@@ -588,7 +697,9 @@ static int _comm_fill_sendb(struct comm *self)
 		/* MESSAGE_FLAG_UCAST & header.flags is true.
 		 */
 
-		/* Route local message directly to the receive queue.
+		/* Route local message directly to the receive queue. If the
+		 * receive queue is full (or older local messages are still
+		 * waiting) the message is appended to the local queue.
 		 */
 		if (self->net->here == header.dst) {
 			err = queue_with_lock_dequeue(&self->sendq, (void **)&buffer);
@@ -603,25 +714,28 @@ static int _comm_fill_sendb(struct comm *self)
 					 */
 			}
 
-			err = queue_with_lock_enqueue(&self->recvq, buffer);
-			if (unlikely(err))
+			err = -ENOMEM;
+			if (list_is_empty(&self->localq))
+				err = queue_with_lock_enqueue(&self->recvq, buffer);
+			if (-ENOMEM == err)
+				list_insert_before(&self->localq, &buffer->list);
+			else if (unlikely(err))
 				fcallerror("queue_with_lock_enqueue", err);
-				/* Will cause a memory leak that we just
-				 * have to live with. */
+				/* Lost message. */
 
 			continue;
 		}
 
-		if (unlikely((header.dst < 0) ||
-		             (header.dst >= self->net->size) ||
-		             (-1 == self->net->lft[header.dst]))) {
+		port = network_route(self->net, header.dst);
+
+		if (unlikely(-1 == port)) {
 
 			if ((header.dst < 0) || (header.dst >= self->net->size))
 				error("Dropping message with "
 				      "invalid destination %d.", header.dst);
 			else
 				error("Dropping message with destination %d "
-				      "due to missing LFT entry.", header.dst);
+				      "due to missing route.", header.dst);
 
 			err = queue_with_lock_dequeue(&self->sendq, (void **)&buffer);
 			if (unlikely(err)) {
@@ -632,13 +746,24 @@ static int _comm_fill_sendb(struct comm *self)
 			continue;
 		}
 
-		if (self->sendb[self->net->lft[header.dst]])
+		if (self->sendb[port])
 			break;
 
 		err = queue_with_lock_dequeue(&self->sendq, (void *)&buffer);
 		if (unlikely(err))
 			return err;
 
+		if (unlikely(self->pollfds[port].fd < 0)) {
+			error("Dropping message with destination %d since "
+			      "port %d is closed.", header.dst, port);
+
+			err = buffer_pool_push(self->bufpool, buffer);
+			if (unlikely(err))
+				fcallerror("buffer_pool_push", err);
+
+			continue;
+		}
+
 		/* We use the position pointer as a write water-level gauge */
 		err = buffer_seek(buffer, 0);
 		if (unlikely(err)) {
@@ -648,7 +773,7 @@ static int _comm_fill_sendb(struct comm *self)
 				 */
 		}
 
-		self->sendb[self->net->lft[header.dst]] = buffer;
+		self->sendb[port] = buffer;
 	}
 
 	return 0;
@@ -663,7 +788,14 @@ static int _comm_fill_pollfds_events(struct comm *self)
 	}
 
 	for (i = 0; i < self->nrwfds; ++i) {
-		self->pollfds[i].events |= POLLIN | POLLPRI | POLLERR;
+		self->pollfds[i].events |= POLLPRI | POLLERR;
+
+		/* Stop reading from a port while its last message cannot be
+		 * delivered. The kernel buffers fill up and the sender is
+		 * throttled by TCP flow control.
+		 */
+		if (!_comm_recvb_held(self, i))
+			self->pollfds[i].events |= POLLIN;
 
 		if (self->sendb[i])
 			self->pollfds[i].events |= POLLOUT;
@@ -728,11 +860,33 @@ static int _comm_accept(struct comm *self)
 	return 0;
 }
 
+/*
+ * Retry the delivery of messages that could not be passed on earlier. No
+ * new data is read from the port until then. Called before ppoll() since
+ * the ports with held messages are not polled for input.
+ */
+static int _comm_retry_held(struct comm *self)
+{
+	int err;
+	int i;
+
+	for (i = 0; i < self->nrwfds; ++i) {
+		if (!_comm_recvb_held(self, i))
+			continue;
+
+		err = _comm_deliver(self, i);
+		if (unlikely(err && (-EAGAIN != err)))
+			return err;
+	}
+
+	return 0;
+}
+
 static int _comm_reads(struct comm *self)
 {
 	int err;
 	int i;
-	struct message_header header;
+	ll pos;
 
 	for (i = 0; i < self->nrwfds; ++i) {
 		if (!(self->pollfds[i].revents & POLLIN))
@@ -744,9 +898,20 @@ static int _comm_reads(struct comm *self)
 				continue;
 		}
 
+		pos = self->recvb[i]->pos;
+
 		err = buffer_read(self->recvb[i], self->pollfds[i].fd);
 		if (unlikely(err)) {
 			fcallerror("buffer_read", err);
+			if (-EAGAIN != err)
+				_comm_close_port(self, i);
+			continue;
+		}
+
+		/* End of file. The peer closed the connection.
+		 */
+		if (unlikely(pos == self->recvb[i]->pos)) {
+			_comm_close_port(self, i);
 			continue;
 		}
 
@@ -755,9 +920,9 @@ static int _comm_reads(struct comm *self)
 
 		/* The protocol asserts that the payload size
 		 * is positive. If the buffer size equals the
-		 * header size we know that we have only read
-		 * the header. */
-		if (sizeof(struct message_header) ==
+		 * minimal header size we know that we have only
+		 * read the beginning of the header. */
+		if (MESSAGE_HEADER_MIN_SIZE ==
 		                buffer_size(self->recvb[i])) {
 			err = _comm_resize_recvb(self, i);
 			if (unlikely(err))
@@ -766,77 +931,142 @@ static int _comm_reads(struct comm *self)
 						 * a lot of bad things may happen.
 						 * Better to stop here. */
 		} else {
-			err = buffer_seek(self->recvb[i], 0);
-			if (unlikely(err)) {
-				fcallerror("buffer_seek", err);
-				die();
-			}
-
-			err = secretly_copy_header(self->recvb[i], &header);
+			err = _comm_deliver(self, i);
+			if (-EAGAIN == err)
+				continue;
 			if (unlikely(err))
 				return err;
+		}
+	}
 
-			/* Handle unicast routing.
-			 */
-			if ((MESSAGE_FLAG_UCAST & header.flags) &&
-			    (self->net->here != header.dst)) {
-				err = queue_with_lock_enqueue(&self->sendq, self->recvb[i]);
-				if (unlikely(err))
-					fcallerror("queue_with_lock_enqueue", err);
-					/* Lost message. */
+	return 0;
+}
 
-				self->recvb[i] = NULL;
-				continue;
-			}
+/*
+ * Pass the completely received message in recvb[i] on to the send queue
+ * (unicast messages for other participants) or the receive queue. If the
+ * target queue is full (or another broadcast is still in progress) the
+ * message is kept in recvb[i] and -EAGAIN is returned.
+ */
+static int _comm_deliver(struct comm *self, int i)
+{
+	int err, tmp;
+	int bcast;
+	struct message_header header;
 
-			/* Handle broadcast routing. Only necessary if the number of ports
-			 * equals at least two (i.e., npollfds equals at least 3).
-			 */
-			if ((MESSAGE_FLAG_BCAST & header.flags) &&
-			    (self->npollfds > 2)) {
-				if (self->bcastb) {
-					error("Currently we can only handle one broadcast at a time.");	/* FIXME */
-					die();
-				}
+	err = buffer_seek(self->recvb[i], 0);
+	if (unlikely(err)) {
+		fcallerror("buffer_seek", err);
+		die();
+	}
 
-				err = _copy_buffer(self->bufpool, self->recvb[i], &self->bcastb);
-				if (unlikely(err)) {
-					fcallerror("_copy_buffer", err);
-					die();	/* FIXME? */
-				}
+	err = secretly_copy_header(self->recvb[i], &header);
+	if (unlikely(err))
+		return err;
 
-				self->bcastp = i;
-			}
+	/* Handle unicast routing.
+	 */
+	if ((MESSAGE_FLAG_UCAST & header.flags) &&
+	    (self->net->here != header.dst)) {
+		err = queue_with_lock_enqueue(&self->sendq, self->recvb[i]);
+		if (-ENOMEM == err)
+			goto hold;
+		if (unlikely(err))
+			fcallerror("queue_with_lock_enqueue", err);
+			/* Lost message. */
 
-			/* FIXME This is not very efficient. The queue is now protected by
-			 *       two separate locks!
-			 */
+		self->recvb[i] = NULL;
+		return 0;
+	}
 
-			err = cond_var_lock_acquire(&self->cond);
-			if (unlikely(err)) {
-				fcallerror("cond_var_lock_acquire", err);
-				die();
-			}
+	/* Broadcasts are only forwarded if the number of ports equals at
+	 * least two (i.e., npollfds equals at least 3).
+	 */
+	if ((MESSAGE_FLAG_BCAST & header.flags) &&
+	    (self->npollfds > 2) && self->bcastb)
+		goto hold;
 
-			err = queue_with_lock_enqueue(&self->recvq, self->recvb[i]);
-			if (unlikely(err))
-				fcallerror("queue_with_lock_enqueue", err);
+	/* The copy must be made before the buffer is handed over to the
+	 * main thread which may release it right away.
+	 */
+	bcast = (MESSAGE_FLAG_BCAST & header.flags) && (self->npollfds > 2);
+	if (bcast) {
+		err = _copy_buffer(self->bufpool, self->recvb[i], &self->bcastb);
+		if (unlikely(err)) {
+			fcallerror("_copy_buffer", err);
+			die();	/* FIXME? */
+		}
+	}
 
-			err = cond_var_broadcast(&self->cond);
-			if (unlikely(err))
-				fcallerror("lock_var_broadcast", err);
+	/* FIXME This is not very efficient. The queue is now protected by
+	 *       two separate locks!
+	 */
 
-			err = cond_var_lock_release(&self->cond);
-			if (unlikely(err)) {
-				fcallerror("cond_var_lock_release", err);
-				die();
-			}
+	err = cond_var_lock_acquire(&self->cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_lock_acquire", err);
+		die();
+	}
 
-			self->recvb[i] = NULL;
-		}
+	err = queue_with_lock_enqueue(&self->recvq, self->recvb[i]);
+	if (likely(!err)) {
+		tmp = cond_var_broadcast(&self->cond);
+		if (unlikely(tmp))
+			fcallerror("lock_var_broadcast", tmp);
+	}
+
+	tmp = cond_var_lock_release(&self->cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_release", tmp);
+		die();
+	}
+
+	if (unlikely(err) && bcast) {
+		tmp = buffer_pool_push(self->bufpool, self->bcastb);
+		if (unlikely(tmp))
+			fcallerror("buffer_pool_push", tmp);
+
+		self->bcastb = NULL;
 	}
 
+	if (-ENOMEM == err)
+		goto hold;
+	if (unlikely(err)) {
+		fcallerror("queue_with_lock_enqueue", err);
+		return err;
+	}
+
+	if (bcast)
+		self->bcastp = i;
+
+	self->recvb[i] = NULL;
+
 	return 0;
+
+hold:
+	/* Move the position back to the end so that _comm_recvb_held()
+	 * recognizes the buffer.
+	 */
+	err = buffer_seek(self->recvb[i], buffer_size(self->recvb[i]));
+	if (unlikely(err)) {
+		fcallerror("buffer_seek", err);
+		die();
+	}
+
+	return -EAGAIN;
+}
+
+/*
+ * Returns true if recvb[i] holds a complete message that could not be
+ * delivered yet. Buffers of messages that are still being received
+ * either end with the header (which is handled right away) or have
+ * their position before the end.
+ */
+static int _comm_recvb_held(struct comm *self, int i)
+{
+	return self->recvb[i] &&
+	       buffer_pos_equal_size(self->recvb[i]) &&
+	       (buffer_size(self->recvb[i]) > MESSAGE_HEADER_MIN_SIZE);
 }
 
 static int _comm_writes(struct comm *self)
@@ -853,6 +1083,8 @@ static int _comm_writes(struct comm *self)
 		err = buffer_write(self->sendb[i], self->pollfds[i].fd);
 		if (unlikely(err)) {
 			fcallerror("buffer_write", err);
+			if (-EAGAIN != err)
+				_comm_close_port(self, i);
 			continue;
 		}
 
@@ -886,8 +1118,7 @@ static int _comm_pull_recvb(struct comm *self, int i)
 		goto fail;
 	}
 
-	err = buffer_resize(self->recvb[i],
-	                    sizeof(struct message_header));
+	err = buffer_resize(self->recvb[i], MESSAGE_HEADER_MIN_SIZE);
 	if (unlikely(err)) {
 		fcallerror("buffer_resize", err);
 		goto fail;
@@ -903,18 +1134,51 @@ fail:
 	return err;
 }
 
+/*
+ * Close port i after the peer closed the connection or an I/O error
+ * occurred. The port keeps its index so that the routing table stays
+ * valid but messages routed through it are dropped. Called while
+ * holding self->net->lock.
+ */
+static void _comm_close_port(struct comm *self, int i)
+{
+	int err;
+
+	debug("Closing port %d.", i);
+
+	err = do_close(self->pollfds[i].fd);
+	if (unlikely(err))
+		fcallerror("do_close", err);
+
+	self->pollfds[i].fd = -1;
+	self->net->ports[i] = -1;
+
+	if (self->recvb[i]) {
+		err = buffer_pool_push(self->bufpool, self->recvb[i]);
+		if (unlikely(err))
+			fcallerror("buffer_pool_push", err);
+
+		self->recvb[i] = NULL;
+	}
+
+	if (self->sendb[i]) {
+		err = buffer_pool_push(self->bufpool, self->sendb[i]);
+		if (unlikely(err))
+			fcallerror("buffer_pool_push", err);
+
+		self->sendb[i] = NULL;
+	}
+}
+
 static int _comm_resize_recvb(struct comm *self, int i)
 {
 	int err;
-	struct message_header header;
 	ll size;
 
-	err = secretly_copy_header(self->recvb[i], &header);
+	err = peek_message_size(self->recvb[i], &size);
 	if (unlikely(err))
 		return err;
 
-	size = sizeof(struct message_header) + header.payload;
-
 	err = buffer_resize(self->recvb[i], size);
 	if (unlikely(err)) {
 		fcallerror("buffer_resize", err);
@@ -930,6 +1194,11 @@ int secretly_copy_header(struct buffer *buffer,
 	int err;
 	ll pos;
 
+	if (likely(buffer->hdrvalid)) {
+		*header = buffer->hdr;
+		return 0;
+	}
+
 	pos = buffer->pos;
 
 	err = buffer_seek(buffer, 0);
@@ -950,6 +1219,9 @@ int secretly_copy_header(struct buffer *buffer,
 		return err;
 	}
 
+	buffer->hdr      = *header;
+	buffer->hdrvalid = 1;
+
 	return 0;
 }
 
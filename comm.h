@@ -3,6 +3,7 @@
 #define SPAWN_COMM_H_INCLUDED 1
 
 #include "ints.h"
+#include "list.h"
 #include "thread.h"
 #include "queue.h"
 
@@ -42,9 +43,12 @@ struct comm
 	struct queue_with_lock	recvq;
 
 	/* Condition variable that threads can block on to be notified
-	 * about the availability of new buffers.
+	 * about the availability of new buffers or about free space in
+	 * the send queue.
 	 */
 	struct cond_var		cond;
+	int			waiting;	/* Number of threads blocked in
+						 * comm_enqueue(). */
 
 	/* Set to one to force the temporary shutdown of the
 	 * communication thread. Set it to two in order to shutdown
@@ -76,11 +80,24 @@ struct comm
 	struct buffer		*bcastb;
 	int			bcastp;
 
+	/* Messages to this participant which did not fit into the
+	 * receive queue. Only accessed by the communication thread.
+	 * The list is unbounded since the main thread sends messages to
+	 * itself and blocking it in comm_enqueue() could deadlock.
+	 */
+	struct list		localq;
+
 	/* Next free channel returned by comm_rescv_channel().
 	 */
 	ui16			channel;
 };
 
+/*
+ * Channels are numbered 1, ..., COMM_MAX_CHANNELS - 1. Channel zero is
+ * reserved for the spawn executable itself.
+ */
+#define COMM_MAX_CHANNELS	1024
+
 /*
  * Constructor for struct comm.
  */
@@ -148,12 +165,14 @@ int comm_dequeue_would_succeed(struct comm *self, int *result);
 int comm_flush(struct comm *self);
 
 /*
- * Reserve a virtual channel.
+ * Reserve a virtual channel. Channel zero is reserved for the spawn
+ * executable and the others are reused round robin.
  */
 int comm_resv_channel(struct comm *self, ui16 *channel);
 
 /*
- * Internal function exported for use by _recv_join_response() in main.c.
+ * Get the header of the message stored in buffer without changing the
+ * buffer position. The header is parsed once and cached in the buffer.
  */
 int secretly_copy_header(struct buffer *buffer,
                          struct message_header *header);
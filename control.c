@@ -0,0 +1,474 @@
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "helper.h"
+#include "list.h"
+#include "job.h"
+#include "spawn.h"
+#include "control.h"
+
+
+static int _accept_clients(struct control *self);
+static int _read_commands(struct control *self);
+static int _next_command(struct control *self);
+static int _run_command(struct control *self, struct spawn *spawn, int i);
+static void _reply(struct control_client *client, int value);
+static int _remove_client(struct control *self, int i);
+static int _tree_is_built(struct spawn *spawn);
+
+
+int control_ctor(struct control *self, struct alloc *alloc, const char *path)
+{
+	int err, tmp;
+	struct sockaddr_un sa;
+	struct stat st;
+	mode_t mask;
+
+	memset(self, 0, sizeof(*self));
+
+	self->alloc    = alloc;
+	self->listenfd = -1;
+
+	if (unlikely(strlen(path) >= sizeof(sa.sun_path))) {
+		error("Path of the control socket '%s' is too long.", path);
+		return -EINVAL;
+	}
+
+	err = xstrdup(alloc, path, &self->path);
+	if (unlikely(err)) {
+		fcallerror("xstrdup", err);
+		return err;
+	}
+
+	self->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(-1 == self->listenfd)) {
+		error("socket() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	/* Remove the socket of an earlier instance that did not clean up
+	 * but never anything else.
+	 */
+	if (0 == lstat(path, &st)) {
+		if (unlikely(!S_ISSOCK(st.st_mode))) {
+			error("'%s' exists and is not a socket.", path);
+			err = -EEXIST;
+			goto fail;
+		}
+
+		(void )unlink(path);
+	}
+
+	/* Only the owner may connect. Other users are also refused in
+	 * _accept_clients() in case the umask is changed concurrently.
+	 */
+	mask = umask(0077);
+
+	if (unlikely(-1 == bind(self->listenfd, (struct sockaddr *)&sa, sizeof(sa)))) {
+		error("bind() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		umask(mask);
+		goto fail;
+	}
+
+	umask(mask);
+
+	if (unlikely(-1 == listen(self->listenfd, 16))) {
+		error("listen() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	log("Listening for commands on '%s'.", path);
+
+	return 0;
+
+fail:
+	if (-1 != self->listenfd) {
+		tmp = do_close(self->listenfd);
+		if (unlikely(tmp))
+			fcallerror("do_close", tmp);
+	}
+
+	tmp = strfree(alloc, &self->path);
+	if (unlikely(tmp))
+		fcallerror("strfree", tmp);
+
+	return err;
+}
+
+int control_dtor(struct control *self)
+{
+	int err;
+
+	err = control_shutdown(self);
+	if (unlikely(err)) {
+		fcallerror("control_shutdown", err);
+		return err;
+	}
+
+	if (self->clients) {
+		err = ZFREE(self->alloc, (void **)&self->clients, self->maxclients,
+		            sizeof(struct control_client *), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	err = strfree(self->alloc, &self->path);
+	if (unlikely(err)) {
+		fcallerror("strfree", err);
+		return err;
+	}
+
+	return 0;
+}
+
+int control_progress(struct control *self, struct spawn *spawn)
+{
+	int err;
+	int i;
+
+	if (-1 == self->listenfd)
+		return 0;
+
+	err = _accept_clients(self);
+	if (unlikely(err))
+		fcallerror("_accept_clients", err);
+
+	err = _read_commands(self);
+	if (unlikely(err))
+		fcallerror("_read_commands", err);
+
+	/* Every task runs on its own channel so commands are started as
+	 * soon as they arrive once the tree is built.
+	 */
+	while (!self->quit && _tree_is_built(spawn)) {
+		i = _next_command(self);
+		if (-1 == i)
+			break;
+
+		err = _run_command(self, spawn, i);
+		if (unlikely(err))
+			fcallerror("_run_command", err);
+	}
+
+	return 0;
+}
+
+int control_task_done(struct control *self, ui16 channel, int ret)
+{
+	int i;
+
+	for (i = 0; i < self->nclients; ++i) {
+		if (self->clients[i]->running &&
+		    (channel == self->clients[i]->channel)) {
+			_reply(self->clients[i], ret);
+
+			return _remove_client(self, i);
+		}
+	}
+
+	return 0;
+}
+
+int control_shutdown(struct control *self)
+{
+	int err;
+
+	if (-1 == self->listenfd)
+		return 0;
+
+	while (self->nclients > 0) {
+		err = _remove_client(self, self->nclients - 1);
+		if (unlikely(err)) {
+			fcallerror("_remove_client", err);
+			return err;
+		}
+	}
+
+	err = do_close(self->listenfd);
+	if (unlikely(err))
+		fcallerror("do_close", err);
+
+	self->listenfd = -1;
+
+	(void )unlink(self->path);
+
+	return 0;
+}
+
+static int _accept_clients(struct control *self)
+{
+	int err;
+	int fd, n;
+	struct control_client *client;
+	struct ucred cred;
+	socklen_t len;
+
+	while (1) {
+		fd = accept4(self->listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if (-1 == fd) {
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+				return 0;
+			if (EINTR == errno)
+				continue;
+
+			error("accept4() failed. errno = %d says '%s'.", errno, strerror(errno));
+			return -errno;
+		}
+
+		len = sizeof(cred);
+		if (unlikely(-1 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))) {
+			error("getsockopt() failed. errno = %d says '%s'.", errno, strerror(errno));
+			(void )do_close(fd);
+			continue;
+		}
+
+		if (unlikely(cred.uid != getuid())) {
+			error("Refusing control connection of user %d.", (int )cred.uid);
+			(void )do_close(fd);
+			continue;
+		}
+
+		if (self->nclients == self->maxclients) {
+			n = MAX(8, 2*self->maxclients);
+
+			err = ZREALLOC(self->alloc, (void **)&self->clients,
+			               self->maxclients, sizeof(struct control_client *),
+			               n, sizeof(struct control_client *), "clients");
+			if (unlikely(err)) {
+				fcallerror("ZREALLOC", err);
+				goto fail;
+			}
+
+			self->maxclients = n;
+		}
+
+		err = ZALLOC(self->alloc, (void **)&client, 1,
+		             sizeof(struct control_client), "client");
+		if (unlikely(err)) {
+			fcallerror("ZALLOC", err);
+			goto fail;
+		}
+
+		client->fd  = fd;
+		client->seq = -1;
+
+		self->clients[self->nclients++] = client;
+	}
+
+fail:
+	(void )do_close(fd);
+
+	return err;
+}
+
+/*
+ * Read from all clients that did not send a complete command yet.
+ */
+static int _read_commands(struct control *self)
+{
+	int err;
+	int i;
+	ll n;
+	char *p;
+	struct control_client *client;
+
+	for (i = self->nclients - 1; i >= 0; --i) {
+		client = self->clients[i];
+
+		if (-1 != client->seq)
+			continue;
+
+		n = recv(client->fd, client->buf + client->len,
+		         CONTROL_MAX_LINE - client->len - 1, MSG_DONTWAIT);
+		if (-1 == n) {
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno) || (EINTR == errno))
+				continue;
+			n = 0;
+		}
+
+		if (0 == n) {
+			/* The client went away before sending a command.
+			 */
+			err = _remove_client(self, i);
+			if (unlikely(err))
+				return err;
+			continue;
+		}
+
+		client->len += n;
+		client->buf[client->len] = 0;
+
+		p = strchr(client->buf, '\n');
+		if (p) {
+			*p = 0;
+			client->seq = self->seq++;
+		} else if (CONTROL_MAX_LINE - 1 == client->len) {
+			error("Command on the control socket is too long.");
+
+			_reply(client, -EINVAL);
+
+			err = _remove_client(self, i);
+			if (unlikely(err))
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Index of the client with the oldest pending command or -1.
+ */
+static int _next_command(struct control *self)
+{
+	int i, k;
+
+	k = -1;
+	for (i = 0; i < self->nclients; ++i) {
+		if ((-1 == self->clients[i]->seq) || self->clients[i]->running)
+			continue;
+
+		if ((-1 == k) || (self->clients[i]->seq < self->clients[k]->seq))
+			k = i;
+	}
+
+	return k;
+}
+
+static int _run_command(struct control *self, struct spawn *spawn, int i)
+{
+	int err;
+	struct control_client *client;
+	struct job *job;
+	char *cmd, *plugin, *args;
+
+	client = self->clients[i];
+
+	cmd = client->buf;
+	while (isspace(*cmd)) ++cmd;
+
+	/* Split the command into the first two words and the rest.
+	 */
+	plugin = cmd;
+	while (*plugin && !isspace(*plugin)) ++plugin;
+	if (*plugin)
+		*plugin++ = 0;
+	while (isspace(*plugin)) ++plugin;
+
+	args = plugin;
+	while (*args && !isspace(*args)) ++args;
+	if (*args)
+		*args++ = 0;
+	while (isspace(*args)) ++args;
+
+	if (!strcmp(cmd, "exit")) {
+		log("Exit requested on the control socket.");
+
+		self->quit = 1;
+
+		_reply(client, 0);
+
+		return _remove_client(self, i);
+	}
+
+	if (strcmp(cmd, "task") || !*plugin) {
+		error("Invalid command '%s' on the control socket.", cmd);
+
+		_reply(client, -EINVAL);
+
+		return _remove_client(self, i);
+	}
+
+	err = alloc_job_task_from_string(spawn->alloc, spawn, plugin,
+	                                 (*args) ? args : NULL, &job);
+	if (unlikely(err)) {
+		fcallerror("alloc_job_task_from_string", err);
+
+		_reply(client, err);
+
+		return _remove_client(self, i);
+	}
+
+	list_insert_before(&spawn->jobs, &job->list);
+
+	client->running = 1;
+	client->channel = ((struct job_task *)job)->channel;
+
+	debug("Starting task '%s' on channel %d.", plugin, client->channel);
+
+	return 0;
+}
+
+/*
+ * The reply is short enough to fit into the socket buffer. Errors are
+ * ignored since the client may have gone away in the meantime.
+ */
+static void _reply(struct control_client *client, int value)
+{
+	char buf[32];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "%d\n", value);
+
+	(void )send(client->fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int _remove_client(struct control *self, int i)
+{
+	int err;
+	struct control_client *client;
+
+	client = self->clients[i];
+
+	err = do_close(client->fd);
+	if (unlikely(err))
+		fcallerror("do_close", err);
+
+	self->clients[i] = self->clients[--self->nclients];
+
+	err = ZFREE(self->alloc, (void **)&client, 1,
+	            sizeof(struct control_client), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	return 0;
+}
+
+static int _tree_is_built(struct spawn *spawn)
+{
+	struct list *p;
+
+	LIST_FOREACH(p, &spawn->jobs) {
+		if (JOB_TYPE_BUILD_TREE == LIST_ENTRY(p, struct job, list)->type)
+			return 0;
+	}
+
+	return 1;
+}
+
@@ -0,0 +1,84 @@
+
+#ifndef SPAWN_CONTROL_H_INCLUDED
+#define SPAWN_CONTROL_H_INCLUDED 1
+
+#include "ints.h"
+
+struct alloc;
+struct spawn;
+
+
+/*
+ * Control socket of the persistent tree mode.
+ *
+ * If the 'ControlSocket' option is set the root process keeps the tree
+ * up after the (optional) initial task and reads commands from clients
+ * connecting to the unix domain socket. Every command is a single line:
+ *
+ *   task <plugin> [arguments...]
+ *	Run the task plugin on all processes of the tree. The reply is
+ *	the first non-zero exit code of the task in the tree (or zero)
+ *	and is sent once the task finished everywhere.
+ *   exit
+ *	Tear down the tree. The reply is zero.
+ *
+ * Replies are decimal numbers followed by a newline. Malformed commands
+ * are answered with a negative error code. The connection is closed
+ * after the reply. Commands are started in the order in which they were
+ * received once the tree is built so only the first launch pays for
+ * building the tree. Tasks run concurrently on separate channels, also
+ * if they use the same plugin.
+ *
+ * The socket is created with mode 0600 and connections of other users
+ * are refused. An existing file at the path is only replaced if it is a
+ * socket.
+ */
+#define CONTROL_MAX_LINE	4096
+
+struct control_client
+{
+	int	fd;
+	int	len;		/* Bytes in buf */
+	char	buf[CONTROL_MAX_LINE];
+	ll	seq;		/* Arrival of the complete command or -1 */
+	int	running;	/* The task of the command is running */
+	ui16	channel;	/* Channel of the task */
+};
+
+struct control
+{
+	struct alloc		*alloc;
+	char			*path;
+	int			listenfd;
+
+	int			nclients;
+	int			maxclients;
+	struct control_client	**clients;
+
+	ll			seq;
+	int			quit;	/* Set once exit was requested. */
+};
+
+int control_ctor(struct control *self, struct alloc *alloc, const char *path);
+int control_dtor(struct control *self);
+
+/*
+ * Accept new clients, read commands and start them once the tree is
+ * built. Called regularly by the main loop of the root.
+ */
+int control_progress(struct control *self, struct spawn *spawn);
+
+/*
+ * Report the completion of the task on channel to the client that
+ * requested it (if any).
+ */
+int control_task_done(struct control *self, ui16 channel, int ret);
+
+/*
+ * Stop accepting commands. Clients still waiting are disconnected and
+ * the socket file is removed.
+ */
+int control_shutdown(struct control *self);
+
+#endif
+
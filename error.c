@@ -100,7 +100,7 @@ static void _report(FILE *f, struct msgbuf *b, const char* prefix, const char* f
 	vsnprintf(_msg1, sizeof(_msg1), fmt, vl);
 	snprintf(_msg2, sizeof(_msg2),
 	         " %s.%06ld %s [%04d, %04d] (%s(), %s:%ld): %s%s\n",
-	         time, (long )tv.tv_usec, hostname, (int )getpid(), (int )gettid(), func,
+	         time, (long )tv.tv_usec, hostname, (int )getpid(), (int )spawn_gettid(), func,
 	         file, line, prefix, _msg1);
 
 	if (b) {
@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include <poll.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -22,6 +23,7 @@
 #include "helper.h"
 #include "error.h"
 #include "alloc.h"
+#include "zygote.h"
 
 
 int do_close(int fd)
@@ -296,7 +298,7 @@ int array_of_str_free(struct alloc *alloc, int n, char ***str)
 			return err;
 	}
 
-	err = ZALLOC(alloc, (void **)str, n, sizeof(char *), "");
+	err = ZFREE(alloc, (void **)str, n, sizeof(char *), "");
 	if (unlikely(err)) {
 		fcallerror("ZFREE", err);
 		return err;
@@ -344,7 +346,7 @@ int daemonize()
 	return 0;
 }
 
-ll gettid()
+ll spawn_gettid()
 {
 	return (long )syscall(SYS_gettid);
 }
@@ -358,6 +360,15 @@ ll llnow()
 	return tv.tv_sec;
 }
 
+ll llnow_usecs()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return 1000000LL*tv.tv_sec + tv.tv_usec;
+}
+
 int add_timespecs(const struct timespec *x,
                   const struct timespec *y, struct timespec *z)
 {
@@ -415,3 +426,122 @@ int sockaddr(int fd, ui32 *ip, ui32 *portnum)
 	return 0;
 }
 
+ui64 fnv1a_hash(const char *str)
+{
+	ui64 h;
+
+	h = 14695981039346656037ULL;
+	for (; *str; ++str) {
+		h ^= (unsigned char )*str;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+int exit_status_to_error(int status)
+{
+	if (likely(WIFEXITED(status))) {
+		log("Child process terminated with exit code %d.", WEXITSTATUS(status));
+		return -WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		log("Child was terminated by signal %d.", WTERMSIG(status));
+		return -ESOMEFAULT;
+	} else {
+		error("Child neither terminated nor was terminated by a signal.");
+		return -ESOMEFAULT;
+	}
+}
+
+int do_pidfd_open(int pid, int *fd)
+{
+#ifdef SYS_pidfd_open
+	*fd = syscall(SYS_pidfd_open, pid, 0);
+	if (unlikely(-1 == *fd))
+		return -errno;
+
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+int spawn_process(char *const *argv, char *const *env,
+                  const int (*dups)[2], int ndups,
+                  const int *closefds, int ncloses, int *pid)
+{
+	int err, tmp;
+	posix_spawn_file_actions_t fa;
+	pid_t child;
+	int i;
+
+	/* The zygote does not have any file descriptors of the daemon so
+	 * there is nothing to close.
+	 */
+	if (zygote_is_running())
+		return zygote_spawn(argv, env, dups, ndups, pid);
+
+	err = posix_spawn_file_actions_init(&fa);
+	if (unlikely(err)) {
+		error("posix_spawn_file_actions_init() failed. errno = %d "
+		      "says '%s'.", err, strerror(err));
+		return -err;
+	}
+
+	for (i = 0; i < ncloses; ++i) {
+		err = posix_spawn_file_actions_addclose(&fa, closefds[i]);
+		if (unlikely(err))
+			goto fail;
+	}
+
+	for (i = 0; i < ndups; ++i) {
+		if (dups[i][0] == dups[i][1])
+			continue;
+
+		err = posix_spawn_file_actions_adddup2(&fa, dups[i][0], dups[i][1]);
+		if (unlikely(err))
+			goto fail;
+
+		err = posix_spawn_file_actions_addclose(&fa, dups[i][0]);
+		if (unlikely(err))
+			goto fail;
+	}
+
+	/* glibc implements posix_spawn() with CLONE_VM | CLONE_VFORK and
+	 * reports a failed execve() in the return value.
+	 */
+	err = posix_spawn(&child, argv[0], &fa, NULL, argv, env);
+	if (unlikely(err)) {
+		error("posix_spawn() failed for '%s'. errno = %d says '%s'.",
+		      argv[0], err, strerror(err));
+		goto fail2;
+	}
+
+	tmp = posix_spawn_file_actions_destroy(&fa);
+	if (unlikely(tmp))
+		error("posix_spawn_file_actions_destroy() failed.");
+
+	*pid = child;
+
+	return 0;
+
+fail:
+	error("Failed to set up file actions. errno = %d says '%s'.",
+	      err, strerror(err));
+
+fail2:
+	tmp = posix_spawn_file_actions_destroy(&fa);
+	if (unlikely(tmp))
+		error("posix_spawn_file_actions_destroy() failed.");
+
+	return -err;
+}
+
+int wait_process(int pid, int *status, int options)
+{
+	if (zygote_is_running())
+		return zygote_wait(pid, status, options);
+
+	return waitpid(pid, status, options);
+}
+
@@ -98,13 +98,18 @@ int daemonize();
 /*
  * Wrapper around syscall(SYS_gettid)
  */
-ll gettid();
+ll spawn_gettid();
 
 /*
  * Get the seconds since the start of the epoch.
  */
 ll llnow();
 
+/*
+ * Get the microseconds since the start of the epoch.
+ */
+ll llnow_usecs();
+
 /*
  * Add two timespecs together and return the result in z. The arguments
  * may alias each other.
@@ -122,5 +127,41 @@ int abstime_near_future(struct timespec *delay, struct timespec *x);
  */
 int sockaddr(int fd, ui32 *ip, ui32 *portnum);
 
+/*
+ * 64-bit FNV-1a hash of a string.
+ */
+ui64 fnv1a_hash(const char *str);
+
+/*
+ * Translate the status returned by waitpid() for a process started by an
+ * exec plugin into the return value convention of exec_plugin_ops.exec():
+ * Zero on success, the negative exit code or -ESOMEFAULT otherwise.
+ */
+int exit_status_to_error(int status);
+
+/*
+ * Wrapper around the pidfd_open() system call. Returns -ENOSYS if the
+ * kernel does not support pidfds.
+ */
+int do_pidfd_open(int pid, int *fd);
+
+/*
+ * Spawn the executable argv[0] with posix_spawn() which avoids copying
+ * the page tables of the (large and multi-threaded) daemon. argv and env
+ * must be fully prepared by the caller since no code of ours runs in the
+ * child. dups contains ndups pairs of file descriptors: The first one is
+ * duplicated to the second one in the child (and closed afterwards).
+ * The ncloses file descriptors in closefds are closed in the child
+ * before. If the zygote is running the process is forked by it instead.
+ */
+int spawn_process(char *const *argv, char *const *env,
+                  const int (*dups)[2], int ndups,
+                  const int *closefds, int ncloses, int *pid);
+
+/*
+ * waitpid() replacement for processes started with spawn_process().
+ */
+int wait_process(int pid, int *status, int options);
+
 #endif
 
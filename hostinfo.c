@@ -17,6 +17,7 @@
 #include "alloc.h"
 #include "hostinfo.h"
 #include "helper.h"
+#include "thread.h"
 
 
 struct _interim_route
@@ -40,6 +41,27 @@ static int _maybe_realloc_routes(struct alloc *alloc, int i, int *nroutes,
 static int _hostinfo_copy_routes(struct hostinfo *self,
                                  struct _interim_route *xroutes);
 static int _count_newlines(const char *file, int *count);
+static int _hostinfo_build_trie(struct hostinfo *self);
+static int _cache_find_or_insert(struct hostinfo *self, const char *host,
+                                 si32 *idx, int *isnew);
+static int _cache_grow_slots(struct hostinfo *self);
+static int _resolve_parallel(struct hostinfo *self, si32 *todo, int ntodo,
+                             int nthreads);
+static int _resolve_main(void *arg);
+static int _resolve_one(const char *host, ui32 *addr);
+
+/*
+ * Work description for the resolver threads. Each thread handles
+ * todo[first], todo[first + stride], ...
+ */
+struct _resolve_work
+{
+	struct hostinfo	*hostinfo;
+	si32		*todo;
+	int		ntodo;
+	int		first;
+	int		stride;
+};
 
 
 int hostinfo_ctor(struct hostinfo *self, struct alloc *alloc)
@@ -69,12 +91,57 @@ int hostinfo_ctor(struct hostinfo *self, struct alloc *alloc)
 		return err;
 	}
 
+	err = _hostinfo_build_trie(self);
+	if (unlikely(err)) {
+		fcallerror("_hostinfo_build_trie", err);
+		return err;
+	}
+
 	return 0;
 }
 
 int hostinfo_dtor(struct hostinfo *self)
 {
 	int err;
+	int i;
+
+	for (i = 0; i < self->ncache; ++i) {
+		err = strfree(self->alloc, &self->cache[i].name);
+		if (unlikely(err)) {
+			fcallerror("strfree", err);
+			return err;
+		}
+	}
+
+	if (self->cache) {
+		err = ZFREE(self->alloc, (void **)&self->cache, self->maxcache,
+		            sizeof(struct hostinfo_cache_entry), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+
+		err = ZFREE(self->alloc, (void **)&self->slots, self->maxslots,
+		            sizeof(si32), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	err = ZFREE(self->alloc, (void **)&self->trie, 1 + 32*self->nroutes,
+	            sizeof(struct hostinfo_trie_node), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	err = ZFREE(self->alloc, (void **)&self->routes, self->nroutes,
+	            sizeof(struct route), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
 
 	err = ZFREE(self->alloc, (void **)&self->ipv4ifs, self->nipv4ifs,
 	            sizeof(struct ipv4interface), "");
@@ -86,36 +153,88 @@ int hostinfo_dtor(struct hostinfo *self)
 	return 0;
 }
 
-int map_hostname_to_interface(struct hostinfo *hi, const char *host,
-                              struct ipv4interface **iface)
+int hostinfo_resolve(struct hostinfo *self, int n, const char **hosts,
+                     ui32 *addrs, int nthreads)
 {
-	int err;
-	struct sockaddr_in addr;
-        struct addrinfo hints;
-        struct addrinfo *ailist;
-        struct addrinfo *aip;
+	int err, tmp;
+	int i, isnew, ntodo;
+	si32 *idx, *todo;
+	struct in_addr in;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags    = AI_CANONNAME;
-	hints.ai_family   = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+	if (0 == n)
+		return 0;
 
-	err = getaddrinfo(host, NULL, &hints, &ailist);
+	err = ZALLOC(self->alloc, (void **)&idx, n, sizeof(si32), "idx");
 	if (unlikely(err)) {
-		error("getaddrinfo() for host '%s' failed with exit code %d (means '%s').",
-		      host, err, gai_strerror(err));
-		return err;	/* seems like the EAI_* constants are
-				 * negative on Linux.
-				 */
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	err = ZALLOC(self->alloc, (void **)&todo, n, sizeof(si32), "todo");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail1;
+	}
+
+	/* Collect the distinct names which are not in the cache yet. Names
+	 * that failed to resolve earlier are tried again.
+	 */
+	ntodo = 0;
+	for (i = 0; i < n; ++i) {
+		if (1 == inet_pton(AF_INET, hosts[i], &in)) {
+			idx[i]   = -1;
+			addrs[i] = in.s_addr;
+			continue;
+		}
+
+		err = _cache_find_or_insert(self, hosts[i], &idx[i], &isnew);
+		if (unlikely(err)) {
+			fcallerror("_cache_find_or_insert", err);
+			goto fail2;
+		}
+
+		if (isnew)
+			todo[ntodo++] = idx[i];
+	}
+
+	err = _resolve_parallel(self, todo, ntodo, nthreads);
+	if (unlikely(err)) {
+		fcallerror("_resolve_parallel", err);
+		goto fail2;
 	}
 
-	aip  = ailist;
-	addr = *(struct sockaddr_in *)aip->ai_addr;
+	for (i = 0; i < n; ++i)
+		if (idx[i] >= 0)
+			addrs[i] = self->cache[idx[i]].addr;
 
-	debug("getaddrinfo() for host '%s' returned %s.", host, inet_ntoa(addr.sin_addr));
+fail2:
+	tmp = ZFREE(self->alloc, (void **)&todo, n, sizeof(si32), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+fail1:
+	tmp = ZFREE(self->alloc, (void **)&idx, n, sizeof(si32), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
 
-	freeaddrinfo(aip);
+	return err;
+}
+
+int map_hostname_to_interface(struct hostinfo *hi, const char *host,
+                              struct ipv4interface **iface)
+{
+	int err;
+	struct sockaddr_in addr;
+	ui32 a;
+
+	err = hostinfo_resolve(hi, 1, &host, &a, 1);
+	if (unlikely(err))
+		return err;
+	if (unlikely(0 == a))
+		return -ESOMEFAULT;	/* _resolve_one() reported reason. */
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = a;
 
 	return map_address_to_interface(hi, &addr, iface);
 }
@@ -124,8 +243,8 @@ int map_address_to_interface(struct hostinfo *hi,
                              const struct sockaddr_in *addr,
                              struct ipv4interface **iface)
 {
-	int i;
-	int a, b, c;
+	ui32 a;
+	int i, j, k;
 
 	/* TODO: Go through lo if addr == 172.0.0.1
 	 */
@@ -139,27 +258,24 @@ int map_address_to_interface(struct hostinfo *hi,
 		return -ESOMEFAULT;
 	}
 
-	for (i = 0; i < hi->nroutes; ++i) {
-		if (hi->defroute == &hi->routes[i])
-			continue;
-
-		b = ntohl(hi->routes[i].genmask.sin_addr.s_addr);
-		c = ntohl(hi->routes[i].dest.sin_addr.s_addr);
-
-		if ((a & b) == c) {
-			*iface = hi->routes[i].iface;
-
-			debug("map_address_to_interface() for addr %s gives %s.",
-			      inet_ntoa(addr->sin_addr), (*iface)->name);
-		}
+	/* Walk down the trie along the bits of the address and remember
+	 * the deepest node carrying a route.
+	 */
+	k = hi->trie[0].route;
+	j = 0;
+	for (i = 31; i >= 0; --i) {
+		j = hi->trie[j].child[(a >> i) & 1];
+		if (!j)
+			break;
+		if (hi->trie[j].route >= 0)
+			k = hi->trie[j].route;
 	}
 
-	if (!(*iface)) {
-		*iface = hi->defroute->iface;
+	*iface = hi->routes[k].iface;
 
-		debug("map_address_to_interface() for addr %s gives %s (default route).",
-		      inet_ntoa(addr->sin_addr), (*iface)->name);
-	}
+	debug("map_address_to_interface() for addr %s gives %s%s.",
+	      inet_ntoa(addr->sin_addr), (*iface)->name,
+	      (hi->defroute == &hi->routes[k]) ? " (default route)" : "");
 
 	return 0;
 }
@@ -658,3 +774,293 @@ static int _count_newlines(const char *file, int *count)
 	return 0;
 }
 
+/*
+ * Build the trie for longest prefix matching. A route for a network with
+ * prefix length l is attached to the node at depth l along the bits of the
+ * destination. Since each route adds at most 32 nodes the size of the trie
+ * is bounded by 1 + 32*nroutes.
+ */
+static int _hostinfo_build_trie(struct hostinfo *self)
+{
+	int err;
+	int i, j, b, l;
+	ui32 dest;
+
+	err = ZALLOC(self->alloc, (void **)&self->trie, 1 + 32*self->nroutes,
+	             sizeof(struct hostinfo_trie_node), "trie");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	self->ntrie = 1;
+	self->trie[0].route = (self->defroute) ? (self->defroute - self->routes) : -1;
+
+	for (i = 0; i < self->nroutes; ++i) {
+		if (self->defroute == &self->routes[i])
+			continue;
+
+		dest = ntohl(self->routes[i].dest.sin_addr.s_addr);
+		l    = __builtin_popcount(ntohl(self->routes[i].genmask.sin_addr.s_addr));
+
+		j = 0;
+		for (b = 31; b > 31 - l; --b) {
+			if (!self->trie[j].child[(dest >> b) & 1]) {
+				self->trie[self->ntrie].route = -1;
+				self->trie[j].child[(dest >> b) & 1] = self->ntrie++;
+			}
+
+			j = self->trie[j].child[(dest >> b) & 1];
+		}
+
+		self->trie[j].route = i;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up a host name in the cache and insert it if it is missing. isnew
+ * is set to one if the name needs to be resolved.
+ */
+static int _cache_find_or_insert(struct hostinfo *self, const char *host,
+                                 si32 *idx, int *isnew)
+{
+	int err;
+	ui32 h;
+	int n;
+	struct hostinfo_cache_entry *x;
+
+	if (2*(self->ncache + 1) > self->maxslots) {
+		err = _cache_grow_slots(self);
+		if (unlikely(err))
+			return err;
+	}
+
+	h = fnv1a_hash(host) & (self->maxslots - 1);
+	while (-1 != self->slots[h]) {
+		x = &self->cache[self->slots[h]];
+
+		if (!strcmp(x->name, host)) {
+			*idx   = self->slots[h];
+			*isnew = (x->done && (0 == x->addr));
+			if (*isnew)
+				x->done = 0;
+
+			return 0;
+		}
+
+		h = (h + 1) & (self->maxslots - 1);
+	}
+
+	if (self->ncache == self->maxcache) {
+		n = MAX(16, 2*self->maxcache);
+
+		err = ZREALLOC(self->alloc, (void **)&self->cache,
+		               self->maxcache, sizeof(struct hostinfo_cache_entry),
+		               n, sizeof(struct hostinfo_cache_entry), "cache");
+		if (unlikely(err)) {
+			fcallerror("ZREALLOC", err);
+			return err;
+		}
+
+		self->maxcache = n;
+	}
+
+	x = &self->cache[self->ncache];
+
+	err = xstrdup(self->alloc, host, &x->name);
+	if (unlikely(err)) {
+		fcallerror("xstrdup", err);
+		return err;
+	}
+
+	x->addr = 0;
+	x->done = 0;
+
+	self->slots[h] = self->ncache;
+
+	*idx   = self->ncache++;
+	*isnew = 1;
+
+	return 0;
+}
+
+static int _cache_grow_slots(struct hostinfo *self)
+{
+	int err;
+	int i, n;
+	ui32 h;
+
+	n = MAX(64, 2*self->maxslots);
+
+	if (self->slots) {
+		err = ZFREE(self->alloc, (void **)&self->slots, self->maxslots,
+		            sizeof(si32), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	err = MALLOC(self->alloc, (void **)&self->slots, n,
+	             sizeof(si32), "slots");
+	if (unlikely(err)) {
+		fcallerror("MALLOC", err);
+		self->maxslots = 0;
+		return err;
+	}
+
+	self->maxslots = n;
+
+	memset(self->slots, -1, n*sizeof(si32));
+
+	for (i = 0; i < self->ncache; ++i) {
+		h = fnv1a_hash(self->cache[i].name) & (self->maxslots - 1);
+		while (-1 != self->slots[h])
+			h = (h + 1) & (self->maxslots - 1);
+
+		self->slots[h] = i;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve the cache entries listed in todo. getaddrinfo() blocks for the
+ * duration of a DNS round trip so the names are distributed over multiple
+ * threads.
+ */
+static int _resolve_parallel(struct hostinfo *self, si32 *todo, int ntodo,
+                             int nthreads)
+{
+	int err, tmp;
+	int i, n;
+	struct thread *threads;
+	struct _resolve_work *work;
+
+	if (0 == ntodo)
+		return 0;
+
+	nthreads = MAX(1, MIN(nthreads, ntodo));
+
+	if (1 == nthreads) {
+		struct _resolve_work x = {self, todo, ntodo, 0, 1};
+
+		return _resolve_main(&x);
+	}
+
+	err = ZALLOC(self->alloc, (void **)&threads, nthreads,
+	             sizeof(struct thread), "threads");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	err = ZALLOC(self->alloc, (void **)&work, nthreads,
+	             sizeof(struct _resolve_work), "work");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	for (n = 0; n < nthreads; ++n) {
+		work[n].hostinfo = self;
+		work[n].todo     = todo;
+		work[n].ntodo    = ntodo;
+		work[n].first    = n;
+		work[n].stride   = nthreads;
+
+		err = thread_ctor(&threads[n]);
+		if (unlikely(err)) {
+			fcallerror("thread_ctor", err);
+			break;
+		}
+
+		err = thread_start(&threads[n], _resolve_main, &work[n]);
+		if (unlikely(err)) {
+			fcallerror("thread_start", err);
+			thread_dtor(&threads[n]);
+			break;
+		}
+	}
+
+	/* If not all threads could be started the calling thread
+	 * resolves the remaining names.
+	 */
+	for (i = n; i < nthreads; ++i)
+		_resolve_main(&work[i]);
+
+	for (i = 0; i < n; ++i) {
+		tmp = thread_join(&threads[i]);
+		if (unlikely(tmp))
+			fcallerror("thread_join", tmp);
+
+		tmp = thread_dtor(&threads[i]);
+		if (unlikely(tmp))
+			fcallerror("thread_dtor", tmp);
+	}
+
+	err = 0;
+
+	tmp = ZFREE(self->alloc, (void **)&work, nthreads,
+	            sizeof(struct _resolve_work), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+fail:
+	tmp = ZFREE(self->alloc, (void **)&threads, nthreads,
+	            sizeof(struct thread), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
+static int _resolve_main(void *arg)
+{
+	struct _resolve_work *work = arg;
+	struct hostinfo_cache_entry *x;
+	int i;
+
+	for (i = work->first; i < work->ntodo; i += work->stride) {
+		x = &work->hostinfo->cache[work->todo[i]];
+
+		_resolve_one(x->name, &x->addr);	/* Leaves x->addr zero
+							 * on failure. */
+		x->done = 1;
+	}
+
+	return 0;
+}
+
+static int _resolve_one(const char *host, ui32 *addr)
+{
+	int err;
+	struct addrinfo hints;
+	struct addrinfo *ailist;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = AI_CANONNAME;
+	hints.ai_family   = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	err = getaddrinfo(host, NULL, &hints, &ailist);
+	if (unlikely(err)) {
+		error("getaddrinfo() for host '%s' failed with exit code %d (means '%s').",
+		      host, err, gai_strerror(err));
+		return err;	/* seems like the EAI_* constants are
+				 * negative on Linux.
+				 */
+	}
+
+	*addr = ((struct sockaddr_in *)ailist->ai_addr)->sin_addr.s_addr;
+
+	debug("getaddrinfo() for host '%s' returned %s.", host,
+	      inet_ntoa(((struct sockaddr_in *)ailist->ai_addr)->sin_addr));
+
+	freeaddrinfo(ailist);
+
+	return 0;
+}
@@ -6,8 +6,12 @@
 #include <netinet/ip.h>
 #include <net/if.h>
 
+#include "ints.h"
+
 struct _ipv4interface;
 struct _route;
+struct hostinfo_trie_node;
+struct hostinfo_cache_entry;
 
 /*
  * Information about the execution host.
@@ -29,6 +33,22 @@ struct hostinfo
 	int			nroutes;
 	struct route		*routes;
 	struct route		*defroute;
+
+	/* Binary trie over the route destinations for longest prefix
+	 * matching. Node zero is the root and carries the default route.
+	 */
+	int			ntrie;
+	struct hostinfo_trie_node	*trie;
+
+	/* Cache of resolved host names. The entries are stored in the
+	 * order of insertion and indexed by an open addressing hash table
+	 * with maxslots (a power of two) slots.
+	 */
+	int			ncache;
+	int			maxcache;
+	struct hostinfo_cache_entry	*cache;
+	int			maxslots;
+	si32			*slots;
 };
 
 /*
@@ -49,6 +69,20 @@ struct route
 	struct ipv4interface	*iface;
 };
 
+struct hostinfo_trie_node
+{
+	si32	child[2];	/* Zero if there is no child */
+	si32	route;		/* Index into routes or -1 */
+};
+
+struct hostinfo_cache_entry
+{
+	char	*name;
+	ui32	addr;	/* IPv4 address in network byte order or zero if
+			 * the name could not be resolved. */
+	int	done;
+};
+
 
 int hostinfo_ctor(struct hostinfo *self, struct alloc *alloc);
 int hostinfo_dtor(struct hostinfo *self);
@@ -59,6 +93,15 @@ int hostinfo_dtor(struct hostinfo *self);
 int map_hostname_to_interface(struct hostinfo *hi, const char *host,
                               struct ipv4interface **iface);
 
+/*
+ * Resolve the n host names in hosts to IPv4 addresses (in network byte
+ * order). Addresses of hosts which cannot be resolved are set to zero.
+ * Names are looked up in the resolve cache first, the remaining names are
+ * resolved by up to nthreads threads in parallel and added to the cache.
+ */
+int hostinfo_resolve(struct hostinfo *self, int n, const char **hosts,
+                     ui32 *addrs, int nthreads);
+
 /*
  * For a given IPv4 address find the interface through which the node is reachable.
  */
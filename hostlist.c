@@ -0,0 +1,466 @@
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "helper.h"
+#include "hostlist.h"
+
+
+/*
+ * Numbers with more digits may overflow ll.
+ */
+#define HOSTLIST_MAX_DIGITS	18
+
+static int _parse_term(struct hostlist *self, const char *s, int n);
+static int _parse_plain(struct hostlist *self, const char *s, int n);
+static int _parse_number(const char *s, int n, ll *x);
+static int _append_range(struct hostlist *self,
+                         const char *prefix, int plen,
+                         const char *suffix, int slen,
+                         ll lo, ll hi, int width);
+static int _add_string(struct hostlist *self, si32 last,
+                       const char *s, int n, si32 *off);
+static si32 _find_range(const struct hostlist *self, ll i);
+static ll _format(const struct hostlist *self, char *buf, ll len);
+
+
+int hostlist_ctor(struct hostlist *self, struct alloc *alloc)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->alloc = alloc;
+
+	return 0;
+}
+
+int hostlist_dtor(struct hostlist *self)
+{
+	int err;
+
+	if (self->ranges) {
+		err = ZFREE(self->alloc, (void **)&self->ranges, self->maxranges,
+		            sizeof(struct hostlist_range), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	if (self->pool) {
+		err = ZFREE(self->alloc, (void **)&self->pool, self->maxpool,
+		            sizeof(char), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	return 0;
+}
+
+int hostlist_parse(struct hostlist *self, const char *str)
+{
+	int err;
+	int i, j, depth;
+
+	i = j = depth = 0;
+	while (1) {
+		if ('[' == str[j])
+			++depth;
+		if (']' == str[j])
+			--depth;
+
+		if ((0 == str[j]) || ((',' == str[j]) && (0 == depth))) {
+			err = _parse_term(self, str + i, j - i);
+			if (unlikely(err)) {
+				error("Invalid host list term '%.*s'.", j - i, str + i);
+				return err;
+			}
+
+			if (0 == str[j])
+				break;
+
+			i = j + 1;
+		}
+
+		++j;
+	}
+
+	return 0;
+}
+
+int hostlist_get(const struct hostlist *self, ll i, char *host, int len)
+{
+	const struct hostlist_range *r;
+	int n;
+
+	if (unlikely((i < 0) || (i >= self->size)))
+		return -EINVAL;
+
+	r = &self->ranges[_find_range(self, i)];
+
+	if (0 == r->width)
+		n = snprintf(host, len, "%s%s",
+		             self->pool + r->prefix,
+		             self->pool + r->suffix);
+	else
+		n = snprintf(host, len, "%s%0*lld%s",
+		             self->pool + r->prefix,
+		             r->width, r->lo + (i - r->start),
+		             self->pool + r->suffix);
+
+	if (unlikely(n >= len))
+		return -EINVAL;
+
+	return 0;
+}
+
+int hostlist_slice(const struct hostlist *self, ll first, ll n,
+                   struct hostlist *other)
+{
+	int err;
+	const struct hostlist_range *r;
+	const char *prefix, *suffix;
+	si32 k;
+	ll off, cnt;
+
+	if (unlikely((first < 0) || (n < 0) || (first + n > self->size)))
+		return -EINVAL;
+	if (0 == n)
+		return 0;
+
+	k = _find_range(self, first);
+	while (n > 0) {
+		r   = &self->ranges[k];
+		off = first - r->start;
+		cnt = MIN(n, r->hi - r->lo + 1 - off);
+
+		prefix = self->pool + r->prefix;
+		suffix = self->pool + r->suffix;
+
+		if (0 == r->width)
+			err = _append_range(other, prefix, strlen(prefix),
+			                    suffix, strlen(suffix),
+			                    0, cnt - 1, 0);
+		else
+			err = _append_range(other, prefix, strlen(prefix),
+			                    suffix, strlen(suffix),
+			                    r->lo + off, r->lo + off + cnt - 1,
+			                    r->width);
+		if (unlikely(err))
+			return err;
+
+		first += cnt;
+		n     -= cnt;
+		++k;
+	}
+
+	return 0;
+}
+
+int hostlist_format(const struct hostlist *self, char **str)
+{
+	int err;
+	ll n;
+
+	n = _format(self, NULL, 0);
+
+	err = MALLOC(self->alloc, (void **)str, n + 1, sizeof(char), "hostlist");
+	if (unlikely(err)) {
+		fcallerror("MALLOC", err);
+		return err;
+	}
+
+	_format(self, *str, n + 1);
+
+	return 0;
+}
+
+
+static int _parse_term(struct hostlist *self, const char *s, int n)
+{
+	int err;
+	const char *b, *e, *p, *q, *m;
+	ll lo, hi;
+
+	if (unlikely(0 == n))
+		return -EINVAL;
+
+	b = memchr(s, '[', n);
+	if (!b) {
+		if (unlikely(memchr(s, ']', n)))
+			return -EINVAL;
+
+		return _parse_plain(self, s, n);
+	}
+
+	e = memchr(b, ']', n - (b - s));
+	if (unlikely(!e))
+		return -EINVAL;
+	if (unlikely(memchr(b + 1, '[', e - (b + 1)) ||
+	             memchr(e + 1, '[', n - (e + 1 - s)) ||
+	             memchr(e + 1, ']', n - (e + 1 - s)))) {
+		error("Only a single range expression per host list term "
+		      "is supported.");
+		return -EINVAL;
+	}
+
+	p = b + 1;
+	while (p <= e) {
+		q = memchr(p, ',', e - p);
+		if (!q)
+			q = e;
+
+		m = memchr(p, '-', q - p);
+		if (!m)
+			m = q;
+
+		err = _parse_number(p, m - p, &lo);
+		if (unlikely(err))
+			return err;
+
+		hi = lo;
+		if (m != q) {
+			err = _parse_number(m + 1, q - (m + 1), &hi);
+			if (unlikely(err))
+				return err;
+		}
+		if (unlikely(hi < lo))
+			return -EINVAL;
+
+		err = _append_range(self, s, b - s, e + 1, n - (e + 1 - s),
+		                    lo, hi, m - p);
+		if (unlikely(err))
+			return err;
+
+		p = q + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a host name without range expression. A trailing number is split
+ * off so that lists of consecutively numbered hosts are stored compressed.
+ */
+static int _parse_plain(struct hostlist *self, const char *s, int n)
+{
+	int err;
+	int k;
+	ll x;
+
+	k = n;
+	while ((k > 0) && (s[k-1] >= '0') && (s[k-1] <= '9'))
+		--k;
+
+	if ((k == n) || (n - k > HOSTLIST_MAX_DIGITS))
+		return _append_range(self, s, n, "", 0, 0, 0, 0);
+
+	err = _parse_number(s + k, n - k, &x);
+	if (unlikely(err))
+		return err;
+
+	return _append_range(self, s, k, "", 0, x, x, n - k);
+}
+
+static int _parse_number(const char *s, int n, ll *x)
+{
+	int i;
+
+	if (unlikely((n < 1) || (n > HOSTLIST_MAX_DIGITS)))
+		return -EINVAL;
+
+	*x = 0;
+	for (i = 0; i < n; ++i) {
+		if (unlikely((s[i] < '0') || (s[i] > '9')))
+			return -EINVAL;
+
+		*x = 10*(*x) + (s[i] - '0');
+	}
+
+	return 0;
+}
+
+/*
+ * Append the range lo, ..., hi to the list. If possible the range is
+ * merged with the last range in the list.
+ */
+static int _append_range(struct hostlist *self,
+                         const char *prefix, int plen,
+                         const char *suffix, int slen,
+                         ll lo, ll hi, int width)
+{
+	int err;
+	struct hostlist_range *r;
+	si32 pre, suf;
+	si32 n;
+
+	r = (self->nranges > 0) ? &self->ranges[self->nranges-1] : NULL;
+
+	err = _add_string(self, (r) ? r->prefix : -1, prefix, plen, &pre);
+	if (unlikely(err))
+		return err;
+
+	err = _add_string(self, (r) ? r->suffix : -1, suffix, slen, &suf);
+	if (unlikely(err))
+		return err;
+
+	if (r && (r->prefix == pre) && (r->suffix == suf) &&
+	    (r->width == width) && ((0 == width) || (r->hi + 1 == lo))) {
+		r->hi      += hi - lo + 1;
+		self->size += hi - lo + 1;
+		return 0;
+	}
+
+	if (self->nranges == self->maxranges) {
+		n = MAX(8, 2*self->maxranges);
+
+		err = ZREALLOC(self->alloc, (void **)&self->ranges,
+		               self->maxranges, sizeof(struct hostlist_range),
+		               n, sizeof(struct hostlist_range), "ranges");
+		if (unlikely(err)) {
+			fcallerror("ZREALLOC", err);
+			return err;
+		}
+
+		self->maxranges = n;
+	}
+
+	r = &self->ranges[self->nranges++];
+
+	r->start  = self->size;
+	r->lo     = (0 == width) ? 0 : lo;
+	r->hi     = (0 == width) ? hi - lo : hi;
+	r->prefix = pre;
+	r->suffix = suf;
+	r->width  = width;
+
+	self->size += hi - lo + 1;
+
+	return 0;
+}
+
+/*
+ * Add a string to the pool. If the string equals the one at offset last
+ * the existing copy is reused.
+ */
+static int _add_string(struct hostlist *self, si32 last,
+                       const char *s, int n, si32 *off)
+{
+	int err;
+	si32 m;
+
+	if ((last >= 0) && (!strncmp(self->pool + last, s, n)) &&
+	    (0 == self->pool[last + n])) {
+		*off = last;
+		return 0;
+	}
+
+	if (self->npool + n + 1 > self->maxpool) {
+		m = MAX(64, 2*self->maxpool);
+		while (self->npool + n + 1 > m)
+			m *= 2;
+
+		err = ZREALLOC(self->alloc, (void **)&self->pool,
+		               self->maxpool, sizeof(char),
+		               m, sizeof(char), "pool");
+		if (unlikely(err)) {
+			fcallerror("ZREALLOC", err);
+			return err;
+		}
+
+		self->maxpool = m;
+	}
+
+	*off = self->npool;
+
+	memcpy(self->pool + self->npool, s, n);
+	self->pool[self->npool + n] = 0;
+	self->npool += n + 1;
+
+	return 0;
+}
+
+/*
+ * Find the range containing the i-th host.
+ */
+static si32 _find_range(const struct hostlist *self, ll i)
+{
+	si32 lo, hi, mid;
+
+	lo = 0;
+	hi = self->nranges - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1)/2;
+		if (self->ranges[mid].start <= i)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Write the host list expression into buf (of size len) and return the
+ * length of the expression. Consecutive numbered ranges sharing prefix and
+ * suffix are combined into a single range expression. buf may be NULL if
+ * len is zero.
+ */
+static ll _format(const struct hostlist *self, char *buf, ll len)
+{
+	const struct hostlist_range *r, *s;
+	ll pos, j;
+	si32 i, k;
+
+#define _PRINT(...)	pos += snprintf((buf) ? buf + MIN(pos, len) : NULL,	\
+	                                MAX(0, len - pos), __VA_ARGS__)
+
+	pos = 0;
+	for (i = 0; i < self->nranges; i = k) {
+		r = &self->ranges[i];
+
+		if (i > 0)
+			_PRINT(",");
+
+		if (0 == r->width) {
+			for (j = r->lo; j <= r->hi; ++j)
+				_PRINT("%s%s%s", (j > r->lo) ? "," : "",
+				       self->pool + r->prefix,
+				       self->pool + r->suffix);
+			k = i + 1;
+			continue;
+		}
+
+		_PRINT("%s[", self->pool + r->prefix);
+
+		for (k = i; k < self->nranges; ++k) {
+			s = &self->ranges[k];
+			if ((s->width == 0) || (s->prefix != r->prefix) ||
+			    (s->suffix != r->suffix))
+				break;
+
+			if (k > i)
+				_PRINT(",");
+			if (s->lo == s->hi)
+				_PRINT("%0*lld", s->width, s->lo);
+			else
+				_PRINT("%0*lld-%0*lld", s->width, s->lo,
+				       s->width, s->hi);
+		}
+
+		_PRINT("]%s", self->pool + r->suffix);
+	}
+
+#undef _PRINT
+
+	return pos;
+}
+
@@ -0,0 +1,92 @@
+
+#ifndef SPAWN_HOSTLIST_H_INCLUDED
+#define SPAWN_HOSTLIST_H_INCLUDED 1
+
+#include "ints.h"
+
+struct alloc;
+
+
+/*
+ * Compressed list of host names.
+ *
+ * Host lists are given as a comma separated list of terms. Each term is
+ * either a plain host name or a range expression of the form
+ * prefix[list]suffix where list is a comma separated list of numbers
+ * and number ranges, e.g., node[0001-4096,5000-5100]. Leading zeros in
+ * the first number of a range determine the width of the generated
+ * numbers. Only a single bracket expression per term is supported.
+ *
+ * The list is stored as a sequence of ranges. Consecutive plain host names
+ * that only differ in a trailing number (node1,node2,...) are merged into
+ * a single range as well as repetitions of the same name. Host names are
+ * only expanded on request by hostlist_get().
+ */
+struct hostlist_range
+{
+	ll	start;	/* Index of the first host of the range in the list */
+	ll	lo;
+	ll	hi;	/* Inclusive */
+	si32	prefix;	/* Offsets into the string pool */
+	si32	suffix;
+	si32	width;	/* Number of digits or zero if the range consists of
+			 * hi - lo + 1 copies of the same name (prefix plus
+			 * suffix). */
+};
+
+struct hostlist
+{
+	struct alloc		*alloc;
+
+	ll			size;	/* Number of hosts */
+
+	si32			nranges;
+	si32			maxranges;
+	struct hostlist_range	*ranges;
+
+	/* Prefix and suffix strings of the ranges.
+	 */
+	si32			npool;
+	si32			maxpool;
+	char			*pool;
+};
+
+int hostlist_ctor(struct hostlist *self, struct alloc *alloc);
+int hostlist_dtor(struct hostlist *self);
+
+/*
+ * Parse a host list expression and append the hosts to the list.
+ */
+int hostlist_parse(struct hostlist *self, const char *str);
+
+/*
+ * Number of hosts in the list.
+ */
+static inline ll hostlist_size(const struct hostlist *self)
+{
+	return self->size;
+}
+
+/*
+ * Expand the name of the i-th host in the list into host which is a buffer
+ * of size len. Returns -EINVAL if i is out of range or the name does not
+ * fit into the buffer.
+ */
+int hostlist_get(const struct hostlist *self, ll i, char *host, int len);
+
+/*
+ * Append the n hosts starting at index first in self to the list other.
+ * The result remains compressed.
+ */
+int hostlist_slice(const struct hostlist *self, ll first, ll n,
+                   struct hostlist *other);
+
+/*
+ * Format the list as a (compressed) host list expression that can be
+ * parsed by hostlist_parse(). The string is allocated with the allocator
+ * of the list and must be released with strfree().
+ */
+int hostlist_format(const struct hostlist *self, char **str);
+
+#endif
+
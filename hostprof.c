@@ -0,0 +1,477 @@
+
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>	/* For PATH_MAX */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "helper.h"
+#include "hostprof.h"
+
+
+/*
+ * New samples enter the moving averages with weight 2^-HOST_PROFILE_SHIFT.
+ */
+#define HOST_PROFILE_SHIFT	2
+#define HOST_PROFILE_MIN_SLOTS	64
+
+static int _host_profile_load(struct host_profile *self);
+static int _host_profile_alloc(struct host_profile *self, ui32 nslots);
+static int _host_profile_release(struct host_profile *self);
+static int _host_profile_grow(struct host_profile *self);
+static ui64 _hash(const char *host);
+static struct host_profile_entry *_find(struct host_profile *self, ui64 key);
+
+
+int host_profile_ctor(struct host_profile *self, struct alloc *alloc,
+                      const char *path)
+{
+	int err, tmp;
+
+	memset(self, 0, sizeof(*self));
+
+	self->alloc = alloc;
+
+	err = lock_ctor(&self->lock);
+	if (unlikely(err)) {
+		fcallerror("lock_ctor", err);
+		return err;
+	}
+
+	err = xstrdup(alloc, path, &self->path);
+	if (unlikely(err)) {
+		fcallerror("xstrdup", err);
+		goto fail;
+	}
+
+	err = _host_profile_load(self);
+	if (unlikely(err)) {
+		err = _host_profile_alloc(self, HOST_PROFILE_MIN_SLOTS);
+		if (unlikely(err)) {
+			fcallerror("_host_profile_alloc", err);
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	tmp = strfree(alloc, &self->path);
+	if (unlikely(tmp))
+		fcallerror("strfree", tmp);
+
+	tmp = lock_dtor(&self->lock);
+	if (unlikely(tmp))
+		fcallerror("lock_dtor", tmp);
+
+	return err;
+}
+
+int host_profile_dtor(struct host_profile *self)
+{
+	int err;
+
+	err = _host_profile_release(self);
+	if (unlikely(err)) {
+		fcallerror("_host_profile_release", err);
+		return err;
+	}
+
+	err = strfree(self->alloc, &self->path);
+	if (unlikely(err)) {
+		fcallerror("strfree", err);
+		return err;
+	}
+
+	err = lock_dtor(&self->lock);
+	if (unlikely(err)) {
+		fcallerror("lock_dtor", err);
+		return err;
+	}
+
+	return 0;
+}
+
+ll host_profile_expected_latency(struct host_profile *self, const char *host)
+{
+	int err;
+	struct host_profile_entry *entry;
+	ll lat, p;
+
+	err = lock_acquire(&self->lock);
+	if (unlikely(err)) {
+		fcallerror("lock_acquire", err);
+		die();
+	}
+
+	entry = _find(self, _hash(host));
+	if (entry->key) {
+		/* Every failed attempt costs another spawn. The number of
+		 * attempts is geometrically distributed. The failure rate
+		 * is capped such that a host which always failed so far
+		 * still gets a finite estimate.
+		 */
+		p   = MIN(entry->failrate, 65535*9/10);
+		lat = entry->latency*65535LL/(65535 - p);
+	} else if (self->hdr->nused > 0) {
+		lat = self->hdr->sumlat/self->hdr->nused;
+	} else {
+		lat = 0;
+	}
+
+	lock_release(&self->lock);
+
+	return lat;
+}
+
+int host_profile_update(struct host_profile *self, const char *host,
+                        ll latency, int failed)
+{
+	int err;
+	struct host_profile_entry *entry;
+	ui64 key;
+	ll lat, f;
+
+	key     = _hash(host);
+	latency = MIN(MAX(0, latency), (ll )UINT32_MAX);
+
+	err = lock_acquire(&self->lock);
+	if (unlikely(err)) {
+		fcallerror("lock_acquire", err);
+		die();
+	}
+
+	entry = _find(self, key);
+	if (!entry->key) {
+		/* Keep the load factor at or below one half so that
+		 * probe sequences stay short.
+		 */
+		if (2*(self->hdr->nused + 1) > self->hdr->nslots) {
+			err = _host_profile_grow(self);
+			if (unlikely(err)) {
+				fcallerror("_host_profile_grow", err);
+				goto fail;
+			}
+
+			entry = _find(self, key);
+		}
+
+		entry->key      = key;
+		entry->latency  = latency;
+		entry->failrate = (failed) ? 65535 : 0;
+		entry->nsamples = 1;
+
+		self->hdr->nused  += 1;
+		self->hdr->sumlat += entry->latency;
+	} else {
+		lat = entry->latency;
+		f   = (failed) ? 65535 : 0;
+
+		self->hdr->sumlat -= entry->latency;
+
+		entry->latency  = lat + ((latency - lat) >> HOST_PROFILE_SHIFT);
+		entry->failrate = entry->failrate + ((f - entry->failrate) >> HOST_PROFILE_SHIFT);
+		entry->nsamples = MIN(entry->nsamples + 1, UINT16_MAX);
+
+		self->hdr->sumlat += entry->latency;
+	}
+
+	self->dirty = 1;
+
+	err = 0;
+
+fail:
+	lock_release(&self->lock);
+
+	return err;
+}
+
+int host_profile_save(struct host_profile *self)
+{
+	int err, tmp;
+	int fd;
+	char path[PATH_MAX];
+
+	err = lock_acquire(&self->lock);
+	if (unlikely(err)) {
+		fcallerror("lock_acquire", err);
+		die();
+	}
+
+	if (!self->dirty) {
+		err = 0;
+		goto fail;
+	}
+
+	/* Write a temporary file and rename it so that concurrent
+	 * launches never see a partially written profile.
+	 */
+	tmp = snprintf(path, sizeof(path), "%s.%d", self->path, (int )getpid());
+	if (unlikely(tmp >= sizeof(path))) {
+		error("Path of the host profile '%s' is too long.", self->path);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (unlikely(-1 == fd)) {
+		error("open() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	err = do_write_loop(fd, self->hdr, self->size);
+
+	tmp = do_close(fd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+
+	if (unlikely(err || tmp)) {
+		fcallerror("do_write_loop", err);
+		unlink(path);
+		err = (err) ? err : tmp;
+		goto fail;
+	}
+
+	if (unlikely(-1 == rename(path, self->path))) {
+		error("rename() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		unlink(path);
+		goto fail;
+	}
+
+	self->dirty = 0;
+
+	debug("Saved the latency profile of %u host(s) to '%s'.",
+	      self->hdr->nused, self->path);
+
+	err = 0;
+
+fail:
+	lock_release(&self->lock);
+
+	return err;
+}
+
+/*
+ * Map the file into memory. Returns an error if the file does not exist
+ * or is not a valid profile.
+ */
+static int _host_profile_load(struct host_profile *self)
+{
+	int err, tmp;
+	int fd;
+	struct stat st;
+	struct host_profile_header *hdr;
+	struct host_profile_entry *slots;
+	ui32 i, n;
+	void *p;
+
+	fd = open(self->path, O_RDONLY);
+	if (-1 == fd) {
+		if (ENOENT != errno)
+			warn("Cannot open host profile '%s'. errno = %d says '%s'.",
+			     self->path, errno, strerror(errno));
+		return -errno;
+	}
+
+	if (unlikely(-1 == fstat(fd, &st))) {
+		error("fstat() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	err = -EINVAL;
+
+	if (unlikely(st.st_size < sizeof(struct host_profile_header))) {
+		warn("Ignoring truncated host profile '%s'.", self->path);
+		goto fail;
+	}
+
+	/* The private mapping is copy-on-write so that updates do not
+	 * modify the file before host_profile_save().
+	 */
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (unlikely(MAP_FAILED == p)) {
+		error("mmap() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail;
+	}
+
+	hdr = p;
+
+	if (unlikely(memcmp(hdr->magic, "SPHP", 4) ||
+	             (HOST_PROFILE_VERSION != hdr->version) ||
+	             (hdr->nslots < HOST_PROFILE_MIN_SLOTS) ||
+	             (hdr->nslots & (hdr->nslots - 1)) ||
+	             (2*(ll )hdr->nused > hdr->nslots) ||
+	             (st.st_size != sizeof(struct host_profile_header) +
+	                            hdr->nslots*sizeof(struct host_profile_entry)))) {
+		warn("Ignoring invalid host profile '%s'.", self->path);
+		munmap(p, st.st_size);
+		goto fail;
+	}
+
+	/* _find() relies on free slots so nused must not understate
+	 * the occupied ones.
+	 */
+	slots = (struct host_profile_entry *)(hdr + 1);
+	for (i = 0, n = 0; i < hdr->nslots; ++i)
+		n += (0 != slots[i].key);
+
+	if (unlikely(n != hdr->nused)) {
+		warn("Ignoring corrupt host profile '%s' (%u used slot(s), "
+		     "%u expected).", self->path, n, hdr->nused);
+		munmap(p, st.st_size);
+		goto fail;
+	}
+
+	self->hdr    = hdr;
+	self->slots  = slots;
+	self->size   = st.st_size;
+	self->mapped = 1;
+
+	debug("Loaded the latency profile of %u host(s) from '%s'.",
+	      hdr->nused, self->path);
+
+	err = 0;
+
+fail:
+	tmp = do_close(fd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+
+	return err;
+}
+
+/*
+ * Allocate an empty table with nslots slots.
+ */
+static int _host_profile_alloc(struct host_profile *self, ui32 nslots)
+{
+	int err;
+	ll size;
+	void *p;
+
+	size = sizeof(struct host_profile_header) +
+	       nslots*sizeof(struct host_profile_entry);
+
+	err = ZALLOC(self->alloc, &p, size, sizeof(char), "host profile");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	self->hdr    = p;
+	self->slots  = (struct host_profile_entry *)(self->hdr + 1);
+	self->size   = size;
+	self->mapped = 0;
+
+	memcpy(self->hdr->magic, "SPHP", 4);
+	self->hdr->version = HOST_PROFILE_VERSION;
+	self->hdr->nslots  = nslots;
+
+	return 0;
+}
+
+static int _host_profile_release(struct host_profile *self)
+{
+	int err;
+
+	if (!self->hdr)
+		return 0;
+
+	if (self->mapped) {
+		if (unlikely(-1 == munmap(self->hdr, self->size))) {
+			error("munmap() failed. errno = %d says '%s'.", errno, strerror(errno));
+			return -errno;
+		}
+	} else {
+		err = ZFREE(self->alloc, (void **)&self->hdr, self->size,
+		            sizeof(char), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	self->hdr   = NULL;
+	self->slots = NULL;
+
+	return 0;
+}
+
+/*
+ * Double the number of slots and rehash the entries.
+ */
+static int _host_profile_grow(struct host_profile *self)
+{
+	int err;
+	struct host_profile old;
+	struct host_profile_entry *entry;
+	ui32 i;
+
+	old = *self;
+
+	err = _host_profile_alloc(self, 2*old.hdr->nslots);
+	if (unlikely(err)) {
+		fcallerror("_host_profile_alloc", err);
+		return err;
+	}
+
+	for (i = 0; i < old.hdr->nslots; ++i) {
+		if (!old.slots[i].key)
+			continue;
+
+		entry  = _find(self, old.slots[i].key);
+		*entry = old.slots[i];
+	}
+
+	self->hdr->nused  = old.hdr->nused;
+	self->hdr->sumlat = old.hdr->sumlat;
+
+	err = _host_profile_release(&old);
+	if (unlikely(err))
+		fcallerror("_host_profile_release", err);
+		/* Leak the old table.
+		 */
+
+	return 0;
+}
+
+/*
+ * Zero is reserved for free slots.
+ */
+static ui64 _hash(const char *host)
+{
+	ui64 h;
+
+	h = fnv1a_hash(host);
+
+	return (h) ? h : 1;
+}
+
+/*
+ * Returns the slot of key or the free slot where it would be inserted.
+ * The table always has free slots.
+ */
+static struct host_profile_entry *_find(struct host_profile *self, ui64 key)
+{
+	ui32 mask, i;
+
+	mask = self->hdr->nslots - 1;
+
+	for (i = key & mask; ; i = (i + 1) & mask) {
+		if ((self->slots[i].key == key) || !self->slots[i].key)
+			return &self->slots[i];
+	}
+}
+
@@ -0,0 +1,90 @@
+
+#ifndef SPAWN_HOSTPROF_H_INCLUDED
+#define SPAWN_HOSTPROF_H_INCLUDED 1
+
+#include "ints.h"
+#include "thread.h"
+
+struct alloc;
+
+
+/*
+ * Persistent latency profile of the hosts.
+ *
+ * The profile keeps moving averages of the exec latency and the failure
+ * rate per host across launches so that historically slow hosts can be
+ * placed at the leaves of the tree and spawned first. The file is a
+ * header followed by an open addressing hash table (linear probing) of
+ * fixed size entries keyed by a hash of the host name. It is mapped into
+ * memory as is so loading it does not depend on the number of hosts.
+ * Modifications go to a private copy of the mapping and
+ * host_profile_save() replaces the file atomically.
+ */
+struct host_profile_header
+{
+	char	magic[4];	/* "SPHP" */
+	ui32	version;
+	ui32	nslots;		/* Power of two */
+	ui32	nused;
+	ui64	sumlat;		/* Sum of the latencies of all entries */
+};
+
+struct host_profile_entry
+{
+	ui64	key;		/* Hash of the host name. Zero marks a free
+				 * slot. */
+	ui32	latency;	/* Microseconds */
+	ui16	failrate;	/* Fraction of failed exec operations in
+				 * units of 1/65535. */
+	ui16	nsamples;	/* Saturates */
+};
+
+#define HOST_PROFILE_VERSION	1
+
+struct host_profile
+{
+	struct alloc			*alloc;
+	char				*path;
+
+	/* Protects the table since the worker threads update it while
+	 * the main thread looks up hosts.
+	 */
+	struct lock			lock;
+
+	struct host_profile_header	*hdr;
+	struct host_profile_entry	*slots;	/* Follow the header */
+	ll				size;	/* Header plus table */
+	int				mapped;	/* hdr is a mapping of
+						 * the file rather than
+						 * allocated memory. */
+	int				dirty;
+};
+
+/*
+ * Load the profile from path. A missing file results in an empty
+ * profile, an invalid one is ignored with a warning.
+ */
+int host_profile_ctor(struct host_profile *self, struct alloc *alloc,
+                      const char *path);
+int host_profile_dtor(struct host_profile *self);
+
+/*
+ * Expected time in microseconds needed to spawn a process on host
+ * including retries of failed attempts. Hosts without history get the
+ * mean of the known hosts and zero is returned for an empty profile.
+ */
+ll host_profile_expected_latency(struct host_profile *self, const char *host);
+
+/*
+ * Add the outcome of an exec operation on host to the moving averages.
+ */
+int host_profile_update(struct host_profile *self, const char *host,
+                        ll latency, int failed);
+
+/*
+ * Write the profile back to the file if it was updated.
+ */
+int host_profile_save(struct host_profile *self);
+
+#endif
+
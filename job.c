@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 #include <unistd.h>
@@ -20,22 +21,60 @@
 #include "protocol.h"
 #include "helper.h"
 #include "task.h"
+#include "hostlist.h"
+#include "hostprof.h"
+#include "control.h"
+
+
+/*
+ * Microseconds after which a child which did not connect back is
+ * considered lost.
+ */
+#define BUILD_TREE_TIMEOUT	(60*1000000LL)
+
+
+/*
+ * Host or tree position together with its sort key
+ * (see _build_tree_place_hosts()).
+ */
+struct _rank
+{
+	ll	key;
+	int	tie;	/* Secondary key */
+	int	i;
+};
 
 
 static int _job_build_tree_ctor(struct job_build_tree *self, struct alloc* alloc,
-                                struct spawn *spawn, int nhosts, int *hosts);
+                                struct spawn *spawn,
+                                const struct message_request_build_tree *req);
 static int _job_build_tree_dtor(struct job_build_tree *self);
 static int _free_job_build_tree(struct alloc *alloc, struct job_build_tree **self);
+static int _build_tree_choose_layout(struct job_build_tree *self, struct spawn *spawn);
+static int _build_tree_read_cost_model(struct job_build_tree *self, struct spawn *spawn);
+static void _build_tree_calibrate(struct job_build_tree *self);
+static int _build_tree_place_hosts(struct job_build_tree *self, struct spawn *spawn);
+static int _compare_ranks(const void *a, const void *b);
+static int _compare_lls(const void *a, const void *b);
+static int _compare_children(const void *a, const void *b);
+static int _build_tree_order_children(struct job_build_tree *self, int first, int n,
+                                      struct job_build_tree_child **order);
 static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed);
+static int _build_tree_resolve(struct job_build_tree *self, struct spawn *spawn);
 static int _build_tree_listen(struct job_build_tree *self, struct spawn *spawn);
 static int _open_listenfds(struct job_build_tree *self, struct spawn *spawn,
                            int fds[NETWORK_MAX_LISTENFDS], int *nfds);
 static int _create_socket_and_bind(struct sockaddr *addr, ull addrlen, int *fd);
 static int _listen_listenfds(struct job_build_tree *self, struct spawn *spawn,
                              int *fds, int nfds);
-static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn *spawn);
+static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn *spawn,
+                                      int first, int n);
+static int _build_tree_read_straggler_options(struct job_build_tree *self,
+                                              struct spawn *spawn);
+static int _build_tree_stragglers(struct job_build_tree *self, struct spawn *spawn);
+static int _build_tree_adopt(struct job_build_tree *self, struct spawn *spawn, int i);
 static int _send_request_build_tree_message(struct job_build_tree *self, struct spawn *spawn,
-                                            int dest, int nhosts, si32 *hosts);
+                                            int dest, int first, int nhosts);
 static int _send_response_build_tree_message(struct job_build_tree *self, struct spawn *spawn);
 static int _job_task_ctor(struct job_task *self, struct alloc *alloc,
                           const char *path, int argc, char **argv,
@@ -46,19 +85,22 @@ static int _task_work(struct job *job, struct spawn *spawn, int *completed);
 static int _task_send_request(struct spawn *spawn, const char *path,
                               int argc, char **argv,
                               ui16 channel);
-static int _task_send_response(struct spawn *spawn, int ret);
+static int _task_send_response(struct spawn *spawn, ui16 channel, int ret);
+static int _task_flush_early(struct job_task *self);
+static int _task_drop_early(struct job_task *self, struct spawn *spawn);
 static int _job_exit_ctor(struct job_exit *self, struct alloc *alloc,
                           const struct timespec *timeout);
 static int _job_exit_dtor(struct job_exit *self);
 static int _free_job_exit(struct alloc *alloc, struct job_exit **self);
 static int _exit_work(struct job *job, struct spawn *spawn, int *completed);
 static int _exit_send_request(struct spawn *spawn);
-static int _exit_send_response(struct spawn *spawn);
+static int _exit_send_response(struct spawn *spawn, struct alloc_profile *profile);
 static int _prepare_task_job(struct spawn *spawn);
 
 
 int alloc_job_build_tree(struct alloc *alloc, struct spawn *spawn,
-                         int nhosts, int *hosts, struct job **self)
+                         const struct message_request_build_tree *req,
+                         struct job **self)
 {
 	int err;
 
@@ -70,7 +112,7 @@ int alloc_job_build_tree(struct alloc *alloc, struct spawn *spawn,
 	}
 
 	return _job_build_tree_ctor((struct job_build_tree *)*self, alloc,
-	                             spawn, nhosts, hosts);
+	                             spawn, req);
 }
 
 int alloc_job_task(struct alloc *alloc, const char* path,
@@ -86,162 +128,864 @@ int alloc_job_task(struct alloc *alloc, const char* path,
 		return err;
 	}
 
-	return _job_task_ctor((struct job_task *)*self, alloc, path, argc, argv, channel);
+	return _job_task_ctor((struct job_task *)*self, alloc, path, argc, argv, channel);
+}
+
+int alloc_job_exit(struct alloc *alloc, const struct timespec *timeout,
+                   struct job **self)
+{
+	int err;
+
+	err = ZALLOC(alloc, (void **)self, 1,
+	             sizeof(struct job_exit), "struct job_exit");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	return _job_exit_ctor((struct job_exit *)*self, alloc, timeout);
+}
+
+int alloc_job_task_from_string(struct alloc *alloc, struct spawn *spawn,
+                               const char *plugin, const char *args,
+                               struct job **self)
+{
+	int err, tmp;
+	int n, i, j, argc;
+	char **argv;
+	char *p;
+	ui16 channel;
+
+	/* The channel is only taken once spawn_add_task() registers the
+	 * job. Until then nothing needs to be released on failure.
+	 */
+	err = spawn_comm_resv_channel(spawn, &channel);
+	if (unlikely(err)) {
+		fcallerror("spawn_comm_resv_channel", err);
+		return err;
+	}
+
+	/* TODO A disadvantage of splitting the string ourselves is that
+	 *      it is tricky to be completely bash conforming. For example,
+	 *      the algorithm below will not take quotes into account.
+	 */
+
+	argc = 0;
+	if (likely(args)) {
+		/* Strip initial whitespaces from the string.
+		 */
+		while ((*args) && isspace(*args)) ++args;
+
+		i = 0;
+		while (args[i]) {
+			/* Skip the word. */
+			while (args[i] && (!isspace(args[i]))) ++i;
+			/* Skip whitespaces. */
+			while (args[i] &&   isspace(args[i]) ) ++i;
+
+			if (args[i])
+				++argc;
+		}
+
+		/* Above we counted the number of whitespace holes in
+		 * the string so the number of arguments is that number
+		 * plus one.
+		 */
+		++argc;
+	}
+
+	err = ZALLOC(spawn->alloc, (void **)&argv, (argc + 1), sizeof(char *), "");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	argv[0] = NULL;
+	j = 0;
+	p = NULL;
+	n = 0;
+	if (likely(args)) {
+		err = xstrdup(spawn->alloc, args, &p);
+		if (unlikely(err)) {
+			fcallerror("xstrdup", err);
+			goto fail;
+		}
+
+		n = strlen(p);
+
+		i = 0;
+		while (p[i]) {
+			argv[j++] = &p[i];
+
+			/* skip word */
+			while (p[i] && (!isspace(p[i]))) ++i;
+			/* skip whitespaces */
+			while (p[i] &&   isspace(p[i]) )
+				p[i++] = 0;
+		}
+	}
+
+	err = alloc_job_task(alloc, plugin,
+	                     argc, argv,
+	                     channel, self);
+	if (unlikely(err)) {
+		fcallerror("alloc_job_task", err);
+		goto fail;
+	}
+
+	err = spawn_add_task(spawn, channel, (struct job_task *)*self);
+	if (unlikely(err)) {
+		fcallerror("spawn_add_task", err);
+
+		tmp = free_job(self);
+		if (unlikely(tmp))
+			fcallerror("free_job", tmp);
+	}
+
+fail:
+	if (p) {
+		tmp = ZFREE(spawn->alloc, (void **)&p, (n + 1), sizeof(char), "");
+		if (unlikely(tmp))
+			fcallerror("ZFREE", tmp);
+	}
+
+	tmp = ZFREE(spawn->alloc, (void **)&argv, (argc + 1), sizeof(char *), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
+int free_job(struct job **self)
+{
+	int err;
+
+	switch ((*self)->type) {
+	case JOB_TYPE_BUILD_TREE:
+		err = _free_job_build_tree((*self)->alloc,
+		                           (struct job_build_tree **)self);
+		break;
+	case JOB_TYPE_TASK:
+		err = _free_job_task((*self)->alloc,
+		                     (struct job_task **)self);
+		break;
+	case JOB_TYPE_EXIT:
+		err = _free_job_exit((*self)->alloc,
+		                     (struct job_exit **)self);
+		break;
+	default:
+		error("Unknown job type %d.", (*self)->type);
+		err = -ESOMEFAULT;
+	}
+
+	if (unlikely(err))
+		return err;	/* Error reporting is done in the _free_...(struct alloc *alloc, )
+				 * functions.
+				 */
+
+	return 0;
+}
+
+
+static int _job_build_tree_ctor(struct job_build_tree *self, struct alloc* alloc,
+                                struct spawn *spawn,
+                                const struct message_request_build_tree *req)
+{
+	int err, tmp;
+	int i;
+	int *first;
+
+	self->job.alloc = alloc;
+	self->job.type  = JOB_TYPE_BUILD_TREE;
+	self->job.work  = _build_tree_work;
+
+	list_ctor(&self->job.list);
+
+	err = arena_alloc_ctor(&self->job.arena, alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		return err;
+	}
+
+	self->alloc  = &self->job.arena.base;
+	self->phase  = 1;
+	self->alive  = 0;
+	hostlist_ctor(&self->hosts, self->alloc);
+
+	if (!req) {
+		err = spawn_load_hosts(spawn);
+		if (unlikely(err)) {
+			fcallerror("spawn_load_hosts", err);
+			goto fail;
+		}
+
+		err = hostlist_slice(spawn->hosts, 0, spawn->nhosts, &self->hosts);
+		if (unlikely(err)) {
+			fcallerror("hostlist_slice", err);
+			goto fail;
+		}
+	} else {
+		err = hostlist_parse(&self->hosts, req->hosts);
+		if (unlikely(err)) {
+			fcallerror("hostlist_parse", err);
+			goto fail;
+		}
+	}
+
+	self->nhosts = hostlist_size(&self->hosts);
+
+	err = ZALLOC(self->alloc, (void **)&self->addrs, self->nhosts,
+	             sizeof(ui32), "addrs");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	if (!req) {
+		err = _build_tree_choose_layout(self, spawn);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_choose_layout", err);
+			goto fail;
+		}
+	} else {
+		/* The parent may have resolved the host names already.
+		 */
+		if (req->naddrs == self->nhosts) {
+			memcpy(self->addrs, req->addrs, req->naddrs*sizeof(ui32));
+			self->resolved = 1;
+		}
+
+		self->layout.type  = req->layout;
+		self->layout.width = req->width;
+
+		/* Start with the latency measured by the parent and refine
+		 * the estimate once the own children connected back.
+		 */
+		if (req->latency > 0) {
+			err = _build_tree_read_cost_model(self, spawn);
+			if (unlikely(err)) {
+				fcallerror("_build_tree_read_cost_model", err);
+				goto fail;
+			}
+
+			self->adaptive      = 1;
+			self->model.latency = req->latency;
+		}
+
+		if (req->ngroups > 0) {
+			err = ZALLOC(self->alloc, (void **)&self->groups, req->ngroups,
+			             sizeof(si32), "groups");
+			if (unlikely(err)) {
+				fcallerror("ZALLOC", err);
+				goto fail;
+			}
+
+			memcpy(self->groups, req->groups, req->ngroups*sizeof(si32));
+			self->ngroups = req->ngroups;
+		}
+	}
+
+	/* The spawn order is based on cost estimates in microseconds
+	 * (see _build_tree_order_children()) even if the width is fixed.
+	 */
+	if (!self->adaptive) {
+		err = _build_tree_read_cost_model(self, spawn);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_read_cost_model", err);
+			goto fail;
+		}
+	}
+
+	if (!req && spawn->hostprof &&
+	    (TREE_LAYOUT_TOPOLOGY != self->layout.type)) {
+		err = _build_tree_place_hosts(self, spawn);
+		if (unlikely(err))
+			fcallerror("_build_tree_place_hosts", err);
+			/* Keep the original order.
+			 */
+	}
+
+	err = ZALLOC(self->alloc, (void **)&first,
+	             tree_layout_max_children(&self->layout, self->nhosts) + 1,
+	             sizeof(int), "first");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	err = tree_layout_split(&self->layout, self->nhosts,
+	                        self->groups, self->ngroups,
+	                        first, &self->nchildren);
+	if (unlikely(err)) {
+		fcallerror("tree_layout_split", err);
+		goto fail;
+	}
+
+	log("# children = %d", self->nchildren);
+
+	err = ZALLOC(self->alloc, (void **)&self->children, self->nchildren,
+	             sizeof(struct job_build_tree_child), "children");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	/* The first host of each chunk becomes a child and the rest of the
+	 * chunk its subtree.
+	 */
+	for (i = 0; i < self->nchildren; ++i) {
+		self->children[i].host    = first[i];
+		self->children[i].nhosts  = first[i+1] - first[i] - 1;
+		self->children[i].id      = spawn->tree.here + 1 + first[i];
+		self->children[i].state   = UNBORN;
+		self->children[i].spawned = 0;
+	}
+
+	err = _build_tree_read_straggler_options(self, spawn);
+	if (unlikely(err)) {
+		fcallerror("_build_tree_read_straggler_options", err);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tmp = arena_alloc_dtor(&self->job.arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+
+	return err;
+}
+
+static int _job_build_tree_dtor(struct job_build_tree *self)
+{
+	int err;
+
+	/* Releases hosts and children.
+	 */
+	err = arena_alloc_dtor(&self->job.arena);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_dtor", err);
+		return err;
+	}
+
+	return 0;
+}
+
+static int _free_job_build_tree(struct alloc *alloc, struct job_build_tree **self)
+{
+	int err;
+
+	err = _job_build_tree_dtor(*self);
+	if (unlikely(err))
+		fcallerror("_job_build_tree_dtor", err);
+
+	err = ZFREE(alloc, (void **)self, 1,
+	            sizeof(struct job_build_tree), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Choose the tree layout on the root process based on the 'TreeLayout',
+ * 'TreeWidth' and 'TreeTopologyFile' options. The choice is passed down
+ * the tree with the build tree requests.
+ */
+static int _build_tree_choose_layout(struct job_build_tree *self, struct spawn *spawn)
+{
+	int err;
+	const char *name, *path;
+
+	name = optpool_find_by_key(spawn->opts, "TreeWidth");
+	if (name && (!strcmp(name, "auto"))) {
+		err = _build_tree_read_cost_model(self, spawn);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_read_cost_model", err);
+			return err;
+		}
+
+		/* No measurement is available on the root so the initial
+		 * width is based on the configured latency.
+		 */
+		err = tree_layout_auto_width(&self->model, self->alloc,
+		                             self->nhosts, &self->layout.width);
+		if (unlikely(err)) {
+			fcallerror("tree_layout_auto_width", err);
+			return err;
+		}
+
+		self->adaptive = 1;
+
+		log("Chose tree width %d for %d hosts.", self->layout.width,
+		    self->nhosts);
+	} else {
+		err = optpool_find_by_key_as_int(spawn->opts, "TreeWidth",
+		                                 &self->layout.width);
+		if (unlikely(err)) {
+			fcallerror("optpool_find_by_key_as_int", err);
+			return err;
+		}
+	}
+	if (unlikely(self->layout.width < 1)) {
+		error("Invalid tree width %d.", self->layout.width);
+		return -EINVAL;
+	}
+
+	name = optpool_find_by_key(spawn->opts, "TreeLayout");
+	if (!name)
+		name = "kary";
+
+	err = tree_layout_from_string(name, &self->layout.type);
+	if (unlikely(err))
+		return err;
+
+	if (TREE_LAYOUT_TOPOLOGY != self->layout.type)
+		return 0;
+
+	path = optpool_find_by_key(spawn->opts, "TreeTopologyFile");
+	if (unlikely(!path)) {
+		error("The topology layout requires the 'TreeTopologyFile' option.");
+		return -EINVAL;
+	}
+
+	err = tree_layout_load_topology(self->alloc, path, &self->hosts,
+	                                &self->groups, &self->ngroups);
+	if (unlikely(err)) {
+		fcallerror("tree_layout_load_topology", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the parameters of the cost model used for the adaptive tree width.
+ * The latency is only used by the root process, all other processes use
+ * the latency measured by their parent.
+ */
+static int _build_tree_read_cost_model(struct job_build_tree *self, struct spawn *spawn)
+{
+	int err;
+	int latency, overhead;
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeSpawnLatency", &latency);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeChildOverhead", &overhead);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	err = optpool_find_by_key_as_int(spawn->opts, "ExecFanout",
+	                                 &self->model.concurrency);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	self->model.latency  = latency;
+	self->model.overhead = overhead;
+
+	return 0;
+}
+
+/*
+ * Update the latency of the cost model with the connect back latencies
+ * of the children. The children are spawned by model.concurrency threads
+ * in order so the i-th spawned child waited for i/concurrency spawns
+ * before its own spawn started. The median of the normalized latencies is robust
+ * against single slow hosts.
+ */
+static void _build_tree_calibrate(struct job_build_tree *self)
+{
+	ll x[TREE_LAYOUT_MAX_AUTO_WIDTH];
+	int i, n, c;
+
+	c = MAX(1, self->model.concurrency);
+
+	/* Only the children which connected back so far are taken into
+	 * account since subtrees are built as soon as possible.
+	 */
+	n = 0;
+	for (i = 0; (i < self->nchildren) && (n < TREE_LAYOUT_MAX_AUTO_WIDTH); ++i) {
+		if ((ALIVE <= self->children[i].state) &&
+		    (DEAD  != self->children[i].state))
+			x[n++] = self->children[i].latency/(self->children[i].order/c + 1);
+	}
+
+	if (0 == n)
+		return;
+
+	qsort(x, n, sizeof(ll), _compare_lls);
+
+	self->model.latency = MAX(1, x[n/2]);
+
+	debug("Spawn latency estimate is %lld microsecond(s).", self->model.latency);
+}
+
+static int _build_tree_read_straggler_options(struct job_build_tree *self,
+                                              struct spawn *spawn)
+{
+	int err;
+	int timeout;
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeStragglerPercentile",
+	                                 &self->percentile);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	if ((self->percentile < 0) || (self->percentile > 100)) {
+		error("Invalid value %d for 'TreeStragglerPercentile'.", self->percentile);
+		return -EINVAL;
+	}
+
+	if (0 == self->percentile)
+		return 0;
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeStragglerFactor",
+	                                 &self->factor);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeStragglerTimeout",
+	                                 &timeout);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	self->factor     = MAX(1, self->factor);
+	self->mintimeout = MAX(0, timeout)*1000000LL;
+
+	return 0;
+}
+
+/*
+ * Declare children dead which did not connect back in time. The deadline
+ * is only derived from the percentile once at least half of the children
+ * connected back since the percentile is meaningless otherwise. Until then
+ * BUILD_TREE_TIMEOUT applies. The deadline of the i-th spawned child is
+ * scaled like the latencies in _build_tree_calibrate() and never exceeds
+ * BUILD_TREE_TIMEOUT.
+ */
+static int _build_tree_stragglers(struct job_build_tree *self, struct spawn *spawn)
+{
+	ll x[TREE_LAYOUT_MAX_AUTO_WIDTH];
+	ll now, base, deadline;
+	int err;
+	int i, n, m, w, c, nchildren;
+
+	c = MAX(1, self->model.concurrency);
+
+	n = 0;
+	m = 0;
+	w = 0;
+	for (i = 0; i < self->nchildren; ++i) {
+		if (UNKNOWN == self->children[i].state) {
+			++w;
+		} else if ((ALIVE <= self->children[i].state) &&
+		           (DEAD  != self->children[i].state)) {
+			if (n < TREE_LAYOUT_MAX_AUTO_WIDTH)
+				x[n++] = self->children[i].latency/(self->children[i].order/c + 1);
+			++m;
+		}
+	}
+
+	if (0 == w)
+		return 0;
+
+	/* Without enough samples only the hard timeout applies.
+	 */
+	base = 0;
+	if (2*m >= m + w) {
+		qsort(x, n, sizeof(ll), _compare_lls);
+
+		base = MAX(1, x[MIN(n - 1, (n*self->percentile)/100)]);
+	}
+
+	now = llnow_usecs();
+
+	/* Children appended by _build_tree_adopt() were just spawned.
+	 */
+	nchildren = self->nchildren;
+
+	for (i = 0; i < nchildren; ++i) {
+		if (UNKNOWN != self->children[i].state)
+			continue;
+
+		if (base > 0) {
+			deadline = self->factor*base*(self->children[i].order/c + 1);
+			deadline = MIN(BUILD_TREE_TIMEOUT, MAX(self->mintimeout, deadline));
+		} else {
+			deadline = BUILD_TREE_TIMEOUT;
+		}
+
+		if ((now - self->children[i].spawned) < deadline)
+			continue;
+
+		err = _build_tree_adopt(self, spawn, i);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_adopt", err);
+			return err;
+		}
+	}
+
+	return 0;
 }
 
-int alloc_job_exit(struct alloc *alloc, const struct timespec *timeout,
-                   struct job **self)
+/*
+ * Declare the i-th child dead and split the hosts of its subtree among
+ * new children. Since the subtree covers a contiguous range of participant
+ * ids the new subtrees do so as well and the routes can be set up as for
+ * any other child. If the dead process connects back later it is told to
+ * terminate (see _handle_request_join()).
+ */
+static int _build_tree_adopt(struct job_build_tree *self, struct spawn *spawn, int i)
 {
-	int err;
+	int err, tmp;
+	struct tree_layout layout;
+	struct sockaddr_in conn;
+	int host, nhosts, id;
+	int *first, j, n, m;
+
+	host   = self->children[i].host;
+	nhosts = self->children[i].nhosts;
+	id     = self->children[i].id;
+	conn   = self->children[i].conn;
+
+	if (UNBORN == self->children[i].state)
+		warn("Participant %d could not be spawned. Declaring it dead.", id);
+	else
+		warn("Participant %d did not connect back after %lld millisecond(s). "
+		     "Declaring it dead.", id, (llnow_usecs() - self->children[i].spawned)/1000);
+
+	self->children[i].state = DEAD;
+	self->ndeads += 1;
+
+	if (0 == nhosts)
+		return 0;
 
-	err = ZALLOC(alloc, (void **)self, 1,
-	             sizeof(struct job_exit), "struct job_exit");
+	/* No socket was opened for a child with an unknown address (see
+	 * _open_listenfds()). Its replacements use the one of a sibling.
+	 */
+	for (j = 0; (0 == conn.sin_port) && (j < self->nchildren); ++j)
+		conn = self->children[j].conn;
+
+	/* The host groups of the topology layout are not tracked for the
+	 * adopted hosts.
+	 */
+	layout = self->layout;
+	if (TREE_LAYOUT_TOPOLOGY == layout.type)
+		layout.type = TREE_LAYOUT_KARY;
+
+	m = tree_layout_max_children(&layout, nhosts);
+
+	err = ZALLOC(self->alloc, (void **)&first, m + 1, sizeof(int), "first");
 	if (unlikely(err)) {
 		fcallerror("ZALLOC", err);
 		return err;
 	}
 
-	return _job_exit_ctor((struct job_exit *)*self, alloc, timeout);
-}
+	err = tree_layout_split(&layout, nhosts, NULL, 0, first, &n);
+	if (unlikely(err)) {
+		fcallerror("tree_layout_split", err);
+		goto fail;
+	}
 
-int free_job(struct job **self)
-{
-	int err;
+	err = ZREALLOC(self->alloc, (void **)&self->children,
+	               self->nchildren, sizeof(struct job_build_tree_child),
+	               self->nchildren + n, sizeof(struct job_build_tree_child),
+	               "children");
+	if (unlikely(err)) {
+		fcallerror("ZREALLOC", err);
+		goto fail;
+	}
 
-	switch ((*self)->type) {
-	case JOB_TYPE_BUILD_TREE:
-		err = _free_job_build_tree((*self)->alloc,
-		                           (struct job_build_tree **)self);
-		break;
-	case JOB_TYPE_TASK:
-		err = _free_job_task((*self)->alloc,
-		                     (struct job_task **)self);
-		break;
-	case JOB_TYPE_EXIT:
-		err = _free_job_exit((*self)->alloc,
-		                     (struct job_exit **)self);
-		break;
-	default:
-		error("Unknown job type %d.", (*self)->type);
-		err = -ESOMEFAULT;
+	/* The new children connect back to the same listening socket as
+	 * the dead child.
+	 */
+	for (j = 0; j < n; ++j) {
+		struct job_build_tree_child *child = &self->children[self->nchildren + j];
+
+		child->host    = host + 1 + first[j];
+		child->nhosts  = first[j+1] - first[j] - 1;
+		child->id      = spawn->tree.here + 1 + child->host;
+		child->conn    = conn;
+		child->state   = UNBORN;
+		child->spawned = 0;
 	}
 
+	log("Splitting the %d host(s) below participant %d among %d new "
+	    "children.", nhosts, id, n);
+
+	self->nchildren += n;
+
+	err = _build_tree_spawn_children(self, spawn, self->nchildren - n, n);
 	if (unlikely(err))
-		return err;	/* Error reporting is done in the _free_...(struct alloc *alloc, )
-				 * functions.
-				 */
+		fcallerror("_build_tree_spawn_children", err);
 
-	return 0;
-}
+fail:
+	tmp = ZFREE(self->alloc, (void **)&first, m + 1, sizeof(int), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
 
+	return err;
+}
 
-static int _job_build_tree_ctor(struct job_build_tree *self, struct alloc* alloc,
-                                struct spawn *spawn, int nhosts, int *hosts)
+/*
+ * Assign the hosts to the positions in the tree according to their
+ * expected spawn latency in the host profile. The fastest hosts root the
+ * largest subtrees and the slowest ones become leaves where their delay
+ * does not hold up other spawns. The subtree sizes assume that all
+ * processes use the layout of the root which does not hold exactly if
+ * the width is chosen adaptively. Note that this permutes the mapping
+ * from participant ids to hosts.
+ */
+static int _build_tree_place_hosts(struct job_build_tree *self, struct spawn *spawn)
 {
 	int err, tmp;
-	int i, quot;
-	int treewidth;
+	struct _rank *hosts, *positions;
+	struct hostlist placed, old;
+	int *sizes, *which;
+	char host[HOST_NAME_MAX];
+	int i, k, n, moved;
 
-	err = optpool_find_by_key_as_int(spawn->opts, "TreeWidth", &treewidth);
+	n = self->nhosts;
+
+	err = ZALLOC(self->alloc, (void **)&hosts, n, sizeof(struct _rank), "hosts");
 	if (unlikely(err)) {
-		fcallerror("optpool_find_by_key_as_int", err);
-		die();	/* Very unlikely. */
+		fcallerror("ZALLOC", err);
+		return err;
 	}
 
-	self->job.alloc = alloc;
-	self->job.type  = JOB_TYPE_BUILD_TREE;
-	self->job.work  = _build_tree_work;
-
-	list_ctor(&self->job.list);
-
-	self->alloc  = alloc;
-	self->phase  = 1;
-	self->nhosts = nhosts;
+	err = ZALLOC(self->alloc, (void **)&positions, n, sizeof(struct _rank), "positions");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail1;
+	}
 
-	err = ZALLOC(alloc, (void **)&self->hosts,
-	             self->nhosts, sizeof(int), "hosts");
+	err = ZALLOC(self->alloc, (void **)&sizes, n, sizeof(int), "sizes");
 	if (unlikely(err)) {
 		fcallerror("ZALLOC", err);
-		return err;
+		goto fail2;
 	}
 
-	if ((spawn->nhosts == nhosts)) {
-		for (i = 0; i < self->nhosts; ++i)
-			self->hosts[i] = i;
-	} else {
-		memcpy(self->hosts, hosts, self->nhosts*sizeof(int));
+	err = tree_layout_subtree_sizes(&self->layout, self->alloc, n, sizes);
+	if (unlikely(err)) {
+		fcallerror("tree_layout_subtree_sizes", err);
+		goto fail3;
 	}
 
-	self->nchildren = MIN(treewidth, self->nhosts);
-	quot = self->nhosts/self->nchildren;
+	for (i = 0; i < n; ++i) {
+		err = hostlist_get(&self->hosts, i, host, sizeof(host));
+		if (unlikely(err)) {
+			fcallerror("hostlist_get", err);
+			goto fail3;
+		}
 
-	log("# children = %d", self->nchildren);
+		hosts[i].key     = host_profile_expected_latency(spawn->hostprof, host);
+		hosts[i].i       = i;
+		positions[i].key = -sizes[i];
+		positions[i].tie = i;
+		positions[i].i   = i;
+	}
 
-	err = ZALLOC(alloc, (void **)&self->children, self->nchildren,
-	             sizeof(struct job_build_tree_child), "children");
-	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
-		goto fail;
+	qsort(positions, n, sizeof(struct _rank), _compare_ranks);
+
+	/* Hosts with the same expected latency keep their order of
+	 * positions so that nothing moves without history.
+	 */
+	for (i = 0; i < n; ++i)
+		hosts[positions[i].i].tie = i;
+
+	qsort(hosts, n, sizeof(struct _rank), _compare_ranks);
+
+	/* sizes is reused to hold the host at each position.
+	 */
+	which = sizes;
+	moved = 0;
+	for (i = 0; i < n; ++i) {
+		which[positions[i].i] = hosts[i].i;
+		moved += (positions[i].i != hosts[i].i);
 	}
 
-	for (i = 0; i < self->nchildren; ++i) {
-		self->children[i].host    = quot*i;
-		self->children[i].nhosts  = quot - 1;
-		self->children[i].id      = spawn->tree.here + 1 + quot*i;
-		self->children[i].state   = UNBORN;
-		self->children[i].spawned = 0;
+	if (0 == moved)
+		goto fail3;
+
+	/* The permuted list is assembled from slices of the old one so it
+	 * stays compressed. Runs of consecutive hosts are copied at once.
+	 * The old list is kept if anything fails.
+	 */
+	hostlist_ctor(&placed, self->alloc);
+
+	for (i = 0; i < n; i += k) {
+		for (k = 1; (i + k < n) && (which[i+k] == which[i] + k); ++k)
+			;
+
+		err = hostlist_slice(&self->hosts, which[i], k, &placed);
+		if (unlikely(err)) {
+			fcallerror("hostlist_slice", err);
+			goto fail4;
+		}
 	}
 
-	self->children[self->nchildren-1].nhosts =
-		self->nhosts - (self->children[self->nchildren-1].host + 1);
+	/* placed takes the old list which is freed below.
+	 */
+	old         = self->hosts;
+	self->hosts = placed;
+	placed      = old;
 
-	return 0;
+	log("Moved %d of %d host(s) according to the host profile.", moved, n);
 
-fail:
-	tmp = ZFREE(alloc, (void **)&self->hosts, self->nhosts, sizeof(int), "");
+fail4:
+	tmp = hostlist_dtor(&placed);
+	if (unlikely(tmp))
+		fcallerror("hostlist_dtor", tmp);
+fail3:
+	tmp = ZFREE(self->alloc, (void **)&sizes, n, sizeof(int), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+fail2:
+	tmp = ZFREE(self->alloc, (void **)&positions, n, sizeof(struct _rank), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+fail1:
+	tmp = ZFREE(self->alloc, (void **)&hosts, n, sizeof(struct _rank), "");
 	if (unlikely(tmp))
 		fcallerror("ZFREE", tmp);
 
 	return err;
 }
 
-static int _job_build_tree_dtor(struct job_build_tree *self)
+static int _compare_ranks(const void *a, const void *b)
 {
-	int err;
-
-	err = ZFREE(self->alloc, (void **)&self->children, self->nchildren,
-	            sizeof(struct job_build_tree_child), "");
-	if (unlikely(err)) {
-		fcallerror("ZFREE", err);
-		return err;
-	}
+	const struct _rank *x = a;
+	const struct _rank *y = b;
 
-	err = ZFREE(self->alloc, (void **)&self->hosts,
-	            self->nhosts, sizeof(int), "");
-	if (unlikely(err)) {
-		fcallerror("ZFREE", err);
-		return err;
-	}
+	if (x->key != y->key)
+		return (x->key > y->key) - (x->key < y->key);
 
-	return 0;
+	return (x->tie > y->tie) - (x->tie < y->tie);
 }
 
-static int _free_job_build_tree(struct alloc *alloc, struct job_build_tree **self)
+static int _compare_lls(const void *a, const void *b)
 {
-	int err;
-
-	err = _job_build_tree_dtor(*self);
-	if (unlikely(err))
-		fcallerror("_job_build_tree_dtor", err);
-
-	err = ZFREE(alloc, (void **)self, 1,
-	            sizeof(struct job_build_tree), "");
-	if (unlikely(err)) {
-		fcallerror("ZFREE", err);
-		return err;
-	}
+	ll x = *(const ll *)a;
+	ll y = *(const ll *)b;
 
-	return 0;
+	return (x > y) - (x < y);
 }
 
 static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed)
@@ -254,6 +998,12 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 	if (1 == self->phase) {
 		self->start = llnow();
 
+		err = _build_tree_resolve(self, spawn);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_resolve", err);
+			die();	/* FIXME */
+		}
+
 		err = _build_tree_listen(self, spawn);
 		if (unlikely(err)) {
 			fcallerror("_build_tree_listen", err);
@@ -271,7 +1021,7 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 			}
 		}
 
-		err = _build_tree_spawn_children(self, spawn);
+		err = _build_tree_spawn_children(self, spawn, 0, self->nchildren);
 		if (unlikely(err)) {
 			fcallerror("_build_tree_spawn_children", err);
 			die();	/* FIXME */
@@ -281,61 +1031,84 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 	}
 
 	/* Phase 2: Wait for children to connect back and send out
-	 *          BUILD_TREE commands.
+	 *          BUILD_TREE commands. The subtree of a child is built
+	 *          as soon as the child connected back so that a slow
+	 *          sibling does not delay it. The phase ends once all
+	 *          children reported completion or are dead.
+	 *
+	 *          Only completion of the whole subtree is reported to
+	 *          the parent. Since no level waits for the slowest
+	 *          sibling before descending the build time already
+	 *          follows the deepest path of the tree. Nothing above
+	 *          could use a partially built subtree (the route of a
+	 *          child covers its whole subtree and tasks start on
+	 *          all participants) so partial reports would only add
+	 *          messages per level.
 	 */
 	if (2 == self->phase) {
-		int i, k;
+		int i, k, n, d;
+
+		if (self->percentile > 0) {
+			err = _build_tree_stragglers(self, spawn);
+			if (unlikely(err)) {
+				fcallerror("_build_tree_stragglers", err);
+				die();	/* FIXME */
+			}
+		}
 
 		k = 0;
+		n = 0;
+		d = 0;
 		for (i = 0; i < self->nchildren; ++i) {
-			if ((UNBORN  == self->children[i].state) ||
+			/* Stragglers are declared dead and adopted by
+			 * _build_tree_stragglers() instead.
+			 */
+			if ((0 == self->percentile) &&
 			    (UNKNOWN == self->children[i].state)) {
 				/* FIXME Variable timeout value
 				 */
-				if (unlikely((llnow() - self->children[i].spawned) > 60)) {
+				if (unlikely((llnow_usecs() - self->children[i].spawned) > BUILD_TREE_TIMEOUT)) {
 					error("Child %d did not connect back.", i);
 					die(); /* FIXME */
 				}
 			}
 
-			/* FIXME Include DEAD children */
-			k += (ALIVE == self->children[i].state);
-		}
-
-		if (k == self->nchildren) {
-			log("All children are alive after %lld second(s).", llnow() - self->start);
-
-			for (i = 0; i < self->nchildren; ++i) {
+			if (ALIVE == self->children[i].state) {
 				if (0 == self->children[i].nhosts) {
 					self->children[i].state = READY;
-					continue;
-				}
-
-				err = _send_request_build_tree_message(self, spawn,
-				                                       self->children[i].id,
-				                                       self->children[i].nhosts,
-				                                       self->hosts + self->children[i].host + 1);
-				if (unlikely(err)) {
-					fcallerror("_send_request_build_tree_message", err);
-					die();	/* FIXME */
+				} else {
+					if (self->adaptive)
+						_build_tree_calibrate(self);
+
+					err = _send_request_build_tree_message(self, spawn,
+					                                       self->children[i].id,
+					                                       self->children[i].host + 1,
+					                                       self->children[i].nhosts);
+					if (unlikely(err)) {
+						fcallerror("_send_request_build_tree_message", err);
+						die();	/* FIXME */
+					}
+
+					self->children[i].state = BUILDING;
 				}
 			}
 
-			self->phase = 3;
+			n += (ALIVE <= self->children[i].state) &&
+			     (DEAD  != self->children[i].state);
+			k += (READY == self->children[i].state);
+			d += (DEAD  == self->children[i].state);
 		}
-	}
 
-	/* Phase 3: Wait for all children to report completion
-	 */
-	if (3 == self->phase) {
-		int i, k;
+		if ((n + d == self->nchildren) && !self->alive) {
+			log("All children are alive after %lld second(s).", llnow() - self->start);
 
-		k = 0;
-		for (i = 0; i < self->nchildren; ++i) {
-			k += (READY == self->children[i].state);
+			self->alive = 1;
 		}
 
-		if (k == self->nchildren) {
+		if (k + d == self->nchildren) {
+			if (unlikely(self->ndeads > 0) && (0 == spawn->tree.here))
+				warn("%d host(s) are dead.", self->ndeads);
+
 			err = _send_response_build_tree_message(self, spawn);
 			if (unlikely(err)) {
 				fcallerror("_send_response_build_tree_message", err);
@@ -347,13 +1120,25 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 	}
 
 	if (*completed) {
-		if (0 == spawn->tree.here) {
+		/* The spawn operations of dead participants may still be
+		 * running and stopping the pool would wait for them. The
+		 * threads terminate with the process instead.
+		 */
+		if ((0 == spawn->tree.here) && (0 == self->ndeads)) {
 			err = exec_worker_pool_stop(spawn->wkpool);
 			if (unlikely(err))
 				fcallerror("exec_worker_pool_stop", err);
 				/* Still possible to go on.
 				 */
+		}
 
+		if ((0 == spawn->tree.here) && spawn->hostprof) {
+			err = host_profile_save(spawn->hostprof);
+			if (unlikely(err))
+				fcallerror("host_profile_save", err);
+		}
+
+		if (0 == spawn->tree.here) {
 			err = _prepare_task_job(spawn);
 			if (unlikely(err))
 				fcallerror("_prepare_task_job", err);
@@ -361,7 +1146,7 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 				 */
 		}
 
-		network_debug_print_lft(&spawn->tree);
+		network_debug_print_routes(&spawn->tree);
 
 		log("Finished building the tree after %lld second(s).", llnow() - self->start);
 	}
@@ -369,6 +1154,104 @@ static int _build_tree_work(struct job *job, struct spawn *spawn, int *completed
 	return 0;
 }
 
+/*
+ * Resolve the host names of the children in one batch. If TreeResolveAhead
+ * is set the whole subtree is resolved at once such that the addresses can
+ * be passed down the tree and no other process needs to resolve names.
+ */
+static int _build_tree_resolve(struct job_build_tree *self, struct spawn *spawn)
+{
+	int err, tmp;
+	int ahead, nthreads;
+	int i, k, n;
+	int *which;
+	const char **names;
+	ui32 *addrs;
+	char host[HOST_NAME_MAX];
+	struct arena_alloc arena;
+
+	err = optpool_find_by_key_as_int(spawn->opts, "TreeResolveAhead", &ahead);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		ahead = 0;
+	}
+
+	err = optpool_find_by_key_as_int(spawn->opts, "HostResolveThreads", &nthreads);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		nthreads = 1;
+	}
+
+	n = (ahead) ? self->nhosts : self->nchildren;
+
+	err = arena_alloc_ctor(&arena, spawn->alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		return err;
+	}
+
+	err = ZALLOC(&arena.base, (void **)&which, n, sizeof(int), "which");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	err = ZALLOC(&arena.base, (void **)&names, n, sizeof(char *), "names");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	err = ZALLOC(&arena.base, (void **)&addrs, n, sizeof(ui32), "addrs");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	k = 0;
+	for (i = 0; i < n; ++i) {
+		which[k] = (ahead) ? i : self->children[i].host;
+
+		if (self->addrs[which[k]])
+			continue;
+
+		/* The address stays unknown. _build_tree_spawn_children()
+		 * declares the participant dead.
+		 */
+		err = hostlist_get(&self->hosts, which[k], host, sizeof(host));
+		if (unlikely(err)) {
+			fcallerror("hostlist_get", err);
+			continue;
+		}
+
+		err = xstrdup(&arena.base, host, (char **)&names[k]);
+		if (unlikely(err)) {
+			fcallerror("xstrdup", err);
+			goto fail;
+		}
+
+		++k;
+	}
+
+	err = hostinfo_resolve(&spawn->hostinfo, k, names, addrs, nthreads);
+	if (unlikely(err)) {
+		fcallerror("hostinfo_resolve", err);
+		goto fail;
+	}
+
+	for (i = 0; i < k; ++i)
+		self->addrs[which[i]] = addrs[i];
+
+	self->resolved |= ahead;
+
+fail:
+	tmp = arena_alloc_dtor(&arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+
+	return err;
+}
+
 static int _build_tree_listen(struct job_build_tree *self, struct spawn *spawn)
 {
 	int err;
@@ -420,7 +1303,7 @@ static int _open_listenfds(struct job_build_tree *self, struct spawn *spawn,
 {
 	int err;
 	int i, j, k;
-	const char *host;
+	struct sockaddr_in addr;
 	struct ipv4interface *ifaces[NETWORK_MAX_LISTENFDS];
 	struct ipv4interface *iface;
 	ui32 ip, port;
@@ -429,11 +1312,18 @@ static int _open_listenfds(struct job_build_tree *self, struct spawn *spawn,
 
 	k = 0;
 	for (i = 0; i < self->nchildren; ++i) {
-		host = spawn->hosts[self->hosts[self->children[i].host]];
+		if (unlikely(0 == self->addrs[self->children[i].host])) {
+			error("Address of child %d is unknown.", i);
+			continue;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family      = AF_INET;
+		addr.sin_addr.s_addr = self->addrs[self->children[i].host];
 
-		err = map_hostname_to_interface(&spawn->hostinfo, host, &iface);
+		err = map_address_to_interface(&spawn->hostinfo, &addr, &iface);
 		if (unlikely(err)) {
-			fcallerror("map_hostname_to_interface", err);
+			fcallerror("map_address_to_interface", err);
 			continue;
 		}
 
@@ -516,10 +1406,58 @@ static int _listen_listenfds(struct job_build_tree *self, struct spawn *spawn,
 	return 0;
 }
 
-static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn *spawn)
+/*
+ * Children with a larger subtree cost come first. Ties are broken by the
+ * position in the host list.
+ */
+static int _compare_children(const void *a, const void *b)
 {
-	int err;
-	int i, n;
+	const struct job_build_tree_child *x = *(struct job_build_tree_child *const *)a;
+	const struct job_build_tree_child *y = *(struct job_build_tree_child *const *)b;
+
+	if (x->cost != y->cost)
+		return (x->cost < y->cost) - (x->cost > y->cost);
+
+	return (x->host > y->host) - (x->host < y->host);
+}
+
+/*
+ * Estimate the time needed to build the subtree of the children first,
+ * ..., first + n - 1 and sort them by it. The spawn requests are sent and
+ * served (see struct exec_worker_pool) in this order so that the children
+ * on the critical path of the tree start first. Without a calibrated cost
+ * model the estimate is based on the configured latency and the shape of
+ * the subtrees.
+ */
+static int _build_tree_order_children(struct job_build_tree *self, int first, int n,
+                                      struct job_build_tree_child **order)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		order[i] = &self->children[first + i];
+		order[i]->cost = tree_layout_build_cost(&self->layout, &self->model,
+		                                        order[i]->nhosts);
+	}
+
+	qsort(order, n, sizeof(struct job_build_tree_child *),
+	      _compare_children);
+
+	for (i = 0; i < n; ++i)
+		order[i]->order = i;
+
+	return 0;
+}
+
+/*
+ * Send the spawn requests for the children first, ..., first + n - 1.
+ */
+static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn *spawn,
+                                      int first, int n)
+{
+	int err, tmp;
+	int i;
+	struct job_build_tree_child **order, *child;
 	struct message_header       header;
 	struct message_request_exec msg;
 	char host[HOST_NAME_MAX];
@@ -542,31 +1480,51 @@ static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn
 	header.type  = MESSAGE_TYPE_REQUEST_EXEC;
 
 	msg.host = host;
+	msg.argc = ARRAYLEN(argv) - 1;
 	msg.argv = argv;
 
+	err = ZALLOC(self->alloc, (void **)&order, n,
+	             sizeof(struct job_build_tree_child *), "order");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	err = _build_tree_order_children(self, first, n, order);
+	if (unlikely(err)) {
+		fcallerror("_build_tree_order_children", err);
+		goto fail;
+	}
+
 	/* TODO It is really a waste of bandwidth to send a single message per spawn request.
 	 *	We should rather extend the MESSAGE_TYPE_EXEC to support spawning multiple
 	 *      processes at once.
 	 */
 
-	for (i = 0; i < self->nchildren; ++i) {
-		/* FIXME Capture errors from those snprintf()s! */
+	for (i = 0; i < n; ++i) {
+		child = order[i];
 
-		n = snprintf(host, sizeof(host), "%s",
-		            spawn->hosts[self->hosts[self->children[i].host]]);
-		if (unlikely(n == sizeof(host))) {
-			error("Hostname truncated");
+		/* The child stays UNBORN and is declared dead below.
+		 */
+		err = hostlist_get(&self->hosts, child->host,
+		                   host, sizeof(host));
+		if (unlikely(err)) {
+			fcallerror("hostlist_get", err);
+			error("Cannot expand the host name of participant %d.", child->id);
 			continue;
 		}
 
-		snprintf(argv1, sizeof(argv1), "%s", inet_ntoa(self->children[i].conn.sin_addr));
-		snprintf(argv2, sizeof(argv2), "%d", (int )self->children[i].conn.sin_port);
+		snprintf(argv1, sizeof(argv1), "%s", inet_ntoa(child->conn.sin_addr));
+		snprintf(argv2, sizeof(argv2), "%d", (int )child->conn.sin_port);
 
 		snprintf(argv3, sizeof(argv3), "%d", spawn->tree.here);	/* my participant id */
 		snprintf(argv4, sizeof(argv4), "%d", spawn->nhosts);	/* number of hosts */
-		snprintf(argv5, sizeof(argv5), "%d", self->children[i].id);
+		snprintf(argv5, sizeof(argv5), "%d", child->id);
 
-		debug("'%s' '%s' '%s' '%s' '%s'", argv1, argv2, argv3, argv4, argv5);
+		debug("'%s' '%s' '%s' '%s' '%s' (cost %lld)", argv1, argv2, argv3,
+		      argv4, argv5, child->cost);
+
+		msg.cost = child->cost;
 
 		err = spawn_send_message(spawn, &header, (void *)&msg);
 		if (unlikely(err))
@@ -574,19 +1532,48 @@ static int _build_tree_spawn_children(struct job_build_tree *self, struct spawn
 								 * as down later when we do not hear back
 								 */
 
-		self->children[i].spawned = llnow();
-		self->children[i].state   = UNKNOWN;
+		child->spawned = llnow_usecs();
+		child->state   = UNKNOWN;
+	}
+
+	err = 0;
+
+fail:
+	tmp = ZFREE(self->alloc, (void **)&order, n,
+	            sizeof(struct job_build_tree_child *), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	if (unlikely(err))
+		return err;
+
+	/* Children which could not be spawned are adopted like stragglers.
+	 * This appends to the children array so order is gone by now.
+	 */
+	for (i = first; i < first + n; ++i) {
+		if (UNBORN != self->children[i].state)
+			continue;
+
+		err = _build_tree_adopt(self, spawn, i);
+		if (unlikely(err)) {
+			fcallerror("_build_tree_adopt", err);
+			return err;
+		}
 	}
 
 	return 0;
 }
 
 static int _send_request_build_tree_message(struct job_build_tree *self, struct spawn *spawn,
-                                            int dest, int nhosts, si32 *hosts)
+                                            int dest, int first, int nhosts)
 {
-	int err;
+	int err, tmp;
 	struct message_header             header;
 	struct message_request_build_tree msg;
+	struct hostlist                   hosts;
+	si32                              *groups;
+	int                               ngroups;
+	int                               width;
 
 	memset(&header, 0, sizeof(header));
 	memset(&msg   , 0, sizeof(msg));
@@ -596,16 +1583,92 @@ static int _send_request_build_tree_message(struct job_build_tree *self, struct
 	header.flags = MESSAGE_FLAG_UCAST;
 	header.type  = MESSAGE_TYPE_REQUEST_BUILD_TREE;
 
-	msg.nhosts = nhosts;
-	msg.hosts  = hosts;
+	/* The host names of the subtree are sent as a host list expression
+	 * which is usually much shorter than the expanded list.
+	 */
+	hostlist_ctor(&hosts, self->alloc);
 
-	err = spawn_send_message(spawn, &header, (void *)&msg);
+	err = hostlist_slice(&self->hosts, first, nhosts, &hosts);
+	if (unlikely(err)) {
+		fcallerror("hostlist_slice", err);
+		goto fail;
+	}
+
+	err = hostlist_format(&hosts, (char **)&msg.hosts);
 	if (unlikely(err)) {
+		fcallerror("hostlist_format", err);
+		goto fail;
+	}
+
+	/* Pass the addresses down so that the child does not need to
+	 * resolve the names again.
+	 */
+	if (self->resolved) {
+		msg.naddrs = nhosts;
+		msg.addrs  = self->addrs + first;
+	}
+
+	msg.layout = self->layout.type;
+	msg.width  = self->layout.width;
+
+	groups = NULL;
+
+	/* The width of the subtree is chosen with the calibrated model.
+	 */
+	if (self->adaptive) {
+		err = tree_layout_auto_width(&self->model, self->alloc,
+		                             nhosts, &width);
+		if (unlikely(err)) {
+			fcallerror("tree_layout_auto_width", err);
+			goto fail2;
+		}
+
+		msg.width   = width;
+		msg.latency = self->model.latency;
+	}
+
+	if (self->ngroups > 0) {
+		err = ZALLOC(self->alloc, (void **)&groups, self->ngroups + 1,
+		             sizeof(si32), "groups");
+		if (unlikely(err)) {
+			fcallerror("ZALLOC", err);
+			goto fail2;
+		}
+
+		err = tree_layout_slice_groups(self->groups, self->ngroups,
+		                               first, first + nhosts,
+		                               groups, &ngroups);
+		if (unlikely(err)) {
+			fcallerror("tree_layout_slice_groups", err);
+			goto fail2;
+		}
+
+		msg.ngroups = ngroups;
+		msg.groups  = groups;
+	}
+
+	err = spawn_send_message(spawn, &header, (void *)&msg);
+	if (unlikely(err))
 		fcallerror("spawn_send_message", err);
-		return err;
+
+fail2:
+	if (groups) {
+		tmp = ZFREE(self->alloc, (void **)&groups, self->ngroups + 1,
+		            sizeof(si32), "");
+		if (unlikely(tmp))
+			fcallerror("ZFREE", tmp);
 	}
 
-	return 0;
+	tmp = strfree(self->alloc, (char **)&msg.hosts);
+	if (unlikely(tmp))
+		fcallerror("strfree", tmp);
+
+fail:
+	tmp = hostlist_dtor(&hosts);
+	if (unlikely(tmp))
+		fcallerror("hostlist_dtor", tmp);
+
+	return err;
 }
 
 static int _send_response_build_tree_message(struct job_build_tree *self, struct spawn *spawn)
@@ -625,7 +1688,7 @@ static int _send_response_build_tree_message(struct job_build_tree *self, struct
 	header.flags = MESSAGE_FLAG_UCAST;
 	header.type  = MESSAGE_TYPE_RESPONSE_BUILD_TREE;
 
-	msg.deads = 0;	/* FIXME */
+	msg.deads = self->ndeads;
 
 	err = spawn_send_message(spawn, &header, (void *)&msg);
 	if (unlikely(err)) {
@@ -640,49 +1703,61 @@ static int _job_task_ctor(struct job_task *self, struct alloc *alloc,
                           const char *path, int argc, char **argv,
                           ui16 channel)
 {
-	int err;
+	int err, tmp;
 
 	self->job.alloc = alloc;
 	self->job.type  = JOB_TYPE_TASK;
 	self->job.work  = _task_work;
 
-	err = xstrdup(alloc, path, &self->path);
+	err = arena_alloc_ctor(&self->job.arena, alloc, 0);
 	if (unlikely(err)) {
-		fcallerror("xstrdup", err);
+		fcallerror("arena_alloc_ctor", err);
 		return err;
 	}
 
+	err = xstrdup(&self->job.arena.base, path, &self->path);
+	if (unlikely(err)) {
+		fcallerror("xstrdup", err);
+		goto fail;
+	}
+
 	self->channel = channel;
 	self->argc    = argc;
 	self->task    = NULL;
 	self->phase   = 1;
 	self->acks    = 0;
+	self->ret     = 0;
+	self->aborted = 0;
+
+	list_ctor(&self->early);
 
-	err = array_of_str_dup(alloc, argc + 1, argv, &self->argv);
+	err = array_of_str_dup(&self->job.arena.base, argc + 1, argv, &self->argv);
 	if (unlikely(err)) {
 		fcallerror("array_of_str_dup", err);
-		return err;
+		goto fail;
 	}
 
 	list_ctor(&self->job.list);
 
 	return 0;
+
+fail:
+	tmp = arena_alloc_dtor(&self->job.arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+
+	return err;
 }
 
 static int _job_task_dtor(struct job_task *self)
 {
 	int err;
-	struct alloc *alloc = self->job.alloc;
-
-	err = strfree(alloc, &self->path);
-	if (unlikely(err)) {
-		fcallerror("strfree", err);
-		return err;
-	}
 
-	err = array_of_str_free(alloc, self->argc + 1, &self->argv);
+	/* Releases path and argv.
+	 */
+	err = arena_alloc_dtor(&self->job.arena);
 	if (unlikely(err)) {
-		fcallerror("array_of_str_free", err);
+		fcallerror("arena_alloc_dtor", err);
 		return err;
 	}
 
@@ -709,7 +1784,7 @@ static int _free_job_task(struct alloc *alloc, struct job_task **self)
 
 static int _task_work(struct job *job, struct spawn *spawn, int *completed)
 {
-	int err;
+	int err, tmp;
 	int ret;
 	struct job_task *self = (struct job_task *)job;
 
@@ -731,19 +1806,33 @@ static int _task_work(struct job *job, struct spawn *spawn, int *completed)
 			return err;
 		}
 
+		/* A task that cannot be started locally still waits for
+		 * the children and reports the error to the parent. Bailing
+		 * out would leave the job (and a persistent tree) hanging.
+		 */
 		err = task_ctor(self->task, spawn->alloc, spawn,
 		                self->path,
 		                self->argc, self->argv,
 		                self->channel);
 		if (unlikely(err)) {
 			fcallerror("task_ctor", err);
-			return err;
+			/* task_ctor() already released what it acquired.
+			 */
+			goto fail;
 		}
 
+		err = _task_flush_early(self);
+		if (unlikely(err))
+			fcallerror("_task_flush_early", err);
+
 		err = task_start(self->task);
 		if (unlikely(err)) {
 			fcallerror("task_start", err);
-			return err;
+
+			tmp = task_dtor(self->task);
+			if (unlikely(tmp))
+				fcallerror("task_dtor", tmp);
+			goto fail;
 		}
 
 		self->phase = 2;
@@ -763,6 +1852,9 @@ static int _task_work(struct job *job, struct spawn *spawn, int *completed)
 
 			log("Task finished with exit code %d.", ret);
 
+			if (0 == self->ret)
+				self->ret = ret;
+
 			err = task_dtor(self->task);
 			if (unlikely(err))
 				fcallerror("task_dtor", err);
@@ -773,25 +1865,67 @@ static int _task_work(struct job *job, struct spawn *spawn, int *completed)
 				fcallerror("ZFREE", err);
 				return err;
 			}
-
-			err = _task_send_response(spawn, ret);
-			if (unlikely(err)) {
-				fcallerror("_task_send_response", err);
-				return err;
-			}
 		}
 	}
 
-	/* Phase 3: Wait for the tasks executed by children
+	/* Phase 3: Wait for the tasks executed by children. The response
+	 *          is only sent once the whole subtree finished so that
+	 *          the task job on the root completes last. A persistent
+	 *          tree (see struct control) relies on this before it
+	 *          starts the next task.
 	 */
 	if (3 == self->phase) {
 		if (spawn->nprocs == self->acks) {
 			*completed = 1;
 
 			log("All children finished executing the task.");
+
+			err = spawn_remove_task(spawn, self->channel);
+			if (unlikely(err))
+				fcallerror("spawn_remove_task", err);
+
+			/* Only left over if the task failed to start.
+			 */
+			err = _task_drop_early(self, spawn);
+			if (unlikely(err))
+				fcallerror("_task_drop_early", err);
+
+			err = _task_send_response(spawn, self->channel, self->ret);
+			if (unlikely(err)) {
+				fcallerror("_task_send_response", err);
+				return err;
+			}
+
+			if ((0 == spawn->tree.here) && spawn->control)
+				control_task_done(spawn->control, self->channel,
+				                  self->ret);
 		}
 	}
 
+	return 0;
+
+fail:
+	tmp = ZFREE(spawn->alloc, (void **)&self->task,
+	            1, sizeof(struct task), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	if (0 == self->ret)
+		self->ret = err;
+
+	/* The tasks elsewhere would wait for our contributions to their
+	 * collective operations forever.
+	 */
+	if (!self->aborted) {
+		self->aborted = 1;
+
+		tmp = task_send_abort(spawn, self->channel, -1);
+		if (unlikely(tmp))
+			fcallerror("task_send_abort", tmp);
+	}
+
+	self->phase = 3;
+
 	return 0;
 }
 
@@ -805,9 +1939,10 @@ static int _task_send_request(struct spawn *spawn, const char *path,
 	memset(&header, 0, sizeof(header));
 	memset(&msg   , 0, sizeof(msg));
 
-	header.src   = spawn->tree.here;	/* Always the same */
-	header.flags = MESSAGE_FLAG_BCAST;
-	header.type  = MESSAGE_TYPE_REQUEST_TASK;
+	header.src     = spawn->tree.here;	/* Always the same */
+	header.flags   = MESSAGE_FLAG_BCAST;
+	header.type    = MESSAGE_TYPE_REQUEST_TASK;
+	header.channel = channel;
 
 	msg.path    = path;
 	msg.argc    = argc;
@@ -823,7 +1958,11 @@ static int _task_send_request(struct spawn *spawn, const char *path,
 	return 0;
 }
 
-static int _task_send_response(struct spawn *spawn, int ret)
+/*
+ * The channel in the header tells the parent which of its task jobs
+ * the response belongs to.
+ */
+static int _task_send_response(struct spawn *spawn, ui16 channel, int ret)
 {
 	int err;
 	struct message_header        header;
@@ -835,10 +1974,11 @@ static int _task_send_response(struct spawn *spawn, int ret)
 	memset(&header, 0, sizeof(header));
 	memset(&msg   , 0, sizeof(msg));
 
-	header.src   = spawn->tree.here;	/* Always the same */
-	header.dst   = spawn->parent;
-	header.flags = MESSAGE_FLAG_UCAST;
-	header.type  = MESSAGE_TYPE_RESPONSE_TASK;
+	header.src     = spawn->tree.here;	/* Always the same */
+	header.dst     = spawn->parent;
+	header.flags   = MESSAGE_FLAG_UCAST;
+	header.type    = MESSAGE_TYPE_RESPONSE_TASK;
+	header.channel = channel;
 
 	msg.ret = ret;
 
@@ -851,13 +1991,79 @@ static int _task_send_response(struct spawn *spawn, int ret)
 	return 0;
 }
 
+static int _task_flush_early(struct job_task *self)
+{
+	int err;
+	struct list *p;
+
+	while (!list_is_empty(&self->early)) {
+		p = self->early.next;
+		list_remove(p);
+
+		err = task_enqueue_message(self->task,
+		                           LIST_ENTRY(p, struct task_recvd_message, list));
+		if (unlikely(err)) {
+			fcallerror("task_enqueue_message", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Same as task_plugin_api_release() for all messages in self->early.
+ */
+static int _task_drop_early(struct job_task *self, struct spawn *spawn)
+{
+	int err;
+	struct list *p;
+	struct task_recvd_message *msg;
+
+	while (!list_is_empty(&self->early)) {
+		p = self->early.next;
+		list_remove(p);
+
+		msg = LIST_ENTRY(p, struct task_recvd_message, list);
+
+		err = buffer_pool_push(&spawn->bufpool, msg->buffer);
+		if (unlikely(err)) {
+			fcallerror("buffer_pool_push", err);
+			return err;
+		}
+
+		err = ZFREE(spawn->alloc, (void **)&msg, 1,
+		            sizeof(struct task_recvd_message), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 static int _job_exit_ctor(struct job_exit *self, struct alloc *alloc,
                           const struct timespec *timeout)
 {
+	int err, tmp;
+
 	self->job.alloc = alloc;
 	self->job.type  = JOB_TYPE_EXIT;
 	self->job.work  = _exit_work;
 
+	err = arena_alloc_ctor(&self->job.arena, alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		return err;
+	}
+
+	err = alloc_profile_ctor(&self->profile, alloc);
+	if (unlikely(err)) {
+		fcallerror("alloc_profile_ctor", err);
+		goto fail;
+	}
+
 	self->acks    = 0;
 	self->timeout = *timeout;
 	self->phase   = 1;
@@ -865,11 +2071,26 @@ static int _job_exit_ctor(struct job_exit *self, struct alloc *alloc,
 	list_ctor(&self->job.list);
 
 	return 0;
+
+fail:
+	tmp = arena_alloc_dtor(&self->job.arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+
+	return err;
 }
 
 static int _job_exit_dtor(struct job_exit *self)
 {
-	return 0;
+	int err;
+
+	err = alloc_profile_dtor(&self->profile);
+	if (unlikely(err)) {
+		fcallerror("alloc_profile_dtor", err);
+		return err;
+	}
+
+	return arena_alloc_dtor(&self->job.arena);
 }
 
 static int _free_job_exit(struct alloc *alloc, struct job_exit **self)
@@ -919,7 +2140,19 @@ static int _exit_work(struct job *job, struct spawn *spawn, int *completed)
 
 			log("All children exited.");
 
-			err = _exit_send_response(spawn);
+			/* The allocation profile travels up the tree together
+			 * with the exit responses.
+			 */
+			if (alloc_profile_get_interval() > 0) {
+				err = alloc_profile_snapshot(&self->profile);
+				if (unlikely(err))
+					fcallerror("alloc_profile_snapshot", err);
+
+				if (0 == spawn->tree.here)
+					alloc_profile_log(&self->profile, 32);
+			}
+
+			err = _exit_send_response(spawn, &self->profile);
 			if (unlikely(err))
 				fcallerror("_exit_send_response", err);
 
@@ -958,7 +2191,7 @@ static int _exit_send_request(struct spawn *spawn)
 	return 0;
 }
 
-static int _exit_send_response(struct spawn *spawn)
+static int _exit_send_response(struct spawn *spawn, struct alloc_profile *profile)
 {
 	int err;
 	struct message_header        header;
@@ -975,6 +2208,8 @@ static int _exit_send_response(struct spawn *spawn)
 	header.flags = MESSAGE_FLAG_UCAST;
 	header.type  = MESSAGE_TYPE_RESPONSE_EXIT;
 
+	msg.profile = profile;
+
 	err = spawn_send_message(spawn, &header, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("spawn_send_message", err);
@@ -989,100 +2224,23 @@ static int _prepare_task_job(struct spawn *spawn)
 	int err;
 	struct job *job;
 	const char *plugin;
-	const char *args;
-	int n, i, j, argc;
-	char **argv;
-	char *p;
-	ui16 channel;
 
 	plugin = optpool_find_by_key(spawn->opts, "TaskPlugin");
-	if (unlikely(!plugin)) {
-		error("Missing 'TaskPlugin' option.");
-		return -EINVAL;
-	}
-
-	/* TODO A disadvantage of splitting the string ourselves is that
-	 *      it is tricky to be completely bash conforming. For example,
-	 *      the algorithm below will not take quotes into account.
-	 */
-
-	args = optpool_find_by_key(spawn->opts, "TaskArgv");
-
-	argc = 0;
-	if (likely(args)) {
-		/* Strip initial whitespaces from the string.
-		 */
-		while ((*args) && isspace(*args)) ++args;
-
-		i = 0;
-		while (args[i]) {
-			/* Skip the word. */
-			while (args[i] && (!isspace(args[i]))) ++i;
-			/* Skip whitespaces. */
-			while (args[i] &&   isspace(args[i]) ) ++i;
-
-			if (args[i])
-				++argc;
-		}
-
-		/* Above we counted the number of whitespace holes in
-		 * the string so the number of arguments is that number
-		 * plus one.
+	if (!plugin) {
+		/* Tasks are submitted through the control socket.
 		 */
-		++argc;
-	}
-
-	err = ZALLOC(spawn->alloc, (void **)&argv, (argc + 1), sizeof(char *), "");
-
-	argv[0] = NULL;
-	j = 0;
-	if (likely(args)) {
-		err = xstrdup(spawn->alloc, args, &p);
-		if (unlikely(err)) {
-			fcallerror("xstrdup", err);
-			return err;
-		}
+		if (likely(spawn->control))
+			return 0;
 
-		n = strlen(p);
-
-		i = 0;
-		while (p[i]) {
-			argv[j++] = &p[i];
-
-			/* skip word */
-			while (p[i] && (!isspace(p[i]))) ++i;
-			/* skip whitespaces */
-			while (p[i] &&   isspace(p[i]) )
-				p[i++] = 0;
-		}
-	}
-
-	err = spawn_comm_resv_channel(spawn, &channel);
-	if (unlikely(err)) {
-		fcallerror("spawn_comm_alloc_channel", err);
-		channel = 1;
-	}
-
-
-	err = alloc_job_task(spawn->alloc, plugin,
-	                     argc, argv,
-	                     channel, &job);
-	if (unlikely(err)) {
-		fcallerror("alloc_job_task", err);
-		return err;
-	}
-
-	if (likely(argc)) {
-		err = ZFREE(spawn->alloc, (void **)&argv[0], (n + 1), sizeof(char), "");
-		if (unlikely(err)) {
-			fcallerror("ZFREE", err);
-			return err;
-		}
+		error("Missing 'TaskPlugin' option.");
+		return -EINVAL;
 	}
 
-	err = ZFREE(spawn->alloc, (void **)&argv, (argc + 1), sizeof(char *), "");
+	err = alloc_job_task_from_string(spawn->alloc, spawn, plugin,
+	                                 optpool_find_by_key(spawn->opts, "TaskArgv"),
+	                                 &job);
 	if (unlikely(err)) {
-		fcallerror("ZFREE", err);
+		fcallerror("alloc_job_task_from_string", err);
 		return err;
 	}
 
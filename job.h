@@ -3,9 +3,13 @@
 #define SPAWN_JOB_H_INCLUDED 1
 
 #include "list.h"
+#include "alloc.h"
+#include "hostlist.h"
+#include "layout.h"
 
 struct spawn;
 struct task;
+struct message_request_build_tree;
 
 
 /*
@@ -29,6 +33,11 @@ struct job
 {
 	struct alloc	*alloc;
 
+			/* Memory owned by the job is taken from this arena
+			 * and released in one go when the job is freed. The
+			 * job structure itself is allocated with alloc. */
+	struct arena_alloc	arena;
+
 	int		type;
 	struct list	list;
 
@@ -44,8 +53,9 @@ struct job
  */
 struct job_build_tree_child
 {
-	int			id;	/* Participant id */
-	int			host;
+	si32			id;	/* Participant id */
+	int			host;	/* Index into the hosts array of the
+					 * struct job_build_tree. */
 
 	int			nhosts;	/* Number of children of the child. */
 
@@ -58,12 +68,21 @@ struct job_build_tree_child
 		UNBORN,
 		UNKNOWN,
 		ALIVE,
-		DEAD,
-		READY
+		BUILDING,	/* REQUEST_BUILD_TREE was sent */
+		READY,
+		DEAD
 	}			state;
-	ll			spawned;	/* Time when we requested the children
-						 * to be spawned. Used to known when to
-						 * declare a child as dead. */
+	ll			spawned;	/* Time (in microseconds) when we
+						 * requested the children to be spawned.
+						 * Used to known when to declare a child
+						 * as dead. */
+	ll			latency;	/* Microseconds until the child
+						 * connected back. */
+	ll			cost;		/* Expected time to build the
+						 * subtree of the child. */
+	int			order;		/* Position in the order in
+						 * which the children were
+						 * spawned. */
 };
 
 /*
@@ -75,17 +94,53 @@ struct job_build_tree
 
 	struct alloc			*alloc;
 
-	/* Hosts are identified by their index into the spawn->hosts
-	 * array.
+	/* Names of the hosts in the subtree. On the root process this
+	 * is a copy of the global spawn->hosts list, on all other processes
+	 * the list received with the build tree request.
 	 */
 	int				nhosts;
-	int				*hosts;
+	struct hostlist			hosts;
+	/* IPv4 addresses (network byte order) of the hosts or zero if
+	 * not resolved yet. resolved is set if all addresses in the
+	 * subtree are known.
+	 */
+	ui32				*addrs;
+	int				resolved;
+
+	/* Layout of the tree. groups are the indices of the first hosts of
+	 * the host groups in the subtree (see tree_layout_split()).
+	 */
+	struct tree_layout		layout;
+	int				ngroups;
+	si32				*groups;
+
+	/* If adaptive is set the width of each subtree is chosen with
+	 * the cost model which is calibrated with the measured connect
+	 * back latency of the children.
+	 */
+	int				adaptive;
+	struct tree_cost_model		model;
 
 	int				nchildren;
 	struct job_build_tree_child	*children;
 
+	/* Straggler mitigation. A child which did not connect back within
+	 * factor times the given percentile of the (normalized) connect
+	 * back latencies of its siblings, but not earlier than mintimeout,
+	 * is declared dead. The hosts of its subtree are split among new
+	 * children. percentile is zero if the mitigation is disabled.
+	 */
+	int				percentile;
+	int				factor;
+	ll				mintimeout;	/* Microseconds */
+	int				ndeads;		/* Number of dead
+							 * participants in
+							 * the subtree. */
+
 	/* Used to keep track of the progress. */
 	int				phase;
+	int				alive;	/* Set once all children
+						 * connected back. */
 
 	ll				start;	/* Timestamp */
 };
@@ -115,10 +170,18 @@ struct job_task
 	ui16		channel;
 
 	struct task	*task;
+	/* Messages for the task that arrived before the task was started
+	 * (struct task_recvd_message). Children may start the task and
+	 * send messages before the job of this process ran.
+	 */
+	struct list	early;
 
 	int		acks;	/* Number of responses received from
 				 * children.
 				 */
+	int		ret;	/* First non-zero exit code in the
+				 * subtree. */
+	int		aborted;	/* TASK_COLL_ABORT was sent */
 
 	int		phase;
 };
@@ -141,16 +204,24 @@ struct job_exit
 				 * children.
 				 */
 
+	/* Allocation profiles received from the children. Merged
+	 * with the local profile and forwarded to the parent.
+	 */
+	struct alloc_profile	profile;
+
 	int		phase;
 };
 
 /*
  * Allocate a struct job_build_tree on the heap and call the constructor.
- * If nhosts == spawn->nhosts the hosts parameter is ignored and may equal
- * NULL since the self->hosts is necessarily equal to [0 .. (nhosts-1)].
+ * req is the build tree request received from the parent. If req is NULL
+ * the global host table is loaded (see spawn_load_hosts()) and the layout
+ * is chosen based on the options, which is only sensible on the root
+ * process.
  */
 int alloc_job_build_tree(struct alloc *alloc, struct spawn *spawn,
-                         int nhosts, int *hosts, struct job **self);
+                         const struct message_request_build_tree *req,
+                         struct job **self);
 
 /*
  * Allocate a struct job_join on the heap and call the constructor.
@@ -164,6 +235,14 @@ int alloc_job_task(struct alloc *alloc, const char* path,
                    int argc, char **argv,
                    ui16 channel, struct job **self);
 
+/*
+ * Same as alloc_job_task() but argv is given as a whitespace separated
+ * string (or NULL) and a new channel is reserved for the task.
+ */
+int alloc_job_task_from_string(struct alloc *alloc, struct spawn *spawn,
+                               const char *plugin, const char *args,
+                               struct job **self);
+
 /*
  * Allocate a struct job_exit on the heap and call the constructor.
  */
@@ -0,0 +1,484 @@
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>	/* For HOST_NAME_MAX */
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "alloc.h"
+#include "helper.h"
+#include "hostlist.h"
+#include "layout.h"
+
+
+/*
+ * Entry of a topology file.
+ */
+struct _topology_entry
+{
+	char	*host;
+	char	*group;
+};
+
+static int _split_kary(int width, int nhosts, int *first, int *n);
+static int _split_binomial(int nhosts, int *first, int *n);
+static int _split_topology(int width, int nhosts, const si32 *groups,
+                           int ngroups, int *first, int *n);
+static int _read_topology(struct alloc *alloc, const char *path,
+                          struct _topology_entry **entries, int *nentries);
+static int _compare_entries(const void *a, const void *b);
+
+
+int tree_layout_from_string(const char *name, int *type)
+{
+	if (!strcmp(name, "kary"))
+		*type = TREE_LAYOUT_KARY;
+	else if (!strcmp(name, "binomial"))
+		*type = TREE_LAYOUT_BINOMIAL;
+	else if (!strcmp(name, "topology"))
+		*type = TREE_LAYOUT_TOPOLOGY;
+	else {
+		error("Unknown tree layout '%s'.", name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int tree_layout_max_children(const struct tree_layout *self, int nhosts)
+{
+	int n;
+
+	if (TREE_LAYOUT_BINOMIAL == self->type) {
+		/* The number of children equals the number of times the
+		 * hosts can be halved.
+		 */
+		n = 0;
+		while ((1LL << n) <= nhosts)
+			++n;
+
+		return n;
+	}
+
+	return MAX(1, MIN(self->width, nhosts));
+}
+
+int tree_layout_split(const struct tree_layout *self, int nhosts,
+                      const si32 *groups, int ngroups, int *first, int *n)
+{
+	if (unlikely(nhosts < 1))
+		return -EINVAL;
+
+	switch (self->type) {
+	case TREE_LAYOUT_KARY:
+		return _split_kary(self->width, nhosts, first, n);
+	case TREE_LAYOUT_BINOMIAL:
+		return _split_binomial(nhosts, first, n);
+	case TREE_LAYOUT_TOPOLOGY:
+		return _split_topology(self->width, nhosts, groups, ngroups,
+		                       first, n);
+	default:
+		error("Unknown tree layout %d.", self->type);
+		return -EINVAL;
+	}
+}
+
+int tree_layout_auto_width(const struct tree_cost_model *model,
+                           struct alloc *alloc, int nhosts, int *width)
+{
+	int err;
+	ll *cost, t, latency, overhead;
+	int c, k, w, best;
+
+	if (nhosts < 2) {
+		*width = 1;
+		return 0;
+	}
+
+	latency  = MAX(1, model->latency);
+	overhead = MAX(0, model->overhead);
+	c        = MAX(1, model->concurrency);
+
+	err = ZALLOC(alloc, (void **)&cost, nhosts + 1, sizeof(ll), "cost");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	/* cost[k] is the time needed to build a tree with k hosts below the
+	 * root. The cost of a level is non-decreasing in the width so the
+	 * search stops as soon as the level alone is more expensive than the
+	 * best tree found so far. Ties are broken in favour of the wider
+	 * (and hence flatter) tree.
+	 */
+	best = 1;
+	for (k = 1; k <= nhosts; ++k) {
+		cost[k] = -1;
+
+		for (w = 1; w <= MIN(k, TREE_LAYOUT_MAX_AUTO_WIDTH); ++w) {
+			t = ((w + c - 1)/c)*latency + w*overhead;
+			if ((cost[k] >= 0) && (t > cost[k]))
+				break;
+
+			t += cost[(k + w - 1)/w - 1];
+			if ((cost[k] < 0) || (t <= cost[k])) {
+				cost[k] = t;
+				best    = w;
+			}
+		}
+	}
+
+	*width = best;
+
+	err = ZFREE(alloc, (void **)&cost, nhosts + 1, sizeof(ll), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	return 0;
+}
+
+ll tree_layout_build_cost(const struct tree_layout *self,
+                          const struct tree_cost_model *model, int nhosts)
+{
+	ll cost, latency, overhead;
+	int c, m, largest;
+
+	latency  = MAX(1, model->latency);
+	overhead = MAX(0, model->overhead);
+	c        = MAX(1, model->concurrency);
+
+	cost = 0;
+	while (nhosts > 0) {
+		if (TREE_LAYOUT_BINOMIAL == self->type) {
+			m       = tree_layout_max_children(self, nhosts);
+			largest = (nhosts + 1)/2;
+		} else {
+			m       = MAX(1, MIN(self->width, nhosts));
+			largest = (nhosts + m - 1)/m;
+		}
+
+		cost  += ((m + c - 1)/c)*latency + m*overhead;
+		nhosts = largest - 1;
+	}
+
+	return cost;
+}
+
+int tree_layout_subtree_sizes(const struct tree_layout *self,
+                              struct alloc *alloc, int nhosts, int *sizes)
+{
+	int err, tmp;
+	int *first, *stack;
+	int nstack, off, n, m, i;
+
+	if (unlikely(TREE_LAYOUT_TOPOLOGY == self->type))
+		return -EINVAL;
+
+	if (nhosts < 1)
+		return 0;
+
+	err = ZALLOC(alloc, (void **)&first,
+	             tree_layout_max_children(self, nhosts) + 1,
+	             sizeof(int), "first");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	/* Pairs of offset and size of the host ranges which still have to
+	 * be split. Every host starts at most one range so the stack is
+	 * bounded by nhosts pairs. An explicit stack is used since
+	 * degenerated trees (width one) are as deep as they are wide.
+	 */
+	err = ZALLOC(alloc, (void **)&stack, 2*nhosts, sizeof(int), "stack");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	stack[0] = 0;
+	stack[1] = nhosts;
+	nstack   = 1;
+
+	while (nstack > 0) {
+		--nstack;
+		off = stack[2*nstack + 0];
+		n   = stack[2*nstack + 1];
+
+		err = tree_layout_split(self, n, NULL, 0, first, &m);
+		if (unlikely(err)) {
+			fcallerror("tree_layout_split", err);
+			goto fail2;
+		}
+
+		for (i = 0; i < m; ++i) {
+			sizes[off + first[i]] = first[i+1] - first[i];
+
+			if (first[i+1] - first[i] > 1) {
+				stack[2*nstack + 0] = off + first[i] + 1;
+				stack[2*nstack + 1] = first[i+1] - first[i] - 1;
+				++nstack;
+			}
+		}
+	}
+
+	err = 0;
+
+fail2:
+	tmp = ZFREE(alloc, (void **)&stack, 2*nhosts, sizeof(int), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+fail:
+	tmp = ZFREE(alloc, (void **)&first,
+	            tree_layout_max_children(self, nhosts) + 1,
+	            sizeof(int), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
+int tree_layout_slice_groups(const si32 *groups, int ngroups, int lo, int hi,
+                             si32 *out, int *nout)
+{
+	int i;
+
+	if (unlikely(lo > hi))
+		return -EINVAL;
+
+	*nout = 0;
+	if (lo == hi)
+		return 0;
+
+	out[(*nout)++] = 0;
+	for (i = 0; i < ngroups; ++i)
+		if ((groups[i] > lo) && (groups[i] < hi))
+			out[(*nout)++] = groups[i] - lo;
+
+	return 0;
+}
+
+int tree_layout_load_topology(struct alloc *alloc, const char *path,
+                              const struct hostlist *hosts,
+                              si32 **groups, int *ngroups)
+{
+	int err, tmp;
+	struct arena_alloc arena;
+	struct _topology_entry *entries, key, *x;
+	int nentries;
+	const char *group, *prev;
+	char host[HOST_NAME_MAX];
+	si32 *starts;
+	int i, n;
+
+	err = arena_alloc_ctor(&arena, alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		return err;
+	}
+
+	err = _read_topology(&arena.base, path, &entries, &nentries);
+	if (unlikely(err))
+		goto fail;
+
+	qsort(entries, nentries, sizeof(struct _topology_entry), _compare_entries);
+
+	err = ZALLOC(&arena.base, (void **)&starts, hostlist_size(hosts),
+	             sizeof(si32), "starts");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	n    = 0;
+	prev = NULL;
+	for (i = 0; i < hostlist_size(hosts); ++i) {
+		err = hostlist_get(hosts, i, host, sizeof(host));
+		if (unlikely(err)) {
+			fcallerror("hostlist_get", err);
+			goto fail;
+		}
+
+		key.host = host;
+		x = bsearch(&key, entries, nentries, sizeof(struct _topology_entry),
+		            _compare_entries);
+		group = (x) ? x->group : "";
+
+		if ((!prev) || strcmp(prev, group))
+			starts[n++] = i;
+
+		prev = group;
+	}
+
+	err = ZALLOC(alloc, (void **)groups, n, sizeof(si32), "groups");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	memcpy(*groups, starts, n*sizeof(si32));
+	*ngroups = n;
+
+	log("Topology file '%s' splits %lld hosts into %d group(s).",
+	    path, hostlist_size(hosts), n);
+
+fail:
+	tmp = arena_alloc_dtor(&arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+
+	return err;
+}
+
+
+static int _split_kary(int width, int nhosts, int *first, int *n)
+{
+	int i, q, r;
+
+	*n = MAX(1, MIN(width, nhosts));
+
+	q = nhosts/(*n);
+	r = nhosts%(*n);
+
+	/* The first r chunks get one extra host.
+	 */
+	first[0] = 0;
+	for (i = 0; i < (*n); ++i)
+		first[i+1] = first[i] + q + (i < r);
+
+	return 0;
+}
+
+static int _split_binomial(int nhosts, int *first, int *n)
+{
+	int m, h;
+
+	/* The process itself and its hosts form a binomial tree with
+	 * m nodes. The first child roots the upper half, the remaining
+	 * nodes are split recursively.
+	 */
+	m  = nhosts + 1;
+	*n = 0;
+
+	first[0] = 0;
+	while (m > 1) {
+		h = m/2;
+
+		first[(*n)+1] = first[*n] + h;
+		++(*n);
+
+		m -= h;
+	}
+
+	return 0;
+}
+
+static int _split_topology(int width, int nhosts, const si32 *groups,
+                           int ngroups, int *first, int *n)
+{
+	int i, k;
+
+	if (ngroups <= 1)
+		return _split_kary(width, nhosts, first, n);
+
+	width = MAX(1, width);
+
+	/* One chunk per group if possible. Otherwise neighbouring groups
+	 * are merged into chunks of roughly equal size.
+	 */
+	k = 0;
+	first[k++] = 0;
+	for (i = 1; i < ngroups; ++i) {
+		if (k == width)
+			break;
+
+		if ((ngroups <= width) ||
+		    ((ll )groups[i]*width >= (ll )k*nhosts))
+			first[k++] = groups[i];
+	}
+
+	first[k] = nhosts;
+	*n = k;
+
+	return 0;
+}
+
+static int _read_topology(struct alloc *alloc, const char *path,
+                          struct _topology_entry **entries, int *nentries)
+{
+	int err;
+	FILE *fp;
+	char line[512];
+	char *host, *group, *save;
+	int n;
+
+	fp = fopen(path, "r");
+	if (unlikely(!fp)) {
+		error("Could not open topology file '%s' for reading.", path);
+		return -ESOMEFAULT;
+	}
+
+	*entries  = NULL;
+	*nentries = 0;
+	n = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		host = strtok_r(line, " \t\n", &save);
+		if ((!host) || ('#' == host[0]))
+			continue;
+
+		group = strtok_r(NULL, " \t\n", &save);
+		if (unlikely(!group)) {
+			error("Missing group for host '%s' in topology file '%s'.",
+			      host, path);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		if (*nentries == n) {
+			err = ZREALLOC(alloc, (void **)entries,
+			               n, sizeof(struct _topology_entry),
+			               MAX(64, 2*n), sizeof(struct _topology_entry),
+			               "entries");
+			if (unlikely(err)) {
+				fcallerror("ZREALLOC", err);
+				goto fail;
+			}
+
+			n = MAX(64, 2*n);
+		}
+
+		err = xstrdup(alloc, host, &(*entries)[*nentries].host);
+		if (unlikely(err)) {
+			fcallerror("xstrdup", err);
+			goto fail;
+		}
+
+		err = xstrdup(alloc, group, &(*entries)[*nentries].group);
+		if (unlikely(err)) {
+			fcallerror("xstrdup", err);
+			goto fail;
+		}
+
+		++(*nentries);
+	}
+
+	err = 0;
+
+fail:
+	fclose(fp);
+
+	return err;
+}
+
+static int _compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const struct _topology_entry *)a)->host,
+	              ((const struct _topology_entry *)b)->host);
+}
+
@@ -0,0 +1,134 @@
+
+#ifndef SPAWN_LAYOUT_H_INCLUDED
+#define SPAWN_LAYOUT_H_INCLUDED 1
+
+#include "ints.h"
+
+struct alloc;
+struct hostlist;
+
+
+/*
+ * Tree layouts.
+ *
+ * Participant ids are assigned such that every subtree covers a contiguous
+ * range of ids (see struct network). A layout therefore only decides how
+ * the hosts below a process are split into consecutive chunks. The first
+ * host in each chunk becomes a child and the remaining hosts of the chunk
+ * form its subtree.
+ */
+enum
+{
+	/* Up to width children with subtrees whose sizes differ by at
+	 * most one.
+	 */
+	TREE_LAYOUT_KARY	= 1,
+	/* Binomial tree. The first child roots half of the hosts, the
+	 * second child a quarter and so on. The width is ignored. Well
+	 * suited for pipelined broadcasts.
+	 */
+	TREE_LAYOUT_BINOMIAL,
+	/* Chunks are aligned with the boundaries of host groups (e.g.,
+	 * racks or switches) read from a topology file such that only one
+	 * link per group crosses the group boundary. Within a group the
+	 * k-ary layout is used.
+	 */
+	TREE_LAYOUT_TOPOLOGY
+};
+
+struct tree_layout
+{
+	int	type;
+	int	width;
+};
+
+/*
+ * Cost model for the adaptive selection of the tree width. Building one
+ * level of the tree with w children takes ceil(w/concurrency)*latency
+ * (the children are spawned by concurrency exec threads and the next
+ * level is only started once all children connected back) plus w times
+ * the overhead for handling a child in the parent.
+ */
+struct tree_cost_model
+{
+	ll	latency;	/* Microseconds from the spawn request to the
+				 * connect back of a child. */
+	ll	overhead;	/* Microseconds per child */
+	int	concurrency;	/* Number of concurrent spawns */
+};
+
+/*
+ * Upper bound for widths chosen by tree_layout_auto_width().
+ */
+#define TREE_LAYOUT_MAX_AUTO_WIDTH	256
+
+/*
+ * Map the layout name used in the 'TreeLayout' option ("kary", "binomial"
+ * or "topology") to the layout type.
+ */
+int tree_layout_from_string(const char *name, int *type);
+
+/*
+ * Upper bound for the number of children produced by tree_layout_split().
+ */
+int tree_layout_max_children(const struct tree_layout *self, int nhosts);
+
+/*
+ * Split nhosts hosts into consecutive chunks. On return first[i] is the
+ * index of the first host of the i-th chunk, n is the number of chunks and
+ * first[n] equals nhosts. first must have room for
+ * tree_layout_max_children() + 1 entries. groups contains the indices of
+ * the first hosts of the ngroups host groups (starting with zero) and is
+ * only used by the topology layout.
+ */
+int tree_layout_split(const struct tree_layout *self, int nhosts,
+                      const si32 *groups, int ngroups, int *first, int *n);
+
+/*
+ * Choose the width of the k-ary tree with nhosts hosts below the calling
+ * process that minimizes the time needed to build the tree according to
+ * the cost model. Only the width of the first level is returned since
+ * the subtrees choose their width again with an updated model.
+ */
+int tree_layout_auto_width(const struct tree_cost_model *model,
+                           struct alloc *alloc, int nhosts, int *width);
+
+/*
+ * Estimate the time in microseconds needed to build a tree with nhosts
+ * hosts below the calling process according to the cost model. The
+ * estimate follows the largest chunk on every level which is the critical
+ * path of the tree. Host groups of the topology layout are ignored.
+ */
+ll tree_layout_build_cost(const struct tree_layout *self,
+                          const struct tree_cost_model *model, int nhosts);
+
+/*
+ * Compute the size of the subtree rooted at each of the nhosts hosts below
+ * the calling process (including the host itself) if all processes use
+ * the same layout. Leaves have size one. sizes must have room for nhosts
+ * entries. The topology layout is not supported.
+ */
+int tree_layout_subtree_sizes(const struct tree_layout *self,
+                              struct alloc *alloc, int nhosts, int *sizes);
+
+/*
+ * Compute the group boundaries of the subtree formed by the hosts
+ * lo, ..., hi - 1 in the format expected by tree_layout_split(). out must
+ * have room for ngroups + 1 entries.
+ */
+int tree_layout_slice_groups(const si32 *groups, int ngroups, int lo, int hi,
+                             si32 *out, int *nout);
+
+/*
+ * Read a topology file and compute the group boundaries for the host list.
+ * Each line of the file consists of a host name and a group name separated
+ * by whitespace. Empty lines and lines starting with '#' are ignored. Hosts
+ * which do not appear in the file are treated as members of an anonymous
+ * group. groups is allocated with alloc and has size ngroups.
+ */
+int tree_layout_load_topology(struct alloc *alloc, const char *path,
+                              const struct hostlist *hosts,
+                              si32 **groups, int *ngroups);
+
+#endif
+
@@ -97,5 +97,22 @@ static inline int list_is_empty(struct list *self)
 	return (self->next == self);
 }
 
+/*
+ * Move all entries of other to the end of self. other is empty
+ * afterwards.
+ */
+static inline void list_splice(struct list *self, struct list *other)
+{
+	if (list_is_empty(other))
+		return;
+
+	other->next->prev = self->prev;
+	self->prev->next  = other->next;
+	other->prev->next = self;
+	self->prev        = other->prev;
+
+	list_ctor(other);
+}
+
 #endif
 
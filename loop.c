@@ -26,6 +26,7 @@
 #include "plugin.h"
 #include "msgbuf.h"
 #include "task.h"
+#include "control.h"
 
 
 static int _work_available(struct spawn *spawn);
@@ -37,14 +38,11 @@ static int _handle_jobs(struct spawn *spawn);
 static int _handle_request_join(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static struct job_build_tree *_find_job_build_tree(struct spawn *spawn);
 static int _insert_process_in_struct_spawn(struct spawn *spawn,
-	                                   struct job_build_tree *job,
 	                                   struct message_header *header,
 	                                   struct message_request_join *msg,
 	                                   int port);
-static int _alloc_process_list_in_struct_spawn(struct spawn *spawn,
-	                                       struct job_build_tree *job);
 static struct process *_find_spawned_process_by_id(struct spawn *spawn, int id);
-static int _send_response_join(struct spawn *spawn, int dest);
+static int _send_response_join(struct spawn *spawn, int dest, int reject);
 static int _handle_ping(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _handle_request_exec(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _alloc_exec_work_item(struct exec_worker_pool *wkpool,
@@ -55,7 +53,7 @@ static int _handle_request_build_tree(struct spawn *spawn, struct message_header
 static int _handle_response_build_tree(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _handle_request_task(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _handle_response_task(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
-static struct job_task *_find_job_task(struct spawn *spawn);
+static struct job_task *_find_job_task(struct spawn *spawn, ui16 channel);
 static int _handle_request_exit(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _handle_response_exit(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static int _handle_write_stdout(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
@@ -63,20 +61,25 @@ static int _handle_write_stderr(struct spawn *spawn, struct message_header *head
 static int _handle_user(struct spawn *spawn, struct message_header *header, struct buffer *buffer);
 static struct job_exit *_find_job_exit(struct spawn *spawn);
 static int _find_peerport(struct spawn *spawn, ui32 ip, ui32 portnum);
-static int _fix_lft(struct spawn *spawn, int port, int *ids, int nids);
+static int _add_route(struct spawn *spawn, int port, int lo, int hi);
 static int _peeraddr(int fd, ui32 *ip, ui32 *portnum);
 static struct job_build_tree_child *_find_child_by_id(struct job_build_tree *job, int id);
 static int _declare_child_alive(struct job_build_tree *job, int id);
 static int _declare_child_ready(struct job_build_tree *job, int id);
 static void _sighandler(int signum);
 static int _install_sighandler();
+static void _sigusr1handler(int signum);
+static int _install_sigusr1handler();
+static int _dump_alloc_profile(struct spawn *spawn);
 static int _quit(struct spawn *spawn);
 static struct job *_find_one_and_only_job(struct spawn *spawn, int type);
+static int _count_jobs(struct spawn *spawn, int type);
 static int _flush_io_buffers(struct spawn *spawn);
 static int _flush_io_buffer(struct spawn *spawn, struct msgbuf *buf, int type);
 
 static int _finished = 0;
 static int _sigrecvd = 0;
+static volatile int _dumprecvd = 0;
 
 
 int loop(struct spawn *spawn)
@@ -99,11 +102,27 @@ int loop(struct spawn *spawn)
 		}
 	}
 
+	/* SIGUSR1 dumps the allocation profile on all processes.
+	 */
+	err = _install_sigusr1handler();
+	if (unlikely(err))
+		fcallerror("_install_sigusr1handler", err);
+
 	_ping(spawn, 60);	/* First time nothing is send. */
 
 	while (1) {
 		if (0 == spawn->tree.here) {
-			if (list_is_empty(&spawn->jobs))
+			if (spawn->control) {
+				err = control_progress(spawn->control, spawn);
+				if (unlikely(err))
+					fcallerror("control_progress", err);
+			}
+
+			/* A persistent tree waits for tasks until the exit
+			 * command is received.
+			 */
+			if (list_is_empty(&spawn->jobs) &&
+			    (!spawn->control || spawn->control->quit))
 				_finished = 1;
 
 			if (1 == _finished) {
@@ -115,6 +134,14 @@ int loop(struct spawn *spawn)
 			}
 		}
 
+		if (unlikely(_dumprecvd)) {
+			_dumprecvd = 0;
+
+			err = _dump_alloc_profile(spawn);
+			if (unlikely(err))
+				fcallerror("_dump_alloc_profile", err);
+		}
+
 		err = _handle_jobs(spawn);
 		if (unlikely(err))
 			die();	/* FIXME */
@@ -261,7 +288,7 @@ static int _send_ping(struct spawn *spawn, ll now)
  *      operation. It might be advantageous to aggregate the connections and
  *      only insert a batch of them at once. This however raises new questions
  *      concerning the cost of the additional delay (we will not be able to
- *      receive the REQUEST_JOIN until we updated the lft) and a good choice
+ *      receive the REQUEST_JOIN until we added the route) and a good choice
  *      of the batch size and timeout.
  */
 static int _handle_accept(struct spawn *spawn, int newfd)
@@ -314,13 +341,19 @@ static int _handle_message(struct spawn *spawn, struct buffer *buffer)
 	int err, tmp;
 	struct message_header header;
 
-	err = unpack_message_header(buffer, &header);
+	/* The communication thread already parsed the header when
+	 * routing the message so this is a cheap copy.
+	 */
+	err = secretly_copy_header(buffer, &header);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_header", err);
-		die();	/* This is pretty much impossible anyway since
-			 * the communication thread had a look at the
-			 * header to see how to treat the packet.
-			 */
+		fcallerror("secretly_copy_header", err);
+		die();
+	}
+
+	err = buffer_seek(buffer, header.size);
+	if (unlikely(err)) {
+		fcallerror("buffer_seek", err);
+		die();
 	}
 
 	if ((header.type != MESSAGE_TYPE_WRITE_STDOUT) &&
@@ -363,6 +396,8 @@ static int _handle_message(struct spawn *spawn, struct buffer *buffer)
 		break;
 	case MESSAGE_TYPE_USER:
 		err = _handle_user(spawn, &header, buffer);
+		if (likely(!err))
+			buffer = NULL;	/* Owned by the task now. */
 		break;
 	default:
 		error("Dropping unexpected message of type %d from %d.", header.type, header.src);
@@ -374,15 +409,30 @@ static int _handle_message(struct spawn *spawn, struct buffer *buffer)
 		goto fail;
 	}
 
-	err = buffer_pool_push(&spawn->bufpool, buffer);
+	/* The handlers copy whatever needs to survive the message
+	 * so the payload can be dropped in one go.
+	 */
+	err = arena_alloc_reset(&spawn->msgarena);
 	if (unlikely(err)) {
-		fcallerror("buffer_pool_push", err);
-		return err;
+		fcallerror("arena_alloc_reset", err);
+		goto fail;
+	}
+
+	if (buffer) {
+		err = buffer_pool_push(&spawn->bufpool, buffer);
+		if (unlikely(err)) {
+			fcallerror("buffer_pool_push", err);
+			return err;
+		}
 	}
 
 	return 0;
 
 fail:
+	tmp = arena_alloc_reset(&spawn->msgarena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_reset", tmp);
+
 	tmp = buffer_pool_push(&spawn->bufpool, buffer);
 	if (unlikely(tmp))
 		fcallerror("buffer_pool_push", tmp);
@@ -434,13 +484,23 @@ static int _handle_request_join(struct spawn *spawn, struct message_header *head
 	struct message_request_join msg;
 	int port, dest;
 	struct job_build_tree *job;
+	struct job_build_tree_child *child;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("unpack_message_payload", err);
 		die();	/* FIXME ?*/
 	}
 
+	/* Mixing binaries speaking different versions of the protocol is a
+	 * deployment error that we cannot recover from.
+	 */
+	if (unlikely(MESSAGE_PROTOCOL_VERSION != msg.version)) {
+		error("Process %d speaks protocol version %d but we need version %d.",
+		      (int )header->src, (int )msg.version, MESSAGE_PROTOCOL_VERSION);
+		die();
+	}
+
 	dest = header->src;
 	port = _find_peerport(spawn, msg.ip, msg.portnum);
 	if (unlikely(port < 0)) {
@@ -448,11 +508,47 @@ static int _handle_request_join(struct spawn *spawn, struct message_header *head
 		die();
 	}
 
-	job = _find_job_build_tree(spawn);
-	if (unlikely(!job))
-		goto fail;
+	/* A process which connects back after it was declared dead (or
+	 * after the tree was completed) is told to terminate. Its subtree
+	 * is already handled by other processes.
+	 */
+	job   = NULL;
+	child = NULL;
+	if (_count_jobs(spawn, JOB_TYPE_BUILD_TREE) > 0) {
+		job = _find_job_build_tree(spawn);
+		if (unlikely(!job)) {
+			error("_find_job_build_tree() returned NULL");
+			err = -ESRCH;
+			goto fail;
+		}
+
+		child = _find_child_by_id(job, dest);
+		if (unlikely(!child)) {
+			error("Process %d is not a child of this process.", dest);
+			err = -ESRCH;
+			goto fail;
+		}
+	}
 
-	err = _insert_process_in_struct_spawn(spawn, job, header, &msg, port);
+	if (!child || (DEAD == child->state)) {
+		warn("Process %d connected back after it was declared dead.", dest);
+
+		err = _add_route(spawn, port, dest, dest);
+		if (unlikely(err)) {
+			fcallerror("_add_route", err);
+			goto fail;
+		}
+
+		err = _send_response_join(spawn, dest, 1);
+		if (unlikely(err)) {
+			fcallerror("_send_response_join", err);
+			goto fail;
+		}
+
+		goto done;
+	}
+
+	err = _insert_process_in_struct_spawn(spawn, header, &msg, port);
 	if (unlikely(err)) {
 		fcallerror("_insert_process_in_struct_spawn", err);
 		goto fail;
@@ -460,13 +556,13 @@ static int _handle_request_join(struct spawn *spawn, struct message_header *head
 
 	debug("Routing messages to %2d via port %2d.", dest, port);
 
-	err = _fix_lft(spawn, port, &dest, 1);
+	err = _add_route(spawn, port, dest, dest);
 	if (unlikely(err)) {
-		fcallerror("_fixup_lft", err);
+		fcallerror("_add_route", err);
 		goto fail;
 	}
 
-	err = _send_response_join(spawn, dest);
+	err = _send_response_join(spawn, dest, 0);
 	if (unlikely(err)) {
 		fcallerror("_send_response_join", err);
 		goto fail;
@@ -478,7 +574,8 @@ static int _handle_request_join(struct spawn *spawn, struct message_header *head
 		goto fail;
 	}
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+done:
+	err = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("free_message_payload", err);
 		return err;
@@ -487,7 +584,7 @@ static int _handle_request_join(struct spawn *spawn, struct message_header *head
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
 		fcallerror("free_message_payload", tmp);
 
@@ -499,8 +596,11 @@ static struct job_build_tree *_find_job_build_tree(struct spawn *spawn)
 	return (struct job_build_tree *)_find_one_and_only_job(spawn, JOB_TYPE_BUILD_TREE);
 }
 
+/*
+ * Record a child which connected back. The list only contains children
+ * which joined successfully so that dead children are not waited for.
+ */
 static int _insert_process_in_struct_spawn(struct spawn *spawn,
-	                                   struct job_build_tree *job,
 	                                   struct message_header *header,
 	                                   struct message_request_join *msg,
 	                                   int port)
@@ -508,19 +608,18 @@ static int _insert_process_in_struct_spawn(struct spawn *spawn,
 	int err;
 	struct process *p;
 
-	if (0 == spawn->nprocs) {
-		err = _alloc_process_list_in_struct_spawn(spawn, job);
+	p = _find_spawned_process_by_id(spawn, header->src);
+	if (!p) {
+		err = ZREALLOC(spawn->alloc, (void **)&spawn->procs,
+		               spawn->nprocs, sizeof(struct process),
+		               spawn->nprocs + 1, sizeof(struct process), "procs");
 		if (unlikely(err)) {
-			fcallerror("_alloc_process_list_in_struct_spawn", err);
-			die();	/* No reasonable way to continue.
-				 */
+			fcallerror("ZREALLOC", err);
+			return err;
 		}
-	}
 
-	p = _find_spawned_process_by_id(spawn, header->src);
-	if (unlikely(!p)) {
-		error("_find_spawned_process_by_id() returned NULL.");
-		return -ESOMEFAULT;
+		p = &spawn->procs[spawn->nprocs++];
+		p->id = header->src;
 	}
 
 	p->pid  = msg->pid;
@@ -531,31 +630,6 @@ static int _insert_process_in_struct_spawn(struct spawn *spawn,
 	return 0;
 }
 
-static int _alloc_process_list_in_struct_spawn(struct spawn *spawn,
-	                                       struct job_build_tree *job)
-{
-	int err;
-	int i;
-
-	/* TODO This is only correct if we do not have any dead hosts.
-	 */
-	spawn->nprocs = job->nchildren;
-
-	err = ZALLOC(spawn->alloc, (void **)&spawn->procs, spawn->nprocs,
-	             sizeof(struct process), "procs");
-	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
-		return err;
-	}
-
-	for (i = 0; i < spawn->nprocs; ++i) {
-		spawn->procs[i].id   = job->children[i].id;
-		spawn->procs[i].port = -1;
-	}
-
-	return 0;
-}
-
 static struct process *_find_spawned_process_by_id(struct spawn *spawn, int id)
 {
 	int i;
@@ -571,7 +645,7 @@ static struct process *_find_spawned_process_by_id(struct spawn *spawn, int id)
 	return p;
 }
 
-static int _send_response_join(struct spawn *spawn, int dest)
+static int _send_response_join(struct spawn *spawn, int dest, int reject)
 {
 	int err;
 	struct message_header        header;
@@ -585,8 +659,9 @@ static int _send_response_join(struct spawn *spawn, int dest)
 	header.flags = MESSAGE_FLAG_UCAST;
 	header.type  = MESSAGE_TYPE_RESPONSE_JOIN;
 
-	msg.addr = dest;
-	msg.opts = spawn->opts;
+	msg.version = MESSAGE_PROTOCOL_VERSION;
+	msg.addr    = (reject) ? MESSAGE_JOIN_REJECTED : dest;
+	msg.opts    = spawn->opts;
 
 	err = spawn_send_message(spawn, &header, (void *)&msg);
 	if (unlikely(err)) {
@@ -610,9 +685,9 @@ static int _handle_request_exec(struct spawn *spawn, struct message_header *head
 	struct message_request_exec msg;
 	struct exec_work_item *wkitem;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload_view(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
@@ -622,34 +697,28 @@ static int _handle_request_exec(struct spawn *spawn, struct message_header *head
 		goto fail;
 	}
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("free_message_payload", err);
+		fcallerror("free_message_payload_view", err);
 		return err;
 	}
 
-	/* Try to insert the worker item. Spin as long as necessary if the queue is
-	 * currently full.
+	/* Blocks if the queue is currently full.
 	 */
-	do {
-		err = exec_worker_pool_enqueue(spawn->wkpool, wkitem);
-		if (-ENOMEM == err)
-			/* FIXME sched_yield()? */
-			continue;
-		if (unlikely(err)) {
-			fcallerror("exec_worker_pool_enqueue", err);
-			return err;
-		}
-	} while (err);
+	err = exec_worker_pool_enqueue(spawn->wkpool, wkitem);
+	if (unlikely(err)) {
+		fcallerror("exec_worker_pool_enqueue", err);
+		return err;
+	}
 
 	return 0;
 
 fail:
 	assert(err);
 
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
-		fcallerror("free_message_payload", tmp);
+		fcallerror("free_message_payload_view", tmp);
 
 	return err;
 }
@@ -669,6 +738,7 @@ static int _alloc_exec_work_item(struct exec_worker_pool *wkpool,
 
 	(*wkitem)->argc   = msg->argc;
 	(*wkitem)->client = header->src;
+	(*wkitem)->cost   = msg->cost;
 
 	err = xstrdup(wkpool->alloc, msg->host, &(*wkitem)->host);
 	if (unlikely(err)) {
@@ -706,14 +776,16 @@ static int _handle_request_build_tree(struct spawn *spawn, struct message_header
 	struct message_request_build_tree msg;
 	struct job *job;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	/* The job parses the host list so there is no need to copy it
+	 * out of the buffer first.
+	 */
+	err = unpack_message_payload_view(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
-	err = alloc_job_build_tree(spawn->alloc, spawn, msg.nhosts,
-	                           msg.hosts, &job);
+	err = alloc_job_build_tree(spawn->alloc, spawn, &msg, &job);
 	if (unlikely(err)) {
 		fcallerror("alloc_job_build_tree", err);
 		goto fail;
@@ -721,18 +793,18 @@ static int _handle_request_build_tree(struct spawn *spawn, struct message_header
 
 	list_insert_before(&spawn->jobs, &job->list);
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("free_message_payload", err);
+		fcallerror("free_message_payload_view", err);
 		return err;
 	}
 
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
-		fcallerror("free_message_payload", tmp);
+		fcallerror("free_message_payload_view", tmp);
 
 	return err;
 }
@@ -742,12 +814,10 @@ static int _handle_response_build_tree(struct spawn *spawn, struct message_heade
 	int err, tmp;
 	struct job_build_tree *job;
 	struct message_response_build_tree msg;
-	int i;
 	struct process *p;
 	struct job_build_tree_child *child;
-	si32 *ids;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("unpack_message_payload", err);
 		die();	/* FIXME ?*/
@@ -759,10 +829,12 @@ static int _handle_response_build_tree(struct spawn *spawn, struct message_heade
 
 	err = _declare_child_ready(job, header->src);
 	if (unlikely(err)) {
-		fcallerror("_declare_child_alive", err);
+		fcallerror("_declare_child_ready", err);
 		goto fail;
 	}
 
+	job->ndeads += msg.deads;
+
 	p = _find_spawned_process_by_id(spawn, header->src);
 	if (unlikely(!p)) {
 		error("_find_process_by_id() returned NULL");
@@ -779,28 +851,23 @@ static int _handle_response_build_tree(struct spawn *spawn, struct message_heade
 		goto fail;
 	}
 
-	/* We already set the LFT entry for the host itself so the +1 is fine.
-	 */
-	ids = job->hosts + child->host + 1;
-
-	for (i = 0; i < child->nhosts; ++i)
-		debug("Routing messages to %2d via port %2d.", ids[i] + 1, p->port);
-
-	/* The root process is not accounted for in the host list in struct spawn
-	 * so we need to add +1 to map from the host id to the network participant id.
+	/* The subtree of a child always covers a contiguous range of participant
+	 * identifiers starting right after the child itself. We already set the
+	 * route for the child so a single interval for the rest of the subtree
+	 * suffices.
 	 */
-	for (i = 0; i < child->nhosts; ++i)
-		ids[i]++;
-	err = _fix_lft(spawn, p->port, ids, child->nhosts);
-	for (i = 0; i < child->nhosts; ++i)
-		ids[i]--;
+	if (child->nhosts > 0) {
+		debug("Routing messages to %2d-%2d via port %2d.",
+		      child->id + 1, child->id + child->nhosts, p->port);
 
-	if (unlikely(err)) {
-		fcallerror("_fixup_lft", err);
-		goto fail;
+		err = _add_route(spawn, p->port, child->id + 1, child->id + child->nhosts);
+		if (unlikely(err)) {
+			fcallerror("_add_route", err);
+			goto fail;
+		}
 	}
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("free_message_payload", err);
 		return err;
@@ -809,7 +876,7 @@ static int _handle_response_build_tree(struct spawn *spawn, struct message_heade
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
 		fcallerror("free_message_payload", tmp);
 
@@ -822,9 +889,9 @@ static int _handle_request_task(struct spawn *spawn, struct message_header *head
 	struct message_request_task msg;
 	struct job *job;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload_view(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
@@ -836,20 +903,33 @@ static int _handle_request_task(struct spawn *spawn, struct message_header *head
 		goto fail;
 	}
 
+	/* Registered right away so that messages of tasks which were
+	 * already started by the children find the job.
+	 */
+	err = spawn_add_task(spawn, msg.channel, (struct job_task *)job);
+	if (unlikely(err)) {
+		fcallerror("spawn_add_task", err);
+
+		tmp = free_job(&job);
+		if (unlikely(tmp))
+			fcallerror("free_job", tmp);
+		goto fail;
+	}
+
 	list_insert_before(&spawn->jobs, &job->list);
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("free_message_payload", err);
+		fcallerror("free_message_payload_view", err);
 		return err;
 	}
 
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
-		fcallerror("free_message_payload", tmp);
+		fcallerror("free_message_payload_view", tmp);
 
 	return err;
 }
@@ -860,19 +940,23 @@ static int _handle_response_task(struct spawn *spawn, struct message_header *hea
 	struct message_response_task msg;
 	struct job_task *job;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("unpack_message_payload", err);
 		die();	/* FIXME ?*/
 	}
 
-	job = _find_job_task(spawn);
-	if (unlikely(!job))
+	job = _find_job_task(spawn, header->channel);
+	if (unlikely(!job)) {
+		err = -ESOMEFAULT;
 		goto fail;
+	}
 
 	job->acks += 1;
+	if (0 == job->ret)
+		job->ret = msg.ret;
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("free_message_payload", err);
 		return err;
@@ -881,16 +965,22 @@ static int _handle_response_task(struct spawn *spawn, struct message_header *hea
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
 		fcallerror("free_message_payload", tmp);
 
 	return err;
 }
 
-static struct job_task *_find_job_task(struct spawn *spawn)
+static struct job_task *_find_job_task(struct spawn *spawn, ui16 channel)
 {
-	return (struct job_task *)_find_one_and_only_job(spawn, JOB_TYPE_TASK);
+	struct job_task *job;
+
+	job = spawn_find_task(spawn, channel);
+	if (unlikely(!job))
+		error("No task is running on channel %d.", (int )channel);
+
+	return job;
 }
 
 static int _handle_request_exit(struct spawn *spawn, struct message_header *header, struct buffer *buffer)
@@ -900,7 +990,7 @@ static int _handle_request_exit(struct spawn *spawn, struct message_header *head
 	struct job *job;
 	struct timespec timeout;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("unpack_message_payload", err);
 		die();	/* FIXME ?*/
@@ -919,7 +1009,7 @@ static int _handle_request_exit(struct spawn *spawn, struct message_header *head
 
 	list_insert_before(&spawn->jobs, &job->list);
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("free_message_payload", err);
 		return err;
@@ -928,7 +1018,7 @@ static int _handle_request_exit(struct spawn *spawn, struct message_header *head
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
 		fcallerror("free_message_payload", tmp);
 
@@ -941,7 +1031,7 @@ static int _handle_response_exit(struct spawn *spawn, struct message_header *hea
 	struct message_response_exit msg;
 	struct job_exit *job;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("unpack_message_payload", err);
 		die();	/* FIXME ?*/
@@ -953,7 +1043,14 @@ static int _handle_response_exit(struct spawn *spawn, struct message_header *hea
 
 	job->acks += 1;
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	if (msg.profile) {
+		err = alloc_profile_merge(&job->profile, msg.profile->sites,
+		                          msg.profile->nsites);
+		if (unlikely(err))
+			fcallerror("alloc_profile_merge", err);
+	}
+
+	err = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
 		fcallerror("free_message_payload", err);
 		return err;
@@ -962,7 +1059,7 @@ static int _handle_response_exit(struct spawn *spawn, struct message_header *hea
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)&msg);
+	tmp = free_message_payload(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(tmp))
 		fcallerror("free_message_payload", tmp);
 
@@ -974,18 +1071,18 @@ static int _handle_write_stdout(struct spawn *spawn, struct message_header *head
 	int err;
 	struct message_write_stdout msg;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload_view(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
 	fprintf(stdout, "%s", msg.lines);
 	fflush (stdout);
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("free_message_payload", err);
+		fcallerror("free_message_payload_view", err);
 		return err;
 	}
 
@@ -997,18 +1094,18 @@ static int _handle_write_stderr(struct spawn *spawn, struct message_header *head
 	int err;
 	struct message_write_stderr msg;
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg);
+	err = unpack_message_payload_view(buffer, header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
 	fprintf(stderr, "%s", msg.lines);
 	fflush (stderr);
 
-	err = free_message_payload(header, spawn->alloc, (void *)&msg);
+	err = free_message_payload_view(header, &spawn->msgarena.base, (void *)&msg);
 	if (unlikely(err)) {
-		fcallerror("free_message_payload", err);
+		fcallerror("free_message_payload_view", err);
 		return err;
 	}
 
@@ -1027,21 +1124,55 @@ static int _handle_user(struct spawn *spawn, struct message_header *header, stru
 		die();	/* FIXME ?*/
 	}
 
-	err = unpack_message_payload(buffer, header, spawn->alloc, (void *)&msg->msg);
+	/* The payload is not copied. Instead the task receives the buffer
+	 * together with the message and returns it to the pool in
+	 * task_plugin_api_release().
+	 */
+	err = unpack_message_payload_view(buffer, header, spawn->alloc, (void *)&msg->msg);
 	if (unlikely(err)) {
-		fcallerror("unpack_message_payload", err);
+		fcallerror("unpack_message_payload_view", err);
 		die();	/* FIXME ?*/
 	}
 
-	job = _find_job_task(spawn);
-	if (unlikely(!job))
-		goto fail;
+	msg->src    = header->src;
+	msg->buffer = buffer;
 
-	if (unlikely(header->channel != job->channel)) {
-		error("Mismatch between task channel %d and message channel %d.", job->channel, header->channel);
+	job = _find_job_task(spawn, header->channel);
+	if (unlikely(!job)) {
+		err = -ESOMEFAULT;
 		goto fail;
 	}
 
+	/* Pass an abort on to the rest of the tree once.
+	 */
+	if (unlikely(TASK_COLL_ABORT == msg->msg.coll) && !job->aborted) {
+		job->aborted = 1;
+
+		err = task_send_abort(spawn, job->channel, header->src);
+		if (unlikely(err))
+			fcallerror("task_send_abort", err);
+	}
+
+	if (!job->task) {
+		/* After an abort the messages of collective operations
+		 * which were already under way still arrive. The buffer
+		 * goes back to the pool in the fail path.
+		 */
+		if (job->aborted && (1 != job->phase)) {
+			err = 0;
+			goto fail;
+		}
+
+		if (unlikely(1 != job->phase)) {
+			error("Task on channel %d already finished.", job->channel);
+			err = -ESOMEFAULT;
+			goto fail;
+		}
+
+		list_insert_before(&job->early, &msg->list);
+		return 0;
+	}
+
 	/* TODO Retry?
 	 */
 	err = task_enqueue_message(job->task, msg);
@@ -1053,14 +1184,23 @@ static int _handle_user(struct spawn *spawn, struct message_header *header, stru
 	return 0;
 
 fail:
-	tmp = free_message_payload(header, spawn->alloc, (void *)msg);
+	tmp = free_message_payload_view(header, spawn->alloc, (void *)&msg->msg);
 	if (unlikely(tmp))
-		fcallerror("free_message_payload", tmp);
+		fcallerror("free_message_payload_view", tmp);
 
 	tmp = ZFREE(spawn->alloc, (void **)&msg, 1, sizeof(struct task_recvd_message), "");
 	if (unlikely(tmp))
 		fcallerror("ZFREE", tmp);
 
+	/* The message was dropped on purpose. The caller only returns
+	 * the buffer to the pool on failure.
+	 */
+	if (!err) {
+		err = buffer_pool_push(&spawn->bufpool, buffer);
+		if (unlikely(err))
+			fcallerror("buffer_pool_push", err);
+	}
+
 	return err;
 }
 
@@ -1079,6 +1219,9 @@ static int _find_peerport(struct spawn *spawn, ui32 ip, ui32 portnum)
 	found = -1;
 
 	for (i = 0; i < spawn->tree.nports; ++i) {
+		if (spawn->tree.ports[i] < 0)	/* Closed */
+			continue;
+
 		err = _peeraddr(spawn->tree.ports[i], &addr, &port);
 		if (unlikely(err))
 			continue;
@@ -1092,7 +1235,7 @@ static int _find_peerport(struct spawn *spawn, ui32 ip, ui32 portnum)
 	return found;
 }
 
-static int _fix_lft(struct spawn *spawn, int port, int *ids, int nids)
+static int _add_route(struct spawn *spawn, int port, int lo, int hi)
 {
 	int err;
 
@@ -1107,7 +1250,7 @@ static int _fix_lft(struct spawn *spawn, int port, int *ids, int nids)
 	if (unlikely(err))
 		die();
 
-	err = network_modify_lft(&spawn->tree, port, ids, nids);
+	err = network_add_route(&spawn->tree, port, lo, hi);
 	if (unlikely(err))
 		die();
 
@@ -1176,12 +1319,13 @@ static int _declare_child_alive(struct job_build_tree *job, int id)
 	if (unlikely(!child))
 		return -ESOMEFAULT;
 
-	if (unlikely(!child->state == UNKNOWN)) {
+	if (unlikely(UNKNOWN != child->state)) {
 		error("Incorrect state %d (expected UNKNOWN = %d)",
 		      child->state, UNKNOWN);
 	}
 
-	child->state = ALIVE;
+	child->state   = ALIVE;
+	child->latency = llnow_usecs() - child->spawned;
 
 	return 0;
 }
@@ -1194,9 +1338,9 @@ static int _declare_child_ready(struct job_build_tree *job, int id)
 	if (unlikely(!child))
 		return -ESOMEFAULT;
 
-	if (unlikely(!child->state == ALIVE)) {
-		error("Incorrect state %d (expected ALIVE = %d)",
-		      child->state, ALIVE);
+	if (unlikely(BUILDING != child->state)) {
+		error("Incorrect state %d (expected BUILDING = %d)",
+		      child->state, BUILDING);
 	}
 
 	debug("Declaring child %d ready.", child->id);
@@ -1237,6 +1381,52 @@ static int _install_sighandler()
 	return 0;
 }
 
+static void _sigusr1handler(int signum)
+{
+	_dumprecvd = 1;
+}
+
+static int _install_sigusr1handler()
+{
+	struct sigaction act, oact;
+
+	act.sa_handler = _sigusr1handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+
+	if (sigaction(SIGUSR1, &act, &oact) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int _dump_alloc_profile(struct spawn *spawn)
+{
+	int err, tmp;
+	struct alloc_profile profile;
+
+	err = alloc_profile_ctor(&profile, spawn->alloc);
+	if (unlikely(err)) {
+		fcallerror("alloc_profile_ctor", err);
+		return err;
+	}
+
+	err = alloc_profile_snapshot(&profile);
+	if (unlikely(err)) {
+		fcallerror("alloc_profile_snapshot", err);
+		goto fail;
+	}
+
+	err = alloc_profile_log(&profile, 32);
+
+fail:
+	tmp = alloc_profile_dtor(&profile);
+	if (unlikely(tmp))
+		fcallerror("alloc_profile_dtor", tmp);
+
+	return err;
+}
+
 static int _quit(struct spawn *spawn)
 {
 	int err;
@@ -1248,6 +1438,14 @@ static int _quit(struct spawn *spawn)
 	timeout.tv_sec  = 3;
 	timeout.tv_nsec = 0;
 
+	/* No new tasks are accepted once the tree is torn down.
+	 */
+	if (spawn->control) {
+		err = control_shutdown(spawn->control);
+		if (unlikely(err))
+			fcallerror("control_shutdown", err);
+	}
+
 	err = alloc_job_exit(spawn->alloc, &timeout, &job);
 	if (unlikely(err)) {
 		fcallerror("alloc_job_exit", err);
@@ -1259,6 +1457,19 @@ static int _quit(struct spawn *spawn)
 	return 0;
 }
 
+static int _count_jobs(struct spawn *spawn, int type)
+{
+	struct list *p;
+	int n;
+
+	n = 0;
+	LIST_FOREACH(p, &spawn->jobs) {
+		n += (type == LIST_ENTRY(p, struct job, list)->type);
+	}
+
+	return n;
+}
+
 static struct job *_find_one_and_only_job(struct spawn *spawn, int type)
 {
 	int matches;
@@ -1306,9 +1517,17 @@ static int _flush_io_buffers(struct spawn *spawn)
 
 static int _flush_io_buffer(struct spawn *spawn, struct msgbuf *buf, int type)
 {
-	int err;
+	int err, tmp;
 	struct message_header       header;
 	struct message_write_stderr msg;
+	struct list lines;
+
+	/* The lines are detached from the buffer before they are sent.
+	 * spawn_send_message() may block until the communication thread
+	 * made room in the send queue and the communication thread must
+	 * not block in msgbuf_print() meanwhile.
+	 */
+	list_ctor(&lines);
 
 	err = msgbuf_lock(buf);
 	if (unlikely(err)) {
@@ -1316,13 +1535,21 @@ static int _flush_io_buffer(struct spawn *spawn, struct msgbuf *buf, int type)
 		return err;
 	}
 
+	list_splice(&lines, &buf->lines);
+
+	err = msgbuf_unlock(buf);
+	if (unlikely(err)) {
+		fcallerror("msgbuf_unlock", err);
+		return err;
+	}
+
 	/* FIXME This section uses knowledge of the internal structure of struct msgbuf.
 	 */
 	{
 		struct list *p;
 		struct list *q;
 
-		LIST_FOREACH_S(p, q, &buf->lines) {
+		LIST_FOREACH_S(p, q, &lines) {
 			struct msgbuf_line *line = LIST_ENTRY(p, struct msgbuf_line, list);
 
 			memset(&header, 0, sizeof(header));
@@ -1337,7 +1564,7 @@ static int _flush_io_buffer(struct spawn *spawn, struct msgbuf *buf, int type)
 			err = spawn_send_message(spawn, &header, (void *)&msg);
 			if (unlikely(err)) {
 				fcallerror("spawn_send_message", err);
-				return err;
+				goto fail;
 			}
 
 			list_remove(p);
@@ -1348,12 +1575,25 @@ static int _flush_io_buffer(struct spawn *spawn, struct msgbuf *buf, int type)
 		}
 	}
 
-	err = msgbuf_unlock(buf);
-	if (unlikely(err)) {
-		fcallerror("msgbuf_unlock", err);
+	return 0;
+
+fail:
+	/* Put the remaining lines back in front of the lines that were
+	 * added meanwhile.
+	 */
+	tmp = msgbuf_lock(buf);
+	if (unlikely(tmp)) {
+		fcallerror("msgbuf_lock", tmp);
 		return err;
 	}
 
-	return 0;
+	list_splice(&lines, &buf->lines);
+	list_splice(&buf->lines, &lines);
+
+	tmp = msgbuf_unlock(buf);
+	if (unlikely(tmp))
+		fcallerror("msgbuf_unlock", tmp);
+
+	return err;
 }
 
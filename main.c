@@ -26,6 +26,9 @@
 #include "job.h"
 #include "protocol.h"
 #include "msgbuf.h"
+#include "layout.h"
+#include "zygote.h"
+#include "agent.h"
 
 
 /*
@@ -44,7 +47,7 @@ struct _args_other
 	 */
 	int			parent;
 	/* Size of the network. Required in order to setup the
-	 * LFT.
+	 * routing table.
 	 */
 	int			size;
 	/* Network identifier of this process. Required for the
@@ -55,8 +58,10 @@ struct _args_other
 
 static int _main_on_local(int argc, char **argv);
 static int _main_on_other(int argc, char **argv);
+static int _main_agent(int argc, char **argv);
 static int _run_loop(struct spawn *spawn);
 static int _parse_argv_on_other(int argc, char **argv, struct _args_other *args);
+static int _task_arg_from_env(int *here);
 static int _redirect_stdio();
 static int _join(struct alloc *alloc, struct _args_other *args, int *fd,
                  struct optpool **opts);
@@ -67,6 +72,7 @@ static int _connect_to_parent(struct sockaddr_in *sa, int *fd);
 static struct optpool *_alloc_and_fill_optpool(struct alloc *alloc,
                                                const char *file, char **argv);
 static int _check_important_options(struct optpool *opts);
+static int _start_zygote(struct alloc *alloc, struct optpool *opts);
 static int _ignore_sigpipe();
 static void _try_setrlimit_core_unlimited();
 
@@ -112,7 +118,9 @@ int main(int argc, char **argv)
 	n = strlen(argv[0]);
 	m = sizeof("libexec/spawn") - 1;
 
-	if ((n >= m) && !strcmp(argv[0] + n - m, "libexec/spawn"))
+	if ((argc > 1) && !strcmp(argv[1], "--agent"))
+		err = _main_agent(argc, argv);
+	else if ((n >= m) && !strcmp(argv[0] + n - m, "libexec/spawn"))
 		err = _main_on_other(argc, argv);
 	else
 		err = _main_on_local(argc, argv);
@@ -150,30 +158,49 @@ static int _main_on_local(int argc, char **argv)
 	if (unlikely(err))
 		return err;
 
-	err = spawn_ctor(&spawn, alloc, opts, -1, 0);
+	err = _start_zygote(alloc, opts);
+	if (unlikely(err))
+		return err;
+
+	err = spawn_ctor(&spawn, alloc, opts, -1, 0, 0);
 	if (unlikely(err)) {
 		error("struct spawn constructor failed with exit code %d.", err);
 		return err;
 	}
 
-	err = alloc_job_build_tree(alloc, &spawn, spawn.nhosts,
-	                           NULL, &job);
+	/* The communication thread must be running before the tree is
+	 * built since comm_enqueue() blocks if the send queue is full.
+	 */
+	err = spawn_comm_start(&spawn);
 	if (unlikely(err)) {
-		fcallerror("alloc_job_build_tree", err);
-		goto fail;
+		error("Failed to start the communication module.");
+		return err;
 	}
 
-	list_insert_before(&spawn.jobs, &job->list);
-
 	path = optpool_find_by_key(spawn.opts, "ExecPlugin");
 	if (unlikely(!path)) {
 		error("Missing 'ExecPlugin' option.");
-		return -EINVAL;
+		err = -EINVAL;
+		goto fail;
 	}
 
+	/* Also loads the host profile used by the build tree job.
+	 */
 	err = spawn_setup_worker_pool(&spawn, path);
 	if (unlikely(err))
-		return err;
+		goto fail;
+
+	err = spawn_setup_control(&spawn);
+	if (unlikely(err))
+		goto fail;
+
+	err = alloc_job_build_tree(alloc, &spawn, NULL, &job);
+	if (unlikely(err)) {
+		fcallerror("alloc_job_build_tree", err);
+		goto fail;
+	}
+
+	list_insert_before(&spawn.jobs, &job->list);
 
 	err = _run_loop(&spawn);
 	if (unlikely(err))
@@ -192,6 +219,10 @@ fail:
 	if (unlikely(tmp))
 		error("Failed to halt the communication module.");
 
+	tmp = zygote_stop();
+	if (unlikely(tmp))
+		fcallerror("zygote_stop", tmp);
+
 	return err;
 }
 
@@ -245,6 +276,10 @@ static int _main_on_other(int argc, char **argv)
 		return err;
 	}
 
+	err = _start_zygote(alloc, opts);
+	if (unlikely(err))
+		return err;
+
 	err = optpool_find_by_key_as_int(opts, "WatchdogTimeout", &timeout);
 	if (unlikely(err)) {
 		fcallerror("optpool_find_by_key_as_int", err);
@@ -257,7 +292,7 @@ static int _main_on_other(int argc, char **argv)
 		/* continue anyway. */
 	}
 
-	err = spawn_ctor(&spawn, alloc, opts, args.parent, args.here);
+	err = spawn_ctor(&spawn, alloc, opts, args.parent, args.here, args.size);
 	if (unlikely(err)) {
 		error("struct spawn constructor failed with exit code %d.", err);
 		return err;
@@ -272,9 +307,15 @@ static int _main_on_other(int argc, char **argv)
 		return err;
 	}
 
-	err = network_initialize_lft(&spawn.tree, 0);
+	err = network_set_default_route(&spawn.tree, 0);
 	if (unlikely(err)) {
-		fcallerror("network_initialize_lft", err);
+		fcallerror("network_set_default_route", err);
+		return err;
+	}
+
+	err = spawn_comm_start(&spawn);
+	if (unlikely(err)) {
+		error("Failed to start the communication module.");
 		return err;
 	}
 
@@ -291,16 +332,32 @@ static int _main_on_other(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Resident node agent (see agent.h). The options are read from the
+ * configuration file and the command line, e.g.,
+ *   spawn --agent -o AgentPort=<port> -o AgentKeyFile=<path>
+ */
+static int _main_agent(int argc, char **argv)
+{
+	struct alloc *alloc;
+	struct optpool *opts;
+
+	alloc = libc_allocator_with_debugging();
+
+	/* Skip "--agent" which optpool_parse_cmdline_args() does not
+	 * understand.
+	 */
+	opts = _alloc_and_fill_optpool(alloc, SPAWN_CONFIG_DEFAULT, argv + 1);
+	if (unlikely(!opts))
+		return -ESOMEFAULT;
+
+	return agent_main(alloc, opts, main);
+}
+
 static int _run_loop(struct spawn *spawn)
 {
 	int err;
 
-	err = spawn_comm_start(spawn);
-	if (unlikely(err)) {
-		error("Failed to start the communication module.");
-		return err;
-	}
-
 	err = loop(spawn);
 	if (unlikely(err))
 		fcallerror("loop", err);	/* Continue anyway with a proper shutdown. */
@@ -311,6 +368,12 @@ static int _run_loop(struct spawn *spawn)
 		return err;
 	}
 
+	err = zygote_stop();
+	if (unlikely(err)) {
+		fcallerror("zygote_stop", err);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -341,7 +404,14 @@ static int _parse_argv_on_other(int argc, char **argv, struct _args_other *args)
 
 	args->parent = strtol(argv[3], NULL, 10);
 	args->size   = strtol(argv[4], NULL, 10);
-	args->here   = strtol(argv[5], NULL, 10);
+
+	if (!strcmp(argv[5], "-")) {
+		err = _task_arg_from_env(&args->here);
+		if (unlikely(err))
+			return err;
+	} else {
+		args->here = strtol(argv[5], NULL, 10);
+	}
 
 	if (0 == args->size) {
 		error("Invalid size specified on command line.");
@@ -355,6 +425,50 @@ static int _parse_argv_on_other(int argc, char **argv, struct _args_other *args)
 	return 0;
 }
 
+/*
+ * Exec plugins which start a batch of processes with a single command
+ * pass the participant ids as "host1=id1,host2=id2,..." in the
+ * environment (see struct exec_plugin_ops).
+ */
+static int _task_arg_from_env(int *here)
+{
+	const char *args, *host, *p;
+	char buf[HOST_NAME_MAX + 1];
+	int n;
+
+	args = getenv("SPAWN_TASK_ARGS");
+	if (unlikely(!args)) {
+		error("SPAWN_TASK_ARGS is not set.");
+		return -EINVAL;
+	}
+
+	host = getenv("SLURMD_NODENAME");
+	if (!host) {
+		if (unlikely(gethostname(buf, sizeof(buf)))) {
+			error("gethostname() failed. errno = %d says '%s'.",
+			      errno, strerror(errno));
+			return -errno;
+		}
+		buf[sizeof(buf) - 1] = 0;
+		host = buf;
+	}
+
+	n = strlen(host);
+
+	for (p = args; p; p = strchr(p, ',')) {
+		if (',' == *p)
+			++p;
+
+		if (!strncmp(p, host, n) && ('=' == p[n])) {
+			*here = strtol(p + n + 1, NULL, 10);
+			return 0;
+		}
+	}
+
+	error("Host '%s' not found in SPAWN_TASK_ARGS.", host);
+	return -EINVAL;
+}
+
 static int _redirect_stdio()
 {
 	int i;
@@ -445,7 +559,8 @@ static int _send_join_request(struct alloc *alloc, int parent, int here, int fd)
 	header.flags = MESSAGE_FLAG_UCAST;
 	header.type  = MESSAGE_TYPE_REQUEST_JOIN;
 
-	msg.pid = getpid();
+	msg.version = MESSAGE_PROTOCOL_VERSION;
+	msg.pid     = getpid();
 
 	err = sockaddr(fd, &msg.ip, &msg.portnum);
 	if (unlikely(err))
@@ -454,7 +569,7 @@ static int _send_join_request(struct alloc *alloc, int parent, int here, int fd)
 	/* Multiply by two to make sure that pack_message() does
 	 * not lead to a reallocation.
 	 */
-	err = buffer_ctor(&buf, alloc, 2*(sizeof(header) + sizeof(msg)));
+	err = buffer_ctor(&buf, alloc, 2*(MESSAGE_HEADER_MAX_SIZE + sizeof(msg)));
 	if (unlikely(err)) {
 		fcallerror("buffer_ctor", err);
 		return err;
@@ -493,14 +608,18 @@ static int _recv_join_response(struct alloc *alloc, int fd,
 	struct message_header        header;
 	struct message_response_join msg;
 	struct buffer buf;
+	ll size;
 
-	err = buffer_ctor(&buf, alloc, sizeof(header));
+	err = buffer_ctor(&buf, alloc, MESSAGE_HEADER_MAX_SIZE);
 	if (unlikely(err)) {
 		fcallerror("buffer_ctor", err);
 		return err;
 	}
 
-	err = buffer_resize(&buf, sizeof(header));
+	/* The header size is variable but MESSAGE_HEADER_MIN_SIZE bytes
+	 * are always sufficient to determine the message size.
+	 */
+	err = buffer_resize(&buf, MESSAGE_HEADER_MIN_SIZE);
 	if (unlikely(err)) {
 		fcallerror("buffer_resize", err);
 		goto fail;
@@ -514,13 +633,13 @@ static int _recv_join_response(struct alloc *alloc, int fd,
 		}
 	}
 
-	err = secretly_copy_header(&buf, &header);
+	err = peek_message_size(&buf, &size);
 	if (unlikely(err)) {
-		fcallerror("secretly_copy_message_header", err);
+		fcallerror("peek_message_size", err);
 		goto fail;
 	}
 
-	err = buffer_resize(&buf, sizeof(header) + header.payload);
+	err = buffer_resize(&buf, size);
 	if (unlikely(err)) {
 		fcallerror("buffer_resize", err);
 		goto fail;
@@ -534,7 +653,13 @@ static int _recv_join_response(struct alloc *alloc, int fd,
 		}
 	}
 
-	err = buffer_seek(&buf, sizeof(header));
+	err = secretly_copy_header(&buf, &header);
+	if (unlikely(err)) {
+		fcallerror("secretly_copy_message_header", err);
+		goto fail;
+	}
+
+	err = buffer_seek(&buf, header.size);
 	if (unlikely(err)) {
 		fcallerror("buffer_seek", err);
 		goto fail;
@@ -546,6 +671,20 @@ static int _recv_join_response(struct alloc *alloc, int fd,
 		goto fail;
 	}
 
+	if (unlikely(MESSAGE_PROTOCOL_VERSION != msg.version)) {
+		error("Parent speaks protocol version %d but we need version %d.",
+		      (int )msg.version, MESSAGE_PROTOCOL_VERSION);
+		err = -ESOMEFAULT;
+		goto fail;	/* We are going to terminate so do not bother
+				 * about msg.opts. */
+	}
+
+	if (unlikely(MESSAGE_JOIN_REJECTED == msg.addr)) {
+		error("Parent declared this process dead.");
+		err = -ESOMEFAULT;
+		goto fail;
+	}
+
 	*opts = msg.opts;
 
 	err = buffer_dtor(&buf);
@@ -617,12 +756,44 @@ fail:
 	return NULL;
 }
 
+/*
+ * Start the fork server if requested. Must be called before any thread
+ * is created.
+ */
+static int _start_zygote(struct alloc *alloc, struct optpool *opts)
+{
+	int err;
+	int forkserver;
+
+	err = optpool_find_by_key_as_int(opts, "ForkServer", &forkserver);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();	/* Should not happen since we have default values
+			 * in place. */
+	}
+
+	if (!forkserver)
+		return 0;
+
+	err = zygote_start(alloc, main);
+	if (unlikely(err)) {
+		fcallerror("zygote_start", err);
+		/* Continue without. */
+	}
+
+	return 0;
+}
+
 static int _check_important_options(struct optpool *opts)
 {
+	int err;
 	const char *p;
+	int type;
 
+	/* Tasks may also be submitted through the control socket.
+	 */
 	p = optpool_find_by_key(opts, "TaskPlugin");
-	if (unlikely(!p)) {
+	if (unlikely(!p) && !optpool_find_by_key(opts, "ControlSocket")) {
 		error("Missing 'TaskPlugin' option.");
 		return -EINVAL;
 	}
@@ -633,6 +804,19 @@ static int _check_important_options(struct optpool *opts)
 		return -EINVAL;
 	}
 
+	p = optpool_find_by_key(opts, "TreeLayout");
+	if (p) {
+		err = tree_layout_from_string(p, &type);
+		if (unlikely(err))
+			return err;
+
+		if ((TREE_LAYOUT_TOPOLOGY == type) &&
+		    unlikely(!optpool_find_by_key(opts, "TreeTopologyFile"))) {
+			error("Missing 'TreeTopologyFile' option.");
+			return -EINVAL;
+		}
+	}
+
 	return 0;
 }
 
@@ -11,14 +11,16 @@
 
 static int _close_listenfds(struct network *self);
 static int _clear_listenfds(struct network *self);
+static int _merge_routes(struct network *self, si32 from, si32 to);
 
 
 int network_ctor(struct network *self, struct alloc *alloc)
 {
 	memset(self, 0, sizeof(*self));
 
-	self->alloc = alloc;
-	self->newfd = -1;
+	self->alloc   = alloc;
+	self->newfd   = -1;
+	self->defport = -1;
 
 	_clear_listenfds(self);
 
@@ -27,6 +29,13 @@ int network_ctor(struct network *self, struct alloc *alloc)
 
 int network_dtor(struct network *self)
 {
+	int err;
+
+	err = ZFREE(self->alloc, (void **)&self->routes, self->maxroutes,
+	            sizeof(struct network_route), "routes");
+	if (unlikely(err))
+		fcallerror("ZFREE", err);
+
 	memset(self, 0, sizeof(*self));
 
 	_close_listenfds(self);
@@ -63,26 +72,12 @@ int network_lock_release(struct network *self)
 
 int network_resize(struct network *self, int size)
 {
-	int err;
-	int i;
-
-	if (unlikely(self->size > 0)) {
-		/* FIXME Reallocating the memory is not a problem but what should
-		 *       we do with the lft content? */
-		error("network_resize() does not support this case yet.");
-		return -ENOTIMPL;
-	}
-
-	err = ZALLOC(self->alloc, (void **)&self->lft, size,
-	             sizeof(si32), "lft");
-	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
-		return err;
-	}
-
-	for (i = 0; i < size; ++i)
-		self->lft[i] = -1;
+	if (unlikely(size < 0))
+		return -EINVAL;
 
+	/* The routing table does not depend on the network size. Routes
+	 * beyond the new size simply become unreachable.
+	 */
 	self->size = size;
 
 	return 0;
@@ -133,78 +128,124 @@ int network_add_ports(struct network *self, int *fds, int nfds)
 	return 0;
 }
 
-int network_initialize_lft(struct network *self, int port)
+int network_set_default_route(struct network *self, int port)
 {
-	si32 i;
-
 	if (unlikely(!self || (port < 0) || (port >= self->nports)))
 		return -EINVAL;
 
-	for (i = 0; i < self->size; ++i)
-		self->lft[i] = port;
+	self->defport = port;
 
 	return 0;
 }
 
-int network_modify_lft(struct network *self, int port, si32 *ids, si32 nids)
+int network_add_route(struct network *self, int port, si32 lo, si32 hi)
 {
-	si32 i;
+	int err;
+	si32 i, j, k, n;
+	int nleft, nright;
+	struct network_route left, right;
 
-	if (unlikely(!self || !ids ||
-	             (nids < 0) || (nids > self->size) ||
+	if (unlikely(!self ||
+	             (lo < 0) || (lo > hi) || (hi >= self->size) ||
 	             (port < 0) || (port >= self->nports)))
 		return -EINVAL;
 
-	for (i = 0; i < nids; ++i) {
-		if (unlikely((ids[i] < 0) || (ids[i] >= self->size)))
-			return -EINVAL;
+	/* Replacing the overlapped routes adds at most two entries (if the
+	 * new interval splits an existing one).
+	 */
+	if (self->nroutes + 2 > self->maxroutes) {
+		n = MAX(8, 2*self->maxroutes);
+
+		err = ZREALLOC(self->alloc, (void **)&self->routes,
+		               self->maxroutes, sizeof(struct network_route),
+		               n, sizeof(struct network_route), "routes");
+		if (unlikely(err)) {
+			fcallerror("ZREALLOC", err);
+			return err;
+		}
 
-		self->lft[ids[i]] = port;
+		self->maxroutes = n;
 	}
 
-	return 0;
-}
+	/* Fast path: The new route follows all existing ones.
+	 */
+	n = self->nroutes;
+	if ((0 == n) || (self->routes[n-1].hi < lo)) {
+		if ((n > 0) && (port == self->routes[n-1].port) &&
+		    (self->routes[n-1].hi + 1 == lo)) {
+			self->routes[n-1].hi = hi;
+			return 0;
+		}
 
-int network_debug_print_lft(struct network *self)
-{
-	int i, n;
+		self->routes[n].lo   = lo;
+		self->routes[n].hi   = hi;
+		self->routes[n].port = port;
+		self->nroutes += 1;
+
+		return 0;
+	}
 
+	/* Routes i, ..., j-1 overlap with [lo, hi]. They are replaced by
+	 * the parts sticking out on the left and right and the new route.
+	 */
 	i = 0;
-	while (i < self->size) {
-		n = MIN(4, self->size - i);
-
-		switch (n) {
-		case 4:
-			debug("%2d-%2d: %2d, %2d, %2d, %2d",
-			      i, i+n-1,
-			      self->lft[i  ], self->lft[i+1], self->lft[i+2],
-			      self->lft[i+3]);
-			break;
-		case 3:
-			debug("%2d-%2d: %2d, %2d, %2d",
-			      i, i+n-1,
-			      self->lft[i  ], self->lft[i+1], self->lft[i+2]);
-			break;
-		case 2:
-			debug("%2d-%2d: %2d, %2d",
-			      i, i+n-1,
-			      self->lft[i  ], self->lft[i+1]);
-			break;
-		case 1:
-			debug("%2d-%2d: %2d",
-			      i, i+n-1,
-			      self->lft[i  ]);
-			break;
-		default:
-			die();	/* Impossible */
-		}
+	j = self->nroutes;
+	while (i < j) {
+		n = i + (j - i)/2;
+		if (self->routes[n].hi < lo)
+			i = n + 1;
+		else
+			j = n;
+	}
+	for (j = i; (j < self->nroutes) && (self->routes[j].lo <= hi); ++j);
 
-		i += n;
+	nleft = ((i < j) && (self->routes[i].lo < lo));
+	if (nleft) {
+		left    = self->routes[i];
+		left.hi = lo - 1;
+	}
+	nright = ((i < j) && (self->routes[j-1].hi > hi));
+	if (nright) {
+		right    = self->routes[j-1];
+		right.lo = hi + 1;
 	}
 
-	return 0;
+	k = nleft + 1 + nright;
+
+	memmove(self->routes + i + k, self->routes + j,
+	        (self->nroutes - j)*sizeof(struct network_route));
+	self->nroutes += k - (j - i);
+
+	n = i;
+
+	if (nleft)
+		self->routes[i++] = left;
+
+	self->routes[i].lo   = lo;
+	self->routes[i].hi   = hi;
+	self->routes[i].port = port;
+
+	if (nright)
+		self->routes[i+1] = right;
+
+	/* Only the new entries and their direct neighbours may need to be
+	 * merged.
+	 */
+	return _merge_routes(self, MAX(n - 1, 0), MIN(n + k, self->nroutes - 1));
 }
 
+int network_debug_print_routes(struct network *self)
+{
+	si32 i;
+
+	for (i = 0; i < self->nroutes; ++i)
+		debug("%2d-%2d: %2d", self->routes[i].lo, self->routes[i].hi,
+		      self->routes[i].port);
+
+	debug("default: %2d", self->defport);
+
+	return 0;
+}
 
 static int _close_listenfds(struct network *self)
 {
@@ -236,3 +277,31 @@ static int _clear_listenfds(struct network *self)
 	return 0;
 }
 
+/*
+ * Join adjacent routes through the same port in the range from, ..., to.
+ * This keeps the table at one entry per child since the route for the
+ * child itself is installed before the route for its subtree.
+ */
+static int _merge_routes(struct network *self, si32 from, si32 to)
+{
+	si32 i, n;
+
+	if (from >= to)
+		return 0;
+
+	n = from + 1;
+	for (i = from + 1; i <= to; ++i) {
+		if ((self->routes[n-1].port == self->routes[i].port) &&
+		    (self->routes[n-1].hi + 1 == self->routes[i].lo))
+			self->routes[n-1].hi = self->routes[i].hi;
+		else
+			self->routes[n++] = self->routes[i];
+	}
+
+	memmove(self->routes + n, self->routes + to + 1,
+	        (self->nroutes - (to + 1))*sizeof(struct network_route));
+	self->nroutes -= (to + 1) - n;
+
+	return 0;
+}
+
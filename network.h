@@ -7,6 +7,16 @@
 
 struct alloc;
 
+/*
+ * Entry in the routing table.
+ */
+struct network_route
+{
+	si32	lo;
+	si32	hi;	/* Inclusive */
+	si32	port;
+};
+
 /*
  * Network data structure.
  */
@@ -14,17 +24,23 @@ struct network
 {
 	struct alloc	*alloc;
 
-	/* The actual network size is restricted to 65536 participants
-	 * since we use an unsigned integer of width 16 in the protocol.
+	/* Participant identifiers are 32-bit wide in the protocol so the
+	 * network size is only limited by the range of si32.
 	 */
 	si32		size;
 	si32		here;	/* Participant identifier */
 
-	/* Linear forwarding table for network routing. The lft maps the
-	 * identifier of each participant to the port to which packets
-	 * should be passed.
+	/* Routing table. Since every subtree covers a contiguous range of
+	 * participant identifiers the table is stored as a sorted list of
+	 * disjoint intervals [lo, hi] each of which is mapped to the port to
+	 * which packets should be passed. Identifiers not covered by any
+	 * interval are routed through defport (or dropped if defport is -1).
+	 * The number of intervals is of the order of the tree width.
 	 */
-	si32		*lft;
+	struct network_route	*routes;
+	si32			nroutes;
+	si32			maxroutes;
+	si32			defport;
 
 	/* Each port is a socket. nports is equal to the tree width plus one
 	 * and equals the storage size of ports.
@@ -73,33 +89,70 @@ int network_resize(struct network *self, int size);
 int network_add_listenfds(struct network *self, int *fds, int nfds);
 
 /*
- * Add some new ports to the network. The LFT is left unchanged.
+ * Add some new ports to the network. The routing table is left unchanged.
  * Make sure to hold the lock when calling this function.
  */
 int network_add_ports(struct network *self, int *fds, int nfds);
 
 /*
- * Initialize the LFT such that messages to all network participants
- * are routed through the given port.
+ * Route messages to all network participants which are not covered by
+ * an explicit route through the given port.
  *
- * FIXME The use of network_initialize_lft() has the disadvantage that
+ * FIXME The use of network_set_default_route() has the disadvantage that
  *       we will have (seemingly) valid routing entries for potentially
  *       non-existing hosts.
  */
-int network_initialize_lft(struct network *self, int port);
+int network_set_default_route(struct network *self, int port);
 
 /*
- * Modify the LFT such that all packages for the specified ids are routed
- * through the given port.
+ * Modify the routing table such that all packages for the ids lo, lo + 1,
+ * ..., hi are routed through the given port. Existing routes overlapping
+ * with the interval are replaced.
+ *
+ * The insert position is found by binary search and only the neighbours of
+ * the new entry are merged. Routes added in increasing id order (as the
+ * children of a process are) are appended in constant time so installing
+ * the routes of all children costs O(children).
  *
  * Make sure to hold the lock when calling this function.
  */
-int network_modify_lft(struct network *self, int port, si32 *ids, si32 nids);
+int network_add_route(struct network *self, int port, si32 lo, si32 hi);
+
+/*
+ * Look up the port for a participant. Returns -1 if there is no route.
+ */
+static inline int network_route(const struct network *self, si32 id)
+{
+	const struct network_route *x;
+	si32 n, half;
+
+	if ((id < 0) || (id >= self->size))
+		return -1;
+	if (0 == self->nroutes)
+		return self->defport;
+
+	/* Find the last interval with lo <= id (or the first interval if
+	 * there is none). The loop is written such that the compiler can
+	 * use conditional moves instead of unpredictable branches.
+	 */
+	x = self->routes;
+	n = self->nroutes;
+	while (n > 1) {
+		half = n/2;
+		x    = (x[half].lo <= id) ? x + half : x;
+		n   -= half;
+	}
+
+	if ((x->lo <= id) && (id <= x->hi))
+		return x->port;
+
+	return self->defport;
+}
 
 /*
- * Print the LFT for debugging purposes
+ * Print the routing table for debugging purposes
  */
-int network_debug_print_lft(struct network *self);
+int network_debug_print_routes(struct network *self);
 
 #endif
 
@@ -19,6 +19,8 @@ struct kvpair
 	char		*key;
 	char		*val;
 
+	int		local;	/* Not forwarded by optpool_buffer_pack() */
+
 	struct list	list;
 };
 
@@ -172,6 +174,19 @@ int optpool_find_by_key_as_int(struct optpool *self,
 	return 0;
 }
 
+int optpool_keep_local(struct optpool *self, const char *key)
+{
+	struct kvpair *opt;
+
+	opt = _find_option_by_key(self, key);
+	if (unlikely(!opt))
+		return -EINVAL;
+
+	opt->local = 1;
+
+	return 0;
+}
+
 int optpool_buffer_pack(struct optpool *self, struct buffer *buffer)
 {
 	int err, i;
@@ -179,7 +194,9 @@ int optpool_buffer_pack(struct optpool *self, struct buffer *buffer)
 	struct list *p;
 	struct kvpair *opt;
 
-	len = list_length(&self->opts);
+	len = 0;
+	LIST_FOREACH(p, &self->opts)
+		len += !LIST_ENTRY(p, struct kvpair, list)->local;
 
 	err = buffer_pack_ui64(buffer, &len, 1);
 	if (unlikely(err))
@@ -188,6 +205,9 @@ int optpool_buffer_pack(struct optpool *self, struct buffer *buffer)
 	LIST_FOREACH(p, &self->opts) {
 		opt = LIST_ENTRY(p, struct kvpair, list);
 
+		if (opt->local)
+			continue;
+
 		i = strlen(opt->key);
 		opt->key[i] = '=';
 
@@ -52,7 +52,15 @@ int optpool_find_by_key_as_int(struct optpool *self,
                                const char *key, int *result);
 
 /*
- * Serialize and de-serialize a struct optpool.
+ * Mark an option as local to this process. Local options are skipped by
+ * optpool_buffer_pack() and hence not forwarded down the tree. Returns
+ * -EINVAL if there is no option with the given key.
+ */
+int optpool_keep_local(struct optpool *self, const char *key);
+
+/*
+ * Serialize and de-serialize a struct optpool. Options marked with
+ * optpool_keep_local() are not serialized.
  */
 int optpool_buffer_pack(struct optpool *self, struct buffer *buffer);
 int optpool_buffer_unpack(struct optpool *self, struct buffer *buffer);
@@ -65,6 +65,8 @@ int buffer_clear(struct buffer *self)
 	self->size = 0;
 	self->pos  = 0;
 
+	self->hdrvalid = 0;
+
 	return 0;
 }
 
@@ -168,6 +170,9 @@ int buffer_copy(struct buffer *self, struct buffer* other)
 	self->size = other->size;
 	self->pos  = other->pos;
 
+	self->hdr      = other->hdr;
+	self->hdrvalid = other->hdrvalid;
+
 	return 0;
 }
 
@@ -226,6 +231,33 @@ DEFINE_PACK_UNPACK_FUNCTIONS(ui32)
 DEFINE_PACK_UNPACK_FUNCTIONS(si64)
 DEFINE_PACK_UNPACK_FUNCTIONS(ui64)
 
+int buffer_pack_reserve(struct buffer *self, ll size, void **p)
+{
+	int err;
+	ll x;
+
+	if (unlikely(!self || !p || (size < 0)))
+		return -EINVAL;
+
+	if (unlikely(self->pos + size > self->memsize)) {
+		x = MAX(self->memsize, 1);
+		while (self->pos + size > x)
+			x *= 2;
+
+		err = _buffer_realloc(self, x);
+		if (unlikely(err)) {
+			fcallerror("_buffer_realloc()", err);
+			return err;
+		}
+	}
+
+	*p = self->buf + self->pos;
+	self->pos  += size;
+	self->size = MAX(self->size, self->pos);
+
+	return 0;
+}
+
 int buffer_pack_string(struct buffer *self, const char *str)
 {
 	int err;
@@ -332,6 +364,83 @@ fail:
 	return err;
 }
 
+int buffer_unpack_view(struct buffer *self, ll size, void **p)
+{
+	if (unlikely(!self || !p || (size < 0)))
+		return -EINVAL;
+
+	if (unlikely(self->pos + size > self->size)) {
+		error("Reached end of buffer.");
+		return -ESOMEFAULT;
+	}
+
+	*p = self->buf + self->pos;
+	self->pos += size;
+
+	return 0;
+}
+
+int buffer_unpack_string_view(struct buffer *self, const char **str)
+{
+	int err;
+	ui64 len;
+
+	err = buffer_unpack_ui64(self, &len, 1);
+	if (unlikely(err))
+		return err;
+
+	*str = NULL;
+
+	if (len > 0) {
+		err = buffer_unpack_view(self, len, (void **)str);
+		if (unlikely(err))
+			return err;
+
+		/* The packed string includes the terminating zero. Do not
+		 * trust the peer on that.
+		 */
+		if (unlikely('\0' != (*str)[len - 1])) {
+			error("String is not zero terminated.");
+			*str = NULL;
+			return -ESOMEFAULT;
+		}
+	}
+
+	return 0;
+}
+
+int buffer_unpack_array_of_str_view(struct buffer *self, struct alloc *alloc,
+                                    ui64 *n, char ***str)
+{
+	int err, tmp;
+	int i;
+
+	err = buffer_unpack_ui64(self, n, 1);
+	if (unlikely(err))
+		return err;
+
+	err = ZALLOC(alloc, (void **)str, *n, sizeof(char *), "");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	for (i = 0; i < (*n); ++i) {
+		err = buffer_unpack_string_view(self, (const char **)&(*str)[i]);
+		if (unlikely(err))
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	tmp = ZFREE(alloc, (void **)str, (*n), sizeof(char *), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
 int buffer_pool_ctor(struct buffer_pool *self, struct alloc *alloc, ll size)
 {
 	int err, tmp;
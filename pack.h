@@ -3,8 +3,10 @@
 #define SPAWN_PACK_H_INCLUDED 1
 
 #include "ints.h"
+#include "list.h"
 #include "thread.h"
 #include "queue.h"
+#include "protocol.h"	/* For message_header */
 
 /*
  * TODO Handle endianess. I do not like the idea to convert everything from
@@ -27,6 +29,17 @@ struct buffer
 	ll		size;
 	/* Position pointer used for packing. */
 	ll		pos;
+
+	/* Parsed copy of the message header stored at the beginning
+	 * of the buffer. Only valid if hdrvalid is non-zero. The cache
+	 * is filled by pack_message() and secretly_copy_header() and
+	 * dropped by buffer_clear(). */
+	struct message_header	hdr;
+	int			hdrvalid;
+
+	/* Used by struct comm to queue local messages that did not fit
+	 * into the receive queue. */
+	struct list		list;
 };
 
 /*
@@ -113,6 +126,14 @@ int buffer_unpack_si64(struct buffer *self, si64 *value, ll num);
 int buffer_pack_ui64(struct buffer *self, const ui64 *value, ll num);
 int buffer_unpack_ui64(struct buffer *self, ui64 *value, ll num);
 
+/*
+ * Reserve size bytes at the current position for packing and advance the
+ * position pointer. On return p points to the reserved memory which the
+ * caller is expected to fill. This allows to grow the buffer once if the
+ * total size of the data is known in advance.
+ */
+int buffer_pack_reserve(struct buffer *self, ll size, void **p);
+
 /*
  * Pack and unpack a zero terminated string.
  */
@@ -126,6 +147,21 @@ int buffer_pack_array_of_str(struct buffer *self, ui64 n, char *const *str);
 int buffer_unpack_array_of_str(struct buffer *self, struct alloc *alloc,
                                ui64 *n, char ***str);
 
+/*
+ * Zero-copy variants of the unpack functions. Instead of copying the data out
+ * of the buffer the result points directly into the buffer memory. The views
+ * are only valid as long as the buffer content is not modified, i.e., until
+ * the buffer is cleared, resized or returned to its pool.
+ *
+ * buffer_unpack_view() returns a view of size bytes starting at the current
+ * position. buffer_unpack_array_of_str_view() allocates the pointer array
+ * with alloc, the strings themselves are views.
+ */
+int buffer_unpack_view(struct buffer *self, ll size, void **p);
+int buffer_unpack_string_view(struct buffer *self, const char **str);
+int buffer_unpack_array_of_str_view(struct buffer *self, struct alloc *alloc,
+                                    ui64 *n, char ***str);
+
 /*
  * A thread-safe pool of buffers. Due to the asynchronous messaging scheme used in this
  * application keeping track of all buffers is a tricky business in particular if we like
@@ -1,6 +1,8 @@
 
 #include <stdlib.h>
+#include <string.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "compiler.h"
@@ -8,37 +10,115 @@
 #include "plugin.h"
 
 
+/*
+ * Plugins keep their state in static variables and plugin_construct()
+ * may only be called once per load. Hence a plugin which is loaded
+ * multiple times at once (e.g., by concurrent tasks) is constructed once
+ * and shared. dlopen() counts the references to the same file as well
+ * and only unmaps it after the last dlclose().
+ */
+#define PLUGIN_MAX_LOADED	64
+
+static struct
+{
+	void		*handle;
+	struct plugin	*plu;
+	int		refs;
+} _loaded[PLUGIN_MAX_LOADED];
+
+static pthread_mutex_t _loaded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 struct plugin *load_plugin(const char *path)
 {
 	void *handle;
 	struct plugin *plu;
 	struct plugin *(*construct)();
+	int i, j;
+
+	pthread_mutex_lock(&_loaded_lock);
 
 	dlerror();
 
 	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
 	if (unlikely(!handle)) {
 		error("dlopen() failed. dlerror() says '%s'.", dlerror());
-		return NULL;
+		plu = NULL;
+		goto out;
+	}
+
+	j = -1;
+	for (i = 0; i < PLUGIN_MAX_LOADED; ++i) {
+		if (_loaded[i].handle == handle) {
+			_loaded[i].refs += 1;
+			plu = _loaded[i].plu;
+			goto out;
+		}
+		if ((-1 == j) && !_loaded[i].handle)
+			j = i;
+	}
+
+	if (unlikely(-1 == j)) {
+		error("Too many plugins are loaded.");
+		goto fail;
 	}
 
 	construct = dlsym(handle, "plugin_construct");
 	if (unlikely(!construct)) {
 		error("Module does not provide the 'plugin_construct' function.");
-		dlclose(handle);
-		return NULL;
+		goto fail;
 	}
 
 	plu = construct();
 	if (unlikely(!plu)) {
 		error("Plugin constructor failed.");
-		dlclose(handle);
-		return NULL;
+		goto fail;
 	}
 
 	plu->handle = handle;
 
+	_loaded[j].handle = handle;
+	_loaded[j].plu    = plu;
+	_loaded[j].refs   = 1;
+
+out:
+	pthread_mutex_unlock(&_loaded_lock);
+
 	return plu;
+
+fail:
+	dlclose(handle);
+
+	pthread_mutex_unlock(&_loaded_lock);
+
+	return NULL;
+}
+
+int unload_plugin(struct plugin *plu)
+{
+	int err;
+	int i;
+
+	pthread_mutex_lock(&_loaded_lock);
+
+	for (i = 0; i < PLUGIN_MAX_LOADED; ++i) {
+		if (_loaded[i].handle == plu->handle) {
+			if (0 == --_loaded[i].refs)
+				memset(&_loaded[i], 0, sizeof(_loaded[i]));
+			break;
+		}
+	}
+
+	err = 0;
+
+	if (unlikely(dlclose(plu->handle))) {
+		error("dlclose() failed. dlerror() says '%s'.", dlerror());
+		err = -ESOMEFAULT;
+	}
+
+	pthread_mutex_unlock(&_loaded_lock);
+
+	return err;
 }
 
 struct exec_plugin *cast_to_exec_plugin(struct plugin *plu)
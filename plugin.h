@@ -48,10 +48,9 @@ struct plugin
  */
 struct plugin_ops
 {
-	/* FIXME init() and fini() are never called.
-	 */
-	/* FIXME Pass command line arguments/options as the
-	 *       second argument.
+	/* init() is called for exec plugins after loading them with
+	 * the struct optpool of the process as opts.
+	 * FIXME fini() is never called.
 	 */
 	int	(*init)(struct plugin *self, void *opts);
 	int	(*fini)(struct plugin *self);
@@ -82,6 +81,31 @@ struct exec_plugin_ops
 	int	(*exec)(struct exec_plugin *self,
 		        const char *host,
 	                char *const *argv);
+	/* Asynchronous variant of exec(). Starts the process performing
+	 * the spawn on host and returns its pid without waiting for it.
+	 * The caller reaps the process and interprets the exit status
+	 * like exec() does (see exit_status_to_error()).
+	 */
+	int	(*start)(struct exec_plugin *self,
+		         const char *host,
+		         char *const *argv,
+		         int *pid);
+	/* Batch variants of exec() and start() for n distinct hosts. The
+	 * argument vectors only differ in their last element so that a
+	 * plugin can start all processes with a single command. Such a
+	 * plugin replaces the last element by "-" and passes
+	 * "host1=arg1,host2=arg2,..." in the environment variable
+	 * SPAWN_TASK_ARGS. The result applies to all hosts.
+	 */
+	int	(*exec_many)(struct exec_plugin *self,
+		             int n,
+		             char *const *hosts,
+		             char *const *const *argvs);
+	int	(*start_many)(struct exec_plugin *self,
+		              int n,
+		              char *const *hosts,
+		              char *const *const *argvs,
+		              int *pid);
 };
 
 /*
@@ -117,10 +141,18 @@ struct task_plugin_ops
 };
 
 /*
- * Load a plugin from disk.
+ * Load a plugin from disk. Loading a plugin that is already loaded
+ * returns the same object and takes another reference.
  */
 struct plugin *load_plugin(const char *path);
 
+/*
+ * Unload a plugin returned by load_plugin() (or a copy of it). Once the
+ * last reference is gone the next load_plugin() of the same file
+ * constructs the plugin anew.
+ */
+int unload_plugin(struct plugin *plu);
+
 /*
  * Check that the plugin is of type PLUGIN_EXEC and cast to exec_plugin
  * if the type is correct.
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "helper.h"
+#include "alloc.h"
+#include "options.h"
+#include "plugin.h"
+#include "agent.h"
+
+
+static int _init(struct plugin *self, void *opts);
+static int _exec(struct exec_plugin *self,
+                 const char *host,
+                 char *const *argv);
+
+static int  _port;
+static int  _haskey;
+static char _key[AGENT_MAX_KEY_LEN + 1];
+
+static struct plugin_ops _agent_base_ops = {
+	.init = _init
+};
+
+static struct exec_plugin_ops _agent_ops = {
+	.exec = _exec
+};
+
+static struct exec_plugin _agent = {
+	.base = {
+		.name = "agent",
+		.version = 1,
+		.type = PLUGIN_EXEC,
+		.ops = &_agent_base_ops
+	},
+	.ops = &_agent_ops
+};
+
+struct plugin *plugin_construct()
+{
+	static int init = 0;
+
+	if (0 != init) {
+		error("plugin_construct() should only be called once.");
+		return NULL;
+	}
+	init = 1;
+
+	return (struct plugin *)&_agent;
+}
+
+
+static int _init(struct plugin *self, void *opts)
+{
+	int err;
+	const char *path;
+
+	err = optpool_find_by_key_as_int(opts, "AgentPort", &_port);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		return err;
+	}
+
+	path = optpool_find_by_key(opts, "AgentKeyFile");
+	if (path) {
+		err = agent_read_key(path, _key, sizeof(_key));
+		if (unlikely(err)) {
+			fcallerror("agent_read_key", err);
+			return err;
+		}
+
+		_haskey = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * No process is created on this side. The agent on host forks the new
+ * process of the tree and replies once it is running.
+ */
+static int _exec(struct exec_plugin *self,
+                 const char *host,
+                 char *const *argv)
+{
+	if (unlikely(!host))
+		return -EINVAL;
+
+	return agent_attach(libc_allocator(), host, _port,
+	                    (_haskey) ? _key : NULL, argv);
+}
+
@@ -65,6 +65,9 @@ static int _other(struct task_plugin *self,
 	long long child;
 	int status;
 	int fdo[2], fde[2];
+	int dups[2][2], closefds[2];
+	char *env[] = {NULL};
+	int pid;
 
 	err = pipe(fdo);
 	if (unlikely(err < 0)) {
@@ -80,33 +83,22 @@ static int _other(struct task_plugin *self,
 		return -errno;
 	}
 
-	child = fork();
-	if (0 == child) {
-		char *env[] = {NULL};
+	dups[0][0] = fdo[1];
+	dups[0][1] = STDOUT_FILENO;
+	dups[1][0] = fde[1];
+	dups[1][1] = STDERR_FILENO;
 
-		close(fdo[0]);
-		if (fdo[1] != STDOUT_FILENO) {
-			dup2 (fdo[1], STDOUT_FILENO);
-			close(fdo[1]);
-		}
-
-		close(fde[0]);
-		if (fde[1] != STDERR_FILENO) {
-			dup2 (fde[1], STDERR_FILENO);
-			close(fde[1]);
-		}
+	closefds[0] = fdo[0];
+	closefds[1] = fde[0];
 
-		execve(argv[0], argv, env);
-		error("execve() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		exit(-1);
-	}
-	else if (unlikely(-1 == child)) {
-		error("fork() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
+	err = spawn_process(argv, env, dups, 2, closefds, 2, &pid);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		return err;
 	}
 
+	child = pid;
+
 	log("Child process %d is alive.", (int )child);
 
 	/* FIXME Error handling.
@@ -196,10 +188,10 @@ static int _watch_child(struct task_plugin *self, long long *child, int *status,
 		quit = (0 == *child) && (0 == k);
 
 		if (*child) {
-			p = waitpid(*child, status, WNOHANG);
+			p = wait_process(*child, status, WNOHANG);
 			if (p) {
 				if (unlikely(p != *child)) {
-					error("waitpid() failed. errno = %d says '%s'.",
+					error("wait_process() failed. errno = %d says '%s'.",
 					      errno, strerror(errno));
 					return -errno;
 				}
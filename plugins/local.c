@@ -8,15 +8,21 @@
 
 #include "compiler.h"
 #include "error.h"
+#include "helper.h"
 #include "plugin.h"
 
 
 static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv);
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid);
 
 static struct exec_plugin_ops _local_ops = {
-	.exec = _exec
+	.exec  = _exec,
+	.start = _start
 };
 
 static struct exec_plugin _local = {
@@ -46,10 +52,35 @@ static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv)
 {
-	long long child;
+	int err;
+	int child;
 	long long p;
 	int status;
 
+	err = _start(self, host, argv, &child);
+	if (unlikely(err))
+		return err;
+
+	/* TODO Handle EINTR? */
+	p = wait_process(child, &status, 0);
+	if (unlikely(p != child)) {
+		error("wait_process() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+		return -errno;
+	}
+
+	return exit_status_to_error(status);
+}
+
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid)
+{
+	int err;
+	int child;
+	char *env[] = {NULL};
+
 	if (unlikely(!host))
 		return -EINVAL;
 
@@ -58,42 +89,15 @@ static int _exec(struct exec_plugin *self,
 		     "instead of host '%s'", host);
 	}
 
-	child = fork();
-	if (0 == child) {
-		char *env[] = {NULL};
-
-		execve(argv[0], argv, env);
-		error("execve() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		exit(-1);
-	}
-	else if (unlikely(-1 == child)) {
-		error("fork() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
+	err = spawn_process(argv, env, NULL, 0, NULL, 0, &child);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		return err;
 	}
 
 	log("Child process %d is alive.", (int )child);
 
-	/* TODO Handle EINTR? */
-	p = waitpid(child, &status, 0);
-	if (unlikely(p != child)) {
-		error("waitpid() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
-	}
-
-	if (likely(WIFEXITED(status))) {
-		log("Child process terminated with exit code %d.", WEXITSTATUS(status));
-		return -WEXITSTATUS(status);
-
-	} else if(WIFSIGNALED(status)) {
-		log("Child was terminated by signal %d.", WTERMSIG(status));
-		return -ESOMEFAULT;
-	} else {
-		error("Child neithr terminated nor was terminated by a signal.");
-		return -ESOMEFAULT;
-	}
+	*pid = child;
 
 	return 0;
 }
@@ -25,12 +25,27 @@ static int _local(struct task_plugin *self,
                   int argc, char **argv);
 static int _other(struct task_plugin *self,
                   int argc, char **argv);
+static int _run(struct task_plugin *self,
+                int argc, char **argv);
 static int _watch_child(struct task_plugin *self, long long *child, int *status,
                         int fdo, int fde, struct pmi_server *pmisrv);
 static int _read_from_child(int fd, char *line, int *len, ll *size,
                             struct task_plugin *plu,
                             int (*flush)(struct task_plugin *, const char *));
 static int _kvs_fence(struct pmi_server *srv, void *ctx);
+static int _kvs_exchange(struct task_plugin *self, struct pmi_server *srv,
+                         ui32 done, ui32 *ndone, ui8 **bytes, ui64 *len);
+static int _kvs_finish(struct task_plugin *self, ui32 done);
+static int _kvs_combine(void *ctx, struct alloc *alloc,
+                        ui8 **acc, ui64 *acclen,
+                        const ui8 *bytes, ui64 len);
+
+/*
+ * The KVS content is exchanged with task_plugin_api_allgather(). Every
+ * contribution starts with the number of processes whose PMI process
+ * terminated (KVS_HEADER_SIZE bytes) followed by the packed KVS.
+ */
+#define KVS_HEADER_SIZE	sizeof(ui32)
 
 static struct task_plugin_ops _pmiexec_ops = {
 	.local = _local,
@@ -59,20 +74,43 @@ struct plugin *plugin_construct()
 	return (struct plugin *)&_pmiexec;
 }
 
+/*
+ * The root process does not run a PMI process. Since the collectives are
+ * routed through it, it takes part in every KVS exchange until all other
+ * processes are done.
+ */
 static int _local(struct task_plugin *self,
                   int argc, char **argv)
 {
-	return 0;
+	return _kvs_finish(self, 0);
 }
 
 static int _other(struct task_plugin *self,
                   int argc, char **argv)
+{
+	int err, tmp;
+
+	err = _run(self, argc, argv);
+
+	tmp = _kvs_finish(self, 1);
+	if (unlikely(tmp))
+		fcallerror("_kvs_finish", tmp);
+
+	return err;
+}
+
+static int _run(struct task_plugin *self,
+                int argc, char **argv)
 {
 	int err;
 	long long child;
 	int status;
 	int fdo[2], fde[2];
 	int fdpmi[2];
+	int dups[2][2], closefds[3];
+	char pmifd[16];
+	char *env[] = {pmifd, NULL};
+	int pid;
 	struct pmi_server pmisrv;
 
 	err = pipe(fdo);
@@ -100,37 +138,25 @@ static int _other(struct task_plugin *self,
 		return -errno;
 	}
 
-	child = fork();
-	if (0 == child) {
-		char pmifd[16];
-		char *env[] = {pmifd, NULL};
+	snprintf(pmifd, sizeof(pmifd), "PMI_FD=%d", fdpmi[1]);
 
-		close(fdo[0]);
-		if (fdo[1] != STDOUT_FILENO) {
-			dup2 (fdo[1], STDOUT_FILENO);
-			close(fdo[1]);
-		}
-
-		close(fde[0]);
-		if (fde[1] != STDERR_FILENO) {
-			dup2 (fde[1], STDERR_FILENO);
-			close(fde[1]);
-		}
+	dups[0][0] = fdo[1];
+	dups[0][1] = STDOUT_FILENO;
+	dups[1][0] = fde[1];
+	dups[1][1] = STDERR_FILENO;
 
-		close(fdpmi[0]);
-		snprintf(pmifd, sizeof(pmifd), "PMI_FD=%d", fdpmi[1]);
+	closefds[0] = fdo[0];
+	closefds[1] = fde[0];
+	closefds[2] = fdpmi[0];
 
-		execve(argv[0], argv, env);
-		error("execve() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		exit(-1);
-	}
-	else if (unlikely(-1 == child)) {
-		error("fork() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
+	err = spawn_process(argv, env, dups, 2, closefds, 3, &pid);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		return err;
 	}
 
+	child = pid;
+
 	log("Child process %d is alive.", (int )child);
 
 	/* FIXME Error handling.
@@ -244,10 +270,10 @@ static int _watch_child(struct task_plugin *self, long long *child, int *status,
 		quit = (0 == *child) && (0 == k);
 
 		if (*child) {
-			p = waitpid(*child, status, WNOHANG);
+			p = wait_process(*child, status, WNOHANG);
 			if (p) {
 				if (unlikely(p != *child)) {
-					error("waitpid() failed. errno = %d says '%s'.",
+					error("wait_process() failed. errno = %d says '%s'.",
 					      errno, strerror(errno));
 					return -errno;
 				}
@@ -322,93 +348,151 @@ static int _read_from_child(int fd, char *line, int *len, ll *size,
 static int _kvs_fence(struct pmi_server *srv, void *ctx)
 {
 	struct task_plugin *self = (struct task_plugin *)ctx;
-	int err;
-	struct task_recvd_message *msg;
-	int i, k;
+	int err, tmp;
+	ui32 ndone;
 	ui8 *bytes;
 	ui64 len;
 
-	/* TODO Use the tree structure to speed this up and reduce the
-	 *      number of messages.
-	 *
-	 *      Unfortunately that is not that easy. The root of the tree is
-	 *      process zero which does not spawn an (PMI) process and does
-	 *      not receive a "kvs-fence" request as the others do. Thus, in
-	 *      order to use the tree the root process would need to continuously
-	 *      spin and call task_plugin_api_recv() which would require a high
-	 *      CPU load.
+	err = _kvs_exchange(self, srv, 0, &ndone, &bytes, &len);
+	if (unlikely(err)) {
+		fcallerror("_kvs_exchange", err);
+		return err;
+	}
+
+	if (unlikely(ndone > 0)) {
+		error("%d PMI process(es) terminated without entering the fence.", (int )ndone);
+		err = -ESOMEFAULT;
+		goto fail;
+	}
+
+	/* The result includes the own contribution.
 	 */
+	err = pmi_server_kvs_free(srv);
+	if (unlikely(err)) {
+		fcallerror("pmi_server_kvs_free", err);
+		goto fail;
+	}
 
-	if (1 == self->task->spawn->tree.here) {
-		for (i = 2; i < self->task->spawn->tree.size; ++i) {
-			k = 0;
-			do {
-				err = task_plugin_api_recv(self, &msg);
-				++k;
-			} while (err);	/* TODO Can we do better than spinning here?
-			                 */
+	err = pmi_server_kvs_unpack(srv, bytes + KVS_HEADER_SIZE, len - KVS_HEADER_SIZE);
+	if (unlikely(err))
+		fcallerror("pmi_server_kvs_unpack", err);
 
-			err = pmi_server_kvs_unpack(srv, msg->msg.bytes, msg->msg.len);
-			if (unlikely(err))
-				fcallerror("pmi_server_kvs_unpack", err);
+fail:
+	tmp = task_plugin_api_arena_reset(self);
+	if (unlikely(tmp))
+		fcallerror("task_plugin_api_arena_reset", tmp);
 
-			/* FIXME We cannot use free_message_payload() here because
-			 *       we do not have the header. However, we cannot be sure
-			 *       the byte array was allocated with srv->alloc.
-			 */
-			err = ZFREE(srv->alloc, (void **)&msg->msg.bytes, msg->msg.len, sizeof(ui8), "");
-			if (unlikely(err))
-				fcallerror("ZFREE", err);
+	return err;
+}
+
+/*
+ * Keep taking part in the KVS exchanges of the processes that are still
+ * in a fence until all PMI processes terminated. done is one if this
+ * process ran a PMI process.
+ */
+static int _kvs_finish(struct task_plugin *self, ui32 done)
+{
+	int err;
+	ui32 ndone;
+	ui8 *bytes;
+	ui64 len;
+
+	do {
+		err = _kvs_exchange(self, NULL, done, &ndone, &bytes, &len);
+		if (unlikely(err)) {
+			fcallerror("_kvs_exchange", err);
+			return err;
 		}
 
-		err = pmi_server_kvs_pack(srv, srv->alloc, &bytes, &len);
+		err = task_plugin_api_arena_reset(self);
 		if (unlikely(err))
-			fcallerror("pmi_server_kvs_pack", err);
+			fcallerror("task_plugin_api_arena_reset", err);
+	} while (ndone < (ui32 )(self->task->spawn->tree.size - 1));
 
-		for (i = 2; i < self->task->spawn->tree.size; ++i) {
-			err = task_plugin_api_send(self, i, bytes, len);
-			if (unlikely(err))
-				fcallerror("task_plugin_api_send", err);
+	return 0;
+}
+
+/*
+ * Contribute done and the KVS content of srv (if not NULL) and get the
+ * combination of the contributions of all processes. ndone is the total
+ * number of processes that are done. bytes is allocated from the arena
+ * of the task.
+ */
+static int _kvs_exchange(struct task_plugin *self, struct pmi_server *srv,
+                         ui32 done, ui32 *ndone, ui8 **bytes, ui64 *len)
+{
+	int err, tmp;
+	struct alloc *arena;
+	ui8 *kvs, *x;
+	ui64 n;
+
+	arena = task_plugin_api_arena(self);
+
+	kvs = NULL;
+	n   = 0;
+
+	if (srv) {
+		err = pmi_server_kvs_pack(srv, srv->alloc, &kvs, &n);
+		if (unlikely(err)) {
+			fcallerror("pmi_server_kvs_pack", err);
+			return err;
 		}
+	}
 
-		err = ZFREE(srv->alloc, (void **)&bytes, len, sizeof(ui8), "");
-		if (unlikely(err))
-			fcallerror("ZFREE", err);
-	} else {
-		pmi_server_kvs_pack(srv, srv->alloc, &bytes, &len);
+	err = ZALLOC(arena, (void **)&x, KVS_HEADER_SIZE + n, sizeof(ui8), "x");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
 
-		err = pmi_server_kvs_free(srv);
-		if (unlikely(err))
-			fcallerror("pmi_server_kvs_free", err);
+	memcpy(x, &done, KVS_HEADER_SIZE);
+	if (n)
+		memcpy(x + KVS_HEADER_SIZE, kvs, n);
 
-		err = task_plugin_api_send(self, 1, bytes, len);
-		if (unlikely(err))
-			fcallerror("task_plugin_api_send", err);
+	err = task_plugin_api_allgather(self, x, KVS_HEADER_SIZE + n,
+	                                _kvs_combine, NULL, bytes, len);
+	if (unlikely(err)) {
+		fcallerror("task_plugin_api_allgather", err);
+		goto fail;
+	}
 
-		err = ZFREE(srv->alloc, (void **)&bytes, len, sizeof(ui8), "");
-		if (unlikely(err))
-			fcallerror("ZFREE", err);
+	memcpy(ndone, *bytes, KVS_HEADER_SIZE);
 
-		k = 0;
-		do {
-			err = task_plugin_api_recv(self, &msg);
-			++k;
-		} while (err);	/* TODO Can we do better than spinning here?
-		                 */
+fail:
+	if (kvs) {
+		tmp = ZFREE(srv->alloc, (void **)&kvs, n, sizeof(ui8), "");
+		if (unlikely(tmp))
+			fcallerror("ZFREE", tmp);
+	}
 
-		pmi_server_kvs_unpack(srv, msg->msg.bytes, msg->msg.len);
-		if (unlikely(err))
-			fcallerror("pmi_server_kvs_unpack", err);
+	return err;
+}
 
-		/* FIXME We cannot use free_message_payload() here because
-		 *       we do not have the header. However, we cannot be sure
-		 *       the byte array was allocated with srv->alloc.
-		 */
-		err = ZFREE(srv->alloc, (void **)&msg->msg.bytes, msg->msg.len, sizeof(ui8), "");
-		if (unlikely(err))
-			fcallerror("ZFREE", err);
+/*
+ * Packed KVS contents can simply be concatenated. The numbers of processes
+ * that are done add up.
+ */
+static int _kvs_combine(void *ctx, struct alloc *alloc,
+                        ui8 **acc, ui64 *acclen,
+                        const ui8 *bytes, ui64 len)
+{
+	int err;
+	ui32 a, b;
+
+	if (unlikely((*acclen < KVS_HEADER_SIZE) || (len < KVS_HEADER_SIZE)))
+		return -EINVAL;
+
+	memcpy(&a, *acc, KVS_HEADER_SIZE);
+	memcpy(&b, bytes, KVS_HEADER_SIZE);
+	a += b;
+	memcpy(*acc, &a, KVS_HEADER_SIZE);
+
+	err = task_combine_concat(ctx, alloc, acc, acclen,
+	                          bytes + KVS_HEADER_SIZE, len - KVS_HEADER_SIZE);
+	if (unlikely(err)) {
+		fcallerror("task_combine_concat", err);
+		return err;
 	}
 
 	return 0;
 }
-
@@ -9,14 +9,29 @@
 
 #include "compiler.h"
 #include "error.h"
+#include "helper.h"
 #include "plugin.h"
 
 
 static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv);
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid);
+static int _exec_many(struct exec_plugin *self,
+                      int n,
+                      char *const *hosts,
+                      char *const *const *argvs);
+static int _start_many(struct exec_plugin *self,
+                       int n,
+                       char *const *hosts,
+                       char *const *const *argvs,
+                       int *pid);
+static int _wait_for_child(int child);
 static char **_combine_argv(char *const *oargv, const char *host);
-static char **_prepare_env();
+static int _prepare_env(char *buf, int size);
 
 static const char *_slurm_argv[] = {
 	"/usr/bin/srun",
@@ -27,7 +42,10 @@ static const char *_slurm_argv[] = {
 };
 
 static struct exec_plugin_ops _slurm_ops = {
-	.exec = _exec
+	.exec       = _exec,
+	.start      = _start,
+	.exec_many  = _exec_many,
+	.start_many = _start_many
 };
 
 static struct exec_plugin _slurm = {
@@ -57,53 +75,174 @@ static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv)
 {
-	long long child;
-	long long p;
-	int status;
-	char **env;
+	int err;
+	int child;
+
+	err = _start(self, host, argv, &child);
+	if (unlikely(err))
+		return err;
+
+	return _wait_for_child(child);
+}
+
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid)
+{
+	int err;
+	int child;
+	char **xargv;
+	char jobid[64];
+	char *env[] = {jobid, NULL};
 
 	if (unlikely(!host))
 		return -EINVAL;
 
-	child = fork();
-	if (0 == child) {
-		argv = _combine_argv(argv, host);
-		env  = _prepare_env();
+	err = _prepare_env(jobid, sizeof(jobid));
+	if (unlikely(err))
+		env[0] = NULL;
 
-		execve(argv[0], argv, env);
-		error("execve() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		exit(-1);
-	}
-	else if (unlikely(-1 == child)) {
-		error("fork() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
+	xargv = _combine_argv(argv, host);
+	if (unlikely(!xargv))
+		return -ENOMEM;
+
+	err = spawn_process(xargv, env, NULL, 0, NULL, 0, &child);
+	free(xargv);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		return err;
 	}
 
 	log("Child process %d is alive.", (int )child);
 
+	*pid = child;
+
+	return 0;
+}
+
+static int _exec_many(struct exec_plugin *self,
+                      int n,
+                      char *const *hosts,
+                      char *const *const *argvs)
+{
+	int err;
+	int child;
+
+	err = _start_many(self, n, hosts, argvs, &child);
+	if (unlikely(err))
+		return err;
+
+	return _wait_for_child(child);
+}
+
+/*
+ * Start all processes as a single job step with one task per node. This
+ * requires a single round trip to slurmctld instead of n.
+ */
+static int _start_many(struct exec_plugin *self,
+                       int n,
+                       char *const *hosts,
+                       char *const *const *argvs,
+                       int *pid)
+{
+	int err;
+	int child;
+	char **xargv;
+	char *nodelist, *taskargs, *p;
+	char num[32];
+	char jobid[64];
+	char *env[3];
+	int i, k, argc;
+	ll len1, len2;
+
+	if (unlikely(n < 1))
+		return -EINVAL;
+
+	argc = 0;
+	while (argvs[0][argc]) argc++;
+
+	len1 = 0;
+	len2 = sizeof("SPAWN_TASK_ARGS=");
+	for (i = 0; i < n; ++i) {
+		len1 += strlen(hosts[i]) + 1;
+		len2 += strlen(hosts[i]) + strlen(argvs[i][argc - 1]) + 2;
+	}
+
+	nodelist = malloc(len1);
+	taskargs = malloc(len2);
+	xargv    = malloc((argc + 9)*sizeof(char *));
+	if (unlikely(!nodelist || !taskargs || !xargv)) {
+		error("malloc() returned NULL.");
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	p = nodelist;
+	for (i = 0; i < n; ++i)
+		p += sprintf(p, (i > 0) ? ",%s" : "%s", hosts[i]);
+
+	p = taskargs + sprintf(taskargs, "SPAWN_TASK_ARGS=");
+	for (i = 0; i < n; ++i)
+		p += sprintf(p, (i > 0) ? ",%s=%s" : "%s=%s",
+		             hosts[i], argvs[i][argc - 1]);
+
+	snprintf(num, sizeof(num), "%d", n);
+
+	k = 0;
+	xargv[k++] = "/usr/bin/srun";
+	xargv[k++] = "-N";
+	xargv[k++] = num;
+	xargv[k++] = "-n";
+	xargv[k++] = num;
+	xargv[k++] = "--ntasks-per-node=1";
+	xargv[k++] = "-w";
+	xargv[k++] = nodelist;
+	for (i = 0; i < argc - 1; ++i)
+		xargv[k++] = argvs[0][i];
+	xargv[k++] = "-";
+	xargv[k]   = NULL;
+
+	/* srun exports its environment to the tasks.
+	 */
+	k = 0;
+	if (!_prepare_env(jobid, sizeof(jobid)))
+		env[k++] = jobid;
+	env[k++] = taskargs;
+	env[k]   = NULL;
+
+	err = spawn_process(xargv, env, NULL, 0, NULL, 0, &child);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		goto fail;
+	}
+
+	log("Child process %d is alive (%d tasks).", (int )child, n);
+
+	*pid = child;
+
+fail:
+	free(nodelist);
+	free(taskargs);
+	free(xargv);
+
+	return err;
+}
+
+static int _wait_for_child(int child)
+{
+	long long p;
+	int status;
+
 	/* TODO Handle EINTR? */
-	p = waitpid(child, &status, 0);
+	p = wait_process(child, &status, 0);
 	if (unlikely(p != child)) {
-		error("waitpid() failed. errno = %d says '%s'.",
+		error("wait_process() failed. errno = %d says '%s'.",
 		      errno, strerror(errno));
 		return -errno;
 	}
 
-	if (likely(WIFEXITED(status))) {
-		log("Child process terminated with exit code %d.", WEXITSTATUS(status));
-		return -WEXITSTATUS(status);
-
-	} else if(WIFSIGNALED(status)) {
-		log("Child was terminated by signal %d.", WTERMSIG(status));
-		return -ESOMEFAULT;
-	} else {
-		error("Child neithr terminated nor was terminated by a signal.");
-		return -ESOMEFAULT;
-	}
-
-	return 0;
+	return exit_status_to_error(status);
 }
 
 static char **_combine_argv(char *const *oargv, const char *host)
@@ -121,15 +260,15 @@ static char **_combine_argv(char *const *oargv, const char *host)
 		return NULL;
 	}
 
-	/* We can freely strdup() in here since _combine_argv() is called by
-	 * the forked process which will next execute an execve() call.
+	/* The array only references the strings and is freed by the caller
+	 * after the process is spawned.
 	 */
 
 	i = 0;
 	for (i = 0; i < sizeof(_slurm_argv)/sizeof(_slurm_argv[0]); ++i)
-		argv[i] = strdup(_slurm_argv[i]);
+		argv[i] = (char *)_slurm_argv[i];
 
-	argv[i] = strdup(host);
+	argv[i] = (char *)host;
 	++i;
 
 	while (*oargv) {
@@ -142,10 +281,10 @@ static char **_combine_argv(char *const *oargv, const char *host)
 	return argv;
 }
 
-static char **_prepare_env()
+static int _prepare_env(char *buf, int size)
 {
-	char **env;
 	char *jobid;
+	int n;
 
 	/* FIXME This is a bit of hack. It would be better to retrieve the job id from
 	 *       the options rather than the environment.
@@ -154,23 +293,15 @@ static char **_prepare_env()
 	jobid = getenv("SLURM_JOB_ID");
 	if (unlikely(!jobid)) {
 		error("SLURM_JOB_ID is not set.");
-		return NULL;
-	}
-
-	env = malloc(2*sizeof(char**));
-	if (unlikely(!env)) {
-		error("malloc() returned. NULL");
-		return NULL;
+		return -EINVAL;
 	}
 
-	env[1] = NULL;
-	env[0] = malloc(13 + strlen(jobid) + 1);
-	if (unlikely(!env[0])) {
-		error("malloc() returned. NULL");
-		return NULL;
+	n = snprintf(buf, size, "SLURM_JOB_ID=%s", jobid);
+	if (unlikely(n >= size)) {
+		error("SLURM_JOB_ID is too long.");
+		return -EINVAL;
 	}
-	snprintf(env[0], 13 + strlen(jobid) + 1, "SLURM_JOB_ID=%s", jobid);
 
-	return env;
+	return 0;
 }
 
@@ -8,12 +8,17 @@
 
 #include "compiler.h"
 #include "error.h"
+#include "helper.h"
 #include "plugin.h"
 
 
 static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv);
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid);
 static char **_combine_argv(char *const *oargv, const char *host);
 
 static const char *_ssh_argv[] = {
@@ -32,7 +37,8 @@ static const char *_ssh_argv[] = {
 };
 
 static struct exec_plugin_ops _ssh_ops = {
-	.exec = _exec
+	.exec  = _exec,
+	.start = _start
 };
 
 static struct exec_plugin _ssh = {
@@ -62,52 +68,54 @@ static int _exec(struct exec_plugin *self,
                  const char *host,
                  char *const *argv)
 {
-	long long child;
+	int err;
+	int child;
 	long long p;
 	int status;
 
-	if (unlikely(!host))
-		return -EINVAL;
-
-	child = fork();
-	if (0 == child) {
-		char *env[] = {NULL};
-
-		argv = _combine_argv(argv, host);
-
-		execve(argv[0], argv, env);
-		error("execve() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		exit(-1);
-	}
-	else if (unlikely(-1 == child)) {
-		error("fork() failed. errno = %d says '%s'.",
-		      errno, strerror(errno));
-		return -errno;
-	}
-
-	log("Child process %d is alive.", (int )child);
+	err = _start(self, host, argv, &child);
+	if (unlikely(err))
+		return err;
 
 	/* TODO Handle EINTR? */
-	p = waitpid(child, &status, 0);
+	p = wait_process(child, &status, 0);
 	if (unlikely(p != child)) {
-		error("waitpid() failed. errno = %d says '%s'.",
+		error("wait_process() failed. errno = %d says '%s'.",
 		      errno, strerror(errno));
 		return -errno;
 	}
 
-	if (likely(WIFEXITED(status))) {
-		log("Child process terminated with exit code %d.", WEXITSTATUS(status));
-		return -WEXITSTATUS(status);
+	return exit_status_to_error(status);
+}
+
+static int _start(struct exec_plugin *self,
+                  const char *host,
+                  char *const *argv,
+                  int *pid)
+{
+	int err;
+	int child;
+	char **xargv;
+	char *env[] = {NULL};
 
-	} else if(WIFSIGNALED(status)) {
-		log("Child was terminated by signal %d.", WTERMSIG(status));
-		return -ESOMEFAULT;
-	} else {
-		error("Child neither terminated nor was terminated by a signal.");
-		return -ESOMEFAULT;
+	if (unlikely(!host))
+		return -EINVAL;
+
+	xargv = _combine_argv(argv, host);
+	if (unlikely(!xargv))
+		return -ENOMEM;
+
+	err = spawn_process(xargv, env, NULL, 0, NULL, 0, &child);
+	free(xargv);
+	if (unlikely(err)) {
+		fcallerror("spawn_process", err);
+		return err;
 	}
 
+	log("Child process %d is alive.", (int )child);
+
+	*pid = child;
+
 	return 0;
 }
 
@@ -124,15 +132,15 @@ static char **_combine_argv(char *const *oargv, const char *host)
 	if (unlikely(!argv))
 		return NULL;
 
-	/* We can freely strdup() in here since _combine_argv() is called by
-	 * the forked process which will next execute an execve() call.
+	/* The array only references the strings and is freed by the caller
+	 * after the process is spawned.
 	 */
 
 	i = 0;
 	for (i = 0; i < sizeof(_ssh_argv)/sizeof(_ssh_argv[0]); ++i)
-		argv[i] = strdup(_ssh_argv[i]);
+		argv[i] = (char *)_ssh_argv[i];
 
-	argv[i] = strdup(host);
+	argv[i] = (char *)host;
 	++i;
 
 	while (*oargv) {
@@ -86,8 +86,6 @@ int pmi_server_talk(struct pmi_server *self)
 	struct _pmi_supported_cmd *z;
 	char resp[32];
 
-	static int first = 1;
-
 	memset(_buf, 0, sizeof(_buf));	/* To simplify debugging. */
 
 	/* TODO We need to be very careful with returning from this function.
@@ -96,8 +94,8 @@ int pmi_server_talk(struct pmi_server *self)
 	 *      is not reading the response.
 	 */
 
-	if (unlikely(first)) {
-		first = 0;
+	if (unlikely(!self->greeted)) {
+		self->greeted = 1;
 
 		x = pmi_read_bytes(self->fd, _buf, strlen(PMI_INIT_STRING) + 1);
 		if (unlikely(x)) {
@@ -25,6 +25,7 @@ struct pmi_server
 	struct alloc		*alloc;
 	struct list		kvs;
 
+	_Bool			greeted;	/* Init string was read */
 	_Bool			initialized;
 	_Bool			finalized;
 
@@ -1,4 +1,3 @@
-
 #include <stdlib.h>
 #include <string.h>
 
@@ -12,149 +11,155 @@
 #include "options.h"
 
 
+/*
+ * List of all message types. The second argument is the name used for
+ * the message struct and the functions handling the type.
+ */
+#define MESSAGE_LIST(X)					\
+	X(REQUEST_JOIN       , request_join)		\
+	X(RESPONSE_JOIN      , response_join)		\
+	X(PING               , ping)			\
+	X(REQUEST_EXEC       , request_exec)		\
+	X(REQUEST_BUILD_TREE , request_build_tree)	\
+	X(RESPONSE_BUILD_TREE, response_build_tree)	\
+	X(REQUEST_TASK       , request_task)		\
+	X(RESPONSE_TASK      , response_task)		\
+	X(REQUEST_EXIT       , request_exit)		\
+	X(RESPONSE_EXIT      , response_exit)		\
+	X(WRITE_STDOUT       , write_stdout)		\
+	X(WRITE_STDERR       , write_stderr)		\
+	X(USER               , user)			\
+	X(REQUEST_ATTACH     , request_attach)		\
+	X(RESPONSE_ATTACH    , response_attach)
+
+#define DECLARE_MESSAGE_FUNCTIONS(TYPE, NAME)				\
+static int _pack_message_ ## NAME(struct buffer *buffer,		\
+                                  const struct message_ ## NAME *msg);	\
+static int _unpack_message_ ## NAME(struct buffer *buffer,		\
+                                    struct alloc *alloc,		\
+                                    int view,				\
+                                    struct message_ ## NAME *msg);	\
+static int _free_message_ ## NAME(struct alloc *alloc,			\
+                                  int view,				\
+                                  const struct message_ ## NAME *msg);
+
+static int _header_size(const struct message_header *header);
+static char *_put_varint(char *p, ui32 x);
+static const char *_get_varint(const char *p, const char *end, ui32 *x);
 static int _pack_message_something(struct buffer *buffer, int type, void *msg);
 static int _alloc_message_something(struct alloc *alloc, int type, void **msg);
 static int _unpack_message_something(struct buffer *buffer, struct alloc *alloc,
-                                     int type, void *msg);
-static int _free_message_something(struct alloc *alloc, int type, void *msg);
-static int _pack_message_request_join(struct buffer *buffer,
-                                      const struct message_request_join *msg);
-static int _unpack_message_request_join(struct buffer *buffer,
-                                        struct message_request_join *msg);
-static int _free_message_request_join(struct alloc *alloc,
-                                      const struct message_request_join *msg);
-static int _pack_message_response_join(struct buffer *buffer,
-                                       const struct message_response_join *msg);
-static int _unpack_message_response_join(struct buffer *buffer,
-                                         struct alloc *alloc,
-                                         struct message_response_join *msg);
-static int _free_message_response_join(struct alloc *alloc,
-                                       const struct message_response_join *msg);
-static int _pack_message_ping(struct buffer *buffer,
-                              const struct message_ping *msg);
-static int _unpack_message_ping(struct buffer *buffer,
-                                struct message_ping *msg);
-static int _free_message_ping(struct alloc *alloc,
-                              const struct message_ping *msg);
-static int _pack_message_request_exec(struct buffer *buffer,
-                                      const struct message_request_exec *msg);
-static int _unpack_message_request_exec(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_request_exec *msg);
-static int _free_message_request_exec(struct alloc *alloc,
-                                      const struct message_request_exec *msg);
-static int _pack_message_request_build_tree(struct buffer *buffer,
-                                            const struct message_request_build_tree *msg);
-static int _unpack_message_request_build_tree(struct buffer *buffer,
-                                              struct alloc *alloc,
-                                              struct message_request_build_tree *msg);
-static int _free_message_request_build_tree(struct alloc *alloc,
-                                            const struct message_request_build_tree *msg);
-static int _pack_message_response_build_tree(struct buffer *buffer,
-                                             const struct message_response_build_tree *msg);
-static int _unpack_message_response_build_tree(struct buffer *buffer,
-                                               struct message_response_build_tree *msg);
-static int _free_message_response_build_tree(struct alloc *alloc,
-                                             const struct message_response_build_tree *msg);
-static int _pack_message_request_task(struct buffer *buffer,
-                                      const struct message_request_task *msg);
-static int _unpack_message_request_task(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_request_task *msg);
-static int _free_message_request_task(struct alloc *alloc,
-                                      const struct message_request_task *msg);
-static int _pack_message_response_task(struct buffer *buffer,
-                                      const struct message_response_task *msg);
-static int _unpack_message_response_task(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_response_task *msg);
-static int _free_message_response_task(struct alloc *alloc,
-                                      const struct message_response_task *msg);
-static int _pack_message_request_exit(struct buffer *buffer,
-                                      const struct message_request_exit *msg);
-static int _unpack_message_request_exit(struct buffer *buffer,
-                                        struct message_request_exit *msg);
-static int _free_message_request_exit(struct alloc *alloc,
-                                      const struct message_request_exit *msg);
-static int _pack_message_response_exit(struct buffer *buffer,
-                                       const struct message_response_exit *msg);
-static int _unpack_message_response_exit(struct buffer *buffer,
-                                         struct message_response_exit *msg);
-static int _free_message_response_exit(struct alloc *alloc,
-                                       const struct message_response_exit *msg);
-static int _pack_message_write_stdout(struct buffer *buffer,
-                                      const struct message_write_stdout *msg);
-static int _unpack_message_write_stdout(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_write_stdout *msg);
-static int _free_message_write_stdout(struct alloc *alloc,
-                                      const struct message_write_stdout *msg);
-static int _pack_message_write_stderr(struct buffer *buffer,
-                                      const struct message_write_stderr *msg);
-static int _unpack_message_write_stderr(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_write_stderr *msg);
-static int _free_message_write_stderr(struct alloc *alloc,
-                                      const struct message_write_stderr *msg);
-static int _pack_message_user(struct buffer *buffer,
-                              const struct message_user *msg);
-static int _unpack_message_user(struct buffer *buffer,
-                                struct alloc *alloc,
-                                struct message_user *msg);
-static int _free_message_user(struct alloc *alloc,
-                              const struct message_user *msg);
+                                     int type, int view, void *msg);
+static int _free_message_something(struct alloc *alloc, int type, int view, void *msg);
+MESSAGE_LIST(DECLARE_MESSAGE_FUNCTIONS)
 
 
 int pack_message_header(struct buffer *buffer,
-                        const struct message_header *header)
+                        struct message_header *header)
 {
 	int err;
-	ui16 tmp[6] = {
-		header->src,
-		header->dst,
-		header->flags,
-		header->type,
-		header->channel,
-		header->pad16[0]
-	};
-
-	err = buffer_pack_ui16(buffer, tmp, ARRAYLEN(tmp));
-	if (unlikely(err))
-		return err;
-	err = buffer_pack_ui32(buffer, &header->payload, 1);
+	char *p, *q;
+
+	header->size = _header_size(header);
+
+	err = buffer_pack_reserve(buffer, header->size, (void **)&p);
 	if (unlikely(err))
 		return err;
 
+	q = p;
+	*q++ = header->size;
+	memcpy(q, &header->payload, sizeof(ui32));
+	q += sizeof(ui32);
+	q = _put_varint(q, header->src);
+	q = _put_varint(q, header->dst);
+	q = _put_varint(q, header->flags);
+	q = _put_varint(q, header->type);
+	q = _put_varint(q, header->channel);
+
 	return 0;
 }
 
 int unpack_message_header(struct buffer *buffer,
                           struct message_header *header)
 {
-	int err;
-	ui16 tmp[6];
+	const char *p, *end;
+	ui32 tmp[5];
+	int i;
 
 	memset(header, 0, sizeof(*header));
 
-	err = buffer_unpack_ui16(buffer, tmp, ARRAYLEN(tmp));
-	if (unlikely(err))
-		return err;
-	err = buffer_unpack_ui32(buffer, &header->payload, 1);
-	if (unlikely(err))
-		return err;
+	if (unlikely(buffer->size - buffer->pos < MESSAGE_HEADER_MIN_SIZE)) {
+		error("Reached end of buffer.");
+		return -ESOMEFAULT;
+	}
+
+	p = buffer->buf + buffer->pos;
+
+	header->size = (ui8 )p[0];
+	memcpy(&header->payload, p + 1, sizeof(ui32));
+
+	if (unlikely((header->size < MESSAGE_HEADER_MIN_SIZE) ||
+	             (header->size > MESSAGE_HEADER_MAX_SIZE) ||
+	             (header->size > buffer->size - buffer->pos))) {
+		error("Invalid header size %d.", (int )header->size);
+		return -ESOMEFAULT;
+	}
+
+	end = p + header->size;
+	p  += 1 + sizeof(ui32);
+
+	for (i = 0; i < ARRAYLEN(tmp); ++i) {
+		p = _get_varint(p, end, &tmp[i]);
+		if (unlikely(!p)) {
+			error("Malformed message header.");
+			return -ESOMEFAULT;
+		}
+	}
+
+	if (unlikely(p != end)) {
+		error("Malformed message header.");
+		return -ESOMEFAULT;
+	}
 
 	header->src     = tmp[0];
 	header->dst     = tmp[1];
 	header->flags   = tmp[2];
 	header->type    = tmp[3];
 	header->channel = tmp[4];
-	/* ignore pad16 */
 
 	if (unlikely(header->payload < 1)) {
 		error("Invalid payload size %lld.", (ll )header->payload);
 		return -ESOMEFAULT;
 	}
 
+	buffer->pos += header->size;
+
+	return 0;
+}
+
+int peek_message_size(struct buffer *buffer, ll *size)
+{
+	ui8 hsize;
+	ui32 payload;
+
+	if (unlikely(buffer->size < MESSAGE_HEADER_MIN_SIZE)) {
+		error("Reached end of buffer.");
+		return -ESOMEFAULT;
+	}
+
+	hsize = buffer->buf[0];
+	memcpy(&payload, buffer->buf + 1, sizeof(ui32));
+
+	if (unlikely((hsize < MESSAGE_HEADER_MIN_SIZE) ||
+	             (hsize > MESSAGE_HEADER_MAX_SIZE) ||
+	             (payload < 1))) {
+		error("Invalid message header (size %d, payload %lld).",
+		      (int )hsize, (ll )payload);
+		return -ESOMEFAULT;
+	}
+
+	*size = (ll )hsize + payload;
+
 	return 0;
 }
 
@@ -176,7 +181,20 @@ int unpack_message_payload(struct buffer *buffer,
 {
 	int err;
 
-	err = _unpack_message_something(buffer, alloc, header->type, msg);
+	err = _unpack_message_something(buffer, alloc, header->type, 0, msg);
+	if (unlikely(err))
+		return err;
+
+	return 0;
+}
+
+int unpack_message_payload_view(struct buffer *buffer,
+                                const struct message_header *header,
+                                struct alloc *alloc, void *msg)
+{
+	int err;
+
+	err = _unpack_message_something(buffer, alloc, header->type, 1, msg);
 	if (unlikely(err))
 		return err;
 
@@ -188,7 +206,19 @@ int free_message_payload(const struct message_header *header,
 {
 	int err;
 
-	err = _free_message_something(alloc, header->type, msg);
+	err = _free_message_something(alloc, header->type, 0, msg);
+	if (unlikely(err))
+		return err;
+
+	return 0;
+}
+
+int free_message_payload_view(const struct message_header *header,
+                              struct alloc *alloc, void *msg)
+{
+	int err;
+
+	err = _free_message_something(alloc, header->type, 1, msg);
 	if (unlikely(err))
 		return err;
 
@@ -199,7 +229,12 @@ int pack_message(struct buffer *buffer, struct message_header *header, void *msg
 {
 	int err;
 
-	err = buffer_seek(buffer, sizeof(*header));
+	/* The header size does not depend on the payload size so we
+	 * can leave exactly the right amount of space for it.
+	 */
+	header->size = _header_size(header);
+
+	err = buffer_seek(buffer, header->size);
 	if (unlikely(err))
 		return err;
 
@@ -209,7 +244,7 @@ int pack_message(struct buffer *buffer, struct message_header *header, void *msg
 	if (unlikely(err))
 		return err;
 
-	header->payload = buffer_size(buffer) - sizeof(*header);
+	header->payload = buffer_size(buffer) - header->size;
 
 	err = buffer_seek(buffer, 0);
 	if (unlikely(err))
@@ -219,6 +254,12 @@ int pack_message(struct buffer *buffer, struct message_header *header, void *msg
 	if (unlikely(err))
 		return err;
 
+	/* Save the communication thread the trouble of parsing the
+	 * header again.
+	 */
+	buffer->hdr      = *header;
+	buffer->hdrvalid = 1;
+
 	return 0;
 }
 
@@ -239,7 +280,7 @@ int unpack_message(struct buffer *buffer, struct message_header *header,
 	if (unlikely(err))
 		return err;
 
-	err = _unpack_message_something(buffer, alloc, header->type, *msg);
+	err = _unpack_message_something(buffer, alloc, header->type, 0, *msg);
 	if (unlikely(err))
 		return err;
 
@@ -247,6 +288,72 @@ int unpack_message(struct buffer *buffer, struct message_header *header,
 }
 
 
+/*
+ * Size of the LEB128 encoding of x.
+ */
+static inline int _varint_size(ui32 x)
+{
+	int n;
+
+	for (n = 1; x >= 0x80; ++n)
+		x >>= 7;
+
+	return n;
+}
+
+static int _header_size(const struct message_header *header)
+{
+	return 1 + sizeof(ui32) +
+	       _varint_size(header->src)   +
+	       _varint_size(header->dst)   +
+	       _varint_size(header->flags) +
+	       _varint_size(header->type)  +
+	       _varint_size(header->channel);
+}
+
+static char *_put_varint(char *p, ui32 x)
+{
+	while (x >= 0x80) {
+		*p++ = (x & 0x7F) | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+
+	return p;
+}
+
+/*
+ * Returns NULL if the encoding is truncated or does not fit into 32 bits.
+ */
+static const char *_get_varint(const char *p, const char *end, ui32 *x)
+{
+	ui64 y;
+	int shift;
+
+	y = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if (unlikely(p >= end))
+			return NULL;
+
+		y |= ((ui64 )(*p & 0x7F)) << shift;
+		if (!(*p++ & 0x80)) {
+			if (unlikely(y > 0xFFFFFFFFULL))
+				return NULL;
+
+			*x = y;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+#define _PACK_CASE(TYPE, NAME)						\
+	case MESSAGE_TYPE_ ## TYPE:					\
+		err = _pack_message_ ## NAME(buffer,			\
+		                 (const struct message_ ## NAME *)msg);	\
+		break;
+
 static int _pack_message_something(struct buffer *buffer, int type, void *msg)
 {
 	int err;
@@ -254,58 +361,7 @@ static int _pack_message_something(struct buffer *buffer, int type, void *msg)
 	err = -ESOMEFAULT;
 
 	switch (type) {
-	case MESSAGE_TYPE_REQUEST_JOIN:
-		err = _pack_message_request_join(buffer,
-		                    (const struct message_request_join *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_JOIN:
-		err = _pack_message_response_join(buffer,
-		                    (const struct message_response_join *)msg);
-		break;
-	case MESSAGE_TYPE_PING:
-		err = _pack_message_ping(buffer,
-		                    (const struct message_ping *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXEC:
-		err = _pack_message_request_exec(buffer,
-		                    (const struct message_request_exec *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_BUILD_TREE:
-		err = _pack_message_request_build_tree(buffer,
-		                    (const struct message_request_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_BUILD_TREE:
-		err = _pack_message_response_build_tree(buffer,
-		                    (const struct message_response_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_TASK:
-		err = _pack_message_request_task(buffer,
-		                    (const struct message_request_task *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_TASK:
-		err = _pack_message_response_task(buffer,
-		                    (const struct message_response_task *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXIT:
-		err = _pack_message_request_exit(buffer,
-		                    (const struct message_request_exit *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_EXIT:
-		err = _pack_message_response_exit(buffer,
-		                    (const struct message_response_exit *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDOUT:
-		err = _pack_message_write_stdout(buffer,
-		                    (const struct message_write_stdout *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDERR:
-		err = _pack_message_write_stderr(buffer,
-		                    (const struct message_write_stderr *)msg);
-		break;
-	case MESSAGE_TYPE_USER:
-		err = _pack_message_user(buffer,
-		                    (const struct message_user *)msg);
-		break;
+	MESSAGE_LIST(_PACK_CASE)
 	default:
 		error("Unknown message type %d.", type);
 		err = -ESOMEFAULT;
@@ -317,6 +373,12 @@ static int _pack_message_something(struct buffer *buffer, int type, void *msg)
 	return 0;
 }
 
+#define _ALLOC_CASE(TYPE, NAME)						\
+	case MESSAGE_TYPE_ ## TYPE:					\
+		err = ZALLOC(alloc, msg, 1, sizeof(struct message_ ## NAME),	\
+		             "struct message_" #NAME);			\
+		break;
+
 static int _alloc_message_something(struct alloc *alloc, int type, void **msg)
 {
 	int err;
@@ -324,58 +386,7 @@ static int _alloc_message_something(struct alloc *alloc, int type, void **msg)
 	err = -ESOMEFAULT;
 
 	switch (type) {
-	case MESSAGE_TYPE_REQUEST_JOIN:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_request_join),
-		             "struct message_request_join");
-		break;
-	case MESSAGE_TYPE_RESPONSE_JOIN:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_response_join),
-		             "struct message_response_join");
-		break;
-	case MESSAGE_TYPE_PING:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_ping),
-		             "struct message_ping");
-		break;
-	case MESSAGE_TYPE_REQUEST_EXEC:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_request_exec),
-		             "struct message_request_exec");
-		break;
-	case MESSAGE_TYPE_REQUEST_BUILD_TREE:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_request_build_tree),
-		             "struct message_request_build_tree");
-		break;
-	case MESSAGE_TYPE_RESPONSE_BUILD_TREE:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_response_build_tree),
-		             "struct message_response_build_tree");
-		break;
-	case MESSAGE_TYPE_REQUEST_TASK:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_request_task),
-		             "struct message_request_task");
-		break;
-	case MESSAGE_TYPE_RESPONSE_TASK:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_response_task),
-		             "struct message_response_task");
-		break;
-	case MESSAGE_TYPE_REQUEST_EXIT:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_request_exit),
-		             "struct message_request_exit");
-		break;
-	case MESSAGE_TYPE_RESPONSE_EXIT:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_response_exit),
-		             "struct message_response_exit");
-		break;
-	case MESSAGE_TYPE_WRITE_STDOUT:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_write_stdout),
-		             "struct message_write_stdout");
-		break;
-	case MESSAGE_TYPE_WRITE_STDERR:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_write_stderr),
-		             "struct message_write_stderr");
-		break;
-	case MESSAGE_TYPE_USER:
-		err = ZALLOC(alloc, msg, 1, sizeof(struct message_user),
-		             "struct message_user");
-		break;
+	MESSAGE_LIST(_ALLOC_CASE)
 	default:
 		error("Unknown message type %d.", type);
 		err = -ESOMEFAULT;
@@ -389,66 +400,21 @@ static int _alloc_message_something(struct alloc *alloc, int type, void **msg)
 	return 0;
 }
 
+#define _UNPACK_CASE(TYPE, NAME)					\
+	case MESSAGE_TYPE_ ## TYPE:					\
+		err = _unpack_message_ ## NAME(buffer, alloc, view,	\
+		                 (struct message_ ## NAME *)msg);	\
+		break;
+
 static int _unpack_message_something(struct buffer *buffer, struct alloc *alloc,
-                                     int type, void *msg)
+                                     int type, int view, void *msg)
 {
 	int err;
 
 	err = -ESOMEFAULT;
 
 	switch (type) {
-	case MESSAGE_TYPE_REQUEST_JOIN:
-		err = _unpack_message_request_join(buffer,
-		                    (struct message_request_join *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_JOIN:
-		err = _unpack_message_response_join(buffer, alloc,
-		                    (struct message_response_join *)msg);
-		break;
-	case MESSAGE_TYPE_PING:
-		err = _unpack_message_ping(buffer,
-		                    (struct message_ping *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXEC:
-		err = _unpack_message_request_exec(buffer, alloc,
-		                    (struct message_request_exec *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_BUILD_TREE:
-		err = _unpack_message_request_build_tree(buffer, alloc,
-		                    (struct message_request_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_BUILD_TREE:
-		err = _unpack_message_response_build_tree(buffer,
-		                    (struct message_response_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_TASK:
-		err = _unpack_message_request_task(buffer, alloc,
-		                    (struct message_request_task *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_TASK:
-		err = _unpack_message_response_task(buffer, alloc,
-		                    (struct message_response_task *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXIT:
-		err = _unpack_message_request_exit(buffer,
-		                    (struct message_request_exit *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_EXIT:
-		err = _unpack_message_response_exit(buffer,
-		                    (struct message_response_exit *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDOUT:
-		err = _unpack_message_write_stdout(buffer, alloc,
-		                    (struct message_write_stdout *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDERR:
-		err = _unpack_message_write_stderr(buffer, alloc,
-		                    (struct message_write_stderr *)msg);
-		break;
-	case MESSAGE_TYPE_USER:
-		err = _unpack_message_user(buffer, alloc,
-		                    (struct message_user *)msg);
-		break;
+	MESSAGE_LIST(_UNPACK_CASE)
 	default:
 		error("Unknown message type %d.", type);
 		err = -ESOMEFAULT;
@@ -460,65 +426,20 @@ static int _unpack_message_something(struct buffer *buffer, struct alloc *alloc,
 	return 0;
 }
 
-static int _free_message_something(struct alloc *alloc, int type, void *msg)
+#define _FREE_CASE(TYPE, NAME)						\
+	case MESSAGE_TYPE_ ## TYPE:					\
+		err = _free_message_ ## NAME(alloc, view,		\
+		                 (const struct message_ ## NAME *)msg);	\
+		break;
+
+static int _free_message_something(struct alloc *alloc, int type, int view, void *msg)
 {
 	int err;
 
 	err = -ESOMEFAULT;
 
 	switch (type) {
-	case MESSAGE_TYPE_REQUEST_JOIN:
-		err = _free_message_request_join(alloc,
-		                    (struct message_request_join *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_JOIN:
-		err = _free_message_response_join(alloc,
-		                    (struct message_response_join *)msg);
-		break;
-	case MESSAGE_TYPE_PING:
-		err = _free_message_ping(alloc,
-		                    (struct message_ping *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXEC:
-		err = _free_message_request_exec(alloc,
-		                    (struct message_request_exec *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_BUILD_TREE:
-		err = _free_message_request_build_tree(alloc,
-		                    (struct message_request_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_BUILD_TREE:
-		err = _free_message_response_build_tree(alloc,
-		                    (struct message_response_build_tree *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_TASK:
-		err = _free_message_request_task(alloc,
-		                    (struct message_request_task *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_TASK:
-		err = _free_message_response_task(alloc,
-		                    (struct message_response_task *)msg);
-		break;
-	case MESSAGE_TYPE_REQUEST_EXIT:
-		err = _free_message_request_exit(alloc,
-		                    (struct message_request_exit *)msg);
-		break;
-	case MESSAGE_TYPE_RESPONSE_EXIT:
-		err = _free_message_response_exit(alloc,
-		                    (struct message_response_exit *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDOUT:
-		err = _free_message_write_stdout(alloc,
-		                    (struct message_write_stdout *)msg);
-		break;
-	case MESSAGE_TYPE_WRITE_STDERR:
-		err = _free_message_write_stderr(alloc,
-		                    (struct message_write_stderr *)msg);
-		break;
-	case MESSAGE_TYPE_USER:
-		err = _free_message_user(alloc,
-		                    (struct message_user *)msg);
-		break;
+	MESSAGE_LIST(_FREE_CASE)
 	default:
 		error("Unknown message type %d.", type);
 		err = -ESOMEFAULT;
@@ -530,402 +451,482 @@ static int _free_message_something(struct alloc *alloc, int type, void *msg)
 	return 0;
 }
 
-static int _pack_message_request_join(struct buffer *buffer,
-                                      const struct message_request_join *msg)
+/*
+ * Generated message functions.
+ *
+ * Packing first computes the exact payload size from the schema, grows the
+ * buffer once and then writes the fields without further bounds checks.
+ * Scalars are copied with fixed-size memcpy()s so that runs of scalars
+ * compile into plain stores.
+ *
+ * Unpacking makes two passes over the payload. The first pass validates all
+ * lengths against the end of the buffer and computes the memory required for
+ * the strings and arrays. The second pass copies the fields into a single
+ * block obtained with one allocation. Each member placed into the block starts
+ * at a multiple of 8 bytes. Members of zero size are set to NULL and do not
+ * take up space, so the first non-NULL pointer member (in schema order) is the
+ * start of the block. This is how the free function finds the block again.
+ * In view mode strings and opaque bytes point into the buffer and only the
+ * pointer arrays and typed arrays are placed in the block.
+ */
+
+#define _BLOCK_ROUNDUP(X)	(((X) + 7) & ~((ll )7))
+
+static inline ll _strsize(const char *str)
 {
-	int err;
-
-	err = buffer_pack_ui32(buffer, &msg->pid, 1);
-	if (unlikely(err))
-		return err;
-	err = buffer_pack_ui32(buffer, &msg->ip, 1);
-	if (unlikely(err))
-		return err;
-	err = buffer_pack_ui32(buffer, &msg->portnum, 1);
-	if (unlikely(err))
-		return err;
-
-	return 0;
+	return (str) ? (strlen(str) + 1) : 0;
 }
 
-static int _unpack_message_request_join(struct buffer *buffer,
-                                        struct message_request_join *msg)
+/*
+ * Packed size of an argv style array with n strings and the trailing
+ * NULL pointer.
+ */
+static ll _strvsize(ui64 n, char *const *str)
 {
-	int err;
+	ll size;
+	ui64 i;
 
-	err = buffer_unpack_ui32(buffer, &msg->pid, 1);
-	if (unlikely(err))
-		return err;
-	err = buffer_unpack_ui32(buffer, &msg->ip, 1);
-	if (unlikely(err))
-		return err;
-	err = buffer_unpack_ui32(buffer, &msg->portnum, 1);
-	if (unlikely(err))
-		return err;
+	size = (n + 2)*sizeof(ui64);
+	for (i = 0; i < n; ++i)
+		size += _strsize(str[i]);
 
-	return 0;
+	return size;
 }
 
-static int _free_message_request_join(struct alloc *alloc,
-                                      const struct message_request_join *msg)
-{
-	return 0;
-}
-
-static int _pack_message_response_join(struct buffer *buffer,
-                                       const struct message_response_join *msg)
+/*
+ * Size of the block memory used by an unpacked argv style array.
+ */
+static ll _strvextent(int view, ui64 n, char *const *str)
 {
-	int err;
+	ll size;
+	ui64 i;
 
-	err = buffer_pack_ui32(buffer, &msg->addr, 1);
-	if (unlikely(err))
-		return err;
-
-	err = optpool_buffer_pack(msg->opts, buffer);
-	if (unlikely(err)) {
-		fcallerror("optpool_buffer_pack", err);
-		return err;
+	size = _BLOCK_ROUNDUP((n + 1)*sizeof(char *));
+	if (!view) {
+		for (i = 0; i < n; ++i)
+			size += _BLOCK_ROUNDUP(_strsize(str[i]));
 	}
 
-	return 0;
+	return size;
 }
 
-static int _unpack_message_response_join(struct buffer *buffer,
-                                         struct alloc *alloc,
-                                         struct message_response_join *msg)
+static inline char *_put_ui64(char *p, ui64 x)
 {
-	int err;
-
-	err = buffer_unpack_ui32(buffer, &msg->addr, 1);
-	if (unlikely(err))
-		return err;
-
-	err = ZALLOC(alloc, (void **)&msg->opts, 1,
-	             sizeof(struct optpool), "opts");
-	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
-		return err;
-	}
-
-	err = optpool_ctor(msg->opts, alloc);
-	if (unlikely(err)) {
-		fcallerror("optpool_ctor", err);
-		return err;
-	}
-
-	err = optpool_buffer_unpack(msg->opts, buffer);
-	if (unlikely(err)) {
-		fcallerror("optpool_buffer_unpack", err);
-		return err;
-	}
-
-	return 0;
+	memcpy(p, &x, sizeof(ui64));
+	return p + sizeof(ui64);
 }
 
-static int _free_message_response_join(struct alloc *alloc,
-                                       const struct message_response_join *msg)
+static inline char *_put_bytes(char *p, const void *x, ll n)
 {
-	/* Since struct optpool can be quite heavy it would be a waste of resources
-	 * to duplicate it. Instead the pointer should be copied and set to zero.
-	 *
-	 * WARNING This means that the correct allocator needs to be passed to
-	 *         the unpack routine.
-	 */
-	if (NULL != msg->opts)
-		warn("msg->opts should be NULL. This may result in a memory leak.");
-
-	return 0;
+	if (n > 0)
+		memcpy(p, x, n);
+	return p + n;
 }
 
-static int _pack_message_ping(struct buffer *buffer,
-                              const struct message_ping *msg)
+static inline char *_put_string(char *p, const char *str)
 {
-	int err;
-
-	err = buffer_pack_ui64(buffer, &msg->now, 1);
-	if (unlikely(err))
-		return err;
+	ll len;
 
-	return 0;
+	len = _strsize(str);
+	p = _put_ui64(p, len);
+	return _put_bytes(p, str, len);
 }
 
-static int _unpack_message_ping(struct buffer *buffer,
-                                struct message_ping *msg)
+static char *_put_strv(char *p, ui64 n, char *const *str)
 {
-	int err;
-
-	err = buffer_unpack_ui64(buffer, &msg->now, 1);
-	if (unlikely(err))
-		return err;
+	ui64 i;
 
-	return 0;
-}
+	p = _put_ui64(p, n + 1);
+	for (i = 0; i < n; ++i)
+		p = _put_string(p, str[i]);
 
-static int _free_message_ping(struct alloc *alloc,
-                              const struct message_ping *msg)
-{
-	return 0;
+	return _put_ui64(p, 0);	/* Trailing NULL pointer */
 }
 
-static int _pack_message_request_exec(struct buffer *buffer,
-                                      const struct message_request_exec *msg)
+static inline int _scan_ui64(const char **q, const char *end, ui64 *x)
 {
-	int err;
-	int i;
-
-	err = buffer_pack_string(buffer, msg->host);
-	if (unlikely(err))
-		return err;
-
-	i = 0;
-	while (msg->argv[i]) ++i;
-	++i;	/* Trailing NULL pointer */
+	if (unlikely(end - (*q) < (ll )sizeof(ui64)))
+		return -ESOMEFAULT;
 
-	err = buffer_pack_array_of_str(buffer, i, msg->argv);
-	if (unlikely(err))
-		return err;
+	memcpy(x, *q, sizeof(ui64));
+	*q += sizeof(ui64);
 
 	return 0;
 }
 
-static int _unpack_message_request_exec(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_request_exec *msg)
+/*
+ * Validate an array of n elements of the given size. If ext is not NULL
+ * the block memory required for the array is added.
+ */
+static inline int _scan_array(const char **q, const char *end, ll size, ll *ext)
 {
-	int err;
-
-	err = buffer_unpack_string(buffer, alloc, (char **)&msg->host);
-	if (unlikely(err))
-		return err;
+	ui64 n;
 
-	err = buffer_unpack_array_of_str(buffer, alloc,
-	                                 &msg->argc, (char ***)&msg->argv);
-	if (unlikely(err))
-		return err;
+	if (unlikely(_scan_ui64(q, end, &n)))
+		return -ESOMEFAULT;
+	if (unlikely(n > (ui64 )(end - (*q))/size))
+		return -ESOMEFAULT;
 
-	--msg->argc;	/* argv has always size argc + 1 with argv[argc] == NULL. */
+	*q += n*size;
+	if (ext)
+		*ext += _BLOCK_ROUNDUP(n*size);
 
 	return 0;
 }
 
-static int _free_message_request_exec(struct alloc *alloc,
-                                      const struct message_request_exec *msg)
+/*
+ * The packed string includes the terminating zero. Do not trust the peer
+ * on that.
+ */
+static int _scan_string(const char **q, const char *end, ll *ext)
 {
-	int err;
+	const char *s;
 
-	err = array_of_str_free(alloc, (msg->argc + 1), (char ***)&msg->argv);
-	if (unlikely(err))
-		return err;	/* array_of_str_free() reports reason. */
+	s = (*q) + sizeof(ui64);
+	if (unlikely(_scan_array(q, end, 1, ext)))
+		return -ESOMEFAULT;
 
-	err = strfree(alloc, (char **)&msg->host);
-	if (unlikely(err))
-		return err;
+	if (unlikely(((*q) > s) && ('\0' != (*q)[-1]))) {
+		error("String is not zero terminated.");
+		return -ESOMEFAULT;
+	}
 
 	return 0;
 }
 
-static int _pack_message_request_build_tree(struct buffer *buffer,
-                                            const struct message_request_build_tree *msg)
+static int _scan_strv(const char **q, const char *end, int view, ll *ext)
 {
-	int err;
-
-	err = buffer_pack_ui64(buffer, &msg->nhosts, 1);
-	if (unlikely(err))
-		return err;
-
-	err = buffer_pack_si32(buffer, msg->hosts, msg->nhosts);
-	if (unlikely(err))
-		return err;
+	ui64 i, n;
+	const char *s;
 
-	return 0;
-}
+	if (unlikely(_scan_ui64(q, end, &n)))
+		return -ESOMEFAULT;
+	/* Every string takes up at least the length field and the array
+	 * must contain the trailing NULL pointer.
+	 */
+	if (unlikely((n < 1) || (n > (ui64 )(end - (*q))/sizeof(ui64))))
+		return -ESOMEFAULT;
 
-static int _unpack_message_request_build_tree(struct buffer *buffer,
-                                              struct alloc *alloc,
-                                              struct message_request_build_tree *msg)
-{
-	int err;
+	*ext += _BLOCK_ROUNDUP(n*sizeof(char *));
 
-	err = buffer_unpack_ui64(buffer, &msg->nhosts, 1);
-	if (unlikely(err))
-		return err;
-
-	err = ZALLOC(alloc, (void **)&msg->hosts, msg->nhosts, sizeof(si32), "hosts");
-	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
-		return err;
+	s = NULL;
+	for (i = 0; i < n; ++i) {
+		s = *q;
+		if (unlikely(_scan_string(q, end, (view) ? NULL : ext)))
+			return -ESOMEFAULT;
 	}
 
-	err = buffer_unpack_si32(buffer, msg->hosts, msg->nhosts);
-	if (unlikely(err))
-		return err;
+	/* The last string must be empty, i.e., consist only of the
+	 * length field.
+	 */
+	if (unlikely((*q) - s != sizeof(ui64))) {
+		error("String array is not NULL terminated.");
+		return -ESOMEFAULT;
+	}
 
 	return 0;
 }
 
-static int _free_message_request_build_tree(struct alloc *alloc,
-                                            const struct message_request_build_tree *msg)
+static inline const char *_get_ui64(const char *q, ui64 *x)
 {
-	int err;
-
-	err = ZFREE(alloc, (void **)&msg->hosts, msg->nhosts, sizeof(si32), "hosts");
-	if (unlikely(err)) {
-		fcallerror("ZFREE", err);
-		return err;
-	}
-
-	return 0;
+	memcpy(x, q, sizeof(ui64));
+	return q + sizeof(ui64);
 }
 
-static int _pack_message_response_build_tree(struct buffer *buffer,
-                                             const struct message_response_build_tree *msg)
+/*
+ * Unpack n elements of the given size either as a view or into the block.
+ */
+static inline const char *_get_array(const char *q, int view, char **b,
+                                     ll size, ui64 *n, void **p)
 {
-	int err;
+	q = _get_ui64(q, n);
 
-	err = buffer_pack_ui32(buffer, &msg->deads, 1);
-	if (unlikely(err))
-		return err;
+	if (0 == (*n)) {
+		*p = NULL;
+		return q;
+	}
 
-	return 0;
+	if (view) {
+		*p = (void *)q;
+	} else {
+		*p = *b;
+		memcpy(*b, q, (*n)*size);
+		*b += _BLOCK_ROUNDUP((*n)*size);
+	}
+
+	return q + (*n)*size;
 }
 
-static int _unpack_message_response_build_tree(struct buffer *buffer,
-                                               struct message_response_build_tree *msg)
+static inline const char *_get_string(const char *q, int view, char **b, char **str)
 {
-	int err;
-
-	err = buffer_unpack_ui32(buffer, &msg->deads, 1);
-	if (unlikely(err))
-		return err;
+	ui64 len;
 
-	return 0;
+	return _get_array(q, view, b, 1, &len, (void **)str);
 }
 
-static int _free_message_response_build_tree(struct alloc *alloc,
-                                             const struct message_response_build_tree *msg)
+static const char *_get_strv(const char *q, int view, char **b,
+                             ui64 *argc, char ***argv)
 {
-	return 0;
-}
+	ui64 i, n;
 
-static int _pack_message_request_task(struct buffer *buffer,
-                                      const struct message_request_task *msg)
-{
-	int err;
+	q = _get_ui64(q, &n);
 
-	err = buffer_pack_string(buffer, msg->path);
-	if (unlikely(err))
-		return err;
+	*argv = (char **)*b;
+	*b   += _BLOCK_ROUNDUP(n*sizeof(char *));
 
-	err = buffer_pack_array_of_str(buffer, (msg->argc + 1), msg->argv);
-	if (unlikely(err))
-		return err;
+	for (i = 0; i < n; ++i)
+		q = _get_string(q, view, b, &(*argv)[i]);
 
-	err = buffer_pack_ui32(buffer, &msg->channel, 1);
-	if (unlikely(err))
-		return err;
+	*argc = n - 1;	/* argv has always size argc + 1 with argv[argc] == NULL. */
 
-	return 0;
+	return q;
 }
 
-static int _unpack_message_request_task(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_request_task *msg)
+static inline void _extent(void **p, ll *ext, const void *ptr, ll size)
 {
-	int err;
+	if ((!(*p)) && ptr)
+		*p = (void *)ptr;
 
-	err = buffer_unpack_string(buffer, alloc, (char **)&msg->path);
-	if (unlikely(err))
-		return err;
-
-	err = buffer_unpack_array_of_str(buffer, alloc,
-	                                 &msg->argc, (char ***)&msg->argv);
-	if (unlikely(err))
-		return err;
+	*ext += _BLOCK_ROUNDUP(size);
+}
 
-	--msg->argc;	/* argv has always size argc + 1 with argv[argc] == NULL. */
+#define _SIZE_SCALAR(T, N)	size += sizeof(T);
+#define _SIZE_STRING(N)		size += sizeof(ui64) + _strsize(msg->N);
+#define _SIZE_STRV(C, N)	size += _strvsize(msg->C, msg->N);
+#define _SIZE_ARRAY(T, C, N)	size += sizeof(ui64) + msg->C*sizeof(T);
+#define _SIZE_BYTES(C, N)	size += sizeof(ui64) + msg->C;
+
+#define _PACK_SCALAR(T, N)	memcpy(p, &msg->N, sizeof(T)); p += sizeof(T);
+#define _PACK_STRING(N)		p = _put_string(p, msg->N);
+#define _PACK_STRV(C, N)	p = _put_strv(p, msg->C, msg->N);
+#define _PACK_ARRAY(T, C, N)	p = _put_ui64(p, msg->C);			\
+				p = _put_bytes(p, msg->N, msg->C*sizeof(T));
+#define _PACK_BYTES(C, N)	p = _put_ui64(p, msg->C);			\
+				p = _put_bytes(p, msg->N, msg->C);
+
+#define _SCAN_SCALAR(T, N)						\
+	if (unlikely(end - q < (ll )sizeof(T)))				\
+		goto fail;						\
+	q += sizeof(T);
+#define _SCAN_STRING(N)							\
+	if (unlikely(_scan_string(&q, end, (view) ? NULL : &ext)))	\
+		goto fail;
+#define _SCAN_STRV(C, N)						\
+	if (unlikely(_scan_strv(&q, end, view, &ext)))			\
+		goto fail;
+#define _SCAN_ARRAY(T, C, N)						\
+	if (unlikely(_scan_array(&q, end, sizeof(T), &ext)))		\
+		goto fail;
+#define _SCAN_BYTES(C, N)						\
+	if (unlikely(_scan_array(&q, end, 1, (view) ? NULL : &ext)))	\
+		goto fail;
+
+#define _FILL_SCALAR(T, N)	memcpy(&msg->N, q, sizeof(T)); q += sizeof(T);
+#define _FILL_STRING(N)		q = _get_string(q, view, &b, (char **)&msg->N);
+#define _FILL_STRV(C, N)	q = _get_strv(q, view, &b, &msg->C, &msg->N);
+#define _FILL_ARRAY(T, C, N)	q = _get_array(q, 0, &b, sizeof(T),		\
+				               &msg->C, (void **)&msg->N);
+#define _FILL_BYTES(C, N)	q = _get_array(q, view, &b, 1,			\
+				               &msg->C, (void **)&msg->N);
+
+#define _EXTENT_SCALAR(T, N)
+#define _EXTENT_STRING(N)						\
+	if (!view)							\
+		_extent(&p, &ext, msg->N, _strsize(msg->N));
+#define _EXTENT_STRV(C, N)						\
+	_extent(&p, &ext, msg->N, _strvextent(view, msg->C, msg->N));
+#define _EXTENT_ARRAY(T, C, N)						\
+	_extent(&p, &ext, msg->N, msg->C*sizeof(T));
+#define _EXTENT_BYTES(C, N)						\
+	if (!view)							\
+		_extent(&p, &ext, msg->N, msg->C);
+
+#define DEFINE_MESSAGE_FUNCTIONS(NAME, SCHEMA)				\
+static ll _size_message_ ## NAME(const struct message_ ## NAME *msg)	\
+{									\
+	ll size = 0;							\
+									\
+	SCHEMA(_SIZE_SCALAR, _SIZE_STRING, _SIZE_STRV,			\
+	       _SIZE_ARRAY, _SIZE_BYTES)				\
+									\
+	return size;							\
+}									\
+									\
+static int _pack_message_ ## NAME(struct buffer *buffer,		\
+                                  const struct message_ ## NAME *msg)	\
+{									\
+	int err;							\
+	char *p;							\
+									\
+	err = buffer_pack_reserve(buffer, _size_message_ ## NAME(msg),	\
+	                          (void **)&p);				\
+	if (unlikely(err)) {						\
+		fcallerror("buffer_pack_reserve", err);			\
+		return err;						\
+	}								\
+									\
+	SCHEMA(_PACK_SCALAR, _PACK_STRING, _PACK_STRV,			\
+	       _PACK_ARRAY, _PACK_BYTES)				\
+									\
+	return 0;							\
+}									\
+									\
+static int _unpack_message_ ## NAME(struct buffer *buffer,		\
+                                    struct alloc *alloc,		\
+                                    int view,				\
+                                    struct message_ ## NAME *msg)	\
+{									\
+	int err;							\
+	const char *q, *end;						\
+	char *b;							\
+	ll ext;								\
+									\
+	memset(msg, 0, sizeof(*msg));					\
+									\
+	q   = buffer->buf + buffer->pos;				\
+	end = buffer->buf + buffer->size;				\
+	ext = 0;							\
+									\
+	SCHEMA(_SCAN_SCALAR, _SCAN_STRING, _SCAN_STRV,			\
+	       _SCAN_ARRAY, _SCAN_BYTES)				\
+									\
+	b = NULL;							\
+	if (ext > 0) {							\
+		err = ZALLOC(alloc, (void **)&b, ext, sizeof(char),	\
+		             "struct message_" #NAME);			\
+		if (unlikely(err)) {					\
+			fcallerror("ZALLOC", err);			\
+			return err;					\
+		}							\
+	}								\
+									\
+	q = buffer->buf + buffer->pos;					\
+									\
+	SCHEMA(_FILL_SCALAR, _FILL_STRING, _FILL_STRV,			\
+	       _FILL_ARRAY, _FILL_BYTES)				\
+									\
+	buffer->pos = q - buffer->buf;					\
+									\
+	return 0;							\
+									\
+fail:									\
+	error("Malformed payload of struct message_" #NAME ".");	\
+	return -ESOMEFAULT;						\
+}									\
+									\
+static int _free_message_ ## NAME(struct alloc *alloc,			\
+                                  int view,				\
+                                  const struct message_ ## NAME *msg)	\
+{									\
+	int err;							\
+	void *p;							\
+	ll ext;								\
+									\
+	p   = NULL;							\
+	ext = 0;							\
+									\
+	SCHEMA(_EXTENT_SCALAR, _EXTENT_STRING, _EXTENT_STRV,		\
+	       _EXTENT_ARRAY, _EXTENT_BYTES)				\
+									\
+	if (!p)								\
+		return 0;						\
+									\
+	err = ZFREE(alloc, &p, ext, sizeof(char), "");			\
+	if (unlikely(err)) {						\
+		fcallerror("ZFREE", err);				\
+		return err;						\
+	}								\
+									\
+	return 0;							\
+}
 
+DEFINE_MESSAGE_FUNCTIONS(request_join       , MESSAGE_SCHEMA_REQUEST_JOIN)
+DEFINE_MESSAGE_FUNCTIONS(ping               , MESSAGE_SCHEMA_PING)
+DEFINE_MESSAGE_FUNCTIONS(request_exec       , MESSAGE_SCHEMA_REQUEST_EXEC)
+DEFINE_MESSAGE_FUNCTIONS(request_build_tree , MESSAGE_SCHEMA_REQUEST_BUILD_TREE)
+DEFINE_MESSAGE_FUNCTIONS(response_build_tree, MESSAGE_SCHEMA_RESPONSE_BUILD_TREE)
+DEFINE_MESSAGE_FUNCTIONS(request_task       , MESSAGE_SCHEMA_REQUEST_TASK)
+DEFINE_MESSAGE_FUNCTIONS(response_task      , MESSAGE_SCHEMA_RESPONSE_TASK)
+DEFINE_MESSAGE_FUNCTIONS(request_exit       , MESSAGE_SCHEMA_REQUEST_EXIT)
+DEFINE_MESSAGE_FUNCTIONS(write_stdout       , MESSAGE_SCHEMA_WRITE_STDOUT)
+DEFINE_MESSAGE_FUNCTIONS(write_stderr       , MESSAGE_SCHEMA_WRITE_STDERR)
+DEFINE_MESSAGE_FUNCTIONS(user               , MESSAGE_SCHEMA_USER)
+DEFINE_MESSAGE_FUNCTIONS(request_attach     , MESSAGE_SCHEMA_REQUEST_ATTACH)
+DEFINE_MESSAGE_FUNCTIONS(response_attach    , MESSAGE_SCHEMA_RESPONSE_ATTACH)
 
-	err = buffer_unpack_ui32(buffer, &msg->channel, 1);
-	if (unlikely(err))
-		return err;
 
-	return 0;
-}
-
-static int _free_message_request_task(struct alloc *alloc,
-                                      const struct message_request_task *msg)
+static int _pack_message_response_join(struct buffer *buffer,
+                                       const struct message_response_join *msg)
 {
 	int err;
 
-	err = array_of_str_free(alloc, (msg->argc + 1), (char ***)&msg->argv);
+	err = buffer_pack_ui32(buffer, &msg->version, 1);
 	if (unlikely(err))
-		return err;	/* array_of_str_free() reports reason. */
+		return err;
 
-	err = strfree(alloc, (char **)&msg->path);
+	err = buffer_pack_ui32(buffer, &msg->addr, 1);
 	if (unlikely(err))
-		return err;	/* strfree() will report problem. */
-
-	return 0;
-}
-
-static int _pack_message_response_task(struct buffer *buffer,
-                                       const struct message_response_task *msg)
-{
-	int err;
+		return err;
 
-	err = buffer_pack_ui32(buffer, &msg->ret, 1);
-	if (unlikely(err))
+	err = optpool_buffer_pack(msg->opts, buffer);
+	if (unlikely(err)) {
+		fcallerror("optpool_buffer_pack", err);
 		return err;
+	}
 
 	return 0;
 }
 
-static int _unpack_message_response_task(struct buffer *buffer,
+static int _unpack_message_response_join(struct buffer *buffer,
                                          struct alloc *alloc,
-                                         struct message_response_task *msg)
+                                         int view,
+                                         struct message_response_join *msg)
 {
 	int err;
 
-	err = buffer_unpack_ui32(buffer, &msg->ret, 1);
+	err = buffer_unpack_ui32(buffer, &msg->version, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
-
-static int _free_message_response_task(struct alloc *alloc,
-                                       const struct message_response_task *msg)
-{
-	return 0;
-}
-
-static int _pack_message_request_exit(struct buffer *buffer,
-                                      const struct message_request_exit *msg)
-{
-	int err;
-
-	err = buffer_pack_ui32(buffer, &msg->signum, 1);
+	err = buffer_unpack_ui32(buffer, &msg->addr, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
+	err = ZALLOC(alloc, (void **)&msg->opts, 1,
+	             sizeof(struct optpool), "opts");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
 
-static int _unpack_message_request_exit(struct buffer *buffer,
-                                        struct message_request_exit *msg)
-{
-	int err;
+	err = optpool_ctor(msg->opts, alloc);
+	if (unlikely(err)) {
+		fcallerror("optpool_ctor", err);
+		return err;
+	}
 
-	err = buffer_unpack_ui32(buffer, &msg->signum, 1);
-	if (unlikely(err))
+	err = optpool_buffer_unpack(msg->opts, buffer);
+	if (unlikely(err)) {
+		fcallerror("optpool_buffer_unpack", err);
 		return err;
+	}
 
 	return 0;
 }
 
-static int _free_message_request_exit(struct alloc *alloc,
-                                      const struct message_request_exit *msg)
+static int _free_message_response_join(struct alloc *alloc,
+                                       int view,
+                                       const struct message_response_join *msg)
 {
+	/* Since struct optpool can be quite heavy it would be a waste of resources
+	 * to duplicate it. Instead the pointer should be copied and set to zero.
+	 *
+	 * WARNING This means that the correct allocator needs to be passed to
+	 *         the unpack routine.
+	 */
+	if (NULL != msg->opts)
+		warn("msg->opts should be NULL. This may result in a memory leak.");
+
 	return 0;
 }
 
@@ -933,151 +934,133 @@ static int _pack_message_response_exit(struct buffer *buffer,
                                        const struct message_response_exit *msg)
 {
 	int err;
+	ui64 i, n;
+	si64 tmp[5];
+	struct alloc_profile_site *x;
 
 	err = buffer_pack_ui32(buffer, &msg->dummy, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
+	n = (msg->profile) ? msg->profile->nsites : 0;
 
-static int _unpack_message_response_exit(struct buffer *buffer,
-                                         struct message_response_exit *msg)
-{
-	int err;
-
-	err = buffer_unpack_ui32(buffer, &msg->dummy, 1);
+	err = buffer_pack_ui64(buffer, &n, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
+	for (i = 0; i < n; ++i) {
+		x = &msg->profile->sites[i];
 
-static int _free_message_response_exit(struct alloc *alloc,
-                                       const struct message_response_exit *msg)
-{
-	return 0;
-}
+		err = buffer_pack_string(buffer, x->file);
+		if (unlikely(err))
+			return err;
+		err = buffer_pack_string(buffer, x->func);
+		if (unlikely(err))
+			return err;
 
-static int _pack_message_write_stdout(struct buffer *buffer,
-                                      const struct message_write_stdout *msg)
-{
-	int err;
+		tmp[0] = x->line;
+		tmp[1] = x->count;
+		tmp[2] = x->bytes;
+		tmp[3] = x->live;
+		tmp[4] = x->hwm;
 
-	err = buffer_pack_string(buffer, msg->lines);
-	if (unlikely(err))
-		return err;
+		err = buffer_pack_si64(buffer, tmp, ARRAYLEN(tmp));
+		if (unlikely(err))
+			return err;
+	}
 
 	return 0;
 }
 
-static int _unpack_message_write_stdout(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_write_stdout *msg)
+static int _unpack_message_response_exit(struct buffer *buffer,
+                                         struct alloc *alloc,
+                                         int view,
+                                         struct message_response_exit *msg)
 {
 	int err;
+	ui64 i, n;
+	si64 tmp[5];
+	struct alloc_profile_site *x;
 
-	err = buffer_unpack_string(buffer, alloc, (char **)&msg->lines);
+	err = buffer_unpack_ui32(buffer, &msg->dummy, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
-
-static int _free_message_write_stdout(struct alloc *alloc,
-                                      const struct message_write_stdout *msg)
-{
-	int err;
-
-	err = strfree(alloc, (char **)&msg->lines);
-	if (unlikely(err))
-		return err;	/* strfree() will report problem. */
-
-	return 0;
-}
-
-static int _pack_message_write_stderr(struct buffer *buffer,
-                                      const struct message_write_stderr *msg)
-{
-	int err;
-
-	err = buffer_pack_string(buffer, msg->lines);
+	err = buffer_unpack_ui64(buffer, &n, 1);
 	if (unlikely(err))
 		return err;
 
-	return 0;
-}
+	msg->profile = NULL;
 
-static int _unpack_message_write_stderr(struct buffer *buffer,
-                                        struct alloc *alloc,
-                                        struct message_write_stderr *msg)
-{
-	int err;
+	if (0 == n)
+		return 0;
 
-	err = buffer_unpack_string(buffer, alloc, (char **)&msg->lines);
-	if (unlikely(err))
+	err = ZALLOC(alloc, (void **)&msg->profile, 1,
+	             sizeof(struct alloc_profile), "profile");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
 		return err;
+	}
 
-	return 0;
-}
-
-static int _free_message_write_stderr(struct alloc *alloc,
-                                      const struct message_write_stderr *msg)
-{
-	int err;
-
-	err = strfree(alloc, (char **)&msg->lines);
-	if (unlikely(err))
-		return err;	/* strfree() will report problem. */
-
-	return 0;
-}
-
-static int _pack_message_user(struct buffer *buffer,
-                              const struct message_user *msg)
-{
-	int err;
-
-	err = buffer_pack_ui64(buffer, &msg->len, 1);
-	if (unlikely(err))
+	err = alloc_profile_ctor(msg->profile, alloc);
+	if (unlikely(err)) {
+		fcallerror("alloc_profile_ctor", err);
 		return err;
+	}
 
-	err = buffer_pack_ui8(buffer, msg->bytes, msg->len);
-	if (unlikely(err))
+	err = ZALLOC(alloc, (void **)&msg->profile->sites, n,
+	             sizeof(struct alloc_profile_site), "sites");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
 		return err;
+	}
+
+	for (i = 0; i < n; ++i) {
+		x = &msg->profile->sites[i];
+
+		err = buffer_unpack_string(buffer, alloc, (char **)&x->file);
+		if (unlikely(err))
+			return err;
+		err = buffer_unpack_string(buffer, alloc, (char **)&x->func);
+		if (unlikely(err))
+			return err;
+
+		/* Let the destructor know about the partially unpacked
+		 * site.
+		 */
+		msg->profile->nsites = i + 1;
+
+		err = buffer_unpack_si64(buffer, tmp, ARRAYLEN(tmp));
+		if (unlikely(err))
+			return err;
+
+		x->line  = tmp[0];
+		x->count = tmp[1];
+		x->bytes = tmp[2];
+		x->live  = tmp[3];
+		x->hwm   = tmp[4];
+	}
 
 	return 0;
 }
 
-static int _unpack_message_user(struct buffer *buffer,
-                                struct alloc *alloc,
-                                struct message_user *msg)
+static int _free_message_response_exit(struct alloc *alloc,
+                                       int view,
+                                       const struct message_response_exit *msg)
 {
 	int err;
 
-	err = buffer_unpack_ui64(buffer, &msg->len, 1);
-	if (unlikely(err))
-		return err;
+	if (!msg->profile)
+		return 0;
 
-	err = ZALLOC(alloc, (void **)&msg->bytes, msg->len, sizeof(ui8), "bytes");
+	err = alloc_profile_dtor(msg->profile);
 	if (unlikely(err)) {
-		fcallerror("ZALLOC", err);
+		fcallerror("alloc_profile_dtor", err);
 		return err;
 	}
 
-	err = buffer_unpack_ui8(buffer, msg->bytes, msg->len);
-	if (unlikely(err))
-		return err;
-
-	return 0;
-}
-
-static int _free_message_user(struct alloc *alloc,
-                              const struct message_user *msg)
-{
-	int err;
-
-	err = ZFREE(alloc, (void **)&msg->bytes, msg->len, sizeof(ui8), "bytes");
+	err = ZFREE(alloc, (void **)&msg->profile, 1,
+	            sizeof(struct alloc_profile), "");
 	if (unlikely(err)) {
 		fcallerror("ZFREE", err);
 		return err;
@@ -5,6 +5,7 @@
 #include "ints.h"
 
 struct alloc;
+struct alloc_profile;
 struct buffer;
 struct optpool;
 
@@ -32,7 +33,9 @@ enum
 	MESSAGE_TYPE_RESPONSE_EXIT,
 	MESSAGE_TYPE_WRITE_STDOUT,
 	MESSAGE_TYPE_WRITE_STDERR,
-	MESSAGE_TYPE_USER
+	MESSAGE_TYPE_USER,
+	MESSAGE_TYPE_REQUEST_ATTACH,
+	MESSAGE_TYPE_RESPONSE_ATTACH
 };
 
 /*
@@ -44,120 +47,213 @@ enum
 	MESSAGE_FLAG_BCAST = 0x2
 };
 
+/*
+ * Revision of the wire protocol. It is exchanged in the REQUEST_JOIN and
+ * RESPONSE_JOIN messages so that processes running incompatible binaries
+ * notice the mismatch when joining the tree.
+ */
+#define MESSAGE_PROTOCOL_VERSION	5
+
 /*
  * Message header for all protocol messages. The payload size may not be null!
  *
- * The packed variant of message_header must consume exactly sizeof(message_header)
- * bytes or otherwise the communication routines will be broken!
+ * On the wire the header has a variable size. It starts with a fixed
+ * prefix consisting of the header size (one byte) and the payload size
+ * (ui32) followed by the variable length (LEB128) encoded src, dst,
+ * flags, type and channel. Participant ids are 32-bit but small ids
+ * consume only a few bytes. Since the prefix fits into
+ * MESSAGE_HEADER_MIN_SIZE bytes the total message size can be determined
+ * after reading MESSAGE_HEADER_MIN_SIZE bytes, see peek_message_size().
  */
-struct __attribute__((packed)) message_header
+#define MESSAGE_HEADER_MIN_SIZE	10
+#define MESSAGE_HEADER_MAX_SIZE	24
+
+struct message_header
 {
-	/* The choice of 16 bit integers at this point limits the
-	 * network size to 2^16 participants.
-	 * dst is meaningless for broadcast messages.
+	/* dst is meaningless for broadcast messages.
 	 */
-	ui16	src;
-	ui16	dst;
+	ui32	src;
+	ui32	dst;
 
 	/* Set MESSAGE_FLAG_BCAST to create a broadcast package. */
 	ui16	flags;
-	ui16	type;		/* Message size */
+	ui16	type;		/* Message type */
 	/* In order to separate traffic for individual plugins we support a
 	 * number of (virtual) channels.
 	 */
 	ui16	channel;
 
-	ui16	pad16[1];	/* I prefer manual padding over the packing by the
-				 * the compiler (the attribute is just for safety). */
+	ui16	size;		/* Size of the packed header. Set by
+				 * pack_message_header() and
+				 * unpack_message_header(). */
 
 	ui32	payload;	/* Payload size. May not be zero. */
 };
 
-struct message_request_join
-{
-	ui32		pid;		/* Process id. 32-bit should be enough on any
-					 * platform I am aware of. */
-	ui32		ip;		/* IPv4 address */
-	ui32		portnum;	/* TCP port */
-};
+/*
+ * Message schemas.
+ *
+ * Messages that consist only of scalars, strings and flat arrays are described
+ * exactly once by a list of fields. The list is expanded into the struct
+ * definition below and into specialized size, pack, unpack and free functions
+ * in protocol.c. The order of the fields is the order on the wire. The field
+ * kinds are
+ *
+ *	SCALAR(T, name)		A single value of type T.
+ *	STRING(name)		A zero terminated string. May be NULL.
+ *	STRV(count, name)	An array of count strings followed by a trailing
+ *				NULL pointer (argv style).
+ *	ARRAY(T, count, name)	An array of count values of type T.
+ *	BYTES(count, name)	An opaque array of count bytes.
+ *
+ * Messages with nested structures (struct message_response_join and
+ * struct message_response_exit) are written by hand.
+ */
 
-struct message_response_join
-{
-	ui32		addr;	/* Already given to process on command line.
-				 * Given again for double checking. */
-	struct optpool	*opts;
-};
+/*
+ * The process id is 32-bit which should be enough on any platform I
+ * am aware of. ip and portnum are the IPv4 address and TCP port. version
+ * is the MESSAGE_PROTOCOL_VERSION of the joining process.
+ */
+#define MESSAGE_SCHEMA_REQUEST_JOIN(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, version)						\
+	SCALAR(ui32, pid)						\
+	SCALAR(ui32, ip)						\
+	SCALAR(ui32, portnum)
 
-struct message_ping
-{
-	ui64		now;
-};
+#define MESSAGE_SCHEMA_PING(SCALAR, STRING, STRV, ARRAY, BYTES)		\
+	SCALAR(ui64, now)
 
-struct message_request_exec
-{
-	const char	*host;
-	ui64		argc;
-	char 		**argv;
-};
+/*
+ * cost is the expected time in microseconds needed to build the subtree
+ * rooted at the spawned process. Requests with a larger cost are served
+ * first since they are on the critical path of the tree.
+ */
+#define MESSAGE_SCHEMA_REQUEST_EXEC(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	STRING(host)							\
+	STRV(argc, argv)						\
+	SCALAR(ui64, cost)
 
-struct message_request_build_tree
-{
-	ui64		nhosts;
-	si32		*hosts;
-};
+/*
+ * Host list expression (see hostlist.h) for the hosts in the subtree rooted
+ * at the receiver, not including the receiver itself. Participant ids are
+ * assigned contiguously so the i-th host has the id of the receiver plus i
+ * plus one. addrs are the IPv4 addresses of the hosts if the sender resolved
+ * them already (naddrs is zero otherwise). layout and width describe the
+ * tree layout used by the receiver (see layout.h) and groups are the indices
+ * of the first hosts of the host groups in the subtree (only used by the
+ * topology layout). If the width is chosen adaptively latency is the spawn
+ * latency in microseconds measured by the sender (zero otherwise).
+ */
+#define MESSAGE_SCHEMA_REQUEST_BUILD_TREE(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	STRING(hosts)							\
+	ARRAY(ui32, naddrs, addrs)					\
+	SCALAR(ui32, layout)						\
+	SCALAR(ui32, width)						\
+	SCALAR(ui64, latency)						\
+	ARRAY(si32, ngroups, groups)
 
-struct message_response_build_tree
-{
-	ui32		deads;
-};
+#define MESSAGE_SCHEMA_RESPONSE_BUILD_TREE(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, deads)
 
-struct message_request_task
-{
-	const char	*path;
-	ui64		argc;
-	char 		**argv;
-	ui32		channel;
-};
+#define MESSAGE_SCHEMA_REQUEST_TASK(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	STRING(path)							\
+	STRV(argc, argv)						\
+	SCALAR(ui32, channel)
 
-struct message_response_task
-{
-	ui32		ret;
-};
+#define MESSAGE_SCHEMA_RESPONSE_TASK(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, ret)
 
-struct message_request_exit
-{
-	ui32		signum;
-};
+#define MESSAGE_SCHEMA_REQUEST_EXIT(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, signum)
 
-struct message_response_exit
-{
-	ui32		dummy;
-};
+#define MESSAGE_SCHEMA_WRITE_STDOUT(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	STRING(lines)
 
-struct message_write_stdout
-{
-	const char	*lines;
-};
+#define MESSAGE_SCHEMA_WRITE_STDERR(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	STRING(lines)
 
-struct message_write_stderr
-{
-	const char	*lines;
+/*
+ * Opaque message that is sent and received by plugins. coll is the
+ * sequence number of the collective operation the message belongs to
+ * (see task_plugin_api_barrier()) or zero for point-to-point messages.
+ */
+#define MESSAGE_SCHEMA_USER(SCALAR, STRING, STRV, ARRAY, BYTES)		\
+	SCALAR(ui32, coll)						\
+	BYTES(len, bytes)
+
+/*
+ * Exchanged between the agent exec plugin and a resident agent (see
+ * agent.h) outside of the tree. argv is the command line of the process
+ * to start and key the content of the 'AgentKeyFile' (may be NULL). ret
+ * follows the conventions of exec_plugin_ops.exec().
+ */
+#define MESSAGE_SCHEMA_REQUEST_ATTACH(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, version)						\
+	STRING(key)							\
+	STRV(argc, argv)
+
+#define MESSAGE_SCHEMA_RESPONSE_ATTACH(SCALAR, STRING, STRV, ARRAY, BYTES)	\
+	SCALAR(ui32, ret)
+
+#define _MESSAGE_MEMBER_SCALAR(T, N)		T N;
+#define _MESSAGE_MEMBER_STRING(N)		const char *N;
+#define _MESSAGE_MEMBER_STRV(C, N)		ui64 C; char **N;
+#define _MESSAGE_MEMBER_ARRAY(T, C, N)		ui64 C; T *N;
+#define _MESSAGE_MEMBER_BYTES(C, N)		ui64 C; ui8 *N;
+
+#define DEFINE_MESSAGE_STRUCT(NAME, SCHEMA)	\
+struct message_ ## NAME				\
+{						\
+	SCHEMA(_MESSAGE_MEMBER_SCALAR,		\
+	       _MESSAGE_MEMBER_STRING,		\
+	       _MESSAGE_MEMBER_STRV,		\
+	       _MESSAGE_MEMBER_ARRAY,		\
+	       _MESSAGE_MEMBER_BYTES)		\
 };
 
+DEFINE_MESSAGE_STRUCT(request_join       , MESSAGE_SCHEMA_REQUEST_JOIN)
+DEFINE_MESSAGE_STRUCT(ping               , MESSAGE_SCHEMA_PING)
+DEFINE_MESSAGE_STRUCT(request_exec       , MESSAGE_SCHEMA_REQUEST_EXEC)
+DEFINE_MESSAGE_STRUCT(request_build_tree , MESSAGE_SCHEMA_REQUEST_BUILD_TREE)
+DEFINE_MESSAGE_STRUCT(response_build_tree, MESSAGE_SCHEMA_RESPONSE_BUILD_TREE)
+DEFINE_MESSAGE_STRUCT(request_task       , MESSAGE_SCHEMA_REQUEST_TASK)
+DEFINE_MESSAGE_STRUCT(response_task      , MESSAGE_SCHEMA_RESPONSE_TASK)
+DEFINE_MESSAGE_STRUCT(request_exit       , MESSAGE_SCHEMA_REQUEST_EXIT)
+DEFINE_MESSAGE_STRUCT(write_stdout       , MESSAGE_SCHEMA_WRITE_STDOUT)
+DEFINE_MESSAGE_STRUCT(write_stderr       , MESSAGE_SCHEMA_WRITE_STDERR)
+DEFINE_MESSAGE_STRUCT(user               , MESSAGE_SCHEMA_USER)
+DEFINE_MESSAGE_STRUCT(request_attach     , MESSAGE_SCHEMA_REQUEST_ATTACH)
+DEFINE_MESSAGE_STRUCT(response_attach    , MESSAGE_SCHEMA_RESPONSE_ATTACH)
+
 /*
- * Opaque message that is sent and received by plugins.
+ * Value of message_response_join.addr if the parent already declared the
+ * joining process dead because it connected back too late. The process
+ * must terminate.
  */
-struct message_user
+#define MESSAGE_JOIN_REJECTED	0xFFFFFFFFU
+
+struct message_response_join
 {
-	ui64		len;
-	ui8		*bytes;
+	ui32		version;	/* MESSAGE_PROTOCOL_VERSION of the parent */
+	ui32		addr;	/* Already given to process on command line.
+				 * Given again for double checking. */
+	struct optpool	*opts;
+};
+
+struct message_response_exit
+{
+	ui32			dummy;
+	/* Allocation profile of the subtree rooted at the sender.
+	 * May be NULL. */
+	struct alloc_profile	*profile;
 };
 
 /*
- * Pack a message header into the buffer.
+ * Pack a message header into the buffer. Sets header->size.
  */
 int pack_message_header(struct buffer *buffer,
-                        const struct message_header *header);
+                        struct message_header *header);
 
 /*
  * Unpack a message header from the buffer.
@@ -165,6 +261,13 @@ int pack_message_header(struct buffer *buffer,
 int unpack_message_header(struct buffer *buffer,
                           struct message_header *header);
 
+/*
+ * Determine the total size (header plus payload) of the message starting
+ * at the beginning of the buffer. Only the first MESSAGE_HEADER_MIN_SIZE
+ * bytes of the buffer need to be valid.
+ */
+int peek_message_size(struct buffer *buffer, ll *size);
+
 /*
  * Pack the message payload into the buffer. The message header is used
  * to specify the message type but is left unchanged otherwise.
@@ -181,12 +284,29 @@ int unpack_message_payload(struct buffer *buffer,
                            const struct message_header *header,
                            struct alloc *alloc, void *msg);
 
+/*
+ * Zero-copy variant of unpack_message_payload(). Strings and opaque byte arrays
+ * are not copied out of the buffer, the corresponding members of msg point into
+ * the buffer memory instead and are only valid until the buffer is cleared or
+ * returned to the buffer pool. alloc is only used for containers such as the
+ * argv pointer arrays.
+ */
+int unpack_message_payload_view(struct buffer *buffer,
+                                const struct message_header *header,
+                                struct alloc *alloc, void *msg);
+
 /*
  * Free a message payload
  */
 int free_message_payload(const struct message_header *header,
                          struct alloc *alloc, void *msg);
 
+/*
+ * Free a message payload unpacked with unpack_message_payload_view().
+ */
+int free_message_payload_view(const struct message_header *header,
+                              struct alloc *alloc, void *msg);
+
 /*
  * Pack a message.
  *
@@ -123,6 +123,125 @@ int queue_peek(struct queue *self, void **p)
 	return 0;
 }
 
+int prio_queue_ctor(struct prio_queue *self, struct alloc *alloc, ll capacity)
+{
+	int err;
+
+	if (unlikely(!self || !alloc || capacity < 1))
+		return -EINVAL;
+
+	memset(self, 0, sizeof(*self));
+
+	err = ZALLOC(alloc, (void **)&self->buf, capacity,
+	             sizeof(struct prio_queue_entry), "prio queue");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	self->alloc    = alloc;
+	self->capacity = capacity;
+	self->size     = 0;
+	self->seq      = 0;
+
+	return 0;
+}
+
+int prio_queue_dtor(struct prio_queue *self)
+{
+	int err;
+
+	err = ZFREE(self->alloc, (void **)&self->buf, self->capacity,
+	            sizeof(struct prio_queue_entry), "prio queue");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	return 0;
+}
+
+/*
+ * Returns true if the entry a must be dequeued before b.
+ */
+static inline int _prio_queue_before(const struct prio_queue_entry *a,
+                                     const struct prio_queue_entry *b)
+{
+	return (a->key > b->key) || ((a->key == b->key) && (a->seq < b->seq));
+}
+
+int prio_queue_enqueue(struct prio_queue *self, void *p, ll key)
+{
+	struct prio_queue_entry x;
+	ll i, j;
+
+	if (unlikely(self->capacity == self->size))
+		return -ENOMEM;
+
+	x.key = key;
+	x.seq = self->seq++;
+	x.p   = p;
+
+	/* Sift up.
+	 */
+	for (i = self->size; i > 0; i = j) {
+		j = (i - 1)/2;
+
+		if (!_prio_queue_before(&x, &self->buf[j]))
+			break;
+
+		self->buf[i] = self->buf[j];
+	}
+
+	self->buf[i] = x;
+	self->size  += 1;
+
+	return 0;
+}
+
+int prio_queue_dequeue(struct prio_queue *self, void **p)
+{
+	struct prio_queue_entry x;
+	ll i, j;
+
+	if (unlikely(0 == self->size))
+		return -ENOENT;
+
+	*p = self->buf[0].p;
+
+	self->size -= 1;
+	x = self->buf[self->size];
+
+	/* Sift down the former last element.
+	 */
+	for (i = 0; (j = 2*i + 1) < self->size; i = j) {
+		if ((j + 1 < self->size) &&
+		    _prio_queue_before(&self->buf[j + 1], &self->buf[j]))
+			j += 1;
+
+		if (!_prio_queue_before(&self->buf[j], &x))
+			break;
+
+		self->buf[i] = self->buf[j];
+	}
+
+	self->buf[i] = x;
+
+	return 0;
+}
+
+int prio_queue_peek(struct prio_queue *self, void **p)
+{
+	if (unlikely(0 == self->size))
+		return -ENOENT;
+
+	*p = self->buf[0].p;
+
+	return 0;
+}
+
 int queue_with_lock_ctor(struct queue_with_lock *self,
                          struct alloc *alloc, ll size)
 {
@@ -73,6 +73,57 @@ int queue_dequeue(struct queue *self, void **p);
 int queue_peek(struct queue *self, void **p);
 
 
+/*
+ * A priority queue storing pointers to something. Elements with a
+ * larger key are dequeued first and elements with the same key in the
+ * order in which they were enqueued. The queue is a binary heap with a
+ * fixed capacity.
+ *
+ * This structure is not thread-safe.
+ */
+struct prio_queue_entry
+{
+	ll	key;
+	ll	seq;
+	void	*p;
+};
+
+struct prio_queue
+{
+	struct alloc		*alloc;
+
+	ll			capacity;
+	struct prio_queue_entry	*buf;
+
+	ll			size;
+	ll			seq;	/* Number of enqueued elements */
+};
+
+int prio_queue_ctor(struct prio_queue *self, struct alloc *alloc, ll capacity);
+int prio_queue_dtor(struct prio_queue *self);
+
+static inline void prio_queue_size(struct prio_queue *self, ll *size)
+{
+	*size = self->size;
+}
+
+/*
+ * Enqueue p with priority key. Returns -ENOMEM if the queue is full.
+ */
+int prio_queue_enqueue(struct prio_queue *self, void *p, ll key);
+
+/*
+ * Dequeue the element with the largest key. Returns -ENOENT if the
+ * queue is empty.
+ */
+int prio_queue_dequeue(struct prio_queue *self, void **p);
+
+/*
+ * Same as prio_queue_dequeue() but the queue is not modified.
+ */
+int prio_queue_peek(struct prio_queue *self, void **p);
+
+
 /*
  * A thread-safe variant of struct queue that ensures consistency by means
  * of mutual exclusion.
@@ -22,32 +22,48 @@
 #include "helper.h"
 #include "protocol.h"
 #include "options.h"
+#include "hostlist.h"
+#include "hostprof.h"
+#include "control.h"
 
 
-static int _copy_hosts(struct spawn *self, struct optpool *opts);
-static int _count_hosts(const char *hosts);
-static int _copy_up_to_char(const char *istr, char *ostr, int len, char x);
 static int _free_hosts(struct spawn* self);
+static int _load_host_profile(struct spawn *self);
 static int _setup_tree(struct network *self, struct alloc *alloc,
                        int size, int here);
 static int _tree_close_listenfd(struct network *self);
 
 
 int spawn_ctor(struct spawn *self, struct alloc *alloc, struct optpool *opts,
-               int parent, int here)
+               int parent, int here, int nhosts)
 {
 	int err;
 	int bufpoolsz, sendqsz, recvqsz;
+	int interval;
 
 	memset(self, 0, sizeof(*self));
 
 	self->alloc  = alloc;
 	self->opts   = opts;
 	self->parent = parent;
+	self->nhosts = nhosts;
 
-	err = _copy_hosts(self, opts);
-	if (unlikely(err))
-		return err;
+	/* Remote processes receive the number of hosts on the command line
+	 * and the names of the hosts in their subtree with the build tree
+	 * request. Only the root process needs to look at the full host
+	 * list.
+	 */
+	if (0 == self->nhosts) {
+		err = spawn_load_hosts(self);
+		if (unlikely(err))
+			return err;
+	}
+
+	/* The host list is of the order of the job size. There is no point
+	 * in sending it down the tree with every RESPONSE_JOIN message.
+	 */
+	if (optpool_find_by_key(opts, "Hosts"))
+		optpool_keep_local(opts, "Hosts");
 
 	err = hostinfo_ctor(&self->hostinfo, self->alloc);
 	if (unlikely(err)) {
@@ -101,8 +117,25 @@ int spawn_ctor(struct spawn *self, struct alloc *alloc, struct optpool *opts,
 		return err;
 	}
 
+	err = optpool_find_by_key_as_int(self->opts, "AllocProfileInterval", &interval);
+	if (likely(!err))
+		alloc_profile_set_interval(interval);
+
+	err = arena_alloc_ctor(&self->msgarena, self->alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		return err;
+	}
+
 	list_ctor(&self->jobs);
 
+	err = ZALLOC(self->alloc, (void **)&self->tasks, COMM_MAX_CHANNELS,
+	             sizeof(struct job_task *), "tasks");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
 	return 0;
 
 fail:
@@ -129,6 +162,19 @@ int spawn_dtor(struct spawn *self)
 		return err;
 	}
 
+	err = ZFREE(self->alloc, (void **)&self->tasks, COMM_MAX_CHANNELS,
+	            sizeof(struct job_task *), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
+	err = arena_alloc_dtor(&self->msgarena);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_dtor", err);
+		return err;
+	}
+
 	err = buffer_pool_dtor(&self->bufpool);
 	if (unlikely(err)) {
 		error("struct buffer_pool destructor failed with error %d.", err);
@@ -147,6 +193,12 @@ int spawn_dtor(struct spawn *self)
 		return err;
 	}
 
+	err = _free_hosts(self);
+	if (unlikely(err)) {
+		fcallerror("_free_hosts", err);
+		return err;
+	}
+
 	err = optpool_dtor(self->opts);
 	if (unlikely(err)) {
 		error("struct optpool destructor failed with error %d.", err);
@@ -184,23 +236,104 @@ int spawn_dtor(struct spawn *self)
 		}
 	}
 
+	if (self->control) {
+		err = control_dtor(self->control);
+		if (unlikely(err)) {
+			fcallerror("control_dtor", err);
+			return err;
+		}
+
+		err = ZFREE(self->alloc, (void **)&self->control, 1,
+		            sizeof(struct control), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
+	if (self->hostprof) {
+		err = host_profile_dtor(self->hostprof);
+		if (unlikely(err)) {
+			fcallerror("host_profile_dtor", err);
+			return err;
+		}
+
+		err = ZFREE(self->alloc, (void **)&self->hostprof, 1,
+		            sizeof(struct host_profile), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
 	memset(self, 0, sizeof(*self));
 
 	return 0;
 }
 
-int spawn_perform_delayed_setup(struct spawn *self,
-                                struct optpool *opts)
+int spawn_load_hosts(struct spawn *self)
 {
-	int err;
+	int err, tmp;
+	const char *hosts;
+	ll nhosts;
 
-	self->opts = opts;
+	if (self->hosts)
+		return 0;
 
-	err = _copy_hosts(self, opts);
-	if (unlikely(err))
+	hosts = optpool_find_by_key(self->opts, "Hosts");
+	if (unlikely(!hosts)) {
+		error("Missing 'Hosts' option.");
+		die();	/* Impossible anyway. Checked in
+			 * _check_important_options() in
+			 * main.c
+			 */
+	}
+
+	err = ZALLOC(self->alloc, (void **)&self->hosts, 1,
+	             sizeof(struct hostlist), "host list");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
 		return err;
+	}
+
+	hostlist_ctor(self->hosts, self->alloc);
+
+	err = hostlist_parse(self->hosts, hosts);
+	if (unlikely(err)) {
+		fcallerror("hostlist_parse", err);
+		goto fail;
+	}
+
+	nhosts = hostlist_size(self->hosts);
+	if (unlikely(0 == nhosts)) {
+		error("Number of hosts is zero.");
+		err = -EINVAL;
+		goto fail;
+	}
+	if (unlikely(nhosts >= INT32_MAX)) {
+		error("Number of hosts exceeds the range of participant ids.");
+		err = -EINVAL;
+		goto fail;
+	}
+
+	/* If we received the number of hosts as part of argv we should
+	 * check that the value is actually correct.
+	 */
+	if ((self->nhosts > 0) && (nhosts != self->nhosts)) {
+		error("Number of hosts does not match expected value.");
+		die();
+	}
+
+	self->nhosts = nhosts;
 
 	return 0;
+
+fail:
+	tmp = _free_hosts(self);
+	if (unlikely(tmp))
+		fcallerror("_free_hosts", tmp);
+
+	return err;
 }
 
 int spawn_setup_worker_pool(struct spawn *self, const char *path)
@@ -208,6 +341,8 @@ int spawn_setup_worker_pool(struct spawn *self, const char *path)
 	struct plugin *plu;
 	int err, tmp;
 	int fanout, cap;
+	int adaptive, latfactor, retries;
+	int async, maxinflight, batchsize;
 
 	if (unlikely(self->exec)) {
 		warn("self->exec is not NULL. This may cause a memory leak.");
@@ -226,6 +361,14 @@ int spawn_setup_worker_pool(struct spawn *self, const char *path)
 		return -EINVAL;
 	}
 
+	if (plu->ops && plu->ops->init) {
+		err = plu->ops->init(plu, self->opts);
+		if (unlikely(err)) {
+			error("Failed to initialize plugin '%s'.", path);
+			return err;
+		}
+	}
+
 	err = ZALLOC(self->alloc, (void **)&self->wkpool, 1,
 	             sizeof(struct exec_worker_pool), "worker pool");
 	if (unlikely(err)) {
@@ -246,13 +389,64 @@ int spawn_setup_worker_pool(struct spawn *self, const char *path)
 		die();
 	}
 
+	err = optpool_find_by_key_as_int(self->opts, "ExecAdaptive", &adaptive);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	err = optpool_find_by_key_as_int(self->opts, "ExecLatencyFactor", &latfactor);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	err = optpool_find_by_key_as_int(self->opts, "ExecRetries", &retries);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	err = optpool_find_by_key_as_int(self->opts, "ExecAsync", &async);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	err = optpool_find_by_key_as_int(self->opts, "ExecMaxInflight", &maxinflight);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	err = optpool_find_by_key_as_int(self->opts, "ExecBatchSize", &batchsize);
+	if (unlikely(err)) {
+		fcallerror("optpool_find_by_key_as_int", err);
+		die();
+	}
+
+	/* Plugins without start() only support the synchronous mode.
+	 */
+	if (!async || !self->exec->ops->start || (maxinflight < 1))
+		maxinflight = 0;
+
 	err = exec_worker_pool_ctor(self->wkpool, self->alloc,
-	                            fanout, cap, self->exec);
+	                            fanout, cap, self->exec,
+	                            adaptive, latfactor, retries,
+	                            maxinflight, batchsize);
 	if (unlikely(err)) {
 		fcallerror("exec_worker_pool_ctor", err);
 		goto fail;
 	}
 
+	err = _load_host_profile(self);
+	if (unlikely(err))
+		fcallerror("_load_host_profile", err);
+		/* Continue without profile.
+		 */
+
+	self->wkpool->profile = self->hostprof;
+
 	return 0;
 
 fail:
@@ -267,6 +461,39 @@ fail:
 	return err;
 }
 
+int spawn_setup_control(struct spawn *self)
+{
+	int err, tmp;
+	const char *path;
+
+	path = optpool_find_by_key(self->opts, "ControlSocket");
+	if (!path || !strlen(path))
+		return 0;
+
+	err = ZALLOC(self->alloc, (void **)&self->control, 1,
+	             sizeof(struct control), "control");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	err = control_ctor(self->control, self->alloc, path);
+	if (unlikely(err)) {
+		fcallerror("control_ctor", err);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tmp = ZFREE(self->alloc, (void **)&self->control, 1,
+	            sizeof(struct control), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
 int spawn_comm_start(struct spawn *self)
 {
 	int err;
@@ -309,13 +536,47 @@ int spawn_comm_flush(struct spawn *self)
 int spawn_comm_resv_channel(struct spawn *self, ui16 *channel)
 {
 	int err;
+	int i;
 
-	err = comm_resv_channel(&self->comm, channel);
-	if (unlikely(err)) {
-		fcallerror("comm_resv_channel", err);
-		return err;
+	for (i = 0; i < COMM_MAX_CHANNELS; ++i) {
+		err = comm_resv_channel(&self->comm, channel);
+		if (unlikely(err)) {
+			fcallerror("comm_resv_channel", err);
+			return err;
+		}
+
+		if (!self->tasks[*channel])
+			return 0;
+	}
+
+	error("All channels are taken by running tasks.");
+	return -ENOMEM;
+}
+
+int spawn_add_task(struct spawn *self, ui16 channel, struct job_task *job)
+{
+	if (unlikely((0 == channel) || (channel >= COMM_MAX_CHANNELS))) {
+		error("Invalid task channel %d.", (int )channel);
+		return -EINVAL;
+	}
+
+	if (unlikely(self->tasks[channel])) {
+		error("Channel %d is already taken by another task.", (int )channel);
+		return -EBUSY;
 	}
 
+	self->tasks[channel] = job;
+
+	return 0;
+}
+
+int spawn_remove_task(struct spawn *self, ui16 channel)
+{
+	if (unlikely((0 == channel) || (channel >= COMM_MAX_CHANNELS)))
+		return -EINVAL;
+
+	self->tasks[channel] = NULL;
+
 	return 0;
 }
 
@@ -361,125 +622,60 @@ fail:
 }
 
 
-static int _copy_hosts(struct spawn *self, struct optpool *opts)
+static int _free_hosts(struct spawn* self)
 {
-	int err, tmp;
-	const char *hosts;
-	char host[64];
-	int i, j;
-	int nhosts;
+	int err;
 
-	/* TODO Add support for compressed host lists.
-	 */
+	if (!self->hosts)
+		return 0;
 
-	hosts = optpool_find_by_key(opts, "Hosts");
-	if (unlikely(!hosts)) {
-		error("Missing 'Hosts' option.");
-		die();	/* Impossible anyway. Checked in
-			 * _check_important_options() in
-			 * main.c
-			 */
-	}
+	err = hostlist_dtor(self->hosts);
+	if (unlikely(err))
+		return err;
 
-	nhosts = _count_hosts(hosts);
-	if (nhosts < 0) {
-		fcallerror("_count_hosts", nhosts);
-		return -EINVAL;
-	}
-	if (nhosts == 0) {
-		error("Number of hosts is zero.");
-		return -EINVAL;
+	err = ZFREE(self->alloc, (void **)&self->hosts, 1,
+	            sizeof(struct hostlist), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
 	}
 
-	/* If we received the number of hosts as part of argv we should
-	 * check that the value is actually correct.
-	 */
-	if ((self->nhosts > 0) && (nhosts != self->nhosts)) {
-		error("Number of hosts does not match expected value.");
-		die();
-	}
+	return 0;
+}
 
-	self->nhosts = nhosts;
+static int _load_host_profile(struct spawn *self)
+{
+	int err, tmp;
+	const char *path;
+
+	path = optpool_find_by_key(self->opts, "HostProfileFile");
+	if (!path || !strlen(path))
+		return 0;
 
-	err = ZALLOC(self->alloc, (void **)&self->hosts, self->nhosts,
-	             sizeof(char *), "host list");
+	err = ZALLOC(self->alloc, (void **)&self->hostprof, 1,
+	             sizeof(struct host_profile), "host profile");
 	if (unlikely(err)) {
 		fcallerror("ZALLOC", err);
 		return err;
 	}
 
-	j = 0;
-	for (i = 0; i < self->nhosts; ++i) {
-		if (',' == hosts[j])
-			++j;
-		j += _copy_up_to_char(hosts + j, host, sizeof(host), ',');
-
-		err = xstrdup(self->alloc, host, &self->hosts[i]);
-		if (unlikely(err)) {
-			fcallerror("xstdrup", err);
-			goto fail;
-		}
+	err = host_profile_ctor(self->hostprof, self->alloc, path);
+	if (unlikely(err)) {
+		fcallerror("host_profile_ctor", err);
+		goto fail;
 	}
 
 	return 0;
 
 fail:
-	tmp = ZFREE(self->alloc, (void **)&self->hosts, self->nhosts,
-                    sizeof(char *), "");
+	tmp = ZFREE(self->alloc, (void **)&self->hostprof, 1,
+	            sizeof(struct host_profile), "");
 	if (unlikely(tmp))
 		fcallerror("ZFREE", tmp);
 
 	return err;
 }
 
-static int _count_hosts(const char *hosts)
-{
-	int i, n;
-	char host[64];
-
-	n = i = 0;
-	while (hosts[i]) {
-		if (0 != hosts[i])
-			++i;
-		i += _copy_up_to_char(hosts + i, host, sizeof(host), ',');
-
-		if (0 == strlen(host)) {
-			error("Invalid host in host list at position %d.", n);
-			return -EINVAL;
-		}
-
-		++n;
-	}
-
-	return n;
-}
-
-static int _copy_up_to_char(const char *istr, char *ostr, int len, char x)
-{
-	int i, j;
-
-	i = j = 0;
-	while ((0 != istr[i]) && (x != istr[i]) && (j < len - 1))
-		ostr[j++] = istr[i++];
-	ostr[j] = 0;
-
-	return i;
-}
-
-static int _free_hosts(struct spawn* self)
-{
-	int err;
-	int nhosts = self->nhosts;
-
-	self->nhosts = 0;
-
-	err = array_of_str_free(self->alloc, nhosts, (char ***)&self->hosts);
-	if (unlikely(err))
-		return err;
-
-	return 0;
-}
-
 static int _setup_tree(struct network *self, struct alloc *alloc,
                        int size, int here)
 {
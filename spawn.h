@@ -3,6 +3,7 @@
 #define SPAWN_SPAWN_H_INCLUDED 1
 
 #include "ints.h"
+#include "alloc.h"
 #include "thread.h"
 #include "hostinfo.h"
 #include "comm.h"
@@ -17,6 +18,10 @@ struct sockaddr;
 struct alloc;
 struct message_header;
 struct exec_plugin;
+struct hostlist;
+struct host_profile;
+struct control;
+struct job_task;
 
 
 /*
@@ -24,7 +29,7 @@ struct exec_plugin;
  */
 struct process
 {
-	int	id;	/* Network participant id. Subtract one to get the
+	si32	id;	/* Network participant id. Subtract one to get the
 			 * offset into the hosts array.
 			 */
 	ll	pid;
@@ -54,9 +59,12 @@ struct spawn
 	 * spawn program itself is running.
 	 */
 	int			nhosts;
-	/* Names of the hosts in the network.
+	/* Names of all hosts in the network in compressed form. The
+	 * global table is only built on demand by spawn_load_hosts() and
+	 * is NULL otherwise. Remote processes only know the hosts in their
+	 * own subtree (see struct job_build_tree).
 	 */
-	char			**hosts;
+	struct hostlist		*hosts;
 
 	/* Participant id of the parent.
 	 */
@@ -70,13 +78,34 @@ struct spawn
 	struct comm		comm;
 	struct buffer_pool	bufpool;
 
+	/* Arena for the payload of received messages. It is reset
+	 * after each message handled by loop() so it must only be
+	 * used for data that does not outlive the message handler.
+	 */
+	struct arena_alloc	msgarena;
+
 	/* List of jobs to be executed. See loop() in loop.c.
 	 */
 	struct list		jobs;
+	/* Task jobs indexed by their channel (COMM_MAX_CHANNELS entries).
+	 * Several tasks may run at the same time.
+	 */
+	struct job_task		**tasks;
 
 	struct exec_plugin	*exec;
 	struct exec_worker_pool	*wkpool;
 
+	/* Latency profile of the hosts if the 'HostProfileFile' option is
+	 * set. Only loaded by the root process which runs all exec
+	 * operations. NULL otherwise.
+	 */
+	struct host_profile	*hostprof;
+
+	/* Control socket of the persistent tree mode on the root process
+	 * if the 'ControlSocket' option is set. NULL otherwise.
+	 */
+	struct control		*control;
+
 	/* Buffered stdout and stderr content on remote processes.
 	 */
 	struct msgbuf		*bout;
@@ -84,16 +113,24 @@ struct spawn
 };
 
 /*
- * Initialize a spawn instance.
+ * Initialize a spawn instance. nhosts is the number of hosts in the network
+ * (as passed on the command line to remote processes). If it is zero the
+ * number is determined from the 'Hosts' option.
  */
 int spawn_ctor(struct spawn *self, struct alloc *alloc, struct optpool *opts,
-               int parent, int here);
+               int parent, int here, int nhosts);
 
 /*
  * Free spawn resources.
  */
 int spawn_dtor(struct spawn *self);
 
+/*
+ * Parse the 'Hosts' option into the global host table unless this has
+ * already been done. Only useful on the root process.
+ */
+int spawn_load_hosts(struct spawn *self);
+
 /*
  * Load the exec plugin and setup the worker pool. The workers are not yet
  * active. path is the filesystem path to the DSO file containing the exec
@@ -101,6 +138,12 @@ int spawn_dtor(struct spawn *self);
  */
 int spawn_setup_worker_pool(struct spawn *self, const char *path);
 
+/*
+ * Open the control socket if the 'ControlSocket' option is set (see
+ * struct control). Only sensible on the root process.
+ */
+int spawn_setup_control(struct spawn *self);
+
 /*
  * Start the communication module. The function begins listening
  * for incoming connections and starts the communication thread.
@@ -118,10 +161,30 @@ int spawn_comm_halt(struct spawn *self);
 int spawn_comm_flush(struct spawn *self);
 
 /*
- * Reserve a virtual channel for a plugin.
+ * Reserve a virtual channel for a plugin. Channels of running tasks are
+ * skipped.
  */
 int spawn_comm_resv_channel(struct spawn *self, ui16 *channel);
 
+/*
+ * Register the task job running on channel. Fails with -EBUSY if the
+ * channel is taken by another task.
+ */
+int spawn_add_task(struct spawn *self, ui16 channel, struct job_task *job);
+
+/*
+ * Forget the task job running on channel.
+ */
+int spawn_remove_task(struct spawn *self, ui16 channel);
+
+/*
+ * Task job running on channel or NULL.
+ */
+static inline struct job_task *spawn_find_task(struct spawn *self, ui16 channel)
+{
+	return (channel < COMM_MAX_CHANNELS) ? self->tasks[channel] : NULL;
+}
+
 /*
  * Send a message.
  */
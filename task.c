@@ -1,5 +1,9 @@
 
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/eventfd.h>
 
 #include "config.h"
 #include "compiler.h"
@@ -14,59 +18,153 @@
 
 static int _thread_main(void *arg);
 static int _send_write_message(struct spawn *spawn, int type, const char *line);
+static int _send_user_message(struct task *self, si32 dst, ui32 coll,
+                              const ui8 *bytes, ui64 len);
+static int _enqueue(struct queue_with_lock *queue, int efd,
+                    struct task_recvd_message *msg);
+static int _dequeue(struct queue_with_lock *queue, int efd,
+                    struct task_recvd_message **msg);
+static int _wait(int efd, int timeout);
+static int _release_all(struct task *self);
+static int _coll_recv(struct task *self, ui32 seq, si32 src,
+                      struct task_recvd_message **msg);
+static int _coll_up(struct task *self, ui32 seq, const ui8 *bytes, ui64 len,
+                    task_combine_fn combine, void *ctx,
+                    ui8 **out, ui64 *outlen);
+static int _coll_down(struct task *self, ui32 seq, ui8 **bytes, ui64 *len);
 
 
 int task_ctor(struct task *self, struct alloc *alloc,
               struct spawn *spawn, const char *path,
               int argc, char **argv, int channel)
 {
-	int err;
+	int err, tmp;
 	struct plugin *plu;
 
 	self->alloc   = alloc;
 	self->spawn   = spawn;
 	self->channel = channel;
+	self->collseq   = 0;
+	self->collabort = 0;
+
+	list_ctor(&self->collpend);
+
+	/* Semaphore semantics: The counter equals the number of queued
+	 * messages so the descriptor is readable as long as there is
+	 * something to receive.
+	 */
+	self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+	if (unlikely(-1 == self->efd)) {
+		error("eventfd() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	self->collfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+	if (unlikely(-1 == self->collfd)) {
+		error("eventfd() failed. errno = %d says '%s'.", errno, strerror(errno));
+		err = -errno;
+		goto fail1;
+	}
 
 	/* TODO Make the size configurable
 	 */
 	err = queue_with_lock_ctor(&self->recvq, alloc, 4096);
-	if (unlikely(err))
-		return err;
+	if (unlikely(err)) {
+		fcallerror("queue_with_lock_ctor", err);
+		goto fail2;
+	}
+
+	err = queue_with_lock_ctor(&self->collq, alloc, 4096);
+	if (unlikely(err)) {
+		fcallerror("queue_with_lock_ctor", err);
+		goto fail3;
+	}
+
+	err = arena_alloc_ctor(&self->arena, alloc, 0);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_ctor", err);
+		goto fail4;
+	}
 
 	plu = load_plugin(path);
-	if (unlikely(!plu))
-		return -ESOMEFAULT;
+	if (unlikely(!plu)) {
+		err = -ESOMEFAULT;
+		goto fail5;
+	}
 
-	self->plu = cast_to_task_plugin(plu);
-	if (unlikely(!self->plu)) {
+	if (unlikely(!cast_to_task_plugin(plu))) {
 		error("Plugin '%s' is not an task plugin.", path);
-		return -EINVAL;
+		err = -EINVAL;
+		goto fail6;
 	}
 
+	err = ZALLOC(alloc, (void **)&self->plu, 1,
+	             sizeof(struct task_plugin), "plu");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail6;
+	}
+
+	memcpy(self->plu, cast_to_task_plugin(plu), sizeof(struct task_plugin));
+
 	/* Required for the task_plugin_api_X functions.
 	 */
 	self->plu->task = self;
 
-	err = thread_ctor(&self->thread);
-	if (unlikely(err)) {
-		fcallerror("thread_ctor", err);
-		return err;
-	}
-
 	self->argc = argc;
 
 	err = array_of_str_dup(self->alloc, argc + 1, argv, &self->argv);
 	if (unlikely(err)) {
 		fcallerror("array_of_str_dup", err);
-		return err;
+		goto fail7;
 	}
 
-	/* FIXME This function leaks resources when one of the initialization
-	 *       routines. It would be better to have a single exit point and
-	 *       handle failures in there.
+	/* Last since the thread is already running afterwards and
+	 * would have to be canceled on failure.
 	 */
+	err = thread_ctor(&self->thread);
+	if (unlikely(err)) {
+		fcallerror("thread_ctor", err);
+		goto fail8;
+	}
 
 	return 0;
+
+fail8:
+	tmp = array_of_str_free(self->alloc, self->argc + 1, &self->argv);
+	if (unlikely(tmp))
+		fcallerror("array_of_str_free", tmp);
+fail7:
+	tmp = ZFREE(alloc, (void **)&self->plu, 1,
+	            sizeof(struct task_plugin), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+fail6:
+	tmp = unload_plugin(plu);
+	if (unlikely(tmp))
+		fcallerror("unload_plugin", tmp);
+fail5:
+	tmp = arena_alloc_dtor(&self->arena);
+	if (unlikely(tmp))
+		fcallerror("arena_alloc_dtor", tmp);
+fail4:
+	tmp = queue_with_lock_dtor(&self->collq);
+	if (unlikely(tmp))
+		fcallerror("queue_with_lock_dtor", tmp);
+fail3:
+	tmp = queue_with_lock_dtor(&self->recvq);
+	if (unlikely(tmp))
+		fcallerror("queue_with_lock_dtor", tmp);
+fail2:
+	tmp = do_close(self->collfd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+fail1:
+	tmp = do_close(self->efd);
+	if (unlikely(tmp))
+		fcallerror("do_close", tmp);
+
+	return err;
 }
 
 int task_dtor(struct task *self)
@@ -85,12 +183,61 @@ int task_dtor(struct task *self)
 		return err;
 	}
 
+	/* Messages that the plugin did not receive.
+	 */
+	err = _release_all(self);
+	if (unlikely(err)) {
+		fcallerror("_release_all", err);
+		return err;
+	}
+
 	err = queue_with_lock_dtor(&self->recvq);
 	if (unlikely(err)) {
 		fcallerror("queue_with_lock_dtor", err);
 		return err;
 	}
 
+	err = queue_with_lock_dtor(&self->collq);
+	if (unlikely(err)) {
+		fcallerror("queue_with_lock_dtor", err);
+		return err;
+	}
+
+	err = arena_alloc_dtor(&self->arena);
+	if (unlikely(err)) {
+		fcallerror("arena_alloc_dtor", err);
+		return err;
+	}
+
+	err = do_close(self->efd);
+	if (unlikely(err)) {
+		fcallerror("do_close", err);
+		return err;
+	}
+
+	err = do_close(self->collfd);
+	if (unlikely(err)) {
+		fcallerror("do_close", err);
+		return err;
+	}
+
+	/* Plugins keep their state in static variables. Unloading
+	 * resets them once no other task uses the plugin so that it
+	 * can run in the next task of a persistent tree.
+	 */
+	err = unload_plugin(&self->plu->base);
+	if (unlikely(err)) {
+		fcallerror("unload_plugin", err);
+		return err;
+	}
+
+	err = ZFREE(self->alloc, (void **)&self->plu, 1,
+	            sizeof(struct task_plugin), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -122,7 +269,42 @@ int task_cancel(struct task *self)
 
 int task_enqueue_message(struct task *self, struct task_recvd_message *msg)
 {
-	return queue_with_lock_enqueue(&self->recvq, (void *)msg);
+	if (msg->msg.coll)
+		return _enqueue(&self->collq, self->collfd, msg);
+
+	return _enqueue(&self->recvq, self->efd, msg);
+}
+
+int task_send_abort(struct spawn *spawn, ui16 channel, si32 src)
+{
+	int err;
+	struct message_header header;
+	struct message_user   msg;
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	memset(&msg   , 0, sizeof(msg));
+
+	header.src     = spawn->tree.here;	/* Always the same */
+	header.flags   = MESSAGE_FLAG_UCAST;
+	header.type    = MESSAGE_TYPE_USER;
+	header.channel = channel;
+
+	msg.coll = TASK_COLL_ABORT;
+
+	for (i = -1; i < spawn->nprocs; ++i) {
+		header.dst = (-1 == i) ? spawn->parent : spawn->procs[i].id;
+		if ((-1 == header.dst) || (src == header.dst))
+			continue;
+
+		err = spawn_send_message(spawn, &header, (void *)&msg);
+		if (unlikely(err)) {
+			fcallerror("spawn_send_message", err);
+			return err;
+		}
+	}
+
+	return 0;
 }
 
 int task_plugin_api_write_line_stdout(struct task_plugin *plu, const char *line)
@@ -135,36 +317,168 @@ int task_plugin_api_write_line_stderr(struct task_plugin *plu, const char *line)
 	return _send_write_message(plu->task->spawn, MESSAGE_TYPE_WRITE_STDERR, line);
 }
 
-int task_plugin_api_send(struct task_plugin *plu, int dst, ui8 *bytes, ui64 len)
+int task_plugin_api_send(struct task_plugin *plu, si32 dst, ui8 *bytes, ui64 len)
+{
+	return _send_user_message(plu->task, dst, 0, bytes, len);
+}
+
+int task_plugin_api_recv(struct task_plugin *plu, struct task_recvd_message **msg)
+{
+	return _dequeue(&plu->task->recvq, plu->task->efd, msg);
+}
+
+int task_plugin_api_recv_timeout(struct task_plugin *plu,
+                                 struct task_recvd_message **msg,
+                                 int timeout)
 {
 	int err;
-	struct message_header header;
-	struct message_user   msg;
 
-	memset(&header, 0, sizeof(header));
-	memset(&msg   , 0, sizeof(msg));
+	while (1) {
+		err = task_plugin_api_recv(plu, msg);
+		if (-ENOENT != err)
+			return err;
 
-	header.src     = plu->task->spawn->tree.here;	/* Always the same */
-	header.dst     = dst;
-	header.flags   = MESSAGE_FLAG_UCAST;
-	header.type    = MESSAGE_TYPE_USER;
-	header.channel = plu->task->channel;
+		err = _wait(plu->task->efd, timeout);
+		if (unlikely(err))
+			return err;
+	}
+}
 
-	msg.len   = len;
-	msg.bytes = bytes;
+int task_plugin_api_recv_fd(struct task_plugin *plu)
+{
+	return plu->task->efd;
+}
 
-	err = spawn_send_message(plu->task->spawn, &header, (void *)&msg);
+int task_plugin_api_release(struct task_plugin *plu, struct task_recvd_message *msg)
+{
+	int err;
+	struct spawn *spawn = plu->task->spawn;
+
+	err = buffer_pool_push(&spawn->bufpool, msg->buffer);
 	if (unlikely(err)) {
-		fcallerror("spawn_send_message", err);
+		fcallerror("buffer_pool_push", err);
+		return err;
+	}
+
+	err = ZFREE(spawn->alloc, (void **)&msg, 1, sizeof(struct task_recvd_message), "");
+	if (unlikely(err)) {
+		fcallerror("ZFREE", err);
 		return err;
 	}
 
 	return 0;
 }
 
-int task_plugin_api_recv(struct task_plugin *plu, struct task_recvd_message **msg)
+struct alloc *task_plugin_api_arena(struct task_plugin *plu)
+{
+	return &plu->task->arena.base;
+}
+
+int task_plugin_api_arena_reset(struct task_plugin *plu)
 {
-	return queue_with_lock_dequeue(&plu->task->recvq, (void **)msg);
+	return arena_alloc_reset(&plu->task->arena);
+}
+
+int task_combine_concat(void *ctx, struct alloc *alloc,
+                        ui8 **acc, ui64 *acclen,
+                        const ui8 *bytes, ui64 len)
+{
+	int err;
+
+	if (0 == len)
+		return 0;
+
+	err = ZREALLOC(alloc, (void **)acc, *acclen, sizeof(ui8),
+	               *acclen + len, sizeof(ui8), "acc");
+	if (unlikely(err)) {
+		fcallerror("ZREALLOC", err);
+		return err;
+	}
+
+	memcpy(*acc + *acclen, bytes, len);
+	*acclen += len;
+
+	return 0;
+}
+
+int task_plugin_api_barrier(struct task_plugin *plu)
+{
+	int err;
+	ui32 seq;
+	ui8 *bytes;
+	ui64 len;
+
+	seq = ++plu->task->collseq;
+
+	err = _coll_up(plu->task, seq, NULL, 0, NULL, NULL, &bytes, &len);
+	if (unlikely(err)) {
+		fcallerror("_coll_up", err);
+		return err;
+	}
+
+	err = _coll_down(plu->task, seq, &bytes, &len);
+	if (unlikely(err)) {
+		fcallerror("_coll_down", err);
+		return err;
+	}
+
+	return 0;
+}
+
+int task_plugin_api_bcast(struct task_plugin *plu, ui8 **bytes, ui64 *len)
+{
+	int err;
+
+	err = _coll_down(plu->task, ++plu->task->collseq, bytes, len);
+	if (unlikely(err)) {
+		fcallerror("_coll_down", err);
+		return err;
+	}
+
+	return 0;
+}
+
+int task_plugin_api_reduce(struct task_plugin *plu, const ui8 *bytes, ui64 len,
+                           task_combine_fn combine, void *ctx,
+                           ui8 **out, ui64 *outlen)
+{
+	int err;
+
+	err = _coll_up(plu->task, ++plu->task->collseq, bytes, len,
+	               combine, ctx, out, outlen);
+	if (unlikely(err)) {
+		fcallerror("_coll_up", err);
+		return err;
+	}
+
+	return 0;
+}
+
+int task_plugin_api_allgather(struct task_plugin *plu, const ui8 *bytes, ui64 len,
+                              task_combine_fn combine, void *ctx,
+                              ui8 **out, ui64 *outlen)
+{
+	int err;
+	ui32 seq;
+
+	/* Both phases use the same sequence number. Messages from the
+	 * parent belong to the second one.
+	 */
+	seq = ++plu->task->collseq;
+
+	err = _coll_up(plu->task, seq, bytes, len, combine, ctx, out, outlen);
+	if (unlikely(err)) {
+		fcallerror("_coll_up", err);
+		return err;
+	}
+
+	err = _coll_down(plu->task, seq, out, outlen);
+	if (unlikely(err)) {
+		fcallerror("_coll_down", err);
+		return err;
+	}
+
+	return 0;
 }
 
 
@@ -210,3 +524,303 @@ static int _send_write_message(struct spawn *spawn, int type, const char *line)
 	return 0;
 }
 
+static int _send_user_message(struct task *self, si32 dst, ui32 coll,
+                              const ui8 *bytes, ui64 len)
+{
+	int err;
+	struct message_header header;
+	struct message_user   msg;
+
+	memset(&header, 0, sizeof(header));
+	memset(&msg   , 0, sizeof(msg));
+
+	header.src     = self->spawn->tree.here;	/* Always the same */
+	header.dst     = dst;
+	header.flags   = MESSAGE_FLAG_UCAST;
+	header.type    = MESSAGE_TYPE_USER;
+	header.channel = self->channel;
+
+	msg.coll  = coll;
+	msg.len   = len;
+	msg.bytes = (ui8 *)bytes;
+
+	err = spawn_send_message(self->spawn, &header, (void *)&msg);
+	if (unlikely(err)) {
+		fcallerror("spawn_send_message", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * The eventfd is signalled after the message is in the queue so that the
+ * task never finds the counter incremented with an empty queue. The message
+ * is owned by the queue at this point so a failure is only reported.
+ */
+static int _enqueue(struct queue_with_lock *queue, int efd,
+                    struct task_recvd_message *msg)
+{
+	int err;
+	ui64 one;
+	ll n;
+
+	err = queue_with_lock_enqueue(queue, (void *)msg);
+	if (unlikely(err))
+		return err;
+
+	one = 1;
+
+	err = do_write(efd, &one, sizeof(one), &n);
+	if (unlikely(err))
+		fcallerror("do_write", err);
+
+	return 0;
+}
+
+/*
+ * Decrement the counter first. If this succeeds the matching message is
+ * guaranteed to be in the queue already.
+ */
+static int _dequeue(struct queue_with_lock *queue, int efd,
+                    struct task_recvd_message **msg)
+{
+	ui64 x;
+	ll n;
+
+	while (1) {
+		n = read(efd, &x, sizeof(x));
+		if (likely(-1 != n))
+			break;
+		if (EAGAIN == errno)
+			return -ENOENT;
+		if (EINTR == errno)
+			continue;
+
+		error("read() failed. errno = %d says '%s'.", errno, strerror(errno));
+		return -errno;
+	}
+
+	return queue_with_lock_dequeue(queue, (void **)msg);
+}
+
+/*
+ * Block until the eventfd is readable. poll() is a cancellation point so
+ * task_cancel() still works while the task is blocked in here.
+ */
+static int _wait(int efd, int timeout)
+{
+	int err;
+	struct pollfd pollfd;
+	int n;
+
+	pollfd.fd      = efd;
+	pollfd.events  = POLLIN;
+	pollfd.revents = 0;
+
+	err = do_poll(&pollfd, 1, timeout, &n);
+	if (unlikely(err)) {
+		fcallerror("do_poll", err);
+		return err;
+	}
+
+	if (0 == n)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static int _release_all(struct task *self)
+{
+	int err;
+	struct task_recvd_message *msg;
+	struct list *p;
+
+	while (0 == _dequeue(&self->recvq, self->efd, &msg)) {
+		err = task_plugin_api_release(self->plu, msg);
+		if (unlikely(err))
+			return err;
+	}
+
+	while (0 == _dequeue(&self->collq, self->collfd, &msg)) {
+		err = task_plugin_api_release(self->plu, msg);
+		if (unlikely(err))
+			return err;
+	}
+
+	while (!list_is_empty(&self->collpend)) {
+		p = self->collpend.next;
+		list_remove(p);
+
+		err = task_plugin_api_release(self->plu,
+		                              LIST_ENTRY(p, struct task_recvd_message, list));
+		if (unlikely(err))
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive the message of collective seq sent by src. Children may already
+ * be in a later collective operation and their messages arrive in any
+ * order. Such messages are kept in self->collpend until they are needed.
+ * Returns -ECANCELED once TASK_COLL_ABORT was received.
+ */
+static int _coll_recv(struct task *self, ui32 seq, si32 src,
+                      struct task_recvd_message **msg)
+{
+	int err;
+	struct list *p;
+	struct task_recvd_message *x;
+
+	if (unlikely(self->collabort))
+		return -ECANCELED;
+
+	LIST_FOREACH(p, &self->collpend) {
+		x = LIST_ENTRY(p, struct task_recvd_message, list);
+
+		if ((seq == x->msg.coll) && (src == x->src)) {
+			list_remove(p);
+			*msg = x;
+			return 0;
+		}
+	}
+
+	while (1) {
+		err = _dequeue(&self->collq, self->collfd, &x);
+		if (-ENOENT == err) {
+			err = _wait(self->collfd, -1);
+			if (unlikely(err))
+				return err;
+			continue;
+		}
+		if (unlikely(err))
+			return err;
+
+		if (unlikely(TASK_COLL_ABORT == x->msg.coll)) {
+			error("Collective operation %u aborted since a task "
+			      "failed to start.", seq);
+
+			self->collabort = 1;
+
+			(void )task_plugin_api_release(self->plu, x);
+			return -ECANCELED;
+		}
+
+		if ((seq == x->msg.coll) && (src == x->src)) {
+			*msg = x;
+			return 0;
+		}
+
+		list_insert_before(&self->collpend, &x->list);
+	}
+}
+
+/*
+ * Combine the own contribution with the ones of the children (in the order
+ * of spawn->procs) and pass the result on to the parent. If combine is NULL
+ * the contributions are only waited for.
+ */
+static int _coll_up(struct task *self, ui32 seq, const ui8 *bytes, ui64 len,
+                    task_combine_fn combine, void *ctx,
+                    ui8 **out, ui64 *outlen)
+{
+	int err;
+	struct spawn *spawn = self->spawn;
+	struct task_recvd_message *msg;
+	ui8 *acc;
+	ui64 acclen;
+	int i;
+
+	acc    = NULL;
+	acclen = 0;
+
+	if (combine) {
+		err = ZALLOC(&self->arena.base, (void **)&acc, len, sizeof(ui8), "acc");
+		if (unlikely(err)) {
+			fcallerror("ZALLOC", err);
+			return err;
+		}
+
+		if (len)
+			memcpy(acc, bytes, len);
+		acclen = len;
+	}
+
+	for (i = 0; i < spawn->nprocs; ++i) {
+		err = _coll_recv(self, seq, spawn->procs[i].id, &msg);
+		if (unlikely(err)) {
+			fcallerror("_coll_recv", err);
+			return err;
+		}
+
+		err = 0;
+		if (combine)
+			err = combine(ctx, &self->arena.base, &acc, &acclen,
+			              msg->msg.bytes, msg->msg.len);
+
+		(void )task_plugin_api_release(self->plu, msg);
+
+		if (unlikely(err)) {
+			fcallerror("combine", err);
+			return err;
+		}
+	}
+
+	if (-1 != spawn->parent) {
+		err = _send_user_message(self, spawn->parent, seq, acc, acclen);
+		if (unlikely(err)) {
+			fcallerror("_send_user_message", err);
+			return err;
+		}
+	}
+
+	*out    = acc;
+	*outlen = acclen;
+
+	return 0;
+}
+
+/*
+ * Receive the data from the parent (unless this is the root) and pass it on
+ * to the children.
+ */
+static int _coll_down(struct task *self, ui32 seq, ui8 **bytes, ui64 *len)
+{
+	int err;
+	struct spawn *spawn = self->spawn;
+	struct task_recvd_message *msg;
+	int i;
+
+	if (-1 != spawn->parent) {
+		err = _coll_recv(self, seq, spawn->parent, &msg);
+		if (unlikely(err)) {
+			fcallerror("_coll_recv", err);
+			return err;
+		}
+
+		*len = msg->msg.len;
+
+		err = ZALLOC(&self->arena.base, (void **)bytes, *len, sizeof(ui8), "bytes");
+		if (likely(!err) && *len)
+			memcpy(*bytes, msg->msg.bytes, *len);
+
+		(void )task_plugin_api_release(self->plu, msg);
+
+		if (unlikely(err)) {
+			fcallerror("ZALLOC", err);
+			return err;
+		}
+	}
+
+	for (i = 0; i < spawn->nprocs; ++i) {
+		err = _send_user_message(self, spawn->procs[i].id, seq, *bytes, *len);
+		if (unlikely(err)) {
+			fcallerror("_send_user_message", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
@@ -2,6 +2,7 @@
 #ifndef SPAWN_TASK_H_INCLUDED
 #define SPAWN_TASK_H_INCLUDED 1
 
+#include "alloc.h"
 #include "list.h"
 #include "thread.h"
 #include "queue.h"
@@ -18,6 +19,9 @@ struct task
 
 	struct spawn		*spawn;
 
+	/* Own copy of the loaded plugin so that concurrent tasks using
+	 * the same plugin have separate back-pointers to their task.
+	 */
 	struct task_plugin	*plu;
 	struct thread		thread;
 
@@ -31,15 +35,46 @@ struct task
 	/* Queue for received messages.
 	 */
 	struct queue_with_lock	recvq;
+
+	/* eventfd signalling the arrival of messages in recvq.
+	 */
+	int			efd;
+
+	/* Messages of collective operations are kept apart from the
+	 * point-to-point messages in recvq. collpend holds the ones
+	 * that arrived before they were needed and is only accessed
+	 * from the task thread.
+	 */
+	struct queue_with_lock	collq;
+	int			collfd;
+	struct list		collpend;
+	ui32			collseq;	/* Last collective operation */
+	int			collabort;	/* See TASK_COLL_ABORT */
+
+	/* Scratch memory for the plugin. Only to be used from the
+	 * task thread.
+	 */
+	struct arena_alloc	arena;
 };
 
+/*
+ * Value of message_user.coll that aborts the collective operations of a
+ * task (collseq never gets this far). It is flooded through the tree by
+ * task_send_abort() if the task of a process fails to start. All pending
+ * and later collective operations then return -ECANCELED instead of
+ * waiting for a contribution that never comes.
+ */
+#define TASK_COLL_ABORT	0xFFFFFFFFU
+
 /*
  * Record of a received message
  */
 struct task_recvd_message
 {
-	int			src;
-	struct message_user	msg;
+	si32			src;
+	struct message_user	msg;	/* msg.bytes points into buffer */
+	struct buffer		*buffer;
+	struct list		list;	/* See struct job_task */
 };
 
 /*
@@ -89,6 +124,13 @@ static inline int task_exit_code(struct task *self)
  */
 int task_enqueue_message(struct task *self, struct task_recvd_message *msg);
 
+/*
+ * Send TASK_COLL_ABORT on channel to the parent and the children except
+ * to src (the neighbour the abort came from or -1). Does not need a
+ * struct task so that it also works if the task could not be created.
+ */
+int task_send_abort(struct spawn *spawn, ui16 channel, si32 src);
+
 /*
  * Write a line to stdout or stderr from a task plugin.
  */
@@ -99,12 +141,106 @@ int task_plugin_api_write_line_stderr(struct task_plugin *plu, const char *line)
  * Send a message to another task. The task identifier equals the process identifier
  * in the tree.
  */
-int task_plugin_api_send(struct task_plugin *plu, int dst, ui8 *bytes, ui64 len);
+int task_plugin_api_send(struct task_plugin *plu, si32 dst, ui8 *bytes, ui64 len);
 
 /*
- * Receive a message.
+ * Receive a message. Returns -ENOENT if no message is available.
  */
 int task_plugin_api_recv(struct task_plugin *plu, struct task_recvd_message **msg);
 
+/*
+ * Same as task_plugin_api_recv() but block for up to timeout milliseconds
+ * until a message arrives. A negative timeout blocks forever. Returns
+ * -ETIMEDOUT if no message arrived in time.
+ */
+int task_plugin_api_recv_timeout(struct task_plugin *plu,
+                                 struct task_recvd_message **msg,
+                                 int timeout);
+
+/*
+ * File descriptor that is readable (POLLIN) while messages are waiting to
+ * be received. Plugins can add it to their own poll() loops. It must not
+ * be read or closed by the plugin; call task_plugin_api_recv() instead.
+ */
+int task_plugin_api_recv_fd(struct task_plugin *plu);
+
+/*
+ * Release a message obtained from task_plugin_api_recv(). The message payload
+ * is a view into the receive buffer and is invalid after this call.
+ */
+int task_plugin_api_release(struct task_plugin *plu, struct task_recvd_message *msg);
+
+/*
+ * Combine callback of the collective operations. Merge the contribution
+ * (bytes, len) of a subtree into the data (*acc, *acclen) accumulated so
+ * far. The accumulated data is allocated from alloc (the arena of the
+ * task) and may be reallocated. ctx is passed through unchanged.
+ */
+typedef int (*task_combine_fn)(void *ctx, struct alloc *alloc,
+                               ui8 **acc, ui64 *acclen,
+                               const ui8 *bytes, ui64 len);
+
+/*
+ * Combine callback that appends the contribution to the accumulated data.
+ * The order of the contributions is unspecified.
+ */
+int task_combine_concat(void *ctx, struct alloc *alloc,
+                        ui8 **acc, ui64 *acclen,
+                        const ui8 *bytes, ui64 len);
+
+/*
+ * Collective operations. They are routed along the tree: Every process
+ * combines the contributions of its children with its own before a single
+ * message is forwarded to the parent and results are passed down the same
+ * way. Thus, a collective needs O(log N) steps instead of O(N) at a single
+ * process.
+ *
+ * All tasks of the tree (including the root, task zero, which runs
+ * task_plugin_ops.local()) must call the same collective operations in the
+ * same order. The calls block until the data needed locally arrived.
+ * Results are allocated from the arena (see task_plugin_api_arena()).
+ * Point-to-point messages are not affected by collective operations. If
+ * the task failed to start on any process the collective operations
+ * return -ECANCELED (see TASK_COLL_ABORT).
+ */
+
+/*
+ * Return once all tasks entered the barrier.
+ */
+int task_plugin_api_barrier(struct task_plugin *plu);
+
+/*
+ * Broadcast (*bytes, *len) from task zero to all other tasks. On the other
+ * tasks the arguments are overwritten with the received data.
+ */
+int task_plugin_api_bcast(struct task_plugin *plu, ui8 **bytes, ui64 *len);
+
+/*
+ * Combine the contributions of all tasks with combine. The result is stored
+ * in (*out, *outlen) on task zero. The other tasks get the combined data
+ * of their subtree.
+ */
+int task_plugin_api_reduce(struct task_plugin *plu, const ui8 *bytes, ui64 len,
+                           task_combine_fn combine, void *ctx,
+                           ui8 **out, ui64 *outlen);
+
+/*
+ * Same as task_plugin_api_reduce() followed by task_plugin_api_bcast() of
+ * the result. With task_combine_concat() every task receives the
+ * contributions of all tasks.
+ */
+int task_plugin_api_allgather(struct task_plugin *plu, const ui8 *bytes, ui64 len,
+                              task_combine_fn combine, void *ctx,
+                              ui8 **out, ui64 *outlen);
+
+/*
+ * Arena allocator for short-lived data of the plugin (e.g., the content of
+ * messages that is assembled and sent). All allocations are released at once
+ * by task_plugin_api_arena_reset() and when the task is destroyed. The arena
+ * is not thread-safe and must only be used from within the task thread.
+ */
+struct alloc *task_plugin_api_arena(struct task_plugin *plu);
+int task_plugin_api_arena_reset(struct task_plugin *plu);
+
 #endif
 
@@ -371,7 +371,7 @@ static void *_thread_main(void *arg)
 	int err;
 	struct thread *self = (struct thread *)arg;
 
-	debug("Thread %d is alive.", (int )gettid());
+	debug("Thread %d is alive.", (int )spawn_gettid());
 	atomic_write(self->state, THREAD_STATE_INITED);
 
 	if (unlikely(!self)) {
@@ -406,7 +406,7 @@ static void *_thread_main(void *arg)
 	atomic_write(self->err, err);	/* Before updating the state! */
 	atomic_write(self->state, THREAD_STATE_DONE);
 
-	debug("Thread %d is done.", (int )gettid());
+	debug("Thread %d is done.", (int )spawn_gettid());
 
 	pthread_exit((void *)self);
 }
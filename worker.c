@@ -1,6 +1,10 @@
 
 #include <string.h>
 
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+
 #include "config.h"
 #include "compiler.h"
 #include "error.h"
@@ -8,30 +12,91 @@
 #include "worker.h"
 #include "helper.h"
 #include "plugin.h"
+#include "hostprof.h"
 
 
 static int _thread_main(void *arg);
+static int _engine_main(void *arg);
+static int _engine_start_work(struct exec_worker_pool *self);
+static int _engine_start(struct exec_worker_pool *self,
+                         struct exec_work_item *wkitem, ll seq);
+static int _engine_reap(struct exec_worker_pool *self);
+static int _engine_complete(struct exec_worker_pool *self, int i);
 static int _work_available(struct exec_worker_pool *self);
+static int _dequeue_batch(struct exec_worker_pool *self,
+                          struct exec_work_item **wkitem);
+static int _batch_compatible(struct exec_work_item *batch,
+                             struct exec_work_item *wkitem);
+static int _batch_arrays(struct exec_worker_pool *self,
+                         struct exec_work_item *batch, int *n,
+                         char ***hosts, char ****argvs);
+static int _batch_arrays_free(struct exec_worker_pool *self, int n,
+                              char ***hosts, char ****argvs);
 static int _all_threads_done(struct exec_worker_pool *self);
 static int _do_exec_work(struct exec_worker_pool *self,
-                         struct exec_work_item *wkitem);
+                         struct exec_work_item *wkitem, ll seq);
+static int _exec_work_done(struct exec_worker_pool *self,
+                           struct exec_work_item *wkitem, ll seq,
+                           int err, ll lat);
+static void _aimd_complete(struct exec_worker_pool *self, ll seq, int err, ll lat);
 static int _free_exec_work_item(struct exec_worker_pool *self,
                                 struct exec_work_item **wkitem);
 
 int exec_worker_pool_ctor(struct exec_worker_pool *self, struct alloc *alloc,
-                          int nthreads, ll capacity, struct exec_plugin *exec)
+                          int nthreads, ll capacity, struct exec_plugin *exec,
+                          int adaptive, int latfactor, int retries,
+                          int maxinflight, int batchsize)
 {
 	int err, tmp;
 	int i, k;
 
+	self->async       = (maxinflight > 0);
+	self->maxinflight = maxinflight;
+	self->inflight    = NULL;
+	self->ninflight   = 0;
+	self->epfd        = -1;
+
+	if (self->async) {
+		if (unlikely(!exec->ops->start)) {
+			error("Exec plugin '%s' does not support asynchronous "
+			      "spawns.", exec->base.name);
+			return -EINVAL;
+		}
+
+		/* A single thread drives all operations.
+		 */
+		nthreads = 1;
+	}
+
 	self->alloc    = alloc;
 	self->nthreads = nthreads;
 	self->done     = 0;
 	self->exec     = exec;
+	self->waiting  = 0;
+	self->profile  = NULL;
 
-	err = queue_ctor(&self->queue, alloc, capacity);
+	if ((self->async && !exec->ops->start_many) ||
+	    (!self->async && !exec->ops->exec_many))
+		batchsize = 1;
+
+	self->batchsize = MAX(1, batchsize);
+
+	memset(&self->aimd, 0, sizeof(self->aimd));
+
+	/* Without congestion control the window is fixed to the maximal
+	 * number of concurrent operations.
+	 */
+	self->aimd.enabled   = adaptive;
+	self->aimd.latfactor = latfactor;
+	self->aimd.retries   = retries;
+	self->aimd.limit     = (self->async) ? maxinflight : nthreads;
+	self->aimd.window    = (adaptive) ? MIN(2, self->aimd.limit) : self->aimd.limit;
+	self->aimd.ssthresh  = self->aimd.limit;
+	self->aimd.maxwindow = self->aimd.window;
+
+	err = prio_queue_ctor(&self->queue, alloc, capacity);
 	if (unlikely(err)) {
-		fcallerror("queue_ctor", err);
+		fcallerror("prio_queue_ctor", err);
 		return err;
 	}
 
@@ -59,6 +124,26 @@ int exec_worker_pool_ctor(struct exec_worker_pool *self, struct alloc *alloc,
 		}
 	}
 
+	if (self->async) {
+		err = ZALLOC(alloc, (void **)&self->inflight, maxinflight,
+		             sizeof(struct exec_inflight), "inflight");
+		if (unlikely(err)) {
+			fcallerror("ZALLOC", err);
+			goto fail3;
+		}
+
+		for (i = 0; i < maxinflight; ++i)
+			self->inflight[i].pidfd = -1;
+
+		self->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (unlikely(-1 == self->epfd)) {
+			error("epoll_create1() failed. errno = %d says '%s'.",
+			      errno, strerror(errno));
+			err = -errno;
+			goto fail4;
+		}
+	}
+
 	/* FIXME Variable timeout value. The timeout value
 	 *       determines how long it takes to stop the
 	 *       threads.
@@ -68,6 +153,12 @@ int exec_worker_pool_ctor(struct exec_worker_pool *self, struct alloc *alloc,
 
 	return 0;
 
+fail4:
+	tmp = ZFREE(alloc, (void **)&self->inflight, maxinflight,
+	            sizeof(struct exec_inflight), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
 fail3:
 	for (i = 0; i < k; ++i) {
 		tmp = thread_dtor(&self->threads[i]);
@@ -86,9 +177,9 @@ fail2:
 		fcallerror("cond_var_dtor", tmp);
 
 fail1:
-	tmp = queue_dtor(&self->queue);
+	tmp = prio_queue_dtor(&self->queue);
 	if (unlikely(tmp))
-		fcallerror("queue_dtor", tmp);
+		fcallerror("prio_queue_dtor", tmp);
 
 	return err;
 }
@@ -118,15 +209,28 @@ int exec_worker_pool_dtor(struct exec_worker_pool *self)
 		return err;
 	}
 
+	if (self->async) {
+		err = do_close(self->epfd);
+		if (unlikely(err))
+			fcallerror("do_close", err);
+
+		err = ZFREE(self->alloc, (void **)&self->inflight,
+		            self->maxinflight, sizeof(struct exec_inflight), "");
+		if (unlikely(err)) {
+			fcallerror("ZFREE", err);
+			return err;
+		}
+	}
+
 	err = cond_var_dtor(&self->cond);
 	if (unlikely(err)) {
 		fcallerror("cond_var_dtor", err);
 		return err;
 	}
 
-	err = queue_dtor(&self->queue);
+	err = prio_queue_dtor(&self->queue);
 	if (unlikely(err)) {
-		fcallerror("queue_dtor", err);
+		fcallerror("prio_queue_dtor", err);
 		return err;
 	}
 
@@ -139,7 +243,9 @@ int exec_worker_pool_start(struct exec_worker_pool *self)
 	int i;
 
 	for (i = 0; i < self->nthreads; ++i) {
-		err = thread_start(&self->threads[i], _thread_main, self);
+		err = thread_start(&self->threads[i],
+		                   (self->async) ? _engine_main : _thread_main,
+		                   self);
 		if (unlikely(err)) {
 			fcallerror("thread_start", err);
 			die();	/* Not sure how to properly fix that
@@ -169,6 +275,11 @@ int exec_worker_pool_stop(struct exec_worker_pool *self)
 			fcallerror("thread_join", err);
 	}
 
+	if (self->aimd.enabled)
+		log("Exec window %d (maximum %d, %lld decrease(s), latency baseline "
+		    "%lld microsecond(s)).", self->aimd.window, self->aimd.maxwindow,
+		    self->aimd.ndecreases, self->aimd.minlat);
+
 	return 0;
 }
 
@@ -176,6 +287,14 @@ int exec_worker_pool_enqueue(struct exec_worker_pool *self,
                              struct exec_work_item *wkitem)
 {
 	int err, tmp;
+	struct timespec abstime;
+
+	/* Historically slow hosts are spawned first since their spawn
+	 * completes last otherwise.
+	 */
+	if (self->profile)
+		wkitem->cost += host_profile_expected_latency(self->profile,
+		                                              wkitem->host);
 
 	err = cond_var_lock_acquire(&self->cond);
 	if (unlikely(err)) {
@@ -183,11 +302,25 @@ int exec_worker_pool_enqueue(struct exec_worker_pool *self,
 		die();
 	}
 
-	err = queue_enqueue(&self->queue, wkitem);
-	if (-ENOMEM == err)
-		goto fail;	/* Expected failure. Do not call error(). */
+	/* Block until a worker thread dequeues an item if the queue is
+	 * full. The caller stops draining its own input meanwhile which
+	 * propagates the backpressure up the tree.
+	 */
+	while (-ENOMEM == (err = prio_queue_enqueue(&self->queue, wkitem, wkitem->cost))) {
+		err = abstime_near_future(&self->timeout, &abstime);
+		if (unlikely(err))
+			fcallerror("abstime_near_future", err);
+
+		++self->waiting;
+		err = cond_var_timedwait(&self->cond, &abstime);
+		--self->waiting;
+		if (unlikely(err && (-ETIMEDOUT != err))) {
+			fcallerror("cond_var_timedwait", err);
+			die();
+		}
+	}
 	if (unlikely(err)) {
-		fcallerror("queue_enqueue", err);
+		fcallerror("prio_queue_enqueue", err);
 		goto fail;
 	}
 
@@ -222,6 +355,7 @@ static int _thread_main(void *arg)
 	int err;
 	struct exec_work_item *wkitem;
 	struct timespec abstime;
+	ll seq;
 
 	while (1) {
 		if (atomic_read(self->done))
@@ -248,11 +382,23 @@ static int _thread_main(void *arg)
 		}
 
 		wkitem = NULL;
+		seq    = 0;
 
-		err = queue_dequeue(&self->queue, (void **)&wkitem);
-		if (unlikely(err && (-ENOENT != err))) {
-			fcallerror("queue_dequeue", err);
-			die();
+		if (_work_available(self)) {
+			err = _dequeue_batch(self, &wkitem);
+			if (unlikely(err)) {
+				fcallerror("_dequeue_batch", err);
+				die();
+			}
+
+			self->aimd.active += 1;
+			seq = self->aimd.started++;
+
+			if (self->waiting) {
+				err = cond_var_broadcast(&self->cond);
+				if (unlikely(err))
+					fcallerror("cond_var_broadcast", err);
+			}
 		}
 
 		err = cond_var_lock_release(&self->cond);
@@ -262,20 +408,399 @@ static int _thread_main(void *arg)
 		}
 
 		if (wkitem) {
-			_do_exec_work(self, wkitem);
+			_do_exec_work(self, wkitem, seq);
+		}
+	}
+
+	return 0;
+}
+
+static int _engine_main(void *arg)
+{
+	struct exec_worker_pool *self = (struct exec_worker_pool *)arg;
+	int err;
+
+	while (1) {
+		/* Processes which are still running are waited for so that
+		 * no zombies are left behind.
+		 */
+		if (atomic_read(self->done) && (0 == self->ninflight))
+			break;
+
+		if (!atomic_read(self->done)) {
+			err = _engine_start_work(self);
+			if (unlikely(err))
+				fcallerror("_engine_start_work", err);
+		}
+
+		err = _engine_reap(self);
+		if (unlikely(err))
+			fcallerror("_engine_reap", err);
+	}
+
+	return 0;
+}
+
+/*
+ * Start operations as long as the window permits.
+ */
+static int _engine_start_work(struct exec_worker_pool *self)
+{
+	int err;
+	struct exec_work_item *wkitem;
+	struct timespec abstime;
+	ll seq;
+
+	while (self->ninflight < self->maxinflight) {
+		err = cond_var_lock_acquire(&self->cond);
+		if (unlikely(err)) {
+			fcallerror("cond_var_lock_acquire", err);
+			die();
+		}
+
+		/* Nothing to reap so we can as well wait for new work.
+		 */
+		if (0 == self->ninflight) {
+			err = abstime_near_future(&self->timeout, &abstime);
+			if (unlikely(err))
+				fcallerror("abstime_near_future", err);
+
+			while (!_work_available(self)) {
+				err = cond_var_timedwait(&self->cond, &abstime);
+				if (-ETIMEDOUT == err)
+					break;
+				if (unlikely(err)) {
+					fcallerror("cond_var_timedwait", err);
+					die();
+				}
+			}
+		}
+
+		wkitem = NULL;
+		seq    = 0;
+
+		if (_work_available(self)) {
+			err = _dequeue_batch(self, &wkitem);
+			if (unlikely(err)) {
+				fcallerror("_dequeue_batch", err);
+				die();
+			}
+
+			self->aimd.active += 1;
+			seq = self->aimd.started++;
+
+			if (self->waiting) {
+				err = cond_var_broadcast(&self->cond);
+				if (unlikely(err))
+					fcallerror("cond_var_broadcast", err);
+			}
 		}
+
+		err = cond_var_lock_release(&self->cond);
+		if (unlikely(err)) {
+			fcallerror("cond_var_lock_release", err);
+			die();
+		}
+
+		if (!wkitem)
+			break;
+
+		_engine_start(self, wkitem, seq);
 	}
 
 	return 0;
 }
 
+static int _engine_start(struct exec_worker_pool *self,
+                         struct exec_work_item *wkitem, ll seq)
+{
+	int err;
+	struct exec_inflight *slot;
+	struct epoll_event ev;
+	char **hosts, ***argvs;
+	ll start;
+	int i, n, pid;
+
+	debug("Spawning process '%s' on host '%s' on request from %d.",
+	      wkitem->argv[0], wkitem->host, wkitem->client);
+
+	start = llnow_usecs();
+
+	if (wkitem->next) {
+		err = _batch_arrays(self, wkitem, &n, &hosts, &argvs);
+		if (likely(!err)) {
+			err = self->exec->ops->start_many(self->exec, n, hosts,
+			                                  (char *const *const *)argvs,
+			                                  &pid);
+
+			_batch_arrays_free(self, n, &hosts, &argvs);
+		}
+	} else {
+		err = self->exec->ops->start(self->exec, wkitem->host,
+		                             wkitem->argv, &pid);
+	}
+	if (unlikely(err))
+		return _exec_work_done(self, wkitem, seq, err, llnow_usecs() - start);
+
+	for (i = 0; i < self->maxinflight; ++i)
+		if (!self->inflight[i].wkitem)
+			break;
+
+	slot = &self->inflight[i];
+
+	slot->wkitem = wkitem;
+	slot->pid    = pid;
+	slot->pidfd  = -1;
+	slot->seq    = seq;
+	slot->start  = start;
+
+	self->ninflight += 1;
+
+	/* Without pidfd support the process is found by the waitpid()
+	 * sweep in _engine_reap(). The same applies to processes forked
+	 * by the zygote which have already been reaped (-ESRCH).
+	 */
+	err = do_pidfd_open(pid, &slot->pidfd);
+	if (unlikely(err)) {
+		if ((-ENOSYS != err) && (-ESRCH != err))
+			fcallerror("do_pidfd_open", err);
+
+		slot->pidfd = -1;
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.u32 = i;
+
+	if (unlikely(epoll_ctl(self->epfd, EPOLL_CTL_ADD, slot->pidfd, &ev))) {
+		error("epoll_ctl() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+
+		do_close(slot->pidfd);
+		slot->pidfd = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait (up to the timeout) for the termination of running processes.
+ */
+static int _engine_reap(struct exec_worker_pool *self)
+{
+	int err;
+	struct epoll_event events[64];
+	int i, n, ms;
+
+	if (0 == self->ninflight)
+		return 0;
+
+	ms = self->timeout.tv_sec*1000 + self->timeout.tv_nsec/1000000;
+
+	n = epoll_wait(self->epfd, events, ARRAYLEN(events), ms);
+	if (unlikely(-1 == n)) {
+		if (EINTR != errno) {
+			error("epoll_wait() failed. errno = %d says '%s'.",
+			      errno, strerror(errno));
+			return -errno;
+		}
+
+		n = 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		err = _engine_complete(self, events[i].data.u32);
+		if (unlikely(err))
+			fcallerror("_engine_complete", err);
+	}
+
+	for (i = 0; i < self->maxinflight; ++i) {
+		if (self->inflight[i].wkitem && (-1 == self->inflight[i].pidfd)) {
+			err = _engine_complete(self, i);
+			if (unlikely(err))
+				fcallerror("_engine_complete", err);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reap the process in slot i. Nothing happens if the process is still
+ * running.
+ */
+static int _engine_complete(struct exec_worker_pool *self, int i)
+{
+	int err;
+	struct exec_inflight *slot = &self->inflight[i];
+	struct exec_work_item *wkitem;
+	int status;
+	ll p, seq, lat;
+
+	/* TODO Handle EINTR? */
+	p = wait_process(slot->pid, &status, WNOHANG);
+	if (0 == p)
+		return 0;
+
+	if (unlikely(p != slot->pid)) {
+		err = -errno;
+		error("wait_process() failed. errno = %d says '%s'.",
+		      -err, strerror(-err));
+	} else {
+		err = exit_status_to_error(status);
+	}
+
+	lat = llnow_usecs() - slot->start;
+
+	if (-1 != slot->pidfd) {
+		/* A concurrent fork() may hold a copy of the pidfd until
+		 * the exec so closing it does not necessarily remove it
+		 * from the epoll set.
+		 */
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, slot->pidfd, NULL);
+		do_close(slot->pidfd);
+	}
+
+	wkitem = slot->wkitem;
+	seq    = slot->seq;
+
+	slot->wkitem = NULL;
+	slot->pidfd  = -1;
+
+	self->ninflight -= 1;
+
+	return _exec_work_done(self, wkitem, seq, err, lat);
+}
+
+/*
+ * Called while holding the lock of self->cond.
+ */
 static int _work_available(struct exec_worker_pool *self)
 {
 	ll size;
 
-	queue_size(&self->queue, &size);
+	prio_queue_size(&self->queue, &size);
+
+	return (size > 0) && (self->aimd.active < self->aimd.window);
+}
+
+/*
+ * Dequeue the next work item and append the following items of the
+ * queue as long as they can be passed to the plugin in a single batch.
+ * Called while holding the lock of self->cond.
+ */
+static int _dequeue_batch(struct exec_worker_pool *self,
+                          struct exec_work_item **wkitem)
+{
+	int err;
+	struct exec_work_item *last, *next;
+	int n;
+
+	err = prio_queue_dequeue(&self->queue, (void **)wkitem);
+	if (unlikely(err))
+		return err;
+
+	last = *wkitem;
+
+	for (n = 1; n < self->batchsize; ++n) {
+		err = prio_queue_peek(&self->queue, (void **)&next);
+		if (err)
+			break;
+
+		if (!_batch_compatible(*wkitem, next))
+			break;
+
+		err = prio_queue_dequeue(&self->queue, (void **)&next);
+		if (unlikely(err))
+			return err;
 
-	return (size > 0);
+		last->next = next;
+		last = next;
+	}
+
+	return 0;
+}
+
+/*
+ * Work items can be batched if their argument vectors only differ in the
+ * last element and if the host does not appear in the batch yet.
+ */
+static int _batch_compatible(struct exec_work_item *batch,
+                             struct exec_work_item *wkitem)
+{
+	struct exec_work_item *x;
+	int i;
+
+	if (batch->argc != wkitem->argc)
+		return 0;
+
+	for (i = 0; i < batch->argc - 1; ++i) {
+		if (strcmp(batch->argv[i], wkitem->argv[i]))
+			return 0;
+	}
+
+	for (x = batch; x; x = x->next) {
+		if (!strcmp(x->host, wkitem->host))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int _batch_arrays(struct exec_worker_pool *self,
+                         struct exec_work_item *batch, int *n,
+                         char ***hosts, char ****argvs)
+{
+	int err, tmp;
+	struct exec_work_item *x;
+	int i;
+
+	*n = 0;
+	for (x = batch; x; x = x->next)
+		*n += 1;
+
+	err = ZALLOC(self->alloc, (void **)hosts, *n, sizeof(char *), "hosts");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		return err;
+	}
+
+	err = ZALLOC(self->alloc, (void **)argvs, *n, sizeof(char **), "argvs");
+	if (unlikely(err)) {
+		fcallerror("ZALLOC", err);
+		goto fail;
+	}
+
+	for (x = batch, i = 0; x; x = x->next, ++i) {
+		(*hosts)[i] = x->host;
+		(*argvs)[i] = x->argv;
+	}
+
+	return 0;
+
+fail:
+	tmp = ZFREE(self->alloc, (void **)hosts, *n, sizeof(char *), "");
+	if (unlikely(tmp))
+		fcallerror("ZFREE", tmp);
+
+	return err;
+}
+
+static int _batch_arrays_free(struct exec_worker_pool *self, int n,
+                              char ***hosts, char ****argvs)
+{
+	int err;
+
+	err = ZFREE(self->alloc, (void **)hosts, n, sizeof(char *), "");
+	if (unlikely(err))
+		fcallerror("ZFREE", err);
+
+	err = ZFREE(self->alloc, (void **)argvs, n, sizeof(char **), "");
+	if (unlikely(err))
+		fcallerror("ZFREE", err);
+
+	return err;
 }
 
 static int _all_threads_done(struct exec_worker_pool *self)
@@ -290,33 +815,167 @@ static int _all_threads_done(struct exec_worker_pool *self)
 }
 
 static int _do_exec_work(struct exec_worker_pool *self,
-                         struct exec_work_item *wkitem)
+                         struct exec_work_item *wkitem, ll seq)
 {
-	int err, tmp;
+	int err;
+	char **hosts, ***argvs;
+	ll start;
+	int n;
 
 	debug("Spawning process '%s' on host '%s' on request from %d.",
 	      wkitem->argv[0], wkitem->host, wkitem->client);
 
-	err = self->exec->ops->exec(self->exec, wkitem->host, wkitem->argv);
-	if (unlikely(err)) {
+	start = llnow_usecs();
+
+	if (wkitem->next) {
+		err = _batch_arrays(self, wkitem, &n, &hosts, &argvs);
+		if (likely(!err)) {
+			err = self->exec->ops->exec_many(self->exec, n, hosts,
+			                                 (char *const *const *)argvs);
+
+			_batch_arrays_free(self, n, &hosts, &argvs);
+		}
+	} else {
+		err = self->exec->ops->exec(self->exec, wkitem->host,
+		                            wkitem->argv);
+	}
+
+	return _exec_work_done(self, wkitem, seq, err, llnow_usecs() - start);
+}
+
+/*
+ * Account for the completion of an exec operation and retry or free the
+ * work items of the batch.
+ */
+static int _exec_work_done(struct exec_worker_pool *self,
+                           struct exec_work_item *wkitem, ll seq,
+                           int err, ll lat)
+{
+	int tmp;
+	struct exec_work_item *next, *done;
+
+	tmp = cond_var_lock_acquire(&self->cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_acquire", tmp);
+		die();
+	}
+
+	_aimd_complete(self, seq, err, lat);
+
+	/* Failed items are retried after the items with the same cost
+	 * which are already in the queue. This gives the target system
+	 * some time to recover.
+	 * Items of a failed batch are retried individually (and may be
+	 * grouped again).
+	 */
+	done = NULL;
+
+	for (; wkitem; wkitem = next) {
+		next = wkitem->next;
+		wkitem->next = NULL;
+
+		if (self->profile) {
+			tmp = host_profile_update(self->profile, wkitem->host,
+			                          lat, (0 != err));
+			if (unlikely(tmp))
+				fcallerror("host_profile_update", tmp);
+		}
+
+		if (unlikely(err) && (wkitem->tries < self->aimd.retries)) {
+			wkitem->tries += 1;
+
+			tmp = prio_queue_enqueue(&self->queue, wkitem, wkitem->cost);
+			if (likely(!tmp)) {
+				warn("Spawning on host '%s' failed with error %d. Retrying "
+				     "(attempt %d of %d).", wkitem->host, err,
+				     wkitem->tries + 1, self->aimd.retries + 1);
+				continue;
+			}
+		}
+
+		wkitem->next = done;
+		done = wkitem;
+	}
+
+	tmp = cond_var_lock_release(&self->cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_release", tmp);
+		die();
+	}
+
+	if (done && unlikely(err))
 		error("Spawn plugin exec function failed with error %d.", err);
-		goto fail;
+
+	for (wkitem = done; wkitem; wkitem = next) {
+		next = wkitem->next;
+
+		tmp = _free_exec_work_item(self, &wkitem);
+		if (unlikely(tmp)) {
+			fcallerror("_free_exec_work_item", tmp);
+			return tmp;
+		}
 	}
 
-	err = _free_exec_work_item(self, &wkitem);
-	if (unlikely(err)) {
-		fcallerror("_free_exec_work_item", err);
-		return err;
+	return (done) ? err : 0;
+}
+
+/*
+ * Update the window after completion of the operation with sequence
+ * number seq. Called while holding the lock of self->cond.
+ */
+static void _aimd_complete(struct exec_worker_pool *self, ll seq, int err, ll lat)
+{
+	struct exec_aimd *a = &self->aimd;
+	int congested;
+
+	a->active -= 1;
+
+	if (!a->enabled)
+		return;
+
+	/* Single slow operations are common (e.g., due to scheduling
+	 * noise) so the latency signal uses the smoothed latency with
+	 * the gain from the TCP round-trip time estimator. The baseline
+	 * slowly follows the latency upwards such that a permanent
+	 * change of the load (e.g., by the processes spawned so far) is
+	 * not mistaken for congestion.
+	 */
+	if (!err) {
+		a->minlat = (a->minlat > 0) ? MIN(a->minlat + a->minlat/32, lat) : MAX(1, lat);
+		a->srtt   = (a->srtt > 0) ? a->srtt + (lat - a->srtt)/8 : lat;
 	}
 
-	return 0;
+	congested = (0 != err) ||
+	            ((a->latfactor > 0) && (a->srtt > a->latfactor*a->minlat));
 
-fail:
-	tmp = _free_exec_work_item(self, &wkitem);
-	if (unlikely(tmp))
-		fcallerror("_free_exec_work_item", tmp);
+	if (congested) {
+		/* Operations that were already running when the window was
+		 * decreased saw the old load and do not count.
+		 */
+		if (seq < a->recover)
+			return;
 
-	return err;
+		a->ssthresh = MAX(1, a->window/2);
+		a->window   = a->ssthresh;
+		a->acked    = 0;
+		a->recover  = a->started;
+
+		a->ndecreases += 1;
+
+		debug("Exec window decreased to %d (error %d, smoothed latency "
+		      "%lld microsecond(s)).", a->window, err, a->srtt);
+		return;
+	}
+
+	if (a->window < a->ssthresh) {
+		a->window += 1;
+	} else if (++a->acked >= a->window) {
+		a->window += 1;
+		a->acked   = 0;
+	}
+
+	a->window    = MIN(a->window, a->limit);
+	a->maxwindow = MAX(a->maxwindow, a->window);
 }
 
 static int _free_exec_work_item(struct exec_worker_pool *self,
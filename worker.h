@@ -6,6 +6,7 @@
 #include "queue.h"
 
 struct exec_plugin;
+struct host_profile;
 
 
 /*
@@ -17,10 +18,77 @@ struct exec_work_item
 	int	argc;
 	char	**argv;
 	int	client;	/* Id of requesting host. */
+	int	tries;	/* Number of failed attempts so far. */
+	ll	cost;	/* Priority in the queue. Expected time until
+			 * the subtree of the spawned process is built
+			 * (see struct message_request_exec). */
+
+	/* Next work item of the same batch (see exec_plugin_ops.exec_many).
+	 */
+	struct exec_work_item	*next;
+};
+
+/*
+ * Congestion control for exec operations. Exec plugins usually talk to
+ * a service with a limited capacity (e.g., sshd with MaxStartups or
+ * slurmctld) and overloading it results in slow or failed spawns. The
+ * number of concurrently running exec operations (the window) is
+ * controlled similar to the TCP congestion window: It grows by one per
+ * completed operation until it reaches the threshold (slow start) and
+ * by one per window of completed operations afterwards (additive
+ * increase). A failed operation or a smoothed latency above latfactor
+ * times the latency baseline halves the window (multiplicative
+ * decrease). Only one decrease happens per window of
+ * operations.
+ */
+struct exec_aimd
+{
+	int	enabled;
+	int	latfactor;	/* Zero disables the latency signal */
+	int	retries;	/* Number of retries for failed operations */
+
+	int	window;
+	int	ssthresh;
+	int	limit;		/* Upper bound for the window */
+	int	acked;		/* Completions since the last increase
+				 * in congestion avoidance. */
+	int	active;		/* Number of running operations */
+
+	ll	started;	/* Number of started operations */
+	ll	recover;	/* Operations started before this one do
+				 * not trigger another decrease. */
+	ll	minlat;		/* Latency baseline in microseconds */
+	ll	srtt;		/* Smoothed latency in microseconds */
+
+	/* Statistics */
+	ll	ndecreases;
+	int	maxwindow;
+};
+
+/*
+ * Exec operation started with exec_plugin_ops.start() which has not
+ * completed yet.
+ */
+struct exec_inflight
+{
+	struct exec_work_item	*wkitem;	/* NULL if the slot is free.
+						 * First item of the batch. */
+	int			pid;
+	int			pidfd;		/* -1 if pidfds are not
+						 * supported. */
+	ll			seq;
+	ll			start;		/* Microseconds */
 };
 
 /*
  * Worker pool used to spawn executable in parallel.
+ *
+ * In the synchronous mode every thread runs one exec operation at a time
+ * so that the number of concurrent operations is bounded by the number
+ * of threads. In the asynchronous mode a single thread starts the
+ * processes with exec_plugin_ops.start() and waits for their termination
+ * on pidfds with epoll. The number of concurrent operations is then only
+ * bounded by maxinflight.
  */
 struct exec_worker_pool
 {
@@ -29,24 +97,65 @@ struct exec_worker_pool
 	int			nthreads;
 	struct thread		*threads;
 
-	/* Queue of exec_work_item pointers.
+	/* Queue of exec_work_item pointers ordered by their cost so that
+	 * processes on the critical path of the tree are spawned first.
+	 * The lock of cond protects the queue as well as aimd. Producers
+	 * block on cond if the queue is full and worker threads if the
+	 * window is exhausted.
 	 */
-	struct queue		queue;
+	struct prio_queue	queue;
 	struct cond_var		cond;
 
+	struct exec_aimd	aimd;
+
+	/* Number of producers blocked in exec_worker_pool_enqueue().
+	 */
+	int			waiting;
+
 	/* Flag used to indicate to threads to terminate.
 	 */
 	int			done;
 
 	struct exec_plugin	*exec;
 
+	/* Maximal number of work items that are handed over to the
+	 * plugin in a single exec operation. One disables batching.
+	 */
+	int			batchsize;
+
+	/* Asynchronous mode. Only accessed by the single thread.
+	 */
+	int			async;
+	int			maxinflight;
+	struct exec_inflight	*inflight;	/* Size is maxinflight */
+	int			ninflight;
+	int			epfd;
+
 	/* Timeout value for cond_var_timedwait()
 	 */
 	struct timespec		timeout;
+
+	/* Optional latency profile. The expected latency of the host is
+	 * added to the cost of work items and every completed operation
+	 * is recorded. Set by the owner after construction.
+	 */
+	struct host_profile	*profile;
 };
 
+/*
+ * nthreads is the maximal number of concurrent exec operations. If
+ * maxinflight is positive the asynchronous mode is used instead (which
+ * requires exec_plugin_ops.start()), nthreads is ignored and up to
+ * maxinflight operations run concurrently. If adaptive is set the
+ * number of concurrent operations is controlled by struct exec_aimd.
+ * If batchsize is larger than one queued work items are grouped and
+ * passed to the batch operations of the plugin. A batch counts as a
+ * single operation.
+ */
 int exec_worker_pool_ctor(struct exec_worker_pool *self, struct alloc *alloc,
-                          int nthreads, ll capacity, struct exec_plugin *exec);
+                          int nthreads, ll capacity, struct exec_plugin *exec,
+                          int adaptive, int latfactor, int retries,
+                          int maxinflight, int batchsize);
 int exec_worker_pool_dtor(struct exec_worker_pool *self);
 
 /*
@@ -61,8 +170,8 @@ int exec_worker_pool_start(struct exec_worker_pool *self);
 int exec_worker_pool_stop(struct exec_worker_pool *self);
 
 /*
- * Enqueue a new work item. The function returns -ENOMEM if the queue
- * is full.
+ * Enqueue a new work item. If the queue is full the function blocks
+ * until a worker thread made room.
  */
 int exec_worker_pool_enqueue(struct exec_worker_pool *self,
                              struct exec_work_item *wkitem);
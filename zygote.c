@@ -0,0 +1,853 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+#include "config.h"
+#include "compiler.h"
+#include "error.h"
+#include "ints.h"
+#include "helper.h"
+#include "alloc.h"
+#include "thread.h"
+#include "zygote.h"
+
+
+#define ZYGOTE_MAX_DUPS		4
+#define ZYGOTE_MAX_REQUEST	(1 << 16)
+
+/*
+ * Spawn request. The file descriptors which are duplicated to targets
+ * in the child are passed as SCM_RIGHTS.
+ */
+struct _zygote_request
+{
+	int	argc;
+	int	envc;
+	int	ndups;
+	int	targets[ZYGOTE_MAX_DUPS];
+	/* Followed by argc + envc zero-terminated strings. */
+};
+
+enum {
+	ZYGOTE_SPAWNED = 1,
+	ZYGOTE_EXITED  = 2
+};
+
+struct _zygote_reply
+{
+	int	type;
+	int	pid;
+	int	status;		/* Status as returned by waitpid() for
+				 * ZYGOTE_EXITED. Zero or a negative
+				 * error code for ZYGOTE_SPAWNED. */
+};
+
+struct _zygote_exit
+{
+	int	pid;
+	int	status;
+};
+
+struct _zygote
+{
+	struct alloc		*alloc;
+
+	/* Only one spawn request is in flight at any time. Serializes
+	 * zygote_spawn() and protects buf.
+	 */
+	struct lock		spawnlock;
+
+	/* Protects the members below. At most one thread (the reader)
+	 * receives replies at a time, without holding the mutex. The
+	 * others block on the condition variable until the reader
+	 * received something.
+	 */
+	struct cond_var		cond;
+	int			reading;
+
+	int			fd;		/* -1 if not running */
+	int			pid;
+
+	/* Reply to the spawn request in flight.
+	 */
+	struct _zygote_reply	spawned;
+	int			nspawned;
+
+	/* Processes which terminated but have not been waited for.
+	 */
+	struct _zygote_exit	*exits;
+	int			nexits;
+	int			maxexits;
+
+	char			buf[ZYGOTE_MAX_REQUEST];
+};
+
+static struct _zygote _zygote = {
+	.fd = -1
+};
+
+/* Only used in the zygote process. */
+static sigset_t _oldmask;
+static dev_t	_exe_dev;
+static ino_t	_exe_ino;
+
+static void _zygote_main(int fd, int (*entry)(int, char **))
+	__attribute__((noreturn));
+static int _zygote_handle_request(int fd, int sfd, int (*entry)(int, char **));
+static void _zygote_child(int fd, int sfd, int errfd,
+                          int argc, char **argv, char **env,
+                          const int *fds, const int *targets, int ndups,
+                          int (*entry)(int, char **))
+	__attribute__((noreturn));
+static int _zygote_reap(int fd);
+static int _is_own_executable(const char *path);
+static int _recv_reply(struct _zygote_reply *reply, int flags);
+static int _await(int (*done)(void *), void *arg, int nonblock);
+static int _has_spawned(void *arg);
+static int _has_exit(void *arg);
+static int _record_exit(int pid, int status);
+static int _take_exit(int pid, int *status);
+
+
+int zygote_start(struct alloc *alloc, int (*entry)(int, char **))
+{
+	int err;
+	int fds[2];
+	ll p;
+
+	if (unlikely(-1 != _zygote.fd)) {
+		error("Zygote is already running.");
+		return -EINVAL;
+	}
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds);
+	if (unlikely(err)) {
+		error("socketpair() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+		return -errno;
+	}
+
+	p = fork();
+	if (0 == p) {
+		close(fds[0]);
+		_zygote_main(fds[1], entry);
+	}
+	else if (unlikely(-1 == p)) {
+		err = -errno;
+		error("fork() failed. errno = %d says '%s'.",
+		      -err, strerror(-err));
+		close(fds[0]);
+		close(fds[1]);
+		return err;
+	}
+
+	close(fds[1]);
+
+	err = lock_ctor(&_zygote.spawnlock);
+	if (unlikely(err)) {
+		fcallerror("lock_ctor", err);
+		close(fds[0]);
+		return err;
+	}
+
+	err = cond_var_ctor(&_zygote.cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_ctor", err);
+		(void )lock_dtor(&_zygote.spawnlock);
+		close(fds[0]);
+		return err;
+	}
+
+	_zygote.alloc    = alloc;
+	_zygote.reading  = 0;
+	_zygote.fd       = fds[0];
+	_zygote.pid      = p;
+	_zygote.nspawned = 0;
+	_zygote.exits    = NULL;
+	_zygote.nexits   = 0;
+	_zygote.maxexits = 0;
+
+	log("Zygote %d is alive.", (int )p);
+
+	return 0;
+}
+
+int zygote_stop()
+{
+	int err;
+	int status;
+	ll p;
+
+	if (-1 == _zygote.fd)
+		return 0;
+
+	/* The zygote terminates once it reads EOF.
+	 */
+	err = do_close(_zygote.fd);
+	if (unlikely(err))
+		fcallerror("do_close", err);
+
+	_zygote.fd = -1;
+
+	/* TODO Handle EINTR? */
+	p = waitpid(_zygote.pid, &status, 0);
+	if (unlikely(p != _zygote.pid)) {
+		error("waitpid() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+	}
+
+	if (_zygote.exits) {
+		err = ZFREE(_zygote.alloc, (void **)&_zygote.exits,
+		            _zygote.maxexits, sizeof(struct _zygote_exit), "");
+		if (unlikely(err))
+			fcallerror("ZFREE", err);
+	}
+
+	err = cond_var_dtor(&_zygote.cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_dtor", err);
+		return err;
+	}
+
+	err = lock_dtor(&_zygote.spawnlock);
+	if (unlikely(err)) {
+		fcallerror("lock_dtor", err);
+		return err;
+	}
+
+	return 0;
+}
+
+int zygote_is_running()
+{
+	return (-1 != _zygote.fd);
+}
+
+int zygote_spawn(char *const *argv, char *const *env,
+                 const int (*dups)[2], int ndups, int *pid)
+{
+	int err, tmp;
+	struct _zygote_request *req;
+	struct _zygote_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char		buf[CMSG_SPACE(ZYGOTE_MAX_DUPS*sizeof(int))];
+		struct cmsghdr	align;
+	} control;
+	char *const *s;
+	ll len, n;
+	int i;
+
+	if (unlikely(ndups > ZYGOTE_MAX_DUPS)) {
+		error("Too many file descriptors for the zygote.");
+		return -EINVAL;
+	}
+
+	err = lock_acquire(&_zygote.spawnlock);
+	if (unlikely(err)) {
+		fcallerror("lock_acquire", err);
+		die();
+	}
+
+	req = (struct _zygote_request *)_zygote.buf;
+	len = sizeof(struct _zygote_request);
+
+	req->argc  = 0;
+	req->envc  = 0;
+	req->ndups = ndups;
+
+	for (i = 0; i < ndups; ++i)
+		req->targets[i] = dups[i][1];
+
+	for (i = 0; i < 2; ++i) {
+		for (s = (0 == i) ? argv : env; s && *s; ++s) {
+			n = strlen(*s) + 1;
+			if (unlikely(len + n > ZYGOTE_MAX_REQUEST)) {
+				error("Spawn request for '%s' is too large.", argv[0]);
+				err = -EINVAL;
+				goto fail;
+			}
+
+			memcpy(_zygote.buf + len, *s, n);
+			len += n;
+
+			if (0 == i)
+				req->argc += 1;
+			else
+				req->envc += 1;
+		}
+	}
+
+	iov.iov_base = _zygote.buf;
+	iov.iov_len  = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (ndups > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = CMSG_SPACE(ndups*sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(ndups*sizeof(int));
+
+		for (i = 0; i < ndups; ++i)
+			((int *)CMSG_DATA(cmsg))[i] = dups[i][0];
+	}
+
+	n = sendmsg(_zygote.fd, &msg, 0);
+	if (unlikely(n != len)) {
+		err = -errno;
+		error("sendmsg() failed. errno = %d says '%s'.",
+		      -err, strerror(-err));
+		goto fail;
+	}
+
+	/* The zygote may report terminated processes before the
+	 * reply arrives.
+	 */
+	err = cond_var_lock_acquire(&_zygote.cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_lock_acquire", err);
+		die();
+	}
+
+	err = _await(_has_spawned, NULL, 0);
+	if (likely(!err)) {
+		reply = _zygote.spawned;
+		_zygote.nspawned = 0;
+	}
+
+	tmp = cond_var_lock_release(&_zygote.cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_release", tmp);
+		die();
+	}
+
+	if (unlikely(err)) {
+		fcallerror("_await", err);
+		goto fail;
+	}
+
+	err = lock_release(&_zygote.spawnlock);
+	if (unlikely(err)) {
+		fcallerror("lock_release", err);
+		die();
+	}
+
+	if (unlikely(reply.status)) {
+		error("Zygote failed to spawn '%s'. errno = %d says '%s'.",
+		      argv[0], -reply.status, strerror(-reply.status));
+		return reply.status;
+	}
+
+	*pid = reply.pid;
+
+	return 0;
+
+fail:
+	tmp = lock_release(&_zygote.spawnlock);
+	if (unlikely(tmp)) {
+		fcallerror("lock_release", tmp);
+		die();
+	}
+
+	return err;
+}
+
+int zygote_wait(int pid, int *status, int options)
+{
+	int err, tmp;
+	int found;
+
+	if (unlikely(options & ~WNOHANG)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = cond_var_lock_acquire(&_zygote.cond);
+	if (unlikely(err)) {
+		fcallerror("cond_var_lock_acquire", err);
+		die();
+	}
+
+	err = _await(_has_exit, &pid, options & WNOHANG);
+
+	found = _take_exit(pid, status);
+
+	tmp = cond_var_lock_release(&_zygote.cond);
+	if (unlikely(tmp)) {
+		fcallerror("cond_var_lock_release", tmp);
+		die();
+	}
+
+	if (found)
+		return pid;
+
+	if (unlikely(err)) {
+		errno = -err;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns one if a reply was received, zero if flags contains
+ * MSG_DONTWAIT and nothing was available and a negative error code
+ * otherwise. Only called by the reader.
+ */
+static int _recv_reply(struct _zygote_reply *reply, int flags)
+{
+	ll n;
+
+	while (1) {
+		n = recv(_zygote.fd, reply, sizeof(*reply), flags);
+		if (likely(sizeof(*reply) == n))
+			return 1;
+
+		if (0 == n) {
+			error("Zygote terminated unexpectedly.");
+			return -ESOMEFAULT;
+		}
+		if (-1 == n) {
+			if (EINTR == errno)
+				continue;
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+				return 0;
+
+			error("recv() failed. errno = %d says '%s'.",
+			      errno, strerror(errno));
+			return -errno;
+		}
+
+		error("Received truncated reply from the zygote.");
+		return -ESOMEFAULT;
+	}
+}
+
+/*
+ * Receive replies until done(arg) is true. If nonblock is set only the
+ * replies which are already available are received. Called while holding
+ * the mutex which is released while receiving so that other threads can
+ * look at the replies in the meantime.
+ */
+static int _await(int (*done)(void *), void *arg, int nonblock)
+{
+	int err, tmp;
+	struct _zygote_reply reply;
+
+	while (!done(arg)) {
+		if (_zygote.reading) {
+			if (nonblock)
+				return 0;
+
+			err = cond_var_wait(&_zygote.cond);
+			if (unlikely(err)) {
+				fcallerror("cond_var_wait", err);
+				die();
+			}
+			continue;
+		}
+
+		_zygote.reading = 1;
+
+		err = cond_var_lock_release(&_zygote.cond);
+		if (unlikely(err)) {
+			fcallerror("cond_var_lock_release", err);
+			die();
+		}
+
+		err = _recv_reply(&reply, nonblock ? MSG_DONTWAIT : 0);
+
+		tmp = cond_var_lock_acquire(&_zygote.cond);
+		if (unlikely(tmp)) {
+			fcallerror("cond_var_lock_acquire", tmp);
+			die();
+		}
+
+		_zygote.reading = 0;
+
+		if (err > 0) {
+			if (ZYGOTE_SPAWNED == reply.type) {
+				_zygote.spawned  = reply;
+				_zygote.nspawned = 1;
+			} else {
+				tmp = _record_exit(reply.pid, reply.status);
+				if (unlikely(tmp)) {
+					fcallerror("_record_exit", tmp);
+					die();
+				}
+			}
+		}
+
+		/* Wake up the threads waiting for the reply and let
+		 * one of them take over reading.
+		 */
+		tmp = cond_var_broadcast(&_zygote.cond);
+		if (unlikely(tmp)) {
+			fcallerror("cond_var_broadcast", tmp);
+			die();
+		}
+
+		if (err <= 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int _has_spawned(void *arg)
+{
+	return _zygote.nspawned;
+}
+
+static int _has_exit(void *arg)
+{
+	int pid = *(int *)arg;
+	int i;
+
+	for (i = 0; i < _zygote.nexits; ++i) {
+		if (pid == _zygote.exits[i].pid)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called while holding the mutex.
+ */
+static int _record_exit(int pid, int status)
+{
+	int err;
+	int n;
+
+	if (unlikely(_zygote.nexits == _zygote.maxexits)) {
+		n = MAX(16, 2*_zygote.maxexits);
+
+		err = ZREALLOC(_zygote.alloc, (void **)&_zygote.exits,
+		               _zygote.maxexits, sizeof(struct _zygote_exit),
+		               n, sizeof(struct _zygote_exit), "exits");
+		if (unlikely(err)) {
+			fcallerror("ZREALLOC", err);
+			return err;
+		}
+
+		_zygote.maxexits = n;
+	}
+
+	_zygote.exits[_zygote.nexits].pid    = pid;
+	_zygote.exits[_zygote.nexits].status = status;
+	_zygote.nexits += 1;
+
+	return 0;
+}
+
+/*
+ * Called while holding the mutex.
+ */
+static int _take_exit(int pid, int *status)
+{
+	int i;
+
+	for (i = 0; i < _zygote.nexits; ++i) {
+		if (pid == _zygote.exits[i].pid) {
+			*status = _zygote.exits[i].status;
+
+			_zygote.nexits -= 1;
+			_zygote.exits[i] = _zygote.exits[_zygote.nexits];
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static void _zygote_main(int fd, int (*entry)(int, char **))
+{
+	int err;
+	sigset_t mask;
+	struct pollfd pfds[2];
+	struct signalfd_siginfo si;
+	struct stat st;
+	int i, n, sfd;
+
+	/* Nothing of the daemon is needed in here.
+	 */
+	for (i = 3; i < 1024; ++i) {
+		if (i != fd)
+			close(i);
+	}
+
+	if (0 == stat("/proc/self/exe", &st)) {
+		_exe_dev = st.st_dev;
+		_exe_ino = st.st_ino;
+	} else {
+		entry = NULL;
+	}
+
+	/* The zygote is single-threaded so that it can safely block
+	 * SIGCHLD and use a signalfd to reap its children.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &_oldmask);
+
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (unlikely(-1 == sfd)) {
+		error("signalfd() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+		_exit(1);
+	}
+
+	pfds[0].fd     = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd     = sfd;
+	pfds[1].events = POLLIN;
+
+	while (1) {
+		n = poll(pfds, 2, -1);
+		if (unlikely(-1 == n)) {
+			if (EINTR == errno)
+				continue;
+
+			error("poll() failed. errno = %d says '%s'.",
+			      errno, strerror(errno));
+			_exit(1);
+		}
+
+		if (pfds[1].revents) {
+			while (sizeof(si) == read(sfd, &si, sizeof(si)))
+				;
+
+			err = _zygote_reap(fd);
+			if (unlikely(err))
+				_exit(1);
+		}
+
+		if (pfds[0].revents) {
+			err = _zygote_handle_request(fd, sfd, entry);
+			if (err)
+				_exit((err > 0) ? 0 : 1);
+		}
+	}
+}
+
+/*
+ * Returns one if the daemon closed the connection.
+ */
+static int _zygote_handle_request(int fd, int sfd, int (*entry)(int, char **))
+{
+	struct _zygote_request *req;
+	struct _zygote_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char		buf[CMSG_SPACE(ZYGOTE_MAX_DUPS*sizeof(int))];
+		struct cmsghdr	align;
+	} control;
+	int fds[ZYGOTE_MAX_DUPS];
+	int errpipe[2];
+	char **ptrs;
+	char *s, *end;
+	int i, nfds, e, status;
+	ll n, p;
+
+	iov.iov_base = _zygote.buf;
+	iov.iov_len  = sizeof(_zygote.buf);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (0 == n)
+		return 1;
+	if (unlikely(-1 == n)) {
+		if (EINTR == errno)
+			return 0;
+
+		error("recvmsg() failed. errno = %d says '%s'.",
+		      errno, strerror(errno));
+		return -errno;
+	}
+
+	nfds = 0;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (SOL_SOCKET == cmsg->cmsg_level) && (SCM_RIGHTS == cmsg->cmsg_type)) {
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), nfds*sizeof(int));
+	}
+
+	req = (struct _zygote_request *)_zygote.buf;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.type = ZYGOTE_SPAWNED;
+
+	ptrs = NULL;
+
+	if (unlikely((n < sizeof(*req)) || (req->ndups != nfds) ||
+	             (req->argc < 1))) {
+		reply.status = -EINVAL;
+		goto done;
+	}
+
+	ptrs = malloc((req->argc + req->envc + 2)*sizeof(char *));
+	if (unlikely(!ptrs)) {
+		reply.status = -ENOMEM;
+		goto done;
+	}
+
+	s   = _zygote.buf + sizeof(*req);
+	end = _zygote.buf + n;
+
+	for (i = 0; i < req->argc + req->envc; ++i) {
+		if (unlikely(s >= end)) {
+			reply.status = -EINVAL;
+			goto done;
+		}
+
+		ptrs[i + (i >= req->argc)] = s;
+		s += strnlen(s, end - s) + 1;
+	}
+	ptrs[req->argc] = NULL;
+	ptrs[req->argc + 1 + req->envc] = NULL;
+
+	/* Reports a failed execve() like posix_spawn().
+	 */
+	if (unlikely(pipe2(errpipe, O_CLOEXEC))) {
+		reply.status = -errno;
+		goto done;
+	}
+
+	p = fork();
+	if (0 == p) {
+		_zygote_child(fd, sfd, errpipe[1], req->argc, ptrs,
+		              ptrs + req->argc + 1, fds, req->targets,
+		              nfds, entry);
+	}
+
+	close(errpipe[1]);
+
+	if (unlikely(-1 == p)) {
+		reply.status = -errno;
+	} else {
+		reply.pid = p;
+
+		do {
+			n = read(errpipe[0], &e, sizeof(e));
+		} while ((-1 == n) && (EINTR == errno));
+
+		if (sizeof(e) == n) {
+			/* The child exits immediately. Reap it here so
+			 * that no ZYGOTE_EXITED is sent for it.
+			 */
+			waitpid(p, &status, 0);
+			reply.status = -e;
+		}
+	}
+
+	close(errpipe[0]);
+
+done:
+	for (i = 0; i < nfds; ++i)
+		close(fds[i]);
+
+	free(ptrs);
+
+	n = send(fd, &reply, sizeof(reply), 0);
+	if (unlikely(sizeof(reply) != n))
+		return -ESOMEFAULT;
+
+	return 0;
+}
+
+static void _zygote_child(int fd, int sfd, int errfd,
+                          int argc, char **argv, char **env,
+                          const int *fds, const int *targets, int ndups,
+                          int (*entry)(int, char **))
+{
+	int i, e;
+
+	sigprocmask(SIG_SETMASK, &_oldmask, NULL);
+
+	close(fd);
+	close(sfd);
+
+	for (i = 0; i < ndups; ++i) {
+		if (fds[i] != targets[i]) {
+			dup2(fds[i], targets[i]);
+			close(fds[i]);
+		}
+	}
+
+	/* Our own executable does not need to be loaded again.
+	 */
+	if (entry && _is_own_executable(argv[0])) {
+		close(errfd);
+
+		environ = env;
+		exit(entry(argc, argv));
+	}
+
+	execve(argv[0], argv, env);
+
+	e = errno;
+	write(errfd, &e, sizeof(e));
+	_exit(127);
+}
+
+static int _zygote_reap(int fd)
+{
+	struct _zygote_reply reply;
+	int status;
+	ll p, n;
+
+	while ((p = waitpid(-1, &status, WNOHANG)) > 0) {
+		reply.type   = ZYGOTE_EXITED;
+		reply.pid    = p;
+		reply.status = status;
+
+		n = send(fd, &reply, sizeof(reply), 0);
+		if (unlikely(sizeof(reply) != n))
+			return -ESOMEFAULT;
+	}
+
+	return 0;
+}
+
+static int _is_own_executable(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return 0;
+
+	return (st.st_dev == _exe_dev) && (st.st_ino == _exe_ino);
+}
+
@@ -0,0 +1,48 @@
+
+#ifndef SPAWN_ZYGOTE_H_INCLUDED
+#define SPAWN_ZYGOTE_H_INCLUDED 1
+
+struct alloc;
+
+/*
+ * The zygote is a single-threaded fork server. It is forked from the
+ * daemon before any thread is created and receives spawn requests over
+ * a socketpair. Forking the small zygote is much cheaper than forking
+ * (or even vfork()ing) the multi-threaded daemon. If the requested
+ * executable is the spawn executable itself the child does not exec
+ * at all but calls the entry function (main()) directly so that the
+ * costs for execve(), dynamic linking and the initialization are
+ * saved.
+ *
+ * The spawned processes are children of the zygote. The zygote reaps
+ * them and reports the exit status back so that zygote_wait() can be
+ * used like waitpid(). There is at most one zygote per process.
+ */
+int zygote_start(struct alloc *alloc, int (*entry)(int, char **));
+
+/*
+ * Terminate the zygote. Processes which are still running are not
+ * affected.
+ */
+int zygote_stop();
+
+/*
+ * Returns one if the zygote is running.
+ */
+int zygote_is_running();
+
+/*
+ * Spawn a process. The arguments have the same meaning as for
+ * spawn_process().
+ */
+int zygote_spawn(char *const *argv, char *const *env,
+                 const int (*dups)[2], int ndups, int *pid);
+
+/*
+ * Same semantics as waitpid() for processes spawned by zygote_spawn().
+ * Only WNOHANG is supported as option.
+ */
+int zygote_wait(int pid, int *status, int options);
+
+#endif
+